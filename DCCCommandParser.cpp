@@ -0,0 +1,392 @@
+/*
+ * CmdrArduino
+ *
+ * DCC Text Command Parser
+ *
+ * Author: Don Goodman-Wilson dgoodman@artificial-science.org
+ * Changes by: Jonathan Pallant dcc@thejpster.org.uk
+ *
+ * based on software by Wolfgang Kufer, http://opendcc.de
+ *
+ * Copyright 2010 Don Goodman-Wilson
+ * Copyright 2015 Jonathan Pallant
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/****************************************************************************
+* Includes
+****************************************************************************/
+#include <Arduino.h>
+#include <stdint.h>
+
+#include "DCCCommandParser.h"
+
+#if DCC_SUPPORT_PARSER
+
+/****************************************************************************
+ * Defines
+ ****************************************************************************/
+
+// Where parse() has got to
+#define PARSE_OUTSIDE 0 //waiting for '<'
+#define PARSE_OPCODE  1 //waiting for the command letter
+#define PARSE_BETWEEN 2 //between numbers
+#define PARSE_SIGN    3 //read a '-', waiting for its first digit
+#define PARSE_NUMBER  4 //reading a number's digits
+
+// Numbers bigger than this are garbled. Keeps args[] from overflowing.
+#define PARSE_MAX_NUMBER 99999
+
+#define PARSE_MAX_CAB    10239 //largest long address
+
+/****************************************************************************
+ * Data Types
+ ****************************************************************************/
+
+/* None */
+
+/****************************************************************************
+ * Function Prototypes
+ ****************************************************************************/
+
+static bool cabAddress(int32_t cab, DCCPacket::address_t& address, DCCPacket::address_kind_t& address_kind);
+
+/****************************************************************************
+ * Public Data
+ ****************************************************************************/
+
+/* None */
+
+/****************************************************************************
+ * Private Data
+ ****************************************************************************/
+
+/* None */
+
+/****************************************************************************
+ * Public Functions
+ ****************************************************************************/
+
+DCCCommandParser::DCCCommandParser(DCCPacketScheduler& scheduler) : scheduler(scheduler), errors(0), done_opcode(0), done_args(0)
+{
+    reset();
+}
+
+void DCCCommandParser::reset(void)
+{
+    state = PARSE_OUTSIDE;
+    num_args = 0;
+    opcode = 0;
+    negative = false;
+    bad = false;
+}
+
+uint8_t DCCCommandParser::parse(uint8_t c)
+{
+    if (c == '<')
+    {
+        //a '<' inside a command means the rest of it was lost; start again
+        uint8_t retval = (state == PARSE_OUTSIDE) ? DCC_PARSE_NONE : DCC_PARSE_ERROR;
+
+        if (retval == DCC_PARSE_ERROR)
+        {
+            ++errors;
+        }
+
+        reset();
+        state = PARSE_OPCODE;
+        return retval;
+    }
+
+    if (state == PARSE_OUTSIDE)
+    {
+        return DCC_PARSE_NONE;
+    }
+
+    if (c == '>')
+    {
+        return finish();
+    }
+
+    if (bad)
+    {
+        return DCC_PARSE_NONE; //skip to the '>'
+    }
+
+    bool space = (c == ' ') || (c == '\t') || (c == '\r') || (c == '\n');
+    bool digit = (c >= '0') && (c <= '9');
+
+    switch (state)
+    {
+    case PARSE_OPCODE:
+        if (!space)
+        {
+            opcode = c;
+            state = PARSE_BETWEEN;
+        }
+        break;
+
+    case PARSE_BETWEEN:
+        if (space)
+        {
+            break;
+        }
+
+        if (num_args == DCC_PARSER_ARGS)
+        {
+            bad = true; //too many numbers
+        }
+        else if (c == '-')
+        {
+            args[num_args] = 0;
+            negative = true;
+            state = PARSE_SIGN;
+        }
+        else if (digit)
+        {
+            args[num_args] = c - '0';
+            negative = false;
+            state = PARSE_NUMBER;
+        }
+        else
+        {
+            bad = true;
+        }
+        break;
+
+    case PARSE_SIGN:
+    case PARSE_NUMBER:
+        if (digit)
+        {
+            args[num_args] = (args[num_args] * 10) + (c - '0');
+
+            if (args[num_args] > PARSE_MAX_NUMBER)
+            {
+                bad = true;
+            }
+
+            state = PARSE_NUMBER;
+        }
+        else if (space && (state == PARSE_NUMBER))
+        {
+            if (negative)
+            {
+                args[num_args] = -args[num_args];
+            }
+
+            ++num_args;
+            state = PARSE_BETWEEN;
+        }
+        else
+        {
+            bad = true;
+        }
+        break;
+    }
+
+    return DCC_PARSE_NONE;
+}
+
+size_t DCCCommandParser::parse(const uint8_t* buffer, size_t length)
+{
+    size_t count = 0;
+
+    for (size_t i = 0; i < length; ++i)
+    {
+        if (parse(buffer[i]) == DCC_PARSE_OK)
+        {
+            ++count;
+        }
+    }
+
+    return count;
+}
+
+/****************************************************************************
+ * Private Functions
+ ****************************************************************************/
+
+//called on '>'
+uint8_t DCCCommandParser::finish(void)
+{
+    uint8_t retval = DCC_PARSE_ERROR;
+
+    if (state == PARSE_NUMBER)
+    {
+        if (negative)
+        {
+            args[num_args] = -args[num_args];
+        }
+
+        ++num_args;
+    }
+    else if ((state == PARSE_OPCODE) || (state == PARSE_SIGN))
+    {
+        bad = true; //"<>" or a '-' with no digits
+    }
+
+    if (!bad)
+    {
+        retval = dispatch();
+    }
+
+    if (retval != DCC_PARSE_OK)
+    {
+        ++errors;
+    }
+
+    done_opcode = opcode;
+    done_args = num_args;
+    reset();
+    return retval;
+}
+
+uint8_t DCCCommandParser::dispatch(void)
+{
+    DCCPacket::address_t address;
+    DCCPacket::address_kind_t address_kind;
+    bool sent;
+
+    switch (opcode)
+    {
+#if DCC_SUPPORT_SPEED128
+    case 't':
+    {
+        //<t REGISTER CAB SPEED DIRECTION>: REGISTER is a DCC++ slot number, which the scheduler has no use for
+        const int32_t* a = (num_args == 4) ? &args[1] : args;
+
+        if (((num_args != 3) && (num_args != 4)) || !cabAddress(a[0], address, address_kind) ||
+                (a[1] < -1) || (a[1] > 126) || (a[2] < 0) || (a[2] > 1))
+        {
+            return DCC_PARSE_ERROR;
+        }
+
+        if (a[1] < 0)
+        {
+            sent = scheduler.eStop(address, address_kind);
+        }
+        else
+        {
+            //DCC++ counts 0 as stop and 1-126 as moving; setSpeed128() uses 1 and 2-127
+            int8_t speed = a[1] + 1;
+            sent = scheduler.setSpeed(address, address_kind, a[2] ? speed : -speed, 128);
+        }
+        break;
+    }
+#endif
+
+    case 'f':
+        if ((num_args < 2) || (num_args > 3) || !cabAddress(args[0], address, address_kind))
+        {
+            return DCC_PARSE_ERROR;
+        }
+
+        if ((num_args == 2) && (args[1] >= 128) && (args[1] <= 159))
+        {
+            //100DDDDD: F0 is bit 4, F1-F4 bits 0-3
+            sent = scheduler.setFunctions0to4(address, address_kind, ((args[1] & 0x0F) << 1) | ((args[1] >> 4) & 0x01));
+        }
+        else if ((num_args == 2) && (args[1] >= 160) && (args[1] <= 175))
+        {
+            sent = scheduler.setFunctions9to12(address, address_kind, args[1] & 0x0F);
+        }
+        else if ((num_args == 2) && (args[1] >= 176) && (args[1] <= 191))
+        {
+            sent = scheduler.setFunctions5to8(address, address_kind, args[1] & 0x0F);
+        }
+#if DCC_SUPPORT_FEATURE_EXPANSION
+        else if ((num_args == 3) && ((args[1] == 222) || (args[1] == 223)) && (args[2] >= 0) && (args[2] <= 255))
+        {
+            if (args[1] == 222)
+            {
+                sent = scheduler.setFunctions13to20(address, address_kind, args[2]);
+            }
+            else
+            {
+                sent = scheduler.setFunctions21to28(address, address_kind, args[2]);
+            }
+        }
+#endif
+        else
+        {
+            return DCC_PARSE_ERROR;
+        }
+        break;
+
+#if DCC_SUPPORT_ACCESSORY
+    case 'a':
+        if ((num_args != 3) || (args[0] < 0) || (args[0] > 511) || (args[1] < 0) || (args[1] > 3) || (args[2] < 0) || (args[2] > 1))
+        {
+            return DCC_PARSE_ERROR;
+        }
+
+        if (args[2])
+        {
+            sent = scheduler.setBasicAccessory(args[0], args[1]);
+        }
+        else
+        {
+            sent = scheduler.unsetBasicAccessory(args[0], args[1]);
+        }
+        break;
+#endif
+
+#if DCC_SUPPORT_OPS_MODE
+    case 'w':
+        if ((num_args != 3) || !cabAddress(args[0], address, address_kind) ||
+                (args[1] < 1) || (args[1] > 1024) || (args[2] < 0) || (args[2] > 255))
+        {
+            return DCC_PARSE_ERROR;
+        }
+
+        sent = scheduler.opsProgramCV(address, address_kind, args[1], args[2]);
+        break;
+#endif
+
+    case '!':
+        if (num_args)
+        {
+            return DCC_PARSE_ERROR;
+        }
+
+        sent = scheduler.eStop();
+        break;
+
+    default:
+        return DCC_PARSE_ERROR;
+    }
+
+    return sent ? DCC_PARSE_OK : DCC_PARSE_REJECTED;
+}
+
+//DCC++ cab numbers: 1-127 are short addresses, 128 and up long ones
+static bool cabAddress(int32_t cab, DCCPacket::address_t& address, DCCPacket::address_kind_t& address_kind)
+{
+    if ((cab < 1) || (cab > PARSE_MAX_CAB))
+    {
+        return false;
+    }
+
+    address = cab;
+    address_kind = (cab <= 127) ? DCCPacket::DCC_SHORT_ADDRESS : DCCPacket::DCC_LONG_ADDRESS;
+    return true;
+}
+
+#endif // DCC_SUPPORT_PARSER
+
+/****************************************************************************
+ * End of file
+ ****************************************************************************/
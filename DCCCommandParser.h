@@ -0,0 +1,131 @@
+/*
+ * CmdrArduino
+ *
+ * DCC Text Command Parser
+ *
+ * Author: Don Goodman-Wilson dgoodman@artificial-science.org
+ * Changes by: Jonathan Pallant dcc@thejpster.org.uk
+ *
+ * based on software by Wolfgang Kufer, http://opendcc.de
+ *
+ * Copyright 2010 Don Goodman-Wilson
+ * Copyright 2015 Jonathan Pallant
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef INC_DCCCOMMANDPARSER_H
+#define INC_DCCCOMMANDPARSER_H
+
+#include "DCCConfig.h"
+
+#if DCC_SUPPORT_PARSER
+
+#include "DCCPacketScheduler.h"
+
+/****************************************************************************
+ * Defines
+ ****************************************************************************/
+
+// What parse() returns
+#define DCC_PARSE_NONE     0 //no command finished with this byte
+#define DCC_PARSE_OK       1 //a command was handed to the scheduler
+#define DCC_PARSE_REJECTED 2 //a command made sense, but the scheduler turned it down (e.g. its queue was full)
+#define DCC_PARSE_ERROR    3 //a command was garbled, unknown, out of range or too long
+
+/****************************************************************************
+ * Data Types
+ ****************************************************************************/
+
+/**
+ * Reads DCC++ style text commands, a byte at a time, and calls the
+ * scheduler with each one as soon as its '>' arrives:
+ *
+ *   <t REGISTER CAB SPEED DIRECTION> or <t CAB SPEED DIRECTION>
+ *       128 step speed. SPEED is 0-126, or -1 for an emergency stop;
+ *       DIRECTION is 1 for forwards, 0 for reverse. REGISTER is ignored.
+ *   <f CAB BYTE1> and <f CAB BYTE1 BYTE2>
+ *       F0-F12 as the DCC instruction byte (128-191), or BYTE1 222 or 223
+ *       followed by F13-F20 or F21-F28.
+ *   <a ADDRESS SUBADDRESS ACTIVATE>
+ *       basic accessory: ADDRESS 0-511, SUBADDRESS 0-3, ACTIVATE 0 or 1.
+ *   <w CAB CV VALUE>
+ *       writes a CV on the main.
+ *   <!>
+ *       emergency stop for every loco.
+ *
+ * CABs up to 127 are short addresses and the rest long. Anything outside
+ * '<' and '>' is skipped, so commands may be run together or separated
+ * by newlines. Numbers are added up as they arrive, so nothing is
+ * buffered and nothing is allocated. No replies are sent; the sketch can
+ * use what parse() returns to make its own.
+**/
+class DCCCommandParser
+{
+public:
+    DCCCommandParser(DCCPacketScheduler& scheduler);
+
+    //returns one of the DCC_PARSE_ values above
+    uint8_t parse(uint8_t c);
+    //parses a whole buffer and returns how many commands were handed to the scheduler
+    size_t parse(const uint8_t* buffer, size_t length);
+
+    void reset(void); //forget any half-read command
+
+    //the command parse() last finished, e.g. to make a reply. Good until parse() is next called.
+    inline char getCommand(void) const
+    {
+        return done_opcode;
+    }
+
+    inline uint8_t getArgCount(void) const
+    {
+        return done_args;
+    }
+
+    inline int32_t getArg(uint8_t i) const
+    {
+        return args[i];
+    }
+
+    inline uint16_t getErrors(void) const //commands that came back DCC_PARSE_ERROR or DCC_PARSE_REJECTED
+    {
+        return errors;
+    }
+
+private:
+    DCCPacketScheduler& scheduler;
+
+    int32_t args[DCC_PARSER_ARGS];
+    uint8_t num_args; //numbers finished so far
+    uint8_t state;
+    char opcode;
+    bool negative; //the number being read started with '-'
+    bool bad; //the command is garbled and will come back DCC_PARSE_ERROR
+    uint16_t errors;
+    char done_opcode;
+    uint8_t done_args;
+
+    uint8_t finish(void);
+    uint8_t dispatch(void);
+};
+
+#endif // DCC_SUPPORT_PARSER
+
+#endif // INC_DCCCOMMANDPARSER_H
+
+/****************************************************************************
+ * End of file
+ ****************************************************************************/
@@ -0,0 +1,541 @@
+/*
+ * CmdrArduino
+ *
+ * Build Configuration
+ *
+ * Author: Don Goodman-Wilson dgoodman@artificial-science.org
+ * Changes by: Jonathan Pallant dcc@thejpster.org.uk
+ *
+ * based on software by Wolfgang Kufer, http://opendcc.de
+ *
+ * Copyright 2010 Don Goodman-Wilson
+ * Copyright 2015 Jonathan Pallant
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef INC_DCCCONFIG_H
+#define INC_DCCCONFIG_H
+
+/*
+ * Everything here can be changed by editing this file, or by passing
+ * -D options to the compiler (e.g. build_flags in PlatformIO). Features
+ * switched off are left out of the build entirely, and calling them is a
+ * compile error rather than a silent failure.
+ */
+
+/****************************************************************************
+ * Features
+ ****************************************************************************/
+
+// Default for the optional features below. On AVR they're all left out, so
+// a sketch only pays flash and RAM for setSpeed(), F0-F12, the accessories
+// and opsProgramCV() unless it asks for more. Builds that run on a host get
+// them all. Set this to 1 to start from everything, or switch features on
+// one at a time.
+#ifndef DCC_SUPPORT_OPTIONAL
+#if defined(__AVR__)
+#define DCC_SUPPORT_OPTIONAL        0
+#else
+#define DCC_SUPPORT_OPTIONAL        1
+#endif
+#endif
+
+// Speed step modes setSpeed() can use. At least one must be enabled.
+#ifndef DCC_SUPPORT_SPEED14
+#define DCC_SUPPORT_SPEED14         1
+#endif
+
+#ifndef DCC_SUPPORT_SPEED28
+#define DCC_SUPPORT_SPEED28         1
+#endif
+
+#ifndef DCC_SUPPORT_SPEED128
+#define DCC_SUPPORT_SPEED128        1
+#endif
+
+// Speed steps used when setSpeed() is given 0 steps
+#ifndef DCC_DEFAULT_SPEED_STEPS
+#define DCC_DEFAULT_SPEED_STEPS     128
+#endif
+
+// setSpeedTarget(), which ramps speed in update() instead of in the sketch,
+// and how many locos can be ramping at once
+#ifndef DCC_SUPPORT_MOMENTUM
+#define DCC_SUPPORT_MOMENTUM        DCC_SUPPORT_OPTIONAL
+#endif
+
+#ifndef DCC_MOMENTUM_SLOTS
+#define DCC_MOMENTUM_SLOTS          8
+#endif
+
+// Time on the rails of every packet sent, getUtilization() and
+// predictRefreshInterval(), and how much time each getUtilization() figure covers
+#ifndef DCC_SUPPORT_BANDWIDTH
+#define DCC_SUPPORT_BANDWIDTH       DCC_SUPPORT_OPTIONAL
+#endif
+
+#ifndef DCC_BANDWIDTH_WINDOW_US
+#define DCC_BANDWIDTH_WINDOW_US     1000000UL
+#endif
+
+// Per-address service classes: setServiceClass() and setAddressClass(), how
+// many classes there are, and how many addresses can be put in a class
+// other than 0, which is the class of every other address.
+#ifndef DCC_SUPPORT_QOS
+#define DCC_SUPPORT_QOS             DCC_SUPPORT_OPTIONAL
+#endif
+
+#ifndef DCC_QOS_CLASSES
+#define DCC_QOS_CLASSES             4
+#endif
+
+#ifndef DCC_QOS_ADDRESSES
+#define DCC_QOS_ADDRESSES           8
+#endif
+
+// setFunctions13to20(), setFunctions21to28(), setFunctions29to68() and
+// setBinaryState(). Not every decoder understands these.
+#ifndef DCC_SUPPORT_FEATURE_EXPANSION
+#define DCC_SUPPORT_FEATURE_EXPANSION DCC_SUPPORT_OPTIONAL
+#endif
+
+// setBasicAccessory(), unsetBasicAccessory() and setExtendedAccessory()
+#ifndef DCC_SUPPORT_ACCESSORY
+#define DCC_SUPPORT_ACCESSORY       1
+#endif
+
+// Remember the last state sent to each of the 2048 basic accessory outputs,
+// so setAccessoryCache(true) can drop commands that wouldn't change anything.
+// Costs 512 bytes of RAM, so it's left out on the smaller chips even when
+// DCC_SUPPORT_OPTIONAL is set.
+#ifndef DCC_SUPPORT_ACCESSORY_CACHE
+#if defined(__AVR_ATmega168__) || defined(__AVR_ATmega328P__)
+#define DCC_SUPPORT_ACCESSORY_CACHE 0
+#else
+#define DCC_SUPPORT_ACCESSORY_CACHE (DCC_SUPPORT_OPTIONAL && DCC_SUPPORT_ACCESSORY)
+#endif
+#endif
+
+// setRoute(), and the least time between two turnouts of a route being
+// thrown, so solenoids don't all fire at once. Needs DCC_SUPPORT_ACCESSORY.
+#ifndef DCC_SUPPORT_ROUTES
+#define DCC_SUPPORT_ROUTES          (DCC_SUPPORT_OPTIONAL && DCC_SUPPORT_ACCESSORY)
+#endif
+
+#ifndef DCC_ROUTE_INTERVAL_MS
+#define DCC_ROUTE_INTERVAL_MS       100
+#endif
+
+// opsProgramCV()
+#ifndef DCC_SUPPORT_OPS_MODE
+#define DCC_SUPPORT_OPS_MODE        1
+#endif
+
+// Advanced consisting with CV19: addToConsist() and removeFromConsist(),
+// and how many locos can be in consists at once. Needs DCC_SUPPORT_OPS_MODE.
+#ifndef DCC_SUPPORT_CONSIST
+#define DCC_SUPPORT_CONSIST         (DCC_SUPPORT_OPTIONAL && DCC_SUPPORT_OPS_MODE)
+#endif
+
+#ifndef DCC_CONSIST_MEMBERS
+#define DCC_CONSIST_MEMBERS         8
+#endif
+
+// schedulePacket() and pulseBasicAccessory(), which send packets a number
+// of packets from now, and how many can be waiting at once
+#ifndef DCC_SUPPORT_TIMERS
+#define DCC_SUPPORT_TIMERS          DCC_SUPPORT_OPTIONAL
+#endif
+
+#ifndef DCC_TIMER_COUNT
+#define DCC_TIMER_COUNT             16
+#endif
+
+// Most timers update() will fire in one call. The rest wait for the next.
+#ifndef DCC_TIMER_FIRE_LIMIT
+#define DCC_TIMER_FIRE_LIMIT        2
+#endif
+
+// Keep loco speeds and F0-F28, the consist table and the accessory cache in
+// EEPROM (or DCC_SNAPSHOT_FILE when not built for AVR), so restoreSnapshot()
+// can bring a layout back after a power cut. Off by default, because it
+// takes over EEPROM from DCC_SNAPSHOT_ADDRESS. DCC_SNAPSHOT_COPIES spreads
+// the writes for each loco over that many records to spread the wear.
+#ifndef DCC_SUPPORT_SNAPSHOT
+#define DCC_SUPPORT_SNAPSHOT        0
+#endif
+
+#ifndef DCC_SNAPSHOT_LOCOS
+#define DCC_SNAPSHOT_LOCOS          8
+#endif
+
+#ifndef DCC_SNAPSHOT_COPIES
+#define DCC_SNAPSHOT_COPIES         4
+#endif
+
+#ifndef DCC_SNAPSHOT_ADDRESS
+#define DCC_SNAPSHOT_ADDRESS        0
+#endif
+
+#ifndef DCC_SNAPSHOT_FILE
+#define DCC_SNAPSHOT_FILE           "dcc_snapshot.bin"
+#endif
+
+// DCCCommandParser, which reads DCC++ style text commands (<t ...>, <f ...>,
+// <a ...>, <w ...> and <!>) a byte at a time and hands them to a scheduler,
+// and the most numbers a command can carry
+#ifndef DCC_SUPPORT_PARSER
+#define DCC_SUPPORT_PARSER          DCC_SUPPORT_OPTIONAL
+#endif
+
+#ifndef DCC_PARSER_ARGS
+#define DCC_PARSER_ARGS             4
+#endif
+
+// DCCFrameDecoder, which reads the binary command frames DCCFrameEncoder
+// builds, the longest frame it takes, and how many received bytes it can
+// hold between calls to update(). DCC_FRAME_RX_SIZE must be a power of two.
+#ifndef DCC_SUPPORT_FRAMES
+#define DCC_SUPPORT_FRAMES          DCC_SUPPORT_OPTIONAL
+#endif
+
+#ifndef DCC_FRAME_MAX_PAYLOAD
+#define DCC_FRAME_MAX_PAYLOAD       32
+#endif
+
+#ifndef DCC_FRAME_RX_SIZE
+#define DCC_FRAME_RX_SIZE           64
+#endif
+
+// DCCInbox, which lets several threads post commands without locks for one
+// thread to hand to the scheduler, and how many commands it can hold. Needs
+// <atomic>, so only for builds that run on a host, and DCC_SUPPORT_FRAMES.
+// DCC_INBOX_SIZE must be a power of two.
+#ifndef DCC_SUPPORT_INBOX
+#if defined(__AVR__)
+#define DCC_SUPPORT_INBOX           0
+#else
+#define DCC_SUPPORT_INBOX           DCC_SUPPORT_FRAMES
+#endif
+#endif
+
+#ifndef DCC_INBOX_SIZE
+#define DCC_INBOX_SIZE              1024
+#endif
+
+// DCCDecoder, which turns the lengths of half bits back into packets, and
+// the fewest preamble '1's it will take before a packet, S 9.2 line 45
+#ifndef DCC_SUPPORT_DECODER
+#define DCC_SUPPORT_DECODER         DCC_SUPPORT_OPTIONAL
+#endif
+
+#ifndef DCC_DECODER_MIN_PREAMBLE
+#define DCC_DECODER_MIN_PREAMBLE    10
+#endif
+
+// setAdaptiveRepeat(), setTrackLoss() and reportDelivery(). Once switched
+// on, each packet is repeated as many times as the loss on the track, or at
+// its address if there is feedback for it, says it takes to reach its
+// decoder, with no more than DCC_ADAPTIVE_MISS_PPM in a million missing it
+// (DCC_ADAPTIVE_ESTOP_MISS_PPM for e-stops). DCC_ADAPTIVE_ADDRESSES locos
+// can have a loss of their own from feedback, averaged over about
+// 2^DCC_ADAPTIVE_SHIFT reports.
+#ifndef DCC_SUPPORT_ADAPTIVE_REPEAT
+#define DCC_SUPPORT_ADAPTIVE_REPEAT DCC_SUPPORT_OPTIONAL
+#endif
+
+#ifndef DCC_ADAPTIVE_ADDRESSES
+#define DCC_ADAPTIVE_ADDRESSES      8
+#endif
+
+#ifndef DCC_ADAPTIVE_MISS_PPM
+#define DCC_ADAPTIVE_MISS_PPM       1000
+#endif
+
+#ifndef DCC_ADAPTIVE_ESTOP_MISS_PPM
+#define DCC_ADAPTIVE_ESTOP_MISS_PPM 1
+#endif
+
+#ifndef DCC_ADAPTIVE_SHIFT
+#define DCC_ADAPTIVE_SHIFT          5
+#endif
+
+// setGovernor(), which stops an encoder throttle being spun from flooding
+// the high priority queue: each loco gets at most one speed packet, and
+// one of each function group, per window, and a command arriving within
+// the window waits for its end, replaced by any newer one in the meantime.
+// Stops and changes of direction always go straight away. The window
+// starts at DCC_GOVERNOR_MS, 0 for no governing, and DCC_GOVERNOR_SLOTS
+// loco and packet kind pairs can be governed at once.
+#ifndef DCC_SUPPORT_GOVERNOR
+#define DCC_SUPPORT_GOVERNOR        DCC_SUPPORT_OPTIONAL
+#endif
+
+#ifndef DCC_GOVERNOR_SLOTS
+#define DCC_GOVERNOR_SLOTS          8
+#endif
+
+#ifndef DCC_GOVERNOR_MS
+#define DCC_GOVERNOR_MS             0
+#endif
+
+/****************************************************************************
+ * Queues
+ ****************************************************************************/
+
+// Total number of packed packet slots shared by every queue. At most 255.
+#ifndef DCC_PACKET_POOL_SIZE
+#define DCC_PACKET_POOL_SIZE        32
+#endif
+
+// Each queue is guaranteed its RESERVE slots and may grow to its SIZE
+// while the pool has slots to spare. Reserves must add up to no more than
+// DCC_PACKET_POOL_SIZE.
+#ifndef E_STOP_QUEUE_RESERVE
+#define E_STOP_QUEUE_RESERVE        2
+#endif
+
+#ifndef HIGH_PRIORITY_QUEUE_RESERVE
+#define HIGH_PRIORITY_QUEUE_RESERVE 4
+#endif
+
+#ifndef LOW_PRIORITY_QUEUE_RESERVE
+#define LOW_PRIORITY_QUEUE_RESERVE  4
+#endif
+
+#ifndef REPEAT_QUEUE_RESERVE
+#define REPEAT_QUEUE_RESERVE        4
+#endif
+
+#ifndef E_STOP_QUEUE_SIZE
+#define E_STOP_QUEUE_SIZE           2
+#endif
+
+#ifndef HIGH_PRIORITY_QUEUE_SIZE
+#define HIGH_PRIORITY_QUEUE_SIZE    DCC_PACKET_POOL_SIZE
+#endif
+
+#ifndef LOW_PRIORITY_QUEUE_SIZE
+#define LOW_PRIORITY_QUEUE_SIZE     DCC_PACKET_POOL_SIZE
+#endif
+
+#ifndef REPEAT_QUEUE_SIZE
+#define REPEAT_QUEUE_SIZE           DCC_PACKET_POOL_SIZE
+#endif
+
+// With DCC_SUPPORT_FAIR_QUEUES, setFairQueues() has the low priority and
+// repeat queues take addresses in turn rather than strictly first come,
+// first served: a loco with a dozen packets queued gets one of them out
+// each round, as does every other address with something waiting, so a
+// newly queued packet waits for one packet from each of them rather than
+// for all of theirs. DCC_FAIR_QUEUES says whether it starts on.
+#ifndef DCC_SUPPORT_FAIR_QUEUES
+#define DCC_SUPPORT_FAIR_QUEUES     DCC_SUPPORT_OPTIONAL
+#endif
+
+#ifndef DCC_FAIR_QUEUES
+#define DCC_FAIR_QUEUES             0
+#endif
+
+/****************************************************************************
+ * Repeats
+ ****************************************************************************/
+
+// How many times each kind of packet is repeated after it is first sent.
+// Queued packets can repeat at most DCC_PACKED_MAX_REPEAT times.
+#ifndef SPEED_REPEAT
+#define SPEED_REPEAT                3
+#endif
+
+#ifndef FUNCTION_REPEAT
+#define FUNCTION_REPEAT             3
+#endif
+
+#ifndef E_STOP_REPEAT
+#define E_STOP_REPEAT               5
+#endif
+
+#ifndef OPS_MODE_PROGRAMMING_REPEAT
+#define OPS_MODE_PROGRAMMING_REPEAT 3
+#endif
+
+#ifndef OTHER_REPEAT
+#define OTHER_REPEAT                2
+#endif
+
+// With DCC_SUPPORT_REPEAT_SPACING, repeats and e-stops are spread out
+// rather than sent back to back, so one burst of noise can't take every
+// copy: the first repeat of a packet waits at least DCC_REPEAT_SPACING
+// packets, each one after that DCC_REPEAT_BACKOFF times as long as the last
+// up to DCC_REPEAT_MAX_GAP, and other addresses' packets go in between.
+// setRepeatSpacing() changes the spacing at run time; 0 turns it off.
+#ifndef DCC_SUPPORT_REPEAT_SPACING
+#define DCC_SUPPORT_REPEAT_SPACING  DCC_SUPPORT_OPTIONAL
+#endif
+
+#ifndef DCC_REPEAT_SPACING
+#define DCC_REPEAT_SPACING          0
+#endif
+
+#ifndef DCC_REPEAT_BACKOFF
+#define DCC_REPEAT_BACKOFF          2
+#endif
+
+#ifndef DCC_REPEAT_MAX_GAP
+#define DCC_REPEAT_MAX_GAP          64
+#endif
+
+/****************************************************************************
+ * Scheduling
+ ****************************************************************************/
+
+// The low priority queue gets a packet at least every LOW_PRIORITY_INTERVAL
+// packets, and the repeat queue at least every REPEAT_INTERVAL packets,
+// however busy the queues above them are.
+#ifndef LOW_PRIORITY_INTERVAL
+#define LOW_PRIORITY_INTERVAL       5
+#endif
+
+#ifndef REPEAT_INTERVAL
+#define REPEAT_INTERVAL             11
+#endif
+
+#ifndef PERIODIC_REFRESH_INTERVAL
+#define PERIODIC_REFRESH_INTERVAL   23
+#endif
+
+/****************************************************************************
+ * Hardware
+ ****************************************************************************/
+
+// If defined, this pin will go high during the preamble
+// of each command. This helps synchronise a logic analyser.
+#ifndef DCC_NO_COMMAND_STROBE
+#define COMMAND_STROBE
+#endif
+
+// Time the rails spend in each half of a '1' and a '0' bit, in microseconds.
+// Raising DCC_ZERO_LOW_US stretches zeros to run a DC loco, up to 9900us.
+#ifndef DCC_ONE_US
+#define DCC_ONE_US                  58
+#endif
+
+#ifndef DCC_ZERO_HIGH_US
+#define DCC_ZERO_HIGH_US            100
+#endif
+
+#ifndef DCC_ZERO_LOW_US
+#define DCC_ZERO_LOW_US             100
+#endif
+
+// '1's sent before each packet. The last packet's end bit makes one more.
+#ifndef DCC_PREAMBLE_BITS
+#define DCC_PREAMBLE_BITS           13
+#endif
+
+// If defined, DCCHardwareSim.cpp stands in for the Timer1 driver so the
+// library can run on a host: packets take as long as they would on the
+// rails, by micros(), and are handed to a monitor instead.
+//#define DCC_HW_SIMULATED
+
+// If defined, supplied packets are kept in a small ring of ready-encoded
+// packets. The ISR picks the next one itself at the end of every packet, so
+// a loop() that blocks for a few milliseconds doesn't starve the track. If
+// the ring runs dry the ISR sends idle packets rather than bare '1's.
+//#define DCC_HW_PACKET_RING
+
+// Number of packets the ring can hold. Must be a power of two.
+#ifndef DCC_HW_PACKET_RING_SIZE
+#define DCC_HW_PACKET_RING_SIZE     4
+#endif
+
+/****************************************************************************
+ * Checks
+ ****************************************************************************/
+
+#if !DCC_SUPPORT_SPEED14 && !DCC_SUPPORT_SPEED28 && !DCC_SUPPORT_SPEED128
+#error "At least one speed step mode must be enabled"
+#endif
+
+#if DCC_SUPPORT_ACCESSORY_CACHE && !DCC_SUPPORT_ACCESSORY
+#error "DCC_SUPPORT_ACCESSORY_CACHE needs DCC_SUPPORT_ACCESSORY"
+#endif
+
+#if DCC_SUPPORT_ROUTES && !DCC_SUPPORT_ACCESSORY
+#error "DCC_SUPPORT_ROUTES needs DCC_SUPPORT_ACCESSORY"
+#endif
+
+#if DCC_SUPPORT_PARSER && ((DCC_PARSER_ARGS < 4) || (DCC_PARSER_ARGS > 255))
+#error "DCC_PARSER_ARGS must be between 4 and 255"
+#endif
+
+#if (DCC_FRAME_MAX_PAYLOAD < 6) || (DCC_FRAME_MAX_PAYLOAD > 255)
+#error "DCC_FRAME_MAX_PAYLOAD must be between 6 and 255"
+#endif
+
+#if DCC_SUPPORT_FRAMES && (((DCC_FRAME_RX_SIZE & (DCC_FRAME_RX_SIZE - 1)) != 0) || (DCC_FRAME_RX_SIZE > 128))
+#error "DCC_FRAME_RX_SIZE must be a power of two, at most 128"
+#endif
+
+#if DCC_SUPPORT_INBOX && !DCC_SUPPORT_FRAMES
+#error "DCC_SUPPORT_INBOX needs DCC_SUPPORT_FRAMES"
+#endif
+
+#if DCC_SUPPORT_INBOX && ((DCC_INBOX_SIZE < 2) || ((DCC_INBOX_SIZE & (DCC_INBOX_SIZE - 1)) != 0))
+#error "DCC_INBOX_SIZE must be a power of two"
+#endif
+
+#if DCC_SUPPORT_ADAPTIVE_REPEAT && ((DCC_ADAPTIVE_SHIFT < 1) || (DCC_ADAPTIVE_SHIFT > 10))
+#error "DCC_ADAPTIVE_SHIFT must be between 1 and 10"
+#endif
+
+#if DCC_SUPPORT_ADAPTIVE_REPEAT && ((DCC_ADAPTIVE_MISS_PPM > 1000000UL) || (DCC_ADAPTIVE_ESTOP_MISS_PPM > 1000000UL))
+#error "DCC_ADAPTIVE_MISS_PPM and DCC_ADAPTIVE_ESTOP_MISS_PPM are parts per million"
+#endif
+
+#if DCC_SUPPORT_REPEAT_SPACING && ((DCC_REPEAT_MAX_GAP < 1) || (DCC_REPEAT_MAX_GAP > 127) || (DCC_REPEAT_SPACING > DCC_REPEAT_MAX_GAP))
+#error "DCC_REPEAT_MAX_GAP must be between 1 and 127, and no less than DCC_REPEAT_SPACING"
+#endif
+
+#if DCC_SUPPORT_REPEAT_SPACING && (DCC_REPEAT_BACKOFF < 1)
+#error "DCC_REPEAT_BACKOFF must be at least 1"
+#endif
+
+#if DCC_SUPPORT_CONSIST && !DCC_SUPPORT_OPS_MODE
+#error "DCC_SUPPORT_CONSIST needs DCC_SUPPORT_OPS_MODE"
+#endif
+
+#if DCC_SUPPORT_TIMERS && ((DCC_TIMER_COUNT < 1) || (DCC_TIMER_COUNT > 65534))
+#error "DCC_TIMER_COUNT must be between 1 and 65534"
+#endif
+
+#if DCC_SUPPORT_SNAPSHOT && ((DCC_SNAPSHOT_COPIES < 2) || (DCC_SNAPSHOT_COPIES > 16))
+#error "DCC_SNAPSHOT_COPIES must be between 2 and 16"
+#endif
+
+#if (E_STOP_QUEUE_RESERVE + HIGH_PRIORITY_QUEUE_RESERVE + LOW_PRIORITY_QUEUE_RESERVE + REPEAT_QUEUE_RESERVE) > DCC_PACKET_POOL_SIZE
+#error "Queue reservations are larger than DCC_PACKET_POOL_SIZE"
+#endif
+
+#if (DCC_HW_PACKET_RING_SIZE & (DCC_HW_PACKET_RING_SIZE - 1)) != 0
+#error "DCC_HW_PACKET_RING_SIZE must be a power of two"
+#endif
+
+#endif // INC_DCCCONFIG_H
+
+/****************************************************************************
+ * End of file
+ ****************************************************************************/
@@ -0,0 +1,285 @@
+/*
+ * CmdrArduino
+ *
+ * DCC Receiver
+ *
+ * Author: Don Goodman-Wilson dgoodman@artificial-science.org
+ * Changes by: Jonathan Pallant dcc@thejpster.org.uk
+ *
+ * based on software by Wolfgang Kufer, http://opendcc.de
+ *
+ * Copyright 2010 Don Goodman-Wilson
+ * Copyright 2015 Jonathan Pallant
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/****************************************************************************
+* Includes
+****************************************************************************/
+#include <Arduino.h>
+#include <stdint.h>
+
+#include "DCCDecoder.h"
+
+#if DCC_SUPPORT_DECODER
+
+/****************************************************************************
+ * Defines
+ ****************************************************************************/
+
+// Where halfBit() has got to
+#define DECODER_PREAMBLE  0 //counting '1's
+#define DECODER_START     1 //read the first half of the packet start bit
+#define DECODER_DATA      2 //reading a byte
+#define DECODER_SEPARATOR 3 //read a byte; a '0' starts another, a '1' ends the packet
+
+// Classes of half bit
+#define HALF_ONE          1
+#define HALF_ZERO         0
+#define HALF_BAD          2
+
+/****************************************************************************
+ * Data Types
+ ****************************************************************************/
+
+/* None */
+
+/****************************************************************************
+ * Function Prototypes
+ ****************************************************************************/
+
+static uint8_t halfClass(uint16_t us);
+
+/****************************************************************************
+ * Public Data
+ ****************************************************************************/
+
+/* None */
+
+/****************************************************************************
+ * Private Data
+ ****************************************************************************/
+
+/* None */
+
+/****************************************************************************
+ * Public Functions
+ ****************************************************************************/
+
+DCCDecoder::DCCDecoder(void) : packet_count(0), packets(0), checksum_errors(0), framing_errors(0)
+{
+    reset();
+}
+
+void DCCDecoder::reset(void)
+{
+    state = DECODER_PREAMBLE;
+    halves = 0;
+    first_half = 0;
+    bits = 0;
+    count = 0;
+}
+
+bool DCCDecoder::halfBit(uint16_t us)
+{
+    uint8_t value = halfClass(us);
+
+    if (value == HALF_BAD)
+    {
+        error();
+        return false;
+    }
+
+    switch (state)
+    {
+    case DECODER_PREAMBLE:
+        if (value == HALF_ONE)
+        {
+            if (halves < 255)
+            {
+                ++halves;
+            }
+        }
+        else if (halves >= (2 * DCC_DECODER_MIN_PREAMBLE))
+        {
+            state = DECODER_START;
+        }
+        else
+        {
+            halves = 0; //noise, or a preamble that's too short
+        }
+        return false;
+
+    case DECODER_START:
+        if (value != HALF_ZERO)
+        {
+            error();
+            return false;
+        }
+
+        state = DECODER_DATA;
+        bytes[0] = 0;
+        bits = 0;
+        count = 0;
+        return false;
+    }
+
+    //both halves of a bit have to agree, and the halves of a '1' be about the same
+    if (!first_half)
+    {
+        first_half = us;
+        return false;
+    }
+
+    uint16_t skew = (us > first_half) ? (us - first_half) : (first_half - us);
+
+    if ((halfClass(first_half) != value) || ((value == HALF_ONE) && (skew > DCC_DECODER_ONE_SKEW_US)))
+    {
+        error();
+        return false;
+    }
+
+    first_half = 0;
+    return bit(value);
+}
+
+size_t DCCDecoder::decode(const uint16_t* us, size_t count, dcc_decoder_handler_t handler)
+{
+    size_t found = 0;
+
+    for (size_t i = 0; i < count; ++i)
+    {
+        if (halfBit(us[i]))
+        {
+            ++found;
+
+            if (handler)
+            {
+                handler(packet, packet_count);
+            }
+        }
+    }
+
+    return found;
+}
+
+size_t DCCDecoder::getBitstream(uint8_t rawbytes[]) const
+{
+    for (uint8_t i = 0; i < packet_count; ++i)
+    {
+        rawbytes[i] = packet[i];
+    }
+
+    return packet_count;
+}
+
+/****************************************************************************
+ * Private Functions
+ ****************************************************************************/
+
+bool DCCDecoder::bit(uint8_t value)
+{
+    if (state == DECODER_DATA)
+    {
+        bytes[count] = (bytes[count] << 1) | value;
+
+        if (++bits == 8)
+        {
+            ++count;
+            state = DECODER_SEPARATOR;
+        }
+
+        return false;
+    }
+
+    if (!value) //another byte
+    {
+        if (count == DCC_PACKET_MAX_LEN)
+        {
+            error();
+            return false;
+        }
+
+        bytes[count] = 0;
+        bits = 0;
+        state = DECODER_DATA;
+        return false;
+    }
+
+    //the packet end bit, which can also be the first '1' of the next preamble
+    state = DECODER_PREAMBLE;
+    halves = 2;
+
+    if (count < 3)
+    {
+        ++framing_errors;
+        return false;
+    }
+
+    uint8_t cs_byte = 0;
+
+    for (uint8_t i = 0; i < count; ++i)
+    {
+        cs_byte ^= bytes[i];
+    }
+
+    if (cs_byte)
+    {
+        ++checksum_errors;
+        return false;
+    }
+
+    for (uint8_t i = 0; i < count; ++i)
+    {
+        packet[i] = bytes[i];
+    }
+
+    packet_count = count;
+    ++packets;
+    return true;
+}
+
+//only counted as an error once a packet has started: the preamble may just be noise
+void DCCDecoder::error(void)
+{
+    if (state != DECODER_PREAMBLE)
+    {
+        ++framing_errors;
+    }
+
+    reset();
+}
+
+static uint8_t halfClass(uint16_t us)
+{
+    if ((us >= DCC_DECODER_ONE_MIN_US) && (us <= DCC_DECODER_ONE_MAX_US))
+    {
+        return HALF_ONE;
+    }
+
+    if ((us >= DCC_DECODER_ZERO_MIN_US) && (us <= DCC_DECODER_ZERO_MAX_US))
+    {
+        return HALF_ZERO;
+    }
+
+    return HALF_BAD;
+}
+
+#endif // DCC_SUPPORT_DECODER
+
+/****************************************************************************
+ * End of file
+ ****************************************************************************/
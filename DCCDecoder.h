@@ -0,0 +1,128 @@
+/*
+ * CmdrArduino
+ *
+ * DCC Receiver
+ *
+ * Author: Don Goodman-Wilson dgoodman@artificial-science.org
+ * Changes by: Jonathan Pallant dcc@thejpster.org.uk
+ *
+ * based on software by Wolfgang Kufer, http://opendcc.de
+ *
+ * Copyright 2010 Don Goodman-Wilson
+ * Copyright 2015 Jonathan Pallant
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef INC_DCCDECODER_H
+#define INC_DCCDECODER_H
+
+#include "DCCConfig.h"
+
+#if DCC_SUPPORT_DECODER
+
+#include "DCCPacket.h"
+
+/****************************************************************************
+ * Defines
+ ****************************************************************************/
+
+// What a decoder must take as half of a '1' and half of a '0', and how far
+// apart the halves of a '1' may be, in microseconds. S 9.1 A.
+#define DCC_DECODER_ONE_MIN_US   52
+#define DCC_DECODER_ONE_MAX_US   64
+#define DCC_DECODER_ONE_SKEW_US  6
+#define DCC_DECODER_ZERO_MIN_US  90
+#define DCC_DECODER_ZERO_MAX_US  10000
+
+/****************************************************************************
+ * Data Types
+ ****************************************************************************/
+
+//called with the bytes of each packet whose XOR checks out, as getBitstream() writes them
+typedef void (*dcc_decoder_handler_t)(const uint8_t* rawbytes, size_t count);
+
+/**
+ * Turns what's on the rails back into packets. It is given the length of
+ * each half bit in turn, from an input capture interrupt or from the
+ * simulated hardware, and looks for a preamble of at least
+ * DCC_DECODER_MIN_PREAMBLE '1's, then bytes separated by '0's, up to the
+ * '1' that ends the packet. Half bits outside the S 9.1 windows, or that
+ * don't pair up, throw away what's been read and it waits for the next
+ * preamble. Holds just the bytes of one packet; nothing is allocated.
+ *
+ * When called from an ISR, copy the packet out with getBitstream() before
+ * the next one can finish, e.g. with interrupts off.
+**/
+class DCCDecoder
+{
+public:
+    DCCDecoder(void);
+
+    void reset(void);
+
+    //true if this half bit finished a packet with a good XOR
+    bool halfBit(uint16_t us);
+    //a run of half bits; calls handler, if there is one, with each packet. Returns how many there were.
+    size_t decode(const uint16_t* us, size_t count, dcc_decoder_handler_t handler = 0);
+
+    //the last good packet
+    size_t getBitstream(uint8_t rawbytes[]) const; //returns number of bytes written
+    inline bool getPacket(DCCPacket& p) const //false if a DCCPacket can't hold it
+    {
+        return p.setBitstream(packet, packet_count);
+    }
+
+    inline uint32_t getPackets(void) const
+    {
+        return packets;
+    }
+
+    inline uint32_t getChecksumErrors(void) const
+    {
+        return checksum_errors;
+    }
+
+    inline uint32_t getFramingErrors(void) const //bad timing, halves that don't match, and packets too long or short
+    {
+        return framing_errors;
+    }
+
+private:
+    uint8_t state;
+    uint8_t halves; //half bits of preamble so far
+    uint16_t first_half; //first half of the bit being read, or 0
+    uint8_t bits; //bits of the current byte so far
+    uint8_t bytes[DCC_PACKET_MAX_LEN];
+    uint8_t count; //bytes so far
+
+    uint8_t packet[DCC_PACKET_MAX_LEN];
+    uint8_t packet_count;
+
+    uint32_t packets;
+    uint32_t checksum_errors;
+    uint32_t framing_errors;
+
+    bool bit(uint8_t value);
+    void error(void);
+};
+
+#endif // DCC_SUPPORT_DECODER
+
+#endif // INC_DCCDECODER_H
+
+/****************************************************************************
+ * End of file
+ ****************************************************************************/
@@ -77,11 +77,24 @@ bool DCCEmergencyQueue::readPacket(DCCPacket& packet)
 {
     if (!isEmpty()) //anything in the queue?
     {
-        queue[read_pos].setRepeat(queue[read_pos].getRepeat() - 1); //decrement the current packet's repeat count
+        uint8_t& info = dcc_packet_pool.packed_info[head];
+        uint8_t repeat = info & DCC_PACKED_REPEAT_MASK;
 
-        if (queue[read_pos].getRepeat()) //if the topmost packet needs repeating
+        if (repeat > 1) //if the topmost packet needs repeating
         {
-            packet = queue[read_pos];
+            //decrement the current packet's repeat count in place
+            beginChange();
+            info = (info & DCC_PACKED_KIND_MASK) | (repeat - 1);
+            endChange();
+            loadPacket(head, packet);
+#if DCC_SUPPORT_REPEAT_SPACING
+            if (spacing)
+            {
+                //let the other e-stops, and anything else due, go before this one again
+                respace(head);
+                requeueHead();
+            }
+#endif
             return true;
         }
         else //the topmost packet is ready to be discarded; use the DCCPacketQueue mechanism
@@ -0,0 +1,218 @@
+/*
+ * CmdrArduino
+ *
+ * DCC Binary Command Frames
+ *
+ * Author: Don Goodman-Wilson dgoodman@artificial-science.org
+ * Changes by: Jonathan Pallant dcc@thejpster.org.uk
+ *
+ * based on software by Wolfgang Kufer, http://opendcc.de
+ *
+ * Copyright 2010 Don Goodman-Wilson
+ * Copyright 2015 Jonathan Pallant
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/****************************************************************************
+* Includes
+****************************************************************************/
+// No Arduino.h: the encoder is also built into host programs
+#include <stdint.h>
+#include <stddef.h>
+
+#include "DCCFrame.h"
+
+/****************************************************************************
+ * Defines
+ ****************************************************************************/
+
+/* None */
+
+/****************************************************************************
+ * Data Types
+ ****************************************************************************/
+
+/* None */
+
+/****************************************************************************
+ * Function Prototypes
+ ****************************************************************************/
+
+/* None */
+
+/****************************************************************************
+ * Public Data
+ ****************************************************************************/
+
+/* None */
+
+/****************************************************************************
+ * Private Data
+ ****************************************************************************/
+
+/* None */
+
+/****************************************************************************
+ * Public Functions
+ ****************************************************************************/
+
+//CRC-8, polynomial x^8 + x^2 + x + 1, one byte at a time
+uint8_t dcc_frame_crc(uint8_t crc, uint8_t c)
+{
+    crc ^= c;
+
+    for (uint8_t i = 0; i < 8; ++i)
+    {
+        crc = (crc & 0x80) ? ((crc << 1) ^ 0x07) : (crc << 1);
+    }
+
+    return crc;
+}
+
+DCCFrameEncoder::DCCFrameEncoder(uint8_t* buffer, size_t size) : buffer(buffer), size(size), length(0)
+{
+}
+
+void DCCFrameEncoder::begin(void)
+{
+    length = 0;
+}
+
+size_t DCCFrameEncoder::finish(void)
+{
+    if (!length)
+    {
+        return 0;
+    }
+
+    uint8_t crc = dcc_frame_crc(0, length);
+
+    for (size_t i = 0; i < length; ++i)
+    {
+        crc = dcc_frame_crc(crc, buffer[2 + i]);
+    }
+
+    buffer[0] = DCC_FRAME_SYNC;
+    buffer[1] = length;
+    buffer[2 + length] = crc;
+    return length + DCC_FRAME_OVERHEAD;
+}
+
+bool DCCFrameEncoder::speed(uint16_t cab, bool long_address, uint8_t speed)
+{
+    uint8_t* p = add(DCC_FRAME_SPEED, DCC_FRAME_SPEED_LEN);
+
+    if (!p)
+    {
+        return false;
+    }
+
+    putCab(p, cab, long_address);
+    p[2] = speed;
+    return true;
+}
+
+bool DCCFrameEncoder::functions(uint16_t cab, bool long_address, uint8_t group, uint8_t functions)
+{
+    uint8_t* p = add(DCC_FRAME_FUNCTIONS, DCC_FRAME_FUNCTIONS_LEN);
+
+    if (!p)
+    {
+        return false;
+    }
+
+    putCab(p, cab, long_address);
+    p[2] = group;
+    p[3] = functions;
+    return true;
+}
+
+bool DCCFrameEncoder::accessory(uint16_t address, uint8_t function, bool on)
+{
+    uint8_t* p = add(DCC_FRAME_ACCESSORY, DCC_FRAME_ACCESSORY_LEN);
+
+    if (!p)
+    {
+        return false;
+    }
+
+    uint16_t output = ((address & 0x1FF) << 2) | (function & 0x03) | (on ? 0x8000 : 0);
+    p[0] = output >> 8;
+    p[1] = output & 0xFF;
+    return true;
+}
+
+bool DCCFrameEncoder::opsProgramCV(uint16_t cab, bool long_address, uint16_t CV, uint8_t CV_data)
+{
+    uint8_t* p = add(DCC_FRAME_OPS_CV, DCC_FRAME_OPS_CV_LEN);
+
+    if (!p)
+    {
+        return false;
+    }
+
+    putCab(p, cab, long_address);
+    p[2] = CV >> 8;
+    p[3] = CV & 0xFF;
+    p[4] = CV_data;
+    return true;
+}
+
+bool DCCFrameEncoder::eStop(void)
+{
+    return add(DCC_FRAME_ESTOP, DCC_FRAME_ESTOP_LEN) != 0;
+}
+
+bool DCCFrameEncoder::eStop(uint16_t cab, bool long_address)
+{
+    uint8_t* p = add(DCC_FRAME_ESTOP_LOCO, DCC_FRAME_ESTOP_LOCO_LEN);
+
+    if (!p)
+    {
+        return false;
+    }
+
+    putCab(p, cab, long_address);
+    return true;
+}
+
+/****************************************************************************
+ * Private Functions
+ ****************************************************************************/
+
+uint8_t* DCCFrameEncoder::add(uint8_t opcode, size_t bytes)
+{
+    if ((length + bytes > DCC_FRAME_MAX_PAYLOAD) || (length + bytes + DCC_FRAME_OVERHEAD > size))
+    {
+        return 0;
+    }
+
+    uint8_t* p = &buffer[2 + length];
+    p[0] = opcode;
+    length += bytes;
+    return p + 1;
+}
+
+void DCCFrameEncoder::putCab(uint8_t* p, uint16_t cab, bool long_address)
+{
+    cab = (cab & 0x3FFF) | (long_address ? DCC_FRAME_LONG : 0);
+    p[0] = cab >> 8;
+    p[1] = cab & 0xFF;
+}
+
+/****************************************************************************
+ * End of file
+ ****************************************************************************/
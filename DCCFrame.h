@@ -0,0 +1,117 @@
+/*
+ * CmdrArduino
+ *
+ * DCC Binary Command Frames
+ *
+ * Author: Don Goodman-Wilson dgoodman@artificial-science.org
+ * Changes by: Jonathan Pallant dcc@thejpster.org.uk
+ *
+ * based on software by Wolfgang Kufer, http://opendcc.de
+ *
+ * Copyright 2010 Don Goodman-Wilson
+ * Copyright 2015 Jonathan Pallant
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef INC_DCCFRAME_H
+#define INC_DCCFRAME_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "DCCConfig.h"
+
+/****************************************************************************
+ * Defines
+ ****************************************************************************/
+
+// A frame is DCC_FRAME_SYNC, a length byte, that many bytes of commands,
+// then a CRC-8 (polynomial 0x07) of the length and commands. Each command
+// is an opcode followed by a fixed number of bytes. CABs are two bytes, high
+// byte first, with DCC_FRAME_LONG set for a long address.
+#define DCC_FRAME_SYNC          0x7E
+#define DCC_FRAME_OVERHEAD      3 //sync, length and CRC
+#define DCC_FRAME_LONG          0x8000
+
+// Opcodes, with the bytes that follow each
+#define DCC_FRAME_SPEED         0x01 //CAB, SPEED: as a 128 step packet; bit 7 forwards, 0 stop, 1 emergency stop, 2-127 moving
+#define DCC_FRAME_FUNCTIONS     0x02 //CAB, GROUP, FUNCTIONS: GROUP 0 is F0-F4 (bit 0 F0), 1 F5-F8, 2 F9-F12, 3 F13-F20, 4 F21-F28, 5-9 F29-F68 eight at a time
+#define DCC_FRAME_ACCESSORY     0x03 //OUTPUT: 2 bytes, (address << 2) | function, plus 0x8000 to set
+#define DCC_FRAME_OPS_CV        0x04 //CAB, CV: 2 bytes, 1-1024, VALUE
+#define DCC_FRAME_ESTOP         0x05 //all locos; nothing follows
+#define DCC_FRAME_ESTOP_LOCO    0x06 //CAB
+
+#define DCC_FRAME_SPEED_LEN     4 //bytes, including the opcode
+#define DCC_FRAME_FUNCTIONS_LEN 5
+#define DCC_FRAME_ACCESSORY_LEN 3
+#define DCC_FRAME_OPS_CV_LEN    6
+#define DCC_FRAME_ESTOP_LEN     1
+#define DCC_FRAME_ESTOP_LOCO_LEN 3
+
+#define DCC_FRAME_FUNCTION_GROUPS 10
+
+/****************************************************************************
+ * Data Types
+ ****************************************************************************/
+
+/**
+ * Builds frames for a DCCFrameDecoder, on the host or another Arduino.
+ * Needs nothing but the caller's buffer, which should be at least
+ * DCC_FRAME_MAX_PAYLOAD + DCC_FRAME_OVERHEAD bytes. Add commands until one
+ * returns false because the frame is full, then call finish() and send
+ * the bytes it counts.
+**/
+class DCCFrameEncoder
+{
+public:
+    DCCFrameEncoder(uint8_t* buffer, size_t size);
+
+    void begin(void); //empties the frame
+    size_t finish(void); //returns the length of the finished frame, or 0 if it has no commands
+
+    //cab: 1-127 short, 1-10239 long
+    bool speed(uint16_t cab, bool long_address, uint8_t speed);
+    bool functions(uint16_t cab, bool long_address, uint8_t group, uint8_t functions);
+    bool accessory(uint16_t address, uint8_t function, bool on); //address: 0-511, function: 0-3
+    bool opsProgramCV(uint16_t cab, bool long_address, uint16_t CV, uint8_t CV_data);
+    bool eStop(void);
+    bool eStop(uint16_t cab, bool long_address);
+
+    inline size_t getLength(void) const //commands so far, not counting sync, length and CRC
+    {
+        return length;
+    }
+
+private:
+    uint8_t* buffer;
+    size_t size;
+    size_t length;
+
+    uint8_t* add(uint8_t opcode, size_t bytes); //where the command's bytes go, or 0 if there's no room
+    static void putCab(uint8_t* p, uint16_t cab, bool long_address);
+};
+
+/****************************************************************************
+ * Function Prototypes
+ ****************************************************************************/
+
+uint8_t dcc_frame_crc(uint8_t crc, uint8_t c);
+
+#endif // INC_DCCFRAME_H
+
+/****************************************************************************
+ * End of file
+ ****************************************************************************/
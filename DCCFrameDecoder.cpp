@@ -0,0 +1,326 @@
+/*
+ * CmdrArduino
+ *
+ * DCC Binary Command Frame Decoder
+ *
+ * Author: Don Goodman-Wilson dgoodman@artificial-science.org
+ * Changes by: Jonathan Pallant dcc@thejpster.org.uk
+ *
+ * based on software by Wolfgang Kufer, http://opendcc.de
+ *
+ * Copyright 2010 Don Goodman-Wilson
+ * Copyright 2015 Jonathan Pallant
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/****************************************************************************
+* Includes
+****************************************************************************/
+#include <Arduino.h>
+#include <stdint.h>
+
+#include "DCCFrameDecoder.h"
+
+#if DCC_SUPPORT_FRAMES
+
+/****************************************************************************
+ * Defines
+ ****************************************************************************/
+
+#define RX_MASK (DCC_FRAME_RX_SIZE - 1)
+
+// Where parse() has got to
+#define FRAME_SYNC    0 //waiting for DCC_FRAME_SYNC
+#define FRAME_LENGTH  1
+#define FRAME_PAYLOAD 2
+#define FRAME_CRC     3
+
+#define FRAME_MAX_CAB 10239 //largest long address
+
+/****************************************************************************
+ * Data Types
+ ****************************************************************************/
+
+/* None */
+
+/****************************************************************************
+ * Function Prototypes
+ ****************************************************************************/
+
+static bool frameAddress(const uint8_t* p, DCCPacket::address_t& address, DCCPacket::address_kind_t& address_kind);
+
+/****************************************************************************
+ * Public Data
+ ****************************************************************************/
+
+/* None */
+
+/****************************************************************************
+ * Private Data
+ ****************************************************************************/
+
+//bytes in each command, including the opcode; 0 for opcodes that don't exist
+static const uint8_t command_lengths[] =
+{
+    0,
+    DCC_FRAME_SPEED_LEN,
+    DCC_FRAME_FUNCTIONS_LEN,
+    DCC_FRAME_ACCESSORY_LEN,
+    DCC_FRAME_OPS_CV_LEN,
+    DCC_FRAME_ESTOP_LEN,
+    DCC_FRAME_ESTOP_LOCO_LEN,
+};
+
+/****************************************************************************
+ * Public Functions
+ ****************************************************************************/
+
+DCCFrameDecoder::DCCFrameDecoder(DCCPacketScheduler& scheduler) : scheduler(scheduler), rx_read(0), rx_write(0), overruns(0),
+    length(0), received(0), crc(0), state(FRAME_SYNC), errors(0)
+{
+}
+
+//single producer, single consumer: store the byte, then publish it with a single byte store
+void DCCFrameDecoder::receive(uint8_t c)
+{
+    if ((uint8_t)(rx_write - rx_read) >= DCC_FRAME_RX_SIZE)
+    {
+        ++overruns;
+        return;
+    }
+
+    rx[rx_write & RX_MASK] = c;
+    rx_write++;
+}
+
+uint8_t DCCFrameDecoder::update(void)
+{
+    uint8_t count = 0;
+
+    while (rx_read != rx_write)
+    {
+        uint8_t c = rx[rx_read & RX_MASK];
+        rx_read++;
+        count += parse(c);
+    }
+
+    return count;
+}
+
+uint8_t DCCFrameDecoder::parse(uint8_t c)
+{
+    switch (state)
+    {
+    case FRAME_SYNC:
+        if (c == DCC_FRAME_SYNC)
+        {
+            state = FRAME_LENGTH;
+        }
+        break;
+
+    case FRAME_LENGTH:
+        if ((c == 0) || (c > DCC_FRAME_MAX_PAYLOAD))
+        {
+            //the sync byte was really part of something else
+            ++errors;
+            state = (c == DCC_FRAME_SYNC) ? FRAME_LENGTH : FRAME_SYNC;
+        }
+        else
+        {
+            length = c;
+            received = 0;
+            crc = dcc_frame_crc(0, c);
+            state = FRAME_PAYLOAD;
+        }
+        break;
+
+    case FRAME_PAYLOAD:
+        frame[received++] = c;
+        crc = dcc_frame_crc(crc, c);
+
+        if (received == length)
+        {
+            state = FRAME_CRC;
+        }
+        break;
+
+    case FRAME_CRC:
+        state = FRAME_SYNC;
+
+        if (c == crc)
+        {
+            return dispatch();
+        }
+
+        ++errors;
+        break;
+    }
+
+    return 0;
+}
+
+bool DCCFrameDecoder::command(DCCPacketScheduler& scheduler, const uint8_t* p)
+{
+    DCCPacket::address_t address;
+    DCCPacket::address_kind_t address_kind;
+
+    switch (p[0])
+    {
+#if DCC_SUPPORT_SPEED128
+    case DCC_FRAME_SPEED:
+    {
+        if (!frameAddress(&p[1], address, address_kind))
+        {
+            return false;
+        }
+
+        uint8_t speed = p[3] & 0x7F;
+
+        if (speed == 1)
+        {
+            return scheduler.eStop(address, address_kind);
+        }
+
+        //setSpeed128() takes 1 as stop, and 0 as an emergency stop
+        int8_t new_speed = speed ? speed : 1;
+        return scheduler.setSpeed(address, address_kind, (p[3] & 0x80) ? new_speed : -new_speed, 128);
+    }
+#endif
+
+    case DCC_FRAME_FUNCTIONS:
+        if (!frameAddress(&p[1], address, address_kind))
+        {
+            return false;
+        }
+
+        switch (p[3])
+        {
+        case 0:
+            return scheduler.setFunctions0to4(address, address_kind, p[4]);
+        case 1:
+            return scheduler.setFunctions5to8(address, address_kind, p[4]);
+        case 2:
+            return scheduler.setFunctions9to12(address, address_kind, p[4]);
+#if DCC_SUPPORT_FEATURE_EXPANSION
+        case 3:
+            return scheduler.setFunctions13to20(address, address_kind, p[4]);
+        case 4:
+            return scheduler.setFunctions21to28(address, address_kind, p[4]);
+        default:
+            return (p[3] < DCC_FRAME_FUNCTION_GROUPS) && scheduler.setFunctions29to68(address, address_kind, 29 + ((p[3] - 5) * 8), p[4]);
+#endif
+        }
+        return false;
+
+#if DCC_SUPPORT_ACCESSORY
+    case DCC_FRAME_ACCESSORY:
+    {
+        uint16_t output = (p[1] << 8) | p[2];
+
+        if (output & 0x7800)
+        {
+            return false; //more than 2048 outputs
+        }
+
+        if (output & 0x8000)
+        {
+            return scheduler.setBasicAccessory((output >> 2) & 0x1FF, output & 0x03);
+        }
+
+        return scheduler.unsetBasicAccessory((output >> 2) & 0x1FF, output & 0x03);
+    }
+#endif
+
+#if DCC_SUPPORT_OPS_MODE
+    case DCC_FRAME_OPS_CV:
+    {
+        uint16_t CV = (p[3] << 8) | p[4];
+
+        if (!frameAddress(&p[1], address, address_kind) || (CV < 1) || (CV > 1024))
+        {
+            return false;
+        }
+
+        return scheduler.opsProgramCV(address, address_kind, CV, p[5]);
+    }
+#endif
+
+    case DCC_FRAME_ESTOP:
+        return scheduler.eStop();
+
+    case DCC_FRAME_ESTOP_LOCO:
+        return frameAddress(&p[1], address, address_kind) && scheduler.eStop(address, address_kind);
+    }
+
+    return false; //left out of this build
+}
+
+/****************************************************************************
+ * Private Functions
+ ****************************************************************************/
+
+uint8_t DCCFrameDecoder::dispatch(void)
+{
+    uint8_t count = 0;
+    uint8_t i = 0;
+
+    while (i < length)
+    {
+        uint8_t opcode = frame[i];
+        uint8_t bytes = (opcode < sizeof(command_lengths)) ? command_lengths[opcode] : 0;
+
+        if (!bytes || (i + bytes > length))
+        {
+            ++errors; //can't tell where the next command starts, so give up on the rest
+            break;
+        }
+
+        if (command(scheduler, &frame[i]))
+        {
+            ++count;
+        }
+        else
+        {
+            ++errors;
+        }
+
+        i += bytes;
+    }
+
+    return count;
+}
+
+//a CAB as DCCFrameEncoder writes it
+static bool frameAddress(const uint8_t* p, DCCPacket::address_t& address, DCCPacket::address_kind_t& address_kind)
+{
+    uint16_t cab = (p[0] << 8) | p[1];
+
+    address = cab & ~DCC_FRAME_LONG;
+    address_kind = (cab & DCC_FRAME_LONG) ? DCCPacket::DCC_LONG_ADDRESS : DCCPacket::DCC_SHORT_ADDRESS;
+
+    if (address_kind == DCCPacket::DCC_LONG_ADDRESS)
+    {
+        return (address >= 1) && (address <= FRAME_MAX_CAB);
+    }
+
+    return (address >= 1) && (address <= 127);
+}
+
+#endif // DCC_SUPPORT_FRAMES
+
+/****************************************************************************
+ * End of file
+ ****************************************************************************/
@@ -0,0 +1,100 @@
+/*
+ * CmdrArduino
+ *
+ * DCC Binary Command Frame Decoder
+ *
+ * Author: Don Goodman-Wilson dgoodman@artificial-science.org
+ * Changes by: Jonathan Pallant dcc@thejpster.org.uk
+ *
+ * based on software by Wolfgang Kufer, http://opendcc.de
+ *
+ * Copyright 2010 Don Goodman-Wilson
+ * Copyright 2015 Jonathan Pallant
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef INC_DCCFRAMEDECODER_H
+#define INC_DCCFRAMEDECODER_H
+
+#include "DCCConfig.h"
+
+#if DCC_SUPPORT_FRAMES
+
+#include "DCCFrame.h"
+#include "DCCPacketScheduler.h"
+
+/****************************************************************************
+ * Data Types
+ ****************************************************************************/
+
+/**
+ * Reads frames built by DCCFrameEncoder and calls the scheduler with each
+ * command in them. A frame's commands are only carried out once its CRC
+ * has checked out; a frame that doesn't is dropped whole, and the decoder
+ * looks for the next DCC_FRAME_SYNC.
+ *
+ * receive() only puts the byte in a ring, so it can be called from a
+ * serial ISR; update(), called from loop(), decodes whatever has arrived.
+ * Or skip the ring and call parse() directly.
+**/
+class DCCFrameDecoder
+{
+public:
+    DCCFrameDecoder(DCCPacketScheduler& scheduler);
+
+    void receive(uint8_t c); //safe to call from an ISR
+    uint8_t update(void); //decodes what receive() has collected; returns the number of commands carried out
+
+    uint8_t parse(uint8_t c); //returns the number of commands carried out, once a frame is complete
+
+    inline uint16_t getErrors(void) const //bad frames and commands, and commands the scheduler turned down
+    {
+        return errors;
+    }
+
+    inline uint16_t getOverruns(void) const //bytes receive() had no room for
+    {
+        return overruns;
+    }
+
+    //carries out one command laid out as in a frame; false if it's bad or the scheduler turned it down
+    static bool command(DCCPacketScheduler& scheduler, const uint8_t* p);
+
+private:
+    DCCPacketScheduler& scheduler;
+
+    volatile uint8_t rx[DCC_FRAME_RX_SIZE];
+    volatile uint8_t rx_read; //free-running. Only update() writes this.
+    volatile uint8_t rx_write; //free-running. Only receive() writes this.
+    volatile uint16_t overruns;
+
+    uint8_t frame[DCC_FRAME_MAX_PAYLOAD];
+    uint8_t length; //from the frame's length byte
+    uint8_t received; //bytes of frame[] so far
+    uint8_t crc;
+    uint8_t state;
+    uint16_t errors;
+
+    uint8_t dispatch(void);
+};
+
+#endif // DCC_SUPPORT_FRAMES
+
+#endif // INC_DCCFRAMEDECODER_H
+
+/****************************************************************************
+ * End of file
+ ****************************************************************************/
@@ -36,19 +36,18 @@
 ****************************************************************************/
 #include <Arduino.h>
 #include <stdint.h>
-#include <avr/io.h>
-#include <avr/interrupt.h>
 
 #include "DCCHardware.h"
 
+#if !defined(DCC_HW_SIMULATED)
+
+#include <avr/io.h>
+#include <avr/interrupt.h>
+
 /****************************************************************************
 * Defines
 ****************************************************************************/
 
-// If defined, this pin will go high during the preamble
-// of each command. This helps synchronise a logic analyser.
-#define COMMAND_STROBE
-
 #if defined(__AVR_ATmega1280__) || defined(__AVR_ATmega2560__) || defined(__AVR_AT90CAN128__) || defined(__AVR_AT90CAN64__) || defined(__AVR_AT90CAN32__)
 
 //On Arduino MEGA, etc, OC1A is digital pin 11, or Port B/Pin 5
@@ -84,7 +83,7 @@
 
 #endif // defined(ATmega1280), etc
 
-#define PREAMBLE_BITS 13 /* Bit counter counts from 13..0 => 14 bits */
+#define PREAMBLE_BITS DCC_PREAMBLE_BITS /* Bit counter counts from 13..0 => 14 bits */
 
 /****************************************************************************
 * Data Types
@@ -137,6 +136,20 @@ static volatile size_t bit_counter = PREAMBLE_BITS;
 
 static enum dcc_hw_state_t dcc_hw_state = DCC_HW_STATE_IDLE; //just to start out
 
+#if defined(DCC_HW_PACKET_RING)
+#define RING_MASK (DCC_HW_PACKET_RING_SIZE - 1)
+/// Encoded packets waiting for the ISR
+static volatile uint8_t ring_packets[DCC_HW_PACKET_RING_SIZE][sizeof(current_packet)];
+/// Length of each encoded packet in ring_packets
+static volatile uint8_t ring_sizes[DCC_HW_PACKET_RING_SIZE];
+/// Free-running index of the next packet the ISR will take. Only the ISR writes this.
+static volatile uint8_t ring_read = 0;
+/// Free-running index of the next free slot. Only dcc_hardware_supply_packet writes this.
+static volatile uint8_t ring_write = 0;
+/// Sent whenever the ring is empty; S 9.2 line 90
+static const uint8_t idle_packet[] = {0xFF, 0x00, 0xFF};
+#endif // defined(DCC_HW_PACKET_RING)
+
 
 /// Timer1 TOP values for one and zero
 /**
@@ -175,9 +188,9 @@ static enum dcc_hw_state_t dcc_hw_state = DCC_HW_STATE_IDLE; //just to start out
 */
 #define US_TO_TICKS(us) (((us) * F_CPU) / (8UL * 1000000UL))
 #define TIMER_COMP_VALUE(us) (US_TO_TICKS(us) - 1UL)
-static const uint16_t ONE_COUNT = TIMER_COMP_VALUE(58);
-static const uint16_t ZERO_HIGH_COUNT = TIMER_COMP_VALUE(100);
-static const uint16_t ZERO_LOW_COUNT = TIMER_COMP_VALUE(100);
+static const uint16_t ONE_COUNT = TIMER_COMP_VALUE(DCC_ONE_US);
+static const uint16_t ZERO_HIGH_COUNT = TIMER_COMP_VALUE(DCC_ZERO_HIGH_US);
+static const uint16_t ZERO_LOW_COUNT = TIMER_COMP_VALUE(DCC_ZERO_LOW_US);
 
 /****************************************************************************
 * Public Functions
@@ -238,7 +251,11 @@ void dcc_hardware_setup()
  ****************************************************************************/
 bool dcc_hardware_need_packet(void)
 {
+#if defined(DCC_HW_PACKET_RING)
+    return ((uint8_t)(ring_write - ring_read) < DCC_HW_PACKET_RING_SIZE);
+#else
     return (byte_counter == 0);
+#endif
 }
 
 /****************************************************************************
@@ -257,6 +274,22 @@ bool dcc_hardware_need_packet(void)
  ****************************************************************************/
 void dcc_hardware_supply_packet(const uint8_t* p_packet, size_t num_bytes)
 {
+#if defined(DCC_HW_PACKET_RING)
+    // Single producer, single consumer: fill the slot first, then publish
+    // it with a single byte store the ISR can't see half-done.
+    if ((num_bytes > 0) && (num_bytes <= sizeof(current_packet)) && dcc_hardware_need_packet())
+    {
+        uint8_t slot = ring_write & RING_MASK;
+
+        for (size_t i = 0; i < num_bytes; i++)
+        {
+            ring_packets[slot][i] = p_packet[i];
+        }
+
+        ring_sizes[slot] = num_bytes;
+        ring_write++;
+    }
+#else
     if (num_bytes <= sizeof(current_packet))
     {
         for (size_t i = 0; i < num_bytes; i++)
@@ -267,6 +300,34 @@ void dcc_hardware_supply_packet(const uint8_t* p_packet, size_t num_bytes)
         packet_size = num_bytes;
         byte_counter = packet_size;
     }
+#endif // defined(DCC_HW_PACKET_RING)
+}
+
+/****************************************************************************
+ * NAME
+ *     dcc_hardware_flush
+ *
+ * DESCRIPTION
+ *     Drop any packets that have been supplied but not yet started on the
+ *     rails, so an e-stop isn't sent behind stale speed packets. The packet
+ *     the ISR is part way through is left to finish.
+ *
+ * PARAMETERS
+ *     None
+ *
+ * RETURNS
+ *     Nothing
+ ****************************************************************************/
+void dcc_hardware_flush(void)
+{
+#if defined(DCC_HW_PACKET_RING)
+    // ring_read belongs to the ISR, so it mustn't move while we catch up
+    // with it
+    uint8_t sreg = SREG;
+    cli();
+    ring_write = ring_read;
+    SREG = sreg;
+#endif // defined(DCC_HW_PACKET_RING)
 }
 
 
@@ -274,6 +335,51 @@ void dcc_hardware_supply_packet(const uint8_t* p_packet, size_t num_bytes)
  * Private Functions
  ****************************************************************************/
 
+#if defined(DCC_HW_PACKET_RING)
+/****************************************************************************
+ * NAME
+ *     load_next_packet
+ *
+ * DESCRIPTION
+ *     Called from the ISR at the end of each packet. Moves the oldest packet
+ *     in the ring into current_packet, or the idle packet if the ring is
+ *     empty. Bounded and lock-free: at most DCC_PACKET_MAX_LEN bytes are
+ *     copied and only ring_read is written.
+ *
+ * PARAMETERS
+ *     None
+ *
+ * RETURNS
+ *     Nothing
+ ****************************************************************************/
+static inline void load_next_packet(void)
+{
+    const volatile uint8_t* p_src = idle_packet;
+    uint8_t num_bytes = sizeof(idle_packet);
+
+    if (ring_read != ring_write)
+    {
+        uint8_t slot = ring_read & RING_MASK;
+        p_src = ring_packets[slot];
+        num_bytes = ring_sizes[slot];
+    }
+
+    for (uint8_t i = 0; i < num_bytes; i++)
+    {
+        current_packet[i] = p_src[i];
+    }
+
+    if (ring_read != ring_write)
+    {
+        // Only free the slot once we've finished copying out of it
+        ring_read++;
+    }
+
+    packet_size = num_bytes;
+    byte_counter = packet_size;
+}
+#endif // defined(DCC_HW_PACKET_RING)
+
 /****************************************************************************
  * NAME
  *     ISR(TIMER1_COMPA_vect)
@@ -320,6 +426,11 @@ ISR(TIMER1_COMPA_vect)
         /// Idle: Check if a new packet is ready. If it is, fall through to
         /// DCC_HW_STATE_SEND_PREMABLE. Otherwise just stick a '1' out there.
         case DCC_HW_STATE_IDLE:
+#if defined(DCC_HW_PACKET_RING)
+            // There is always something to send: a queued packet or an idle
+            load_next_packet();
+#endif // defined(DCC_HW_PACKET_RING)
+
             if (byte_counter == 0)
             {
                 // If no new packet, just send ones if we don't know what else
@@ -407,6 +518,8 @@ ISR(TIMER1_COMPA_vect)
     }
 }
 
+#endif // !defined(DCC_HW_SIMULATED)
+
 /****************************************************************************
 * End of file
 ****************************************************************************/
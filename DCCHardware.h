@@ -29,9 +29,39 @@
 #ifndef INC_DCCHARDWARE_H
 #define INC_DCCHARDWARE_H
 
+#include "DCCConfig.h"
+
 void dcc_hardware_setup(void);
 bool dcc_hardware_need_packet(void);
 void dcc_hardware_supply_packet(const uint8_t* p_packet, size_t num_bytes);
+void dcc_hardware_flush(void); //drops supplied packets not yet started; only DCC_HW_PACKET_RING queues any
+
+#if defined(DCC_HW_SIMULATED)
+//called with each packet supplied, and the micros() when it will start on the rails
+typedef void (*dcc_hardware_monitor_t)(const uint8_t* p_packet, size_t num_bytes, uint32_t start_us);
+
+void dcc_hardware_set_monitor(dcc_hardware_monitor_t monitor);
+uint32_t dcc_hardware_wait_us(void); //how long until dcc_hardware_need_packet() will be true
+
+// Formats for dcc_hardware_capture(). Both run from the start of the first
+// packet captured, count time in microseconds, and include the '1's the
+// rails carry between packets when the scheduler has nothing to send.
+//
+// DCC_CAPTURE_VCD: a Value Change Dump for waveform viewers, with the rails
+// as signal "rails" and the COMMAND_STROBE pin as "strobe".
+//
+// DCC_CAPTURE_EDGES: the 8 bytes "DCCEDGE1", then one record for each
+// edge on the rails. A record is (us since the edge before << 1) | strobe,
+// as an unsigned LEB128 varint: the low 7 bits of each byte, least
+// significant first, with the top bit set on all but the last. The rails
+// go high at the first edge and swap at each one after; strobe is the
+// strobe pin from that edge on. A '1' takes two bytes and a '0' four.
+#define DCC_CAPTURE_VCD    0
+#define DCC_CAPTURE_EDGES  1
+
+bool dcc_hardware_capture(const char* path, uint8_t format); //false if the file couldn't be opened
+void dcc_hardware_capture_stop(void); //flushes and closes every capture
+#endif
 
 #endif // INC_DCCHARDWARE_H
 
@@ -0,0 +1,513 @@
+/*
+ * CmdrArduino
+ *
+ * DCC Hardware Interface, simulated
+ *
+ * Stands in for DCCHardware.cpp when DCC_HW_SIMULATED is defined, so the
+ * library can run on a host. Nothing is output: each packet is handed to
+ * the monitor, if there is one, and the rails are counted as busy for as
+ * long as the packet would take to send. As with the Timer1 driver, a
+ * packet supplied while the rails are idle waits for the '1' being sent
+ * to finish.
+ *
+ * The waveform, and the COMMAND_STROBE pin, can be streamed to disk with
+ * dcc_hardware_capture(), as a VCD file or a binary edge log.
+ *
+ * Author: Don Goodman-Wilson dgoodman@artificial-science.org
+ * Changes by: Jonathan Pallant dcc@thejpster.org.uk
+ *
+ * based on software by Wolfgang Kufer, http://opendcc.de
+ *
+ * Copyright 2010 Don Goodman-Wilson
+ * Copyright 2015 Jonathan Pallant
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/****************************************************************************
+* Includes
+****************************************************************************/
+#include <Arduino.h>
+#include <stdint.h>
+
+#include "DCCHardware.h"
+
+#if defined(DCC_HW_SIMULATED)
+
+#include <stdio.h>
+#include <string.h>
+
+#include "DCCPacket.h"
+
+/****************************************************************************
+* Defines
+****************************************************************************/
+
+#define ONE_BIT_US          (2UL * DCC_ONE_US)
+
+/// Bytes gathered before each write; a VCD edge is about 12
+#define CAPTURE_BUFFER_SIZE 65536
+/// Room one edge can take up in either format
+#define CAPTURE_EDGE_MAX    48
+
+/****************************************************************************
+* Data Types
+****************************************************************************/
+
+typedef struct
+{
+    FILE* file;
+    char buffer[CAPTURE_BUFFER_SIZE];
+    size_t fill;
+    bool started; //waits for the start of a packet
+    uint64_t origin_us; //capture_us at that start
+    uint64_t last_edge_us;
+    bool rails;
+    uint8_t strobe_written; //2 until the first edge
+} capture_t;
+
+/****************************************************************************
+* Function Prototypes
+****************************************************************************/
+
+static uint32_t wire_time(const uint8_t* p_packet, size_t num_bytes);
+static void capture_packet(const uint8_t* p_packet, size_t num_bytes, uint32_t gap_us);
+static void capture_bit(uint32_t half_us, uint32_t other_half_us);
+static void capture_edge(uint32_t half_us);
+static void capture_flush(capture_t& c);
+
+/****************************************************************************
+* Public Data
+****************************************************************************/
+
+/* None */
+
+/****************************************************************************
+* Private Data
+****************************************************************************/
+
+/// micros() when the last packet supplied starts on the rails
+static uint32_t last_start_us = 0;
+/// micros() when the last packet supplied finishes
+static uint32_t last_end_us = 0;
+
+static dcc_hardware_monitor_t packet_monitor = 0;
+
+static capture_t* captures[2] = {0, 0}; //by format
+/// Time of the next edge on the rails, in 64 bits so hours of capture don't wrap
+static uint64_t capture_us = 0;
+static bool capture_strobe = false;
+
+/****************************************************************************
+* Public Functions
+****************************************************************************/
+
+/****************************************************************************
+ * NAME
+ *     dcc_hardware_setup
+ *
+ * DESCRIPTION
+ *     Start with idle rails.
+ *
+ * PARAMETERS
+ *     None
+ *
+ * RETURNS
+ *     Nothing
+ ****************************************************************************/
+void dcc_hardware_setup()
+{
+    last_start_us = last_end_us = micros();
+}
+
+/****************************************************************************
+ * NAME
+ *     dcc_hardware_need_packet
+ *
+ * DESCRIPTION
+ *     Like the Timer1 driver, holds one packet while another is being sent:
+ *     a packet is wanted once the last one supplied has started.
+ *
+ * PARAMETERS
+ *     None
+ *
+ * RETURNS
+ *     true if packet required.
+ ****************************************************************************/
+bool dcc_hardware_need_packet(void)
+{
+    return dcc_hardware_wait_us() == 0;
+}
+
+/****************************************************************************
+ * NAME
+ *     dcc_hardware_supply_packet
+ *
+ * DESCRIPTION
+ *     Supply a new packet. It starts when the one before it finishes, or
+ *     if the rails have gone quiet, at the end of the '1' they're sending.
+ *
+ * PARAMETERS
+ *     p_packet - the buffer containing the packet
+ *     num_bytes - the length of the p_packet buffer
+ *
+ * RETURNS
+ *     Nothing
+ ****************************************************************************/
+void dcc_hardware_supply_packet(const uint8_t* p_packet, size_t num_bytes)
+{
+    uint32_t now = micros();
+    uint32_t gap_us = 0;
+
+    if ((int32_t)(now - last_end_us) > 0)
+    {
+        gap_us = ((now - last_end_us + ONE_BIT_US - 1) / ONE_BIT_US) * ONE_BIT_US;
+    }
+
+    last_start_us = last_end_us + gap_us;
+    last_end_us = last_start_us + wire_time(p_packet, num_bytes);
+
+    if (captures[DCC_CAPTURE_VCD] || captures[DCC_CAPTURE_EDGES])
+    {
+        capture_packet(p_packet, num_bytes, gap_us);
+    }
+
+    if (packet_monitor)
+    {
+        packet_monitor(p_packet, num_bytes, last_start_us);
+    }
+}
+
+/****************************************************************************
+ * NAME
+ *     dcc_hardware_flush
+ *
+ * DESCRIPTION
+ *     Nothing to do: each packet is on its way to the rails as soon as it's
+ *     supplied, as with the single packet buffer on the AVR.
+ *
+ * PARAMETERS
+ *     None
+ *
+ * RETURNS
+ *     Nothing
+ ****************************************************************************/
+void dcc_hardware_flush(void)
+{
+}
+
+/****************************************************************************
+ * NAME
+ *     dcc_hardware_set_monitor
+ *
+ * DESCRIPTION
+ *     Choose what is called with each packet supplied.
+ *
+ * PARAMETERS
+ *     monitor - the function to call, or 0 for none
+ *
+ * RETURNS
+ *     Nothing
+ ****************************************************************************/
+void dcc_hardware_set_monitor(dcc_hardware_monitor_t monitor)
+{
+    packet_monitor = monitor;
+}
+
+/****************************************************************************
+ * NAME
+ *     dcc_hardware_wait_us
+ *
+ * DESCRIPTION
+ *     How long a host's event loop can sleep before the scheduler needs to
+ *     supply another packet.
+ *
+ * PARAMETERS
+ *     None
+ *
+ * RETURNS
+ *     Microseconds until dcc_hardware_need_packet() is true; 0 if it is now.
+ ****************************************************************************/
+uint32_t dcc_hardware_wait_us(void)
+{
+    int32_t wait = last_start_us - micros();
+
+    return (wait > 0) ? wait : 0;
+}
+
+/****************************************************************************
+ * NAME
+ *     dcc_hardware_capture
+ *
+ * DESCRIPTION
+ *     Start streaming the rails and strobe pin to a file, from the next
+ *     packet supplied. Each format can have one file at a time; starting
+ *     it again closes the one before.
+ *
+ * PARAMETERS
+ *     path - the file to write
+ *     format - DCC_CAPTURE_VCD or DCC_CAPTURE_EDGES
+ *
+ * RETURNS
+ *     false if the format is unknown or the file can't be opened.
+ ****************************************************************************/
+bool dcc_hardware_capture(const char* path, uint8_t format)
+{
+    if (format > DCC_CAPTURE_EDGES)
+    {
+        return false;
+    }
+
+    FILE* file = fopen(path, "wb");
+
+    if (!file)
+    {
+        return false;
+    }
+
+    capture_t* c = captures[format];
+
+    if (c)
+    {
+        capture_flush(*c);
+        fclose(c->file);
+    }
+    else
+    {
+        c = new capture_t;
+    }
+
+    //the buffer in capture_t does the batching
+    setvbuf(file, 0, _IONBF, 0);
+    c->file = file;
+    c->started = false;
+
+    if (format == DCC_CAPTURE_VCD)
+    {
+        c->fill = snprintf(c->buffer, CAPTURE_BUFFER_SIZE,
+                           "$version CmdrArduino DCCHardwareSim $end\n"
+                           "$timescale 1us $end\n"
+                           "$scope module dcc $end\n"
+                           "$var wire 1 ! rails $end\n"
+#if defined(COMMAND_STROBE)
+                           "$var wire 1 \" strobe $end\n"
+#endif
+                           "$upscope $end\n"
+                           "$enddefinitions $end\n");
+    }
+    else
+    {
+        memcpy(c->buffer, "DCCEDGE1", 8);
+        c->fill = 8;
+    }
+
+    captures[format] = c;
+    return true;
+}
+
+/****************************************************************************
+ * NAME
+ *     dcc_hardware_capture_stop
+ *
+ * DESCRIPTION
+ *     Write out whatever is buffered and close every capture file.
+ *
+ * PARAMETERS
+ *     None
+ *
+ * RETURNS
+ *     Nothing
+ ****************************************************************************/
+void dcc_hardware_capture_stop(void)
+{
+    for (uint8_t format = DCC_CAPTURE_VCD; format <= DCC_CAPTURE_EDGES; ++format)
+    {
+        if (captures[format])
+        {
+            capture_flush(*captures[format]);
+            fclose(captures[format]->file);
+            delete captures[format];
+            captures[format] = 0;
+        }
+    }
+}
+
+/****************************************************************************
+* Private Functions
+****************************************************************************/
+
+static uint32_t wire_time(const uint8_t* p_packet, size_t num_bytes)
+{
+#if DCC_SUPPORT_BANDWIDTH
+    return DCCPacket::getWireTime(p_packet, num_bytes);
+#else
+    //as DCCPacket::getWireTime() counts it, so captures line up
+    uint32_t us = ((DCC_PREAMBLE_BITS + 1) * ONE_BIT_US) + (num_bytes * (DCC_ZERO_HIGH_US + DCC_ZERO_LOW_US));
+
+    for (size_t i = 0; i < num_bytes; ++i)
+    {
+        for (uint8_t mask = 0x80; mask; mask >>= 1)
+        {
+            us += (p_packet[i] & mask) ? ONE_BIT_US : (DCC_ZERO_HIGH_US + DCC_ZERO_LOW_US);
+        }
+    }
+
+    return us;
+#endif
+}
+
+//the '1's in the gap, then the packet: the preamble with the strobe up, a '0' before each byte, and the end bit
+static void capture_packet(const uint8_t* p_packet, size_t num_bytes, uint32_t gap_us)
+{
+    for (uint32_t i = 0; i < gap_us; i += ONE_BIT_US)
+    {
+        capture_bit(DCC_ONE_US, DCC_ONE_US);
+    }
+
+    for (uint8_t format = DCC_CAPTURE_VCD; format <= DCC_CAPTURE_EDGES; ++format)
+    {
+        capture_t* c = captures[format];
+
+        if (c && !c->started)
+        {
+            c->started = true;
+            c->origin_us = c->last_edge_us = capture_us;
+            c->rails = false;
+            c->strobe_written = 2;
+        }
+    }
+
+#if defined(COMMAND_STROBE)
+    capture_strobe = true;
+#endif
+
+    for (uint8_t i = 0; i < DCC_PREAMBLE_BITS; ++i)
+    {
+        capture_bit(DCC_ONE_US, DCC_ONE_US);
+    }
+
+    capture_strobe = false;
+
+    for (size_t i = 0; i < num_bytes; ++i)
+    {
+        capture_bit(DCC_ZERO_HIGH_US, DCC_ZERO_LOW_US);
+
+        for (uint8_t mask = 0x80; mask; mask >>= 1)
+        {
+            if (p_packet[i] & mask)
+            {
+                capture_bit(DCC_ONE_US, DCC_ONE_US);
+            }
+            else
+            {
+                capture_bit(DCC_ZERO_HIGH_US, DCC_ZERO_LOW_US);
+            }
+        }
+    }
+
+    capture_bit(DCC_ONE_US, DCC_ONE_US);
+}
+
+static void capture_bit(uint32_t half_us, uint32_t other_half_us)
+{
+    capture_edge(half_us);
+    capture_edge(other_half_us);
+}
+
+//an edge at capture_us, then half_us until the next one
+static void capture_edge(uint32_t half_us)
+{
+    capture_t* c = captures[DCC_CAPTURE_VCD];
+
+    if (c && c->started)
+    {
+        char digits[20];
+        uint8_t n = 0;
+        uint64_t t = capture_us - c->origin_us;
+
+        if (c->fill > (CAPTURE_BUFFER_SIZE - CAPTURE_EDGE_MAX))
+        {
+            capture_flush(*c);
+        }
+
+        do
+        {
+            digits[n++] = '0' + (t % 10);
+            t /= 10;
+        }
+        while (t);
+
+        c->buffer[c->fill++] = '#';
+
+        while (n)
+        {
+            c->buffer[c->fill++] = digits[--n];
+        }
+
+        c->rails = !c->rails;
+        c->buffer[c->fill++] = '\n';
+        c->buffer[c->fill++] = c->rails ? '1' : '0';
+        c->buffer[c->fill++] = '!';
+        c->buffer[c->fill++] = '\n';
+
+#if defined(COMMAND_STROBE)
+        if (capture_strobe != c->strobe_written)
+        {
+            c->buffer[c->fill++] = capture_strobe ? '1' : '0';
+            c->buffer[c->fill++] = '"';
+            c->buffer[c->fill++] = '\n';
+            c->strobe_written = capture_strobe;
+        }
+#endif
+    }
+
+    c = captures[DCC_CAPTURE_EDGES];
+
+    if (c && c->started)
+    {
+        uint64_t record = ((capture_us - c->last_edge_us) << 1) | (capture_strobe ? 1 : 0);
+
+        if (c->fill > (CAPTURE_BUFFER_SIZE - CAPTURE_EDGE_MAX))
+        {
+            capture_flush(*c);
+        }
+
+        while (record > 0x7F)
+        {
+            c->buffer[c->fill++] = 0x80 | (record & 0x7F);
+            record >>= 7;
+        }
+
+        c->buffer[c->fill++] = record;
+        c->last_edge_us = capture_us;
+    }
+
+    capture_us += half_us;
+}
+
+static void capture_flush(capture_t& c)
+{
+    if (c.fill)
+    {
+        fwrite(c.buffer, 1, c.fill, c.file);
+        c.fill = 0;
+    }
+}
+
+#endif // defined(DCC_HW_SIMULATED)
+
+/****************************************************************************
+* End of file
+****************************************************************************/
@@ -0,0 +1,205 @@
+/*
+ * CmdrArduino
+ *
+ * DCC Multi-Producer Command Inbox
+ *
+ * Author: Don Goodman-Wilson dgoodman@artificial-science.org
+ * Changes by: Jonathan Pallant dcc@thejpster.org.uk
+ *
+ * based on software by Wolfgang Kufer, http://opendcc.de
+ *
+ * Copyright 2010 Don Goodman-Wilson
+ * Copyright 2015 Jonathan Pallant
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/****************************************************************************
+* Includes
+****************************************************************************/
+#include <Arduino.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "DCCInbox.h"
+
+#if DCC_SUPPORT_INBOX
+
+#include "DCCFrameDecoder.h"
+
+/****************************************************************************
+ * Defines
+ ****************************************************************************/
+
+#define INBOX_MASK (DCC_INBOX_SIZE - 1)
+
+// What a post function builds its command in: the command starts after
+// the frame's sync and length bytes
+#define INBOX_FRAME_LEN (DCC_INBOX_COMMAND_LEN + DCC_FRAME_OVERHEAD)
+
+/****************************************************************************
+ * Data Types
+ ****************************************************************************/
+
+/* None */
+
+/****************************************************************************
+ * Function Prototypes
+ ****************************************************************************/
+
+/* None */
+
+/****************************************************************************
+ * Public Data
+ ****************************************************************************/
+
+/* None */
+
+/****************************************************************************
+ * Private Data
+ ****************************************************************************/
+
+/* None */
+
+/****************************************************************************
+ * Public Functions
+ ****************************************************************************/
+
+DCCInbox::DCCInbox(DCCPacketScheduler& scheduler) : scheduler(scheduler), post_pos(0), drain_pos(0), errors(0), full(0)
+{
+    //slot i is free for the post that claims position i
+    for (size_t i = 0; i < DCC_INBOX_SIZE; ++i)
+    {
+        slots[i].sequence.store(i, std::memory_order_relaxed);
+    }
+}
+
+bool DCCInbox::speed(uint16_t cab, bool long_address, uint8_t speed)
+{
+    uint8_t frame[INBOX_FRAME_LEN] = {0};
+    DCCFrameEncoder encoder(frame, sizeof(frame));
+    return encoder.speed(cab, long_address, speed) && post(frame);
+}
+
+bool DCCInbox::functions(uint16_t cab, bool long_address, uint8_t group, uint8_t functions)
+{
+    uint8_t frame[INBOX_FRAME_LEN] = {0};
+    DCCFrameEncoder encoder(frame, sizeof(frame));
+    return encoder.functions(cab, long_address, group, functions) && post(frame);
+}
+
+bool DCCInbox::accessory(uint16_t address, uint8_t function, bool on)
+{
+    uint8_t frame[INBOX_FRAME_LEN] = {0};
+    DCCFrameEncoder encoder(frame, sizeof(frame));
+    return encoder.accessory(address, function, on) && post(frame);
+}
+
+bool DCCInbox::opsProgramCV(uint16_t cab, bool long_address, uint16_t CV, uint8_t CV_data)
+{
+    uint8_t frame[INBOX_FRAME_LEN] = {0};
+    DCCFrameEncoder encoder(frame, sizeof(frame));
+    return encoder.opsProgramCV(cab, long_address, CV, CV_data) && post(frame);
+}
+
+bool DCCInbox::eStop(void)
+{
+    uint8_t frame[INBOX_FRAME_LEN] = {0};
+    DCCFrameEncoder encoder(frame, sizeof(frame));
+    return encoder.eStop() && post(frame);
+}
+
+bool DCCInbox::eStop(uint16_t cab, bool long_address)
+{
+    uint8_t frame[INBOX_FRAME_LEN] = {0};
+    DCCFrameEncoder encoder(frame, sizeof(frame));
+    return encoder.eStop(cab, long_address) && post(frame);
+}
+
+size_t DCCInbox::drain(size_t limit)
+{
+    size_t count = 0;
+
+    while (count < limit)
+    {
+        slot_t& slot = slots[drain_pos & INBOX_MASK];
+
+        //published once its sequence is one past the position that claimed it
+        if (slot.sequence.load(std::memory_order_acquire) != drain_pos + 1)
+        {
+            break;
+        }
+
+        if (!DCCFrameDecoder::command(scheduler, slot.command))
+        {
+            errors.fetch_add(1, std::memory_order_relaxed);
+        }
+
+        //free for the post that claims this slot next time round
+        slot.sequence.store(drain_pos + DCC_INBOX_SIZE, std::memory_order_release);
+        ++drain_pos;
+        ++count;
+    }
+
+    return count;
+}
+
+/****************************************************************************
+ * Private Functions
+ ****************************************************************************/
+
+//frame: as built by DCCFrameEncoder, with one command
+bool DCCInbox::post(const uint8_t* frame)
+{
+    size_t pos = post_pos.load(std::memory_order_relaxed);
+    slot_t* slot;
+
+    for (;;)
+    {
+        slot = &slots[pos & INBOX_MASK];
+        size_t sequence = slot->sequence.load(std::memory_order_acquire);
+        intptr_t diff = (intptr_t)sequence - (intptr_t)pos;
+
+        if (diff == 0)
+        {
+            //free: try to claim it. On failure pos is reloaded.
+            if (post_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+            {
+                break;
+            }
+        }
+        else if (diff < 0)
+        {
+            //still holds the command from one lap ago
+            full.fetch_add(1, std::memory_order_relaxed);
+            return false;
+        }
+        else
+        {
+            //another producer claimed it first
+            pos = post_pos.load(std::memory_order_relaxed);
+        }
+    }
+
+    memcpy(slot->command, &frame[2], DCC_INBOX_COMMAND_LEN);
+    slot->sequence.store(pos + 1, std::memory_order_release);
+    return true;
+}
+
+#endif // DCC_SUPPORT_INBOX
+
+/****************************************************************************
+ * End of file
+ ****************************************************************************/
@@ -0,0 +1,118 @@
+/*
+ * CmdrArduino
+ *
+ * DCC Multi-Producer Command Inbox
+ *
+ * Author: Don Goodman-Wilson dgoodman@artificial-science.org
+ * Changes by: Jonathan Pallant dcc@thejpster.org.uk
+ *
+ * based on software by Wolfgang Kufer, http://opendcc.de
+ *
+ * Copyright 2010 Don Goodman-Wilson
+ * Copyright 2015 Jonathan Pallant
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef INC_DCCINBOX_H
+#define INC_DCCINBOX_H
+
+#include "DCCConfig.h"
+
+#if DCC_SUPPORT_INBOX
+
+#include <atomic>
+
+#include "DCCFrame.h"
+#include "DCCPacketScheduler.h"
+
+/****************************************************************************
+ * Defines
+ ****************************************************************************/
+
+// Longest command, as laid out in a frame
+#define DCC_INBOX_COMMAND_LEN DCC_FRAME_OPS_CV_LEN
+
+/****************************************************************************
+ * Data Types
+ ****************************************************************************/
+
+/**
+ * A bounded queue of commands that any number of threads can post to at
+ * once, without locks, for a single thread to hand to the scheduler with
+ * drain(). Only that thread may touch the scheduler.
+ *
+ * Each slot carries a sequence number that says whose turn it is: a
+ * producer claims a slot with one compare-and-swap, writes its command,
+ * then publishes it by moving the sequence on. Posting never waits; if
+ * every slot is taken it returns false. Commands are taken in the order
+ * their slots were claimed, so a producer stopped between claiming and
+ * publishing holds back the ones behind it until it carries on.
+ *
+ * The post functions take the same arguments as DCCFrameEncoder's.
+**/
+class DCCInbox
+{
+public:
+    DCCInbox(DCCPacketScheduler& scheduler);
+
+    //any thread
+    bool speed(uint16_t cab, bool long_address, uint8_t speed);
+    bool functions(uint16_t cab, bool long_address, uint8_t group, uint8_t functions);
+    bool accessory(uint16_t address, uint8_t function, bool on);
+    bool opsProgramCV(uint16_t cab, bool long_address, uint16_t CV, uint8_t CV_data);
+    bool eStop(void);
+    bool eStop(uint16_t cab, bool long_address);
+
+    //the scheduler's thread: carries out at most limit commands, and returns how many it took
+    size_t drain(size_t limit = DCC_INBOX_SIZE);
+
+    inline uint32_t getErrors(void) const //commands the scheduler turned down
+    {
+        return errors.load(std::memory_order_relaxed);
+    }
+
+    inline uint32_t getFull(void) const //posts that failed because the inbox was full
+    {
+        return full.load(std::memory_order_relaxed);
+    }
+
+private:
+    typedef struct
+    {
+        std::atomic<size_t> sequence;
+        uint8_t command[DCC_INBOX_COMMAND_LEN];
+    } slot_t;
+
+    DCCPacketScheduler& scheduler;
+
+    slot_t slots[DCC_INBOX_SIZE];
+
+    //on their own cache lines, so producers and the consumer don't fight over them
+    alignas(64) std::atomic<size_t> post_pos;
+    alignas(64) size_t drain_pos;
+    std::atomic<uint32_t> errors; //only drain() writes it, but any thread may read it
+    alignas(64) std::atomic<uint32_t> full;
+
+    bool post(const uint8_t* frame);
+};
+
+#endif // DCC_SUPPORT_INBOX
+
+#endif // INC_DCCINBOX_H
+
+/****************************************************************************
+ * End of file
+ ****************************************************************************/
@@ -31,6 +31,26 @@
 
 #include "DCCPacket.h"
 
+//packet kinds in the order of their packed kind code. At most 16 of them.
+static const uint8_t packed_kinds[] =
+{
+	OTHER_PACKET_KIND,
+	IDLE_PACKET_KIND,
+	ESTOP_PACKET_KIND,
+	SPEED_PACKET_KIND,
+	FUNCTION_PACKET_1_KIND,
+	FUNCTION_PACKET_2_KIND,
+	FUNCTION_PACKET_3_KIND,
+	ACCESSORY_PACKET_KIND,
+	RESET_PACKET_KIND,
+	OPS_MODE_PROGRAMMING_KIND,
+	BASIC_ACCESSORY_PACKET_KIND,
+	EXTENDED_ACCESSORY_PACKET_KIND,
+	FUNCTION_PACKET_4_KIND,
+	FUNCTION_PACKET_5_KIND,
+	FEATURE_EXPANSION_KIND
+};
+
 DCCPacket::DCCPacket(address_t new_address, address_kind_t new_address_kind) : address(new_address), address_kind(new_address_kind), kind(IDLE_PACKET_KIND), size_repeat(0x40) //size(1), repeat(0)
 {
 	address = new_address;
@@ -77,6 +97,7 @@ size_t DCCPacket::getBitstream(uint8_t rawbytes[]) const //returns size of array
 
 		return total_size + 1;
 	}
+#if DCC_SUPPORT_ACCESSORY
 	else if (kind & ACCESSORY_PACKET_KIND_MASK)
 	{
 		if (kind == BASIC_ACCESSORY_PACKET_KIND)
@@ -93,30 +114,192 @@ size_t DCCPacket::getBitstream(uint8_t rawbytes[]) const //returns size of array
 			rawbytes[1] |= (~(address >> 2) & 0x70)
 			               | (data[0] & 0x07);
 
-			cs_byte = rawbytes[0] ^ rawbytes[1];
 			total_size = 2;
 
 			//now, add any programming bytes (skipping first data byte, of course)
 			for (size_t i = 1; i < getSize(); ++i)
 			{
 				rawbytes[total_size++] = data[i];
-				cs_byte ^= data[i];
 			}
+		}
+		else if (kind == EXTENDED_ACCESSORY_PACKET_KIND)
+		{
+			// Extended Accessory Packet looks like this:
+			// {preamble} 0 10AAAAAA 0 0AAA0AA1 0 XXXXXXXX 0 EEEEEEEE 1
+			// The address is the 11 bit output address: the basic decoder address
+			// with the output pair number as its two least significant bits.
+
+			address_t decoder = address >> 2;
+
+			rawbytes[0] = 0x80 | (decoder & 0x3F);
+			rawbytes[1] = 0x01 | (~(decoder >> 2) & 0x70) | ((address & 0x03) << 1);
+			rawbytes[2] = data[0]; //aspect
+			total_size = 3;
+		}
+		else
+		{
+			return 0;
+		}
+
+		//and, finally, the XOR
+		for (size_t i = 0; i < total_size; ++i)
+		{
+			cs_byte ^= rawbytes[i];
+		}
+
+		rawbytes[total_size] = cs_byte;
+
+		return total_size + 1;
+	}
+#endif // DCC_SUPPORT_ACCESSORY
+
+	return 0; //ERROR! SHOULD NEVER REACH HERE! do something useful, like transform it into an idle packet or something! TODO
+}
+
+bool DCCPacket::setBitstream(const uint8_t rawbytes[], size_t count)
+{
+	uint8_t cs_byte = 0;
+	size_t first = 1; //first byte after the address
+
+	if ((count < 3) || (count > DCC_PACKET_MAX_LEN))
+	{
+		return false;
+	}
+
+	for (size_t i = 0; i < count; ++i)
+	{
+		cs_byte ^= rawbytes[i];
+	}
 
-			//and, finally, the XOR
+	if (cs_byte)
+	{
+		return false;
+	}
 
-			for (size_t i = 0; i < total_size; ++i)
+	//the address partitions, S 9.2.1
+	if ((rawbytes[0] == 0xFF) && (count == 3))
+	{
+		address = 0xFF;
+		address_kind = DCC_SHORT_ADDRESS;
+		kind = IDLE_PACKET_KIND;
+		data[0] = rawbytes[1];
+		size_repeat = 0x40;
+		return true;
+	}
+	else if (rawbytes[0] <= 127) //broadcast or 7-bit
+	{
+		address = rawbytes[0];
+		address_kind = DCC_SHORT_ADDRESS;
+	}
+	else if ((rawbytes[0] >= 0xC0) && (rawbytes[0] <= 0xE7)) //14-bit
+	{
+		address = ((rawbytes[0] & 0x3F) << 8) | rawbytes[1];
+		address_kind = DCC_LONG_ADDRESS;
+		first = 2;
+	}
+#if DCC_SUPPORT_ACCESSORY
+	else if ((rawbytes[0] & 0xC0) == 0x80) //accessory: 10AAAAAA, then 1AAACDDD or 0AAA0AA1
+	{
+		address_t decoder = (rawbytes[0] & 0x3F) | ((~rawbytes[1] & 0x70) << 2);
+
+		address_kind = DCC_SHORT_ADDRESS;
+
+		if (rawbytes[1] & 0x80)
+		{
+			if (count > 5)
 			{
-				cs_byte ^= rawbytes[i];
+				return false;
 			}
 
-			rawbytes[total_size] = cs_byte;
+			address = decoder;
+			kind = BASIC_ACCESSORY_PACKET_KIND;
+			data[0] = rawbytes[1] & 0x07;
+			data[1] = (count > 3) ? rawbytes[2] : 0x00;
+			data[2] = (count > 4) ? rawbytes[3] : 0x00;
+			size_repeat = (count - 2) << 6;
+			return true;
+		}
 
-			return total_size + 1;
+		if (((rawbytes[1] & 0x89) != 0x01) || (count != 4))
+		{
+			return false;
 		}
+
+		address = (decoder << 2) | ((rawbytes[1] >> 1) & 0x03);
+		kind = EXTENDED_ACCESSORY_PACKET_KIND;
+		data[0] = rawbytes[2];
+		size_repeat = 0x40;
+		return true;
+	}
+#endif // DCC_SUPPORT_ACCESSORY
+	else
+	{
+		return false;
 	}
 
-	return 0; //ERROR! SHOULD NEVER REACH HERE! do something useful, like transform it into an idle packet or something! TODO
+	size_t size = count - 1 - first;
+
+	if ((size < 1) || (size > sizeof(data)))
+	{
+		return false;
+	}
+
+	for (size_t i = 0; i < sizeof(data); ++i)
+	{
+		data[i] = (i < size) ? rawbytes[first + i] : 0x00;
+	}
+
+	size_repeat = size << 6;
+
+	//the instruction, S 9.2.1
+	uint8_t instruction = data[0];
+
+	if (((instruction & 0xC0) == 0x40) && ((instruction & 0x0F) == 0x01))
+	{
+		kind = ESTOP_PACKET_KIND;
+	}
+	else if (((instruction & 0xC0) == 0x40) || (instruction == 0x3F))
+	{
+		kind = SPEED_PACKET_KIND;
+	}
+	else if ((instruction & 0xE0) == 0x80)
+	{
+		kind = FUNCTION_PACKET_1_KIND;
+	}
+	else if ((instruction & 0xF0) == 0xB0)
+	{
+		kind = FUNCTION_PACKET_2_KIND;
+	}
+	else if ((instruction & 0xF0) == 0xA0)
+	{
+		kind = FUNCTION_PACKET_3_KIND;
+	}
+	else if (instruction == 0xDE)
+	{
+		kind = FUNCTION_PACKET_4_KIND;
+	}
+	else if (instruction == 0xDF)
+	{
+		kind = FUNCTION_PACKET_5_KIND;
+	}
+	else if ((instruction & 0xE0) == 0xC0)
+	{
+		kind = FEATURE_EXPANSION_KIND;
+	}
+	else if ((instruction & 0xF0) == 0xE0)
+	{
+		kind = OPS_MODE_PROGRAMMING_KIND;
+	}
+	else if ((instruction == 0x00) && (size == 1))
+	{
+		kind = RESET_PACKET_KIND;
+	}
+	else
+	{
+		return false; //consist control, analog function groups and the like
+	}
+
+	return true;
 }
 
 size_t DCCPacket::getSize(void) const
@@ -132,4 +315,85 @@ void DCCPacket::addData(uint8_t new_data[], size_t new_size) //insert freeform d
 	}
 
 	size_repeat = (size_repeat & 0x3F) | (new_size << 6);
-}
\ No newline at end of file
+}
+
+uint16_t DCCPacket::packAddress(address_t address, address_kind_t address_kind)
+{
+	//short and accessory addresses all fit below the offset; long ones go above it
+	if (address_kind == DCC_LONG_ADDRESS)
+	{
+		address += DCC_PACKED_LONG_OFFSET;
+	}
+
+	return address & DCC_PACKED_ADDRESS_MASK;
+}
+
+void DCCPacket::pack(uint16_t& packed_address, uint8_t packed_data[], uint8_t& packed_info) const
+{
+	uint8_t code = 0; //unknown kinds are stored as OTHER_PACKET_KIND
+	uint8_t repeat = getRepeat();
+
+	for (uint8_t i = 0; i < sizeof(packed_kinds); ++i)
+	{
+		if (packed_kinds[i] == kind)
+		{
+			code = i;
+			break;
+		}
+	}
+
+	if (repeat > DCC_PACKED_MAX_REPEAT)
+	{
+		repeat = DCC_PACKED_MAX_REPEAT;
+	}
+
+	packed_address = packAddress(address, address_kind) | (getSize() << DCC_PACKED_SIZE_SHIFT);
+	packed_data[0] = data[0];
+	packed_data[1] = data[1];
+	packed_data[2] = data[2];
+	packed_info = (code << 4) | repeat;
+}
+
+#if DCC_SUPPORT_BANDWIDTH
+uint32_t DCCPacket::getWireTime(const uint8_t rawbytes[], size_t count)
+{
+	//the preamble and end bit are ones, and each byte has a zero in front of it
+	uint16_t ones = DCC_PREAMBLE_BITS + 1;
+	uint16_t zeros = count;
+
+	for (size_t i = 0; i < count; ++i)
+	{
+		for (uint8_t bits = rawbytes[i], n = 0; n < 8; ++n, bits >>= 1)
+		{
+			if (bits & 1)
+			{
+				++ones;
+			}
+			else
+			{
+				++zeros;
+			}
+		}
+	}
+
+	return ((uint32_t)ones * (2 * DCC_ONE_US)) + ((uint32_t)zeros * (DCC_ZERO_HIGH_US + DCC_ZERO_LOW_US));
+}
+#endif
+
+void DCCPacket::unpack(uint16_t packed_address, const uint8_t packed_data[], uint8_t packed_info)
+{
+	address = unpackAddress(packed_address);
+	address_kind = unpackAddressKind(packed_address);
+	data[0] = packed_data[0];
+	data[1] = packed_data[1];
+	data[2] = packed_data[2];
+	size_repeat = ((packed_address >> DCC_PACKED_SIZE_SHIFT) << 6) | (packed_info & DCC_PACKED_REPEAT_MASK);
+	kind = unpackKind(packed_info);
+}
+
+uint8_t DCCPacket::unpackKind(uint8_t packed_info)
+{
+	uint8_t code = (packed_info & DCC_PACKED_KIND_MASK) >> 4;
+
+	return (code < sizeof(packed_kinds)) ? packed_kinds[code] : OTHER_PACKET_KIND;
+}
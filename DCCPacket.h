@@ -29,6 +29,8 @@
 #ifndef  INC_DCCPACKET_H
 #define  INC_DCCPACKET_H
 
+#include "DCCConfig.h"
+
 /****************************************************************************
  * Defines
  ****************************************************************************/
@@ -43,15 +45,33 @@
 #define ACCESSORY_PACKET_KIND          0x16
 #define RESET_PACKET_KIND              0x17
 #define OPS_MODE_PROGRAMMING_KIND      0x18
+#define FUNCTION_PACKET_4_KIND         0x19 //F13-F20
+#define FUNCTION_PACKET_5_KIND         0x1A //F21-F28
+#define FEATURE_EXPANSION_KIND         0x1B //F29-F68 and binary states; queues also tell these apart by their data
 
 #define ACCESSORY_PACKET_KIND_MASK     0x40
-#define BASIC_ACCESSORY_PACKET_KIND    0x40
+#define BASIC_ACCESSORY_PACKET_KIND    0x40 //queues also tell these apart by the output in their data
 #define EXTENDED_ACCESSORY_PACKET_KIND 0x41
 
 #define OTHER_PACKET_KIND              0x00
 
 #define DCC_PACKET_MAX_LEN             6
 
+// Queues hold packets in a packed six byte form, one array per field, and
+// only expand them back into a DCCPacket when they are about to be sent.
+//  address: bits 0-13 are the address. Long addresses are stored
+//           DCC_PACKED_LONG_OFFSET higher than short ones, which is how
+//           the address kind is kept. Bits 14-15 are the data size.
+//  data:    the three data bytes
+//  info:    bits 4-7 are a code for the packet kind, bits 0-3 the repeat
+#define DCC_PACKED_DATA_LEN            3
+#define DCC_PACKED_LONG_OFFSET         2048
+#define DCC_PACKED_ADDRESS_MASK        0x3FFF
+#define DCC_PACKED_SIZE_SHIFT          14
+#define DCC_PACKED_KIND_MASK           0xF0
+#define DCC_PACKED_REPEAT_MASK         0x0F
+#define DCC_PACKED_MAX_REPEAT          15
+
 /****************************************************************************
  * Data Types
  ****************************************************************************/
@@ -70,6 +90,7 @@ public:
     DCCPacket(address_t decoder_address = 0xFF, address_kind_t decoder_address_kind = DCC_SHORT_ADDRESS);
 
     size_t getBitstream(uint8_t rawbytes[]) const; //returns number of bytes written
+    bool setBitstream(const uint8_t rawbytes[], size_t count); //the reverse; false if the XOR is wrong or a DCCPacket can't hold it
     size_t getSize(void)  const;
 
     inline address_t getAddress(void) const
@@ -115,6 +136,30 @@ public:
         return size_repeat & 0x3F;
     }
 
+    //convert to and from the packed queue form (see DCC_PACKED_DATA_LEN)
+    void pack(uint16_t& packed_address, uint8_t packed_data[], uint8_t& packed_info) const;
+    void unpack(uint16_t packed_address, const uint8_t packed_data[], uint8_t packed_info);
+
+    static uint16_t packAddress(address_t address, address_kind_t address_kind);
+
+    static inline address_t unpackAddress(uint16_t packed_address)
+    {
+        packed_address &= DCC_PACKED_ADDRESS_MASK;
+        return (packed_address >= DCC_PACKED_LONG_OFFSET) ? (packed_address - DCC_PACKED_LONG_OFFSET) : packed_address;
+    }
+
+    static inline address_kind_t unpackAddressKind(uint16_t packed_address)
+    {
+        return ((packed_address & DCC_PACKED_ADDRESS_MASK) >= DCC_PACKED_LONG_OFFSET) ? DCC_LONG_ADDRESS : DCC_SHORT_ADDRESS;
+    }
+
+    static uint8_t unpackKind(uint8_t packed_info);
+
+#if DCC_SUPPORT_BANDWIDTH
+    //time on the rails of a packet from getBitstream(), in microseconds, preamble to end bit
+    static uint32_t getWireTime(const uint8_t rawbytes[], size_t count);
+#endif
+
 private:
     //A DCC packet is at most 6 bytes: 2 of address, three of data, one of XOR
     address_t address;
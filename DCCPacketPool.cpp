@@ -0,0 +1,139 @@
+/*
+ * CmdrArduino
+ *
+ * DCC Packet Pool
+ *
+ * Author: Don Goodman-Wilson dgoodman@artificial-science.org
+ * Changes by: Jonathan Pallant dcc@thejpster.org.uk
+ *
+ * based on software by Wolfgang Kufer, http://opendcc.de
+ *
+ * Copyright 2010 Don Goodman-Wilson
+ * Copyright 2015 Jonathan Pallant
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/****************************************************************************
+* Includes
+****************************************************************************/
+#include <Arduino.h>
+#include <stdint.h>
+
+#include "DCCPacketPool.h"
+
+/****************************************************************************
+ * Defines
+ ****************************************************************************/
+
+/* None */
+
+/****************************************************************************
+ * Data Types
+ ****************************************************************************/
+
+/* None */
+
+/****************************************************************************
+ * Function Prototypes
+ ****************************************************************************/
+
+/* None */
+
+/****************************************************************************
+ * Public Data
+ ****************************************************************************/
+
+DCCPacketPool dcc_packet_pool;
+
+/****************************************************************************
+ * Private Data
+ ****************************************************************************/
+
+/* None */
+
+/****************************************************************************
+ * Public Functions
+ ****************************************************************************/
+
+bool DCCPacketPool::reserve(uint8_t count)
+{
+    if ((reserved_total + count) > DCC_PACKET_POOL_SIZE)
+    {
+        return false;
+    }
+
+    reserved_total += count;
+    reserved_unused += count;
+    return true;
+}
+
+void DCCPacketPool::unreserve(uint8_t count)
+{
+    reserved_total -= count;
+    reserved_unused -= count;
+}
+
+uint8_t DCCPacketPool::allocate(bool from_reserve)
+{
+    uint8_t slot;
+
+    if (!canAllocate(from_reserve))
+    {
+        return DCC_POOL_NONE;
+    }
+
+    if (free_list)
+    {
+        slot = free_list - 1;
+        free_list = (next[slot] == DCC_POOL_NONE) ? 0 : (next[slot] + 1);
+    }
+    else
+    {
+        slot = untouched++;
+    }
+
+    next[slot] = DCC_POOL_NONE;
+    ++in_use;
+
+    if (from_reserve)
+    {
+        --reserved_unused;
+    }
+
+    return slot;
+}
+
+void DCCPacketPool::release(uint8_t slot, bool to_reserve)
+{
+    next[slot] = free_list ? (free_list - 1) : DCC_POOL_NONE;
+    free_list = slot + 1;
+    --in_use;
+
+    if (to_reserve)
+    {
+        ++reserved_unused;
+    }
+}
+
+/****************************************************************************
+ * Private Functions
+ ****************************************************************************/
+
+/* None */
+
+/****************************************************************************
+ * End of file
+ ****************************************************************************/
@@ -0,0 +1,112 @@
+/*
+ * CmdrArduino
+ *
+ * DCC Packet Pool
+ *
+ * Author: Don Goodman-Wilson dgoodman@artificial-science.org
+ * Changes by: Jonathan Pallant dcc@thejpster.org.uk
+ *
+ * based on software by Wolfgang Kufer, http://opendcc.de
+ *
+ * Copyright 2010 Don Goodman-Wilson
+ * Copyright 2015 Jonathan Pallant
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef INC_DCCPACKETPOOL_H
+#define INC_DCCPACKETPOOL_H
+
+#include "DCCConfig.h"
+#include "DCCPacket.h"
+
+/****************************************************************************
+ * Defines
+ ****************************************************************************/
+
+// Slot index meaning "no slot"
+#define DCC_POOL_NONE        0xFF
+
+/****************************************************************************
+ * Data Types
+ ****************************************************************************/
+
+/**
+ * A statically allocated arena of packed packet slots (see
+ * DCC_PACKED_DATA_LEN). Queues are singly linked lists threaded through
+ * next[]; free slots are another such list.
+ *
+ * Each queue may reserve a number of slots which are always available to
+ * it. Everything else is first come, first served, so slots go to
+ * whichever queue is busiest.
+ *
+ * There is deliberately no constructor: all-zeroes is a valid empty pool,
+ * so queues in other global objects can use it whatever order the
+ * constructors run in.
+**/
+class DCCPacketPool
+{
+public:
+    uint16_t packed_address[DCC_PACKET_POOL_SIZE];
+    uint8_t packed_data[DCC_PACKET_POOL_SIZE][DCC_PACKED_DATA_LEN];
+    uint8_t packed_info[DCC_PACKET_POOL_SIZE];
+    uint8_t next[DCC_PACKET_POOL_SIZE];
+#if DCC_SUPPORT_REPEAT_SPACING
+    uint8_t due[DCC_PACKET_POOL_SIZE]; //clock when the slot's packet may next go out
+    uint8_t gap[DCC_PACKET_POOL_SIZE]; //packets it last waited; 0 if it hasn't been sent yet
+    uint8_t clock; //packets put on the rails, counted by the scheduler
+#endif
+#if DCC_SUPPORT_FAIR_QUEUES
+    uint8_t round[DCC_PACKET_POOL_SIZE]; //which of its queue's rounds the slot goes out in
+#endif
+
+    //set aside count slots for one queue. Returns false if there aren't enough.
+    bool reserve(uint8_t count);
+    //and give them back, once the queue holds nothing
+    void unreserve(uint8_t count);
+
+    //can a slot be taken? from_reserve says the caller is still within its reservation
+    inline bool canAllocate(bool from_reserve) const
+    {
+        return from_reserve ? (reserved_unused > 0) : (freeSlots() > reserved_unused);
+    }
+
+    uint8_t allocate(bool from_reserve); //returns DCC_POOL_NONE if nothing is available
+    void release(uint8_t slot, bool to_reserve);
+
+    inline uint8_t freeSlots(void) const
+    {
+        return DCC_PACKET_POOL_SIZE - in_use;
+    }
+
+private:
+    uint8_t free_list; //one more than the first released slot, or 0 if none
+    uint8_t untouched; //slots from here up have never been handed out
+    uint8_t in_use;
+    uint8_t reserved_total;
+    uint8_t reserved_unused; //reserved slots not currently holding a packet
+};
+
+/****************************************************************************
+ * Public Data
+ ****************************************************************************/
+
+extern DCCPacketPool dcc_packet_pool;
+
+#endif // INC_DCCPACKETPOOL_H
+
+/****************************************************************************
+ * End of file
+ ****************************************************************************/
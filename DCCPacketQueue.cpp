@@ -38,7 +38,9 @@
  * Defines
  ****************************************************************************/
 
-/* None */
+//furthest ahead of the round being served a packet is put, so rounds can be
+//compared as signed bytes
+#define DCC_FAIR_MAX_TURN 64
 
 /****************************************************************************
  * Data Types
@@ -50,7 +52,8 @@
  * Function Prototypes
  ****************************************************************************/
 
-/* None */
+static bool sameFeature(const uint8_t a[], const uint8_t b[]);
+static bool sameOutput(const uint8_t a[], const uint8_t b[]);
 
 /****************************************************************************
  * Public Data
@@ -68,54 +71,99 @@
  * Public Functions
  ****************************************************************************/
 
-DCCPacketQueue::DCCPacketQueue(void) : read_pos(0), write_pos(0), size(10), written(0)
+DCCPacketQueue::DCCPacketQueue(void) : head(DCC_POOL_NONE), tail(DCC_POOL_NONE), reserved(0), size(0), written(0), changes(0)
+#if DCC_SUPPORT_REPEAT_SPACING
+    , spacing(0), backoff(1)
+#endif
+#if DCC_SUPPORT_FAIR_QUEUES
+    , fair(false), served(0)
+#endif
 {
     return;
 }
 
-void DCCPacketQueue::setup(size_t length)
+void DCCPacketQueue::setup(size_t reserved_slots, size_t max_slots)
 {
-    size = length;
-    queue = new DCCPacket[size];
+    if (dcc_packet_pool.reserve(reserved_slots))
+    {
+        reserved = reserved_slots;
+    }
+
+    size = max_slots;
 }
 
-bool DCCPacketQueue::insertPacket(const DCCPacket& packet)
+bool DCCPacketQueue::isDue(DCCPacket::address_t avoid)
 {
-    //First: Overwrite any packet with the same address and kind; if no such packet THEN hitup the packet at write_pos
-    byte i = read_pos;
-
-    while (i != (read_pos + written) % (size))  //(size+1) ) //size+1 so we can check the last slot, too…
+#if DCC_SUPPORT_REPEAT_SPACING
+    if (spacing)
     {
-        if ((queue[i].getAddress() == packet.getAddress()) && (queue[i].getKind() == packet.getKind()))
+        //the oldest packet whose time has come, so repeats for different addresses take turns.
+        //nothing is ever due more than DCC_REPEAT_MAX_GAP + 1 ahead, so further than that is overdue.
+        for (uint8_t prev = DCC_POOL_NONE, i = head; i != DCC_POOL_NONE; prev = i, i = dcc_packet_pool.next[i])
         {
-            queue[i] = packet;
-            //do not increment written or modify write_pos
-            return true;
+            uint8_t wait = dcc_packet_pool.due[i] - dcc_packet_pool.clock;
+
+            if (((wait == 0) || (wait > DCC_REPEAT_MAX_GAP + 1)) &&
+                    (DCCPacket::unpackAddress(dcc_packet_pool.packed_address[i]) != avoid))
+            {
+                if (prev != DCC_POOL_NONE)
+                {
+                    beginChange();
+                    dcc_packet_pool.next[prev] = dcc_packet_pool.next[i];
+
+                    if (tail == i)
+                    {
+                        tail = prev;
+                    }
+
+                    dcc_packet_pool.next[i] = head;
+                    head = i;
+                    endChange();
+                }
+
+                return true;
+            }
         }
 
-        i = (i + 1) % size;
+        return false;
     }
+#endif
 
-    //else, tack it on to the end
-    if (!isFull())
+    return notEmpty() && ((avoid == DCC_QUEUE_ANY_ADDRESS) || notRepeat(avoid));
+}
+
+#if DCC_SUPPORT_REPEAT_SPACING
+void DCCPacketQueue::setSpacing(uint8_t gap, uint8_t backoff)
+{
+    spacing = (gap > DCC_REPEAT_MAX_GAP) ? DCC_REPEAT_MAX_GAP : gap;
+    this->backoff = backoff ? backoff : 1;
+}
+#endif
+
+#if DCC_SUPPORT_FAIR_QUEUES
+void DCCPacketQueue::setFair(bool on)
+{
+    fair = on;
+
+    //whatever is queued already goes out in the order it's in
+    for (uint8_t i = head; i != DCC_POOL_NONE; i = dcc_packet_pool.next[i])
     {
-        //else, just write it at the end of the queue.
-        queue[write_pos] = packet;
-        write_pos = (write_pos + 1) % size;
-        ++written;
-        return true;
+        dcc_packet_pool.round[i] = served;
     }
+}
+#endif
 
-    return false;
+bool DCCPacketQueue::insertPacket(const DCCPacket& packet)
+{
+    return insertSlot(packet) != DCC_POOL_NONE;
 }
 
 bool DCCPacketQueue::readPacket(DCCPacket& packet)
 {
     if (!isEmpty())
     {
-        packet = queue[read_pos];
-        read_pos = (read_pos + 1) % size;
-        --written;
+        loadPacket(head, packet);
+        dropHead();
         return true;
     }
 
@@ -124,38 +172,316 @@ bool DCCPacketQueue::readPacket(DCCPacket& packet)
 
 bool DCCPacketQueue::forget(DCCPacket::address_t address, DCCPacket::address_kind_t address_kind)
 {
+    uint16_t key = DCCPacket::packAddress(address, address_kind);
+    uint8_t prev = DCC_POOL_NONE;
+    uint8_t i = head;
     bool found = false;
 
-    for (int i = 0; i < size; ++i)
+    //unlink every packet for this address, keeping the rest in order
+    while (i != DCC_POOL_NONE)
     {
-        if ((queue[i].getAddress() == address) && (queue[i].getAddressKind() == address_kind))
+        uint8_t next = dcc_packet_pool.next[i];
+
+        if ((dcc_packet_pool.packed_address[i] & DCC_PACKED_ADDRESS_MASK) == key)
         {
+            beginChange();
+
+            if (prev == DCC_POOL_NONE)
+            {
+                head = next;
+            }
+            else
+            {
+                dcc_packet_pool.next[prev] = next;
+            }
+
+            if (tail == i)
+            {
+                tail = prev;
+            }
+
+            --written;
+            dcc_packet_pool.release(i, written < reserved);
             found = true;
-            queue[i] = DCCPacket(); //revert to default value
+            endChange();
+        }
+        else
+        {
+            prev = i;
         }
+
+        i = next;
     }
 
-    --written;
     return found;
 }
 
 void DCCPacketQueue::clear(void)
 {
-    read_pos = 0;
-    write_pos = 0;
-    written = 0;
+    while (!isEmpty())
+    {
+        dropHead();
+    }
+}
+
+bool DCCPacketQueue::visit(dcc_queue_visitor_t visitor, void* context, uint8_t queue) const
+{
+    uint8_t before = changes;
+    DCCQueuedPacket packet;
 
-    for (int i = 0; i < size; ++i)
+    if (before & 1) //caught in the middle of a change
     {
-        queue[i] = DCCPacket();
+        return false;
+    }
+
+    DCC_QUEUE_BARRIER();
+
+    packet.queue = queue;
+    packet.position = 0;
+
+    //a change under our feet can send next[] anywhere, so stop as soon as one is seen,
+    //and never go round more times than there are slots
+    for (uint8_t i = head; (i != DCC_POOL_NONE) && (packet.position < DCC_PACKET_POOL_SIZE); i = dcc_packet_pool.next[i])
+    {
+        packet.slot = i;
+
+        if ((changes != before) || !visitor(packet, context))
+        {
+            break;
+        }
+
+        ++packet.position;
     }
+
+    DCC_QUEUE_BARRIER();
+    return changes == before;
 }
 
+#if DCC_SUPPORT_BANDWIDTH
+uint32_t DCCPacketQueue::getWireTime(void) const
+{
+    uint32_t total = 0;
+
+    for (uint8_t i = head; i != DCC_POOL_NONE; i = dcc_packet_pool.next[i])
+    {
+        DCCPacket p;
+        uint8_t buffer[DCC_PACKET_MAX_LEN];
+
+        loadPacket(i, p);
+        total += DCCPacket::getWireTime(buffer, p.getBitstream(buffer)) * (1 + p.getRepeat());
+    }
+
+    return total;
+}
+#endif
+
 /****************************************************************************
  * Private Functions
  ****************************************************************************/
 
-/* None */
+void DCCPacketQueue::dropHead(void)
+{
+    uint8_t slot = head;
+    beginChange();
+    head = dcc_packet_pool.next[slot];
+
+    if (head == DCC_POOL_NONE)
+    {
+        tail = DCC_POOL_NONE;
+    }
+
+#if DCC_SUPPORT_FAIR_QUEUES
+    //rounds only go forward, even if isDue() brought a later one to the front
+    if (fair && ((int8_t)(dcc_packet_pool.round[slot] - served) > 0))
+    {
+        served = dcc_packet_pool.round[slot];
+    }
+#endif
+
+    --written;
+    dcc_packet_pool.release(slot, written < reserved);
+    endChange();
+}
+
+uint8_t DCCPacketQueue::insertSlot(const DCCPacket& packet)
+{
+    uint16_t address;
+    uint8_t data[DCC_PACKED_DATA_LEN];
+    uint8_t info;
+
+    packet.pack(address, data, info);
+#if DCC_SUPPORT_FAIR_QUEUES
+    int8_t turn = 0; //rounds after the one being served that this address is next free
+#endif
+
+    //First: Overwrite any packet with the same address and kind; if no such packet THEN hitup a new slot
+    for (uint8_t i = head; i != DCC_POOL_NONE; i = dcc_packet_pool.next[i])
+    {
+#if DCC_SUPPORT_FAIR_QUEUES
+        if (fair && (((dcc_packet_pool.packed_address[i] ^ address) & DCC_PACKED_ADDRESS_MASK) == 0) &&
+                ((int8_t)(dcc_packet_pool.round[i] - served) >= turn))
+        {
+            turn = (int8_t)(dcc_packet_pool.round[i] - served) + 1;
+        }
+#endif
+
+        if ((((dcc_packet_pool.packed_address[i] ^ address) & DCC_PACKED_ADDRESS_MASK) == 0) &&
+                (((dcc_packet_pool.packed_info[i] ^ info) & DCC_PACKED_KIND_MASK) == 0) &&
+                ((packet.getKind() != FEATURE_EXPANSION_KIND) || sameFeature(dcc_packet_pool.packed_data[i], data)) &&
+                ((packet.getKind() != BASIC_ACCESSORY_PACKET_KIND) || sameOutput(dcc_packet_pool.packed_data[i], data)))
+        {
+            beginChange();
+            storePacket(i, packet);
+#if DCC_SUPPORT_REPEAT_SPACING
+            dcc_packet_pool.due[i] = dcc_packet_pool.clock;
+            dcc_packet_pool.gap[i] = 0;
+#endif
+            endChange();
+            //do not increment written
+            return i;
+        }
+    }
+
+    //else, tack it on to the end
+    if (!isFull())
+    {
+        uint8_t slot = dcc_packet_pool.allocate(written < reserved);
+        beginChange();
+        storePacket(slot, packet);
+
+#if DCC_SUPPORT_FAIR_QUEUES
+        if (fair)
+        {
+            linkFair(slot, (turn > DCC_FAIR_MAX_TURN) ? DCC_FAIR_MAX_TURN : turn);
+        }
+        else
+#endif
+        {
+            if (head == DCC_POOL_NONE)
+            {
+                head = slot;
+            }
+            else
+            {
+                dcc_packet_pool.next[tail] = slot;
+            }
+
+            tail = slot;
+        }
+
+        ++written;
+#if DCC_SUPPORT_REPEAT_SPACING
+        dcc_packet_pool.due[slot] = dcc_packet_pool.clock;
+        dcc_packet_pool.gap[slot] = 0;
+#endif
+        endChange();
+        return slot;
+    }
+
+    return DCC_POOL_NONE;
+}
+
+#if DCC_SUPPORT_FAIR_QUEUES
+void DCCPacketQueue::linkFair(uint8_t slot, uint8_t turn)
+{
+    uint8_t prev = DCC_POOL_NONE;
+
+    dcc_packet_pool.round[slot] = served + turn;
+
+    //behind everything in its round or an earlier one
+    for (uint8_t i = head; i != DCC_POOL_NONE; i = dcc_packet_pool.next[i])
+    {
+        if ((int8_t)(dcc_packet_pool.round[i] - served) <= (int8_t)turn)
+        {
+            prev = i;
+        }
+    }
+
+    if (prev == DCC_POOL_NONE)
+    {
+        dcc_packet_pool.next[slot] = head;
+        head = slot;
+    }
+    else
+    {
+        dcc_packet_pool.next[slot] = dcc_packet_pool.next[prev];
+        dcc_packet_pool.next[prev] = slot;
+    }
+
+    if (dcc_packet_pool.next[slot] == DCC_POOL_NONE)
+    {
+        tail = slot;
+    }
+}
+#endif
+
+#if DCC_SUPPORT_REPEAT_SPACING
+void DCCPacketQueue::respace(uint8_t slot)
+{
+    uint8_t gap = dcc_packet_pool.gap[slot];
+
+    if (!gap)
+    {
+        gap = spacing;
+    }
+    else if (gap * backoff > DCC_REPEAT_MAX_GAP)
+    {
+        gap = DCC_REPEAT_MAX_GAP;
+    }
+    else
+    {
+        gap *= backoff;
+    }
+
+    dcc_packet_pool.gap[slot] = gap;
+    //it goes out before the clock ticks, so this leaves gap packets in between
+    dcc_packet_pool.due[slot] = dcc_packet_pool.clock + 1 + gap;
+}
+
+void DCCPacketQueue::requeueHead(void)
+{
+    if (head != tail)
+    {
+        uint8_t slot = head;
+        beginChange();
+        head = dcc_packet_pool.next[slot];
+        dcc_packet_pool.next[slot] = DCC_POOL_NONE;
+        dcc_packet_pool.next[tail] = slot;
+        tail = slot;
+        endChange();
+    }
+}
+#endif
+
+//FEATURE_EXPANSION_KIND packets only replace one another if they're for the
+//same function group, or the same binary state
+static bool sameFeature(const uint8_t a[], const uint8_t b[])
+{
+    if (a[0] != b[0])
+    {
+        return false;
+    }
+
+    switch (a[0])
+    {
+    case 0xDD: //binary state, short form: DLLLLLLL
+        return ((a[1] ^ b[1]) & 0x7F) == 0;
+
+    case 0xC0: //binary state, long form: DLLLLLLL HHHHHHHH
+        return (((a[1] ^ b[1]) & 0x7F) == 0) && (a[2] == b[2]);
+
+    default:
+        return true;
+    }
+}
+
+//BASIC_ACCESSORY_PACKET_KIND packets only replace one another if they're for the
+//same output pair of a decoder, the upper two D bits of 1AAACDDD; the lowest D bit says
+//which output of the pair, so setting one after the other still replaces it
+static bool sameOutput(const uint8_t a[], const uint8_t b[])
+{
+    return ((a[0] ^ b[0]) & 0x06) == 0;
+}
 
 /****************************************************************************
  * End of file
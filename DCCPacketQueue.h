@@ -31,34 +31,91 @@
 
 
 /**
- * A FIFO queue for holding DCC packets, implemented as a circular buffer.
+ * A FIFO queue for holding DCC packets, implemented as a linked list of
+ * slots taken from dcc_packet_pool.
  * Copyright 2010 D.E. Goodman-Wilson
- * TODO
 **/
 
 #include "DCCPacket.h"
+#include "DCCPacketPool.h"
+
+//for isDue(): any address will do
+#define DCC_QUEUE_ANY_ADDRESS 0xFFFF
+
+//stops the compiler moving reads and writes of a queue across a change of its changes count
+#define DCC_QUEUE_BARRIER() __asm__ __volatile__ ("" ::: "memory")
+
+//which of the scheduler's queues a DCCQueuedPacket is in
+#define DCC_QUEUE_E_STOP 0
+#define DCC_QUEUE_HIGH   1
+#define DCC_QUEUE_LOW    2
+#define DCC_QUEUE_REPEAT 3
+
+//a queued packet as visit() shows it: read where it lies in dcc_packet_pool, not copied out
+class DCCQueuedPacket
+{
+public:
+    uint8_t queue; //DCC_QUEUE_E_STOP and so on, or whatever was passed to visit()
+    uint8_t position; //0 for the packet that goes out next
+    uint8_t slot;
+
+    inline DCCPacket::address_t getAddress(void) const
+    {
+        return DCCPacket::unpackAddress(dcc_packet_pool.packed_address[slot]);
+    }
+
+    inline DCCPacket::address_kind_t getAddressKind(void) const
+    {
+        return DCCPacket::unpackAddressKind(dcc_packet_pool.packed_address[slot]);
+    }
+
+    inline uint8_t getKind(void) const
+    {
+        return DCCPacket::unpackKind(dcc_packet_pool.packed_info[slot]);
+    }
+
+    inline uint8_t getRepeat(void) const //times it's still to be repeated
+    {
+        return dcc_packet_pool.packed_info[slot] & DCC_PACKED_REPEAT_MASK;
+    }
+
+    inline uint8_t getSize(void) const //bytes of data
+    {
+        return dcc_packet_pool.packed_address[slot] >> DCC_PACKED_SIZE_SHIFT;
+    }
+
+    inline const uint8_t* getData(void) const
+    {
+        return dcc_packet_pool.packed_data[slot];
+    }
+};
+
+//called for each packet visit() comes to; return false to skip the rest of that queue
+typedef bool (*dcc_queue_visitor_t)(const DCCQueuedPacket& packet, void* context);
 
 class DCCPacketQueue
 {
 public: //protected:
-    DCCPacket* queue;
-    size_t read_pos;
-    size_t write_pos;
-    size_t size;
-    size_t written; //how many cells have valid data? used for determining full status.
+    uint8_t head; //oldest slot, DCC_POOL_NONE if empty
+    uint8_t tail; //newest slot
+    size_t reserved; //slots guaranteed to this queue
+    size_t size; //most slots this queue may hold
+    size_t written; //how many slots are in use? used for determining full status.
+    volatile uint8_t changes; //for visit(): odd while what's queued, or its order, is being changed
 public:
     DCCPacketQueue(void);
 
-    virtual void setup(size_t length);
+    virtual void setup(size_t reserved_slots, size_t max_slots);
 
     ~DCCPacketQueue(void)
     {
-        delete [] queue;
+        clear();
+        dcc_packet_pool.unreserve(reserved);
     }
 
     virtual inline bool isFull(void)
     {
-        return (written == size);
+        return (written == size) || !dcc_packet_pool.canAllocate(written < reserved);
     }
 
     virtual inline bool isEmpty(void)
@@ -73,14 +130,84 @@ public:
 
     virtual inline bool notRepeat(DCCPacket::address_t address)
     {
-        return (address != queue[read_pos].getAddress());
+        return (address != DCCPacket::unpackAddress(dcc_packet_pool.packed_address[head]));
     }
 
+    //is there a packet readPacket() can send now, for an address other than avoid? with
+    //DCC_SUPPORT_REPEAT_SPACING, the first such packet is moved to the front for it.
+    bool isDue(DCCPacket::address_t avoid);
+
+#if DCC_SUPPORT_REPEAT_SPACING
+    //a packet sent that stays queued waits gap packets before it goes again, then backoff
+    //times as long each time after, up to DCC_REPEAT_MAX_GAP. 0 doesn't hold them back at all.
+    void setSpacing(uint8_t gap, uint8_t backoff);
+#endif
+
+#if DCC_SUPPORT_FAIR_QUEUES
+    //on: packets are taken an address at a time, in rounds, rather than in the order they came.
+    //each address gets one packet per round, and one newly arrived joins the round in progress.
+    void setFair(bool on);
+#endif
+
     virtual bool insertPacket(const DCCPacket& packet); //makes a local copy, does not take over memory management!
     virtual bool readPacket(DCCPacket& packet); //does not hand off memory management of packet. used immediately.
 
     bool forget(DCCPacket::address_t address, DCCPacket::address_kind_t address_kind);
     void clear(void);
+
+    //show visitor each packet, in the order they'll go out, without taking them off the queue or
+    //copying them. may be called from an interrupt that has broken into update() on the same core:
+    //false then means the queue was caught part way through a change, what the visitor saw is not
+    //to be trusted, and it should look again once update() has been let finish. nothing makes it
+    //safe to call from another thread; on a host, call it from the one that calls update().
+    bool visit(dcc_queue_visitor_t visitor, void* context, uint8_t queue = 0) const;
+
+#if DCC_SUPPORT_BANDWIDTH
+    uint32_t getWireTime(void) const; //microseconds to send everything queued, with all its repeats
+#endif
+
+  protected:
+    //copy between a slot and a DCCPacket
+    inline void storePacket(uint8_t slot, const DCCPacket& packet)
+    {
+        packet.pack(dcc_packet_pool.packed_address[slot], dcc_packet_pool.packed_data[slot], dcc_packet_pool.packed_info[slot]);
+    }
+
+    inline void loadPacket(uint8_t slot, DCCPacket& packet) const
+    {
+        packet.unpack(dcc_packet_pool.packed_address[slot], dcc_packet_pool.packed_data[slot], dcc_packet_pool.packed_info[slot]);
+    }
+
+    //bracket every change to what's queued, or its order, so visit() can see it's under way
+    inline void beginChange(void)
+    {
+        ++changes;
+        DCC_QUEUE_BARRIER();
+    }
+
+    inline void endChange(void)
+    {
+        DCC_QUEUE_BARRIER();
+        ++changes;
+    }
+
+    void dropHead(void); //give the oldest slot back to the pool
+    uint8_t insertSlot(const DCCPacket& packet); //insertPacket(), returning the slot used or DCC_POOL_NONE
+
+#if DCC_SUPPORT_REPEAT_SPACING
+    uint8_t spacing;
+    uint8_t backoff;
+
+    void respace(uint8_t slot); //slot's packet has just been sent, and will be again
+    void requeueHead(void); //move the head to the back, behind everything else waiting
+#endif
+
+#if DCC_SUPPORT_FAIR_QUEUES
+    bool fair;
+    uint8_t served; //the round being sent; the list is kept in order of round
+
+    void linkFair(uint8_t slot, uint8_t turn); //put a new slot in the list turn rounds on from served
+#endif
 };
 
 #endif // INC_DCCPACKETQUEUE_H
@@ -35,26 +35,25 @@
 
 #include "DCCPacketScheduler.h"
 #include "DCCHardware.h"
+#include "DCCStorage.h"
 
 /****************************************************************************
  * Defines
  ****************************************************************************/
 
-#define SPEED_REPEAT      3
-#define FUNCTION_REPEAT   3
-#define E_STOP_REPEAT     5
-#define OPS_MODE_PROGRAMMING_REPEAT 3
-#define OTHER_REPEAT      2
+//Queue sizes, repeat counts and scheduling intervals are in DCCConfig.h
 
-#define E_STOP_QUEUE_SIZE           2
-#define HIGH_PRIORITY_QUEUE_SIZE    10
-#define LOW_PRIORITY_QUEUE_SIZE     10
-#define REPEAT_QUEUE_SIZE           10
-//#define PERIODIC_REFRESH_QUEUE_SIZE 10
+#define DCC_MOMENTUM_FREE 0xFFFF
+#define DCC_CONSIST_FREE  0xFFFF
+#define DCC_QOS_FREE      0xFFFF
+#define DCC_ADAPTIVE_FREE 0xFFFF
+#define DCC_GOVERNOR_FREE 0xFFFF
 
-#define LOW_PRIORITY_INTERVAL     5
-#define REPEAT_INTERVAL           11
-#define PERIODIC_REFRESH_INTERVAL 23
+#define DCC_SNAPSHOT_FREE    0xFFFF
+#define DCC_SNAPSHOT_PENDING 0x01 //the loco's record is being written, and the one before still holds
+#define DCC_SNAPSHOT_CHANGED 0x02 //the loco changed while its record was being written
+#define DCC_SNAPSHOT_UNITS   (DCC_SNAPSHOT_LOCOS + 3)
+#define DCC_SNAPSHOT_SCAN    16 //most bytes updateSnapshot() compares per call
 
 /****************************************************************************
  * Data Types
@@ -78,22 +77,156 @@
  * Private Data
  ****************************************************************************/
 
-/* None */
+#if DCC_SUPPORT_SNAPSHOT
+//function groups as kept in a snapshot record
+static const uint8_t snapshot_function_kinds[] =
+{
+    FUNCTION_PACKET_1_KIND,
+    FUNCTION_PACKET_2_KIND,
+    FUNCTION_PACKET_3_KIND,
+    FUNCTION_PACKET_4_KIND,
+    FUNCTION_PACKET_5_KIND
+};
+#endif
+
+#if DCC_SUPPORT_SPEED14
+//speed bits for setSpeed14(), indexed by abs_speed - 2. Equivalent to map(abs_speed, 2, 127, 2, 15)
+static const uint8_t speed14_table[] PROGMEM =
+{
+    0x02, 0x02, 0x02, 0x02, 0x02, 0x02, 0x02, 0x02, 0x02, 0x02, 0x03, 0x03, 0x03, 0x03, 0x03, 0x03,
+    0x03, 0x03, 0x03, 0x03, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x04, 0x05, 0x05, 0x05,
+    0x05, 0x05, 0x05, 0x05, 0x05, 0x05, 0x05, 0x06, 0x06, 0x06, 0x06, 0x06, 0x06, 0x06, 0x06, 0x06,
+    0x06, 0x07, 0x07, 0x07, 0x07, 0x07, 0x07, 0x07, 0x07, 0x07, 0x08, 0x08, 0x08, 0x08, 0x08, 0x08,
+    0x08, 0x08, 0x08, 0x08, 0x09, 0x09, 0x09, 0x09, 0x09, 0x09, 0x09, 0x09, 0x09, 0x0A, 0x0A, 0x0A,
+    0x0A, 0x0A, 0x0A, 0x0A, 0x0A, 0x0A, 0x0A, 0x0B, 0x0B, 0x0B, 0x0B, 0x0B, 0x0B, 0x0B, 0x0B, 0x0B,
+    0x0B, 0x0C, 0x0C, 0x0C, 0x0C, 0x0C, 0x0C, 0x0C, 0x0C, 0x0C, 0x0D, 0x0D, 0x0D, 0x0D, 0x0D, 0x0D,
+    0x0D, 0x0D, 0x0D, 0x0D, 0x0E, 0x0E, 0x0E, 0x0E, 0x0E, 0x0E, 0x0E, 0x0E, 0x0E, 0x0F
+};
+#endif
+
+#if DCC_SUPPORT_SPEED28
+//speed bits for setSpeed28(), indexed by abs_speed - 2. Equivalent to map(abs_speed, 2, 127, 4, 31)
+//with the least significant bit already moved to bit 4, as S 9.2 wants.
+static const uint8_t speed28_table[] PROGMEM =
+{
+    0x02, 0x02, 0x02, 0x02, 0x02, 0x12, 0x12, 0x12, 0x12, 0x12, 0x03, 0x03, 0x03, 0x03, 0x13, 0x13,
+    0x13, 0x13, 0x13, 0x04, 0x04, 0x04, 0x04, 0x04, 0x14, 0x14, 0x14, 0x14, 0x05, 0x05, 0x05, 0x05,
+    0x05, 0x15, 0x15, 0x15, 0x15, 0x15, 0x06, 0x06, 0x06, 0x06, 0x16, 0x16, 0x16, 0x16, 0x16, 0x07,
+    0x07, 0x07, 0x07, 0x17, 0x17, 0x17, 0x17, 0x17, 0x08, 0x08, 0x08, 0x08, 0x08, 0x18, 0x18, 0x18,
+    0x18, 0x09, 0x09, 0x09, 0x09, 0x09, 0x19, 0x19, 0x19, 0x19, 0x19, 0x0A, 0x0A, 0x0A, 0x0A, 0x1A,
+    0x1A, 0x1A, 0x1A, 0x1A, 0x0B, 0x0B, 0x0B, 0x0B, 0x1B, 0x1B, 0x1B, 0x1B, 0x1B, 0x0C, 0x0C, 0x0C,
+    0x0C, 0x0C, 0x1C, 0x1C, 0x1C, 0x1C, 0x0D, 0x0D, 0x0D, 0x0D, 0x0D, 0x1D, 0x1D, 0x1D, 0x1D, 0x1D,
+    0x0E, 0x0E, 0x0E, 0x0E, 0x1E, 0x1E, 0x1E, 0x1E, 0x1E, 0x0F, 0x0F, 0x0F, 0x0F, 0x1F
+};
+#endif
 
 /****************************************************************************
  * Public Functions
  ****************************************************************************/
 
 DCCPacketScheduler::DCCPacketScheduler(void) :
-    default_speed_steps(128),
+    //in the order they're declared
+#if DCC_SUPPORT_MOMENTUM
+    momentum_next(0),
+#endif
+#if DCC_SUPPORT_QOS
+    service_next(0),
+#endif
+#if DCC_SUPPORT_ADAPTIVE_REPEAT
+    track_loss(0), adaptive(false),
+#endif
+#if DCC_SUPPORT_GOVERNOR
+    governor_ms(DCC_GOVERNOR_MS), governor_coalesced(0), governor_deferred(0),
+#endif
+#if DCC_SUPPORT_SNAPSHOT
+    snapshot_unit(0), snapshot_pos(0), snapshot_restore(DCC_SNAPSHOT_LOCOS), snapshot_wipe(false),
+#endif
+#if DCC_SUPPORT_ACCESSORY_CACHE
+    accessory_suppress(false),
+#endif
+#if DCC_SUPPORT_ROUTES
+    route(0), route_count(0), route_next(0), route_last_ms(0),
+#endif
+#if DCC_SUPPORT_TIMERS
+    timer_clock(0),
+#endif
+#if DCC_SUPPORT_BANDWIDTH
+    wire_total(0), wire_busy(0), wire_last(0), utilization(0),
+#endif
+    default_speed_steps(DCC_DEFAULT_SPEED_STEPS),
     last_packet_address(255),
     packet_counter(1)
 {
-    e_stop_queue.setup(E_STOP_QUEUE_SIZE);
-    high_priority_queue.setup(HIGH_PRIORITY_QUEUE_SIZE);
-    low_priority_queue.setup(LOW_PRIORITY_QUEUE_SIZE);
-    repeat_queue.setup(REPEAT_QUEUE_SIZE);
+    e_stop_queue.setup(E_STOP_QUEUE_RESERVE, E_STOP_QUEUE_SIZE);
+    high_priority_queue.setup(HIGH_PRIORITY_QUEUE_RESERVE, HIGH_PRIORITY_QUEUE_SIZE);
+    low_priority_queue.setup(LOW_PRIORITY_QUEUE_RESERVE, LOW_PRIORITY_QUEUE_SIZE);
+    repeat_queue.setup(REPEAT_QUEUE_RESERVE, REPEAT_QUEUE_SIZE);
     //periodic_refresh_queue.setup(PERIODIC_REFRESH_QUEUE_SIZE);
+
+#if DCC_SUPPORT_REPEAT_SPACING
+    setRepeatSpacing(DCC_REPEAT_SPACING, DCC_REPEAT_BACKOFF);
+#endif
+#if DCC_SUPPORT_FAIR_QUEUES
+    setFairQueues(DCC_FAIR_QUEUES);
+#endif
+
+#if DCC_SUPPORT_MOMENTUM
+    for (uint8_t i = 0; i < DCC_MOMENTUM_SLOTS; ++i)
+    {
+        momentum[i].key = DCC_MOMENTUM_FREE;
+    }
+#endif
+
+#if DCC_SUPPORT_CONSIST
+    for (uint8_t i = 0; i < DCC_CONSIST_MEMBERS; ++i)
+    {
+        consist_members[i].cv19 = 0;
+    }
+#endif
+
+#if DCC_SUPPORT_ACCESSORY_CACHE
+    clearAccessoryCache();
+#endif
+
+#if DCC_SUPPORT_QOS
+    for (uint8_t i = 0; i < DCC_QOS_CLASSES; ++i)
+    {
+        setServiceClass(i, 0, DCC_QOS_DEFAULT_REPEAT, DCC_QOS_NORMAL);
+    }
+
+    for (uint8_t i = 0; i < DCC_QOS_ADDRESSES; ++i)
+    {
+        service_addresses[i].service_class = 0;
+    }
+#endif
+
+#if DCC_SUPPORT_ADAPTIVE_REPEAT
+    for (uint8_t i = 0; i < DCC_ADAPTIVE_ADDRESSES; ++i)
+    {
+        deliveries[i].key = DCC_ADAPTIVE_FREE;
+    }
+#endif
+
+#if DCC_SUPPORT_GOVERNOR
+    for (uint8_t i = 0; i < DCC_GOVERNOR_SLOTS; ++i)
+    {
+        governors[i].key = DCC_GOVERNOR_FREE;
+    }
+#endif
+
+#if DCC_SUPPORT_SNAPSHOT
+    for (uint8_t i = 0; i < DCC_SNAPSHOT_LOCOS; ++i)
+    {
+        for (uint8_t b = 0; b < DCC_SNAPSHOT_DATA_LEN; ++b)
+        {
+            snapshot_locos[i].record[b] = (b < 2) ? 0xFF : 0x00;
+        }
+
+        snapshot_locos[i].copy = 0;
+        snapshot_locos[i].seq = 0;
+        snapshot_locos[i].flags = 0;
+    }
+#endif
 }
 
 //for configuration
@@ -106,7 +239,21 @@ void DCCPacketScheduler::setup(void) //for any post-constructor initialization
 {
     dcc_hardware_setup();
 
-    //Following RP 9.2.4, begin by putting 20 reset packets and 10 idle packets on the rails.
+#if DCC_SUPPORT_SNAPSHOT
+    dcc_storage_setup(DCC_SNAPSHOT_SIZE);
+
+    //a snapshot from another configuration can't be restored, and its records mustn't be mistaken for ours later
+    for (uint16_t i = 0; i < DCC_SNAPSHOT_HEADER_LEN; ++i)
+    {
+        if (dcc_storage_read(i) != snapshotByte(0, i))
+        {
+            snapshot_wipe = true;
+        }
+    }
+#endif
+
+    //Following RP 9.2.4, begin by putting at least 20 valid packets on the rails: 15 resets
+    //(the most a queued packet can repeat, see DCC_PACKED_MAX_REPEAT) then 15 idles.
     //use the e_stop_queue to do this, to ensure these packets go out first!
 
     DCCPacket p;
@@ -115,7 +262,7 @@ void DCCPacketScheduler::setup(void) //for any post-constructor initialization
     //reset packet: address 0x00, data 0x00, XOR 0x00; S 9.2 line 75
     p.addData(data, 1);
     p.setAddress(0x00, DCCPacket::DCC_SHORT_ADDRESS);
-    p.setRepeat(20);
+    p.setRepeat(DCC_PACKED_MAX_REPEAT);
     p.setKind(RESET_PACKET_KIND);
     e_stop_queue.insertPacket(p);
 
@@ -126,7 +273,7 @@ void DCCPacketScheduler::setup(void) //for any post-constructor initialization
 
     //idle packet: address 0xFF, data 0x00, XOR 0xFF; S 9.2 line 90
     p.setAddress(0xFF, DCCPacket::DCC_SHORT_ADDRESS);
-    p.setRepeat(10);
+    p.setRepeat(DCC_PACKED_MAX_REPEAT);
     p.setKind(IDLE_PACKET_KIND);
     e_stop_queue.insertPacket(p); //e_stop_queue will be empty, so no need to check if insertion was OK.
 
@@ -148,6 +295,9 @@ void DCCPacketScheduler::repeatPacket(const DCCPacket& p)
     case FUNCTION_PACKET_1_KIND: //all other packets go to the repeat_queue
     case FUNCTION_PACKET_2_KIND: //all other packets go to the repeat_queue
     case FUNCTION_PACKET_3_KIND: //all other packets go to the repeat_queue
+    case FUNCTION_PACKET_4_KIND:
+    case FUNCTION_PACKET_5_KIND:
+    case FEATURE_EXPANSION_KIND:
     case ACCESSORY_PACKET_KIND:
     case RESET_PACKET_KIND:
     case OPS_MODE_PROGRAMMING_KIND:
@@ -166,9 +316,85 @@ void DCCPacketScheduler::repeatPacket(const DCCPacket& p)
 // a value >1 (or <-1) means go.
 // valid non-estop speeds are in the range [1,127] / [-127,-1] with 1 = stop
 bool DCCPacketScheduler::setSpeed(DCCPacket::address_t address, DCCPacket::address_kind_t address_kind, int8_t new_speed, uint8_t steps)
+{
+#if DCC_SUPPORT_MOMENTUM
+    //an explicit speed overrides any ramp in progress
+    uint16_t key = DCCPacket::packAddress(address, address_kind);
+    momentum_t* m = findMomentum(key);
+
+    if (m)
+    {
+        m->key = DCC_MOMENTUM_FREE;
+    }
+
+    if (!sendSpeed(address, address_kind, new_speed, steps))
+    {
+        return false;
+    }
+
+    //and is where the next one starts from; an e-stop leaves it not knowing again
+    m = new_speed ? takeMomentum(key, new_speed) : 0;
+
+    if (m)
+    {
+        m->current = new_speed;
+        m->target = new_speed;
+        m->steps = steps;
+    }
+
+    return true;
+#else
+    return sendSpeed(address, address_kind, new_speed, steps);
+#endif
+}
+
+#if DCC_SUPPORT_MOMENTUM
+bool DCCPacketScheduler::setSpeedTarget(DCCPacket::address_t address, DCCPacket::address_kind_t address_kind, int8_t new_speed, uint8_t rate, uint8_t steps)
+{
+    if (!new_speed || !rate) //e-stops and a rate of 0 take effect straight away
+    {
+        return setSpeed(address, address_kind, new_speed, steps);
+    }
+
+    momentum_t* m = takeMomentum(DCCPacket::packAddress(address, address_kind), new_speed);
+
+    if (!m)
+    {
+        return false;
+    }
+
+    if (m->current == m->target) //not ramping, so start the clock now
+    {
+        m->last_ms = millis();
+    }
+
+    m->target = new_speed;
+    m->steps = steps;
+    m->interval = 1000 / rate;
+    return true;
+}
+#endif // DCC_SUPPORT_MOMENTUM
+
+bool DCCPacketScheduler::sendSpeed(DCCPacket::address_t address, DCCPacket::address_kind_t address_kind, int8_t new_speed, uint8_t steps)
 {
     uint8_t num_steps = steps;
 
+#if DCC_SUPPORT_CONSIST
+    //members of a consist get their speed through the consist address
+    consist_member_t* member = findConsistMember(DCCPacket::packAddress(address, address_kind));
+
+    if (member)
+    {
+        address = member->cv19 & 0x7F;
+        address_kind = DCCPacket::DCC_SHORT_ADDRESS;
+
+        if (member->cv19 & 0x80) //its decoder will flip the direction back again
+        {
+            new_speed = (new_speed == -128) ? 127 : -new_speed;
+        }
+    }
+#endif
+
     //steps = 0 means use the default; otherwise use the number of steps specified
     if (!steps)
     {
@@ -177,19 +403,26 @@ bool DCCPacketScheduler::setSpeed(DCCPacket::address_t address, DCCPacket::addre
 
     switch (num_steps)
     {
+#if DCC_SUPPORT_SPEED14
     case 14:
         return (setSpeed14(address, address_kind, new_speed));
+#endif
 
+#if DCC_SUPPORT_SPEED28
     case 28:
         return (setSpeed28(address, address_kind, new_speed));
+#endif
 
+#if DCC_SUPPORT_SPEED128
     case 128:
         return (setSpeed128(address, address_kind, new_speed));
+#endif
     }
 
     return false; //invalid number of steps specified.
 }
 
+#if DCC_SUPPORT_SPEED14
 bool DCCPacketScheduler::setSpeed14(DCCPacket::address_t address, DCCPacket::address_kind_t address_kind, int8_t new_speed, bool F0)
 {
     DCCPacket p(address, address_kind);
@@ -200,7 +433,7 @@ bool DCCPacketScheduler::setSpeed14(DCCPacket::address_t address, DCCPacket::add
     if (new_speed < 0)
     {
         dir = 0;
-        abs_speed = new_speed * -1;
+        abs_speed = (new_speed == -128) ? 127 : (new_speed * -1);
     }
 
     if (!new_speed) //estop!
@@ -214,7 +447,7 @@ bool DCCPacketScheduler::setSpeed14(DCCPacket::address_t address, DCCPacket::add
     }
     else //movement
     {
-        speed_data_bytes[0] |= map(abs_speed, 2, 127, 2, 15);  //convert from [2-127] to [1-14]
+        speed_data_bytes[0] |= pgm_read_byte(&speed14_table[abs_speed - 2]);  //convert from [2-127] to [2-15]
     }
 
     speed_data_bytes[0] |= (0x20 * dir); //flip bit 3 to indicate direction;
@@ -226,9 +459,11 @@ bool DCCPacketScheduler::setSpeed14(DCCPacket::address_t address, DCCPacket::add
 
     //speed packets get refreshed indefinitely, and so the repeat doesn't need to be set.
     //speed packets go to the high proirity queue
-    return (high_priority_queue.insertPacket(p));
+    return queueCommand(p);
 }
+#endif // DCC_SUPPORT_SPEED14
 
+#if DCC_SUPPORT_SPEED28
 bool DCCPacketScheduler::setSpeed28(DCCPacket::address_t address, DCCPacket::address_kind_t address_kind, int8_t new_speed)
 {
     DCCPacket p(address, address_kind);
@@ -239,7 +474,7 @@ bool DCCPacketScheduler::setSpeed28(DCCPacket::address_t address, DCCPacket::add
     if (new_speed < 0)
     {
         dir = 0;
-        abs_speed = new_speed * -1;
+        abs_speed = (new_speed == -128) ? 127 : (new_speed * -1);
     }
 
     if (new_speed == 0) //estop!
@@ -252,9 +487,7 @@ bool DCCPacketScheduler::setSpeed28(DCCPacket::address_t address, DCCPacket::add
     }
     else //movement
     {
-        speed_data_bytes[0] |= map(abs_speed, 2, 127, 2, 0X1F); //convert from [2-127] to [2-31]
-        //most least significant bit has to be shufled around
-        speed_data_bytes[0] = (speed_data_bytes[0] & 0xE0) | ((speed_data_bytes[0] & 0x1F) >> 1) | ((speed_data_bytes[0] & 0x01) << 4);
+        speed_data_bytes[0] |= pgm_read_byte(&speed28_table[abs_speed - 2]); //convert from [2-127] to [4-31], LSB shuffled
     }
 
     speed_data_bytes[0] |= (0x20 * dir); //flip bit 3 to indicate direction;
@@ -267,9 +500,11 @@ bool DCCPacketScheduler::setSpeed28(DCCPacket::address_t address, DCCPacket::add
     //speed packets get refreshed indefinitely, and so the repeat doesn't need to be set.
     //speed packets go to the high proirity queue
     //return(high_priority_queue.insertPacket(p));
-    return (high_priority_queue.insertPacket(p));
+    return queueCommand(p);
 }
+#endif // DCC_SUPPORT_SPEED28
 
+#if DCC_SUPPORT_SPEED128
 bool DCCPacketScheduler::setSpeed128(DCCPacket::address_t address, DCCPacket::address_kind_t address_kind, int8_t new_speed)
 {
     //why do we get things like this?
@@ -283,7 +518,7 @@ bool DCCPacketScheduler::setSpeed128(DCCPacket::address_t address, DCCPacket::ad
     if (new_speed < 0)
     {
         dir = 0;
-        abs_speed = new_speed * -1;
+        abs_speed = (new_speed == -128) ? 127 : (new_speed * -1);
     }
 
     if (!new_speed) //estop!
@@ -308,8 +543,9 @@ bool DCCPacketScheduler::setSpeed128(DCCPacket::address_t address, DCCPacket::ad
 
     //speed packets get refreshed indefinitely, and so the repeat doesn't need to be set.
     //speed packets go to the high proirity queue
-    return (high_priority_queue.insertPacket(p));
+    return queueCommand(p);
 }
+#endif // DCC_SUPPORT_SPEED128
 
 bool DCCPacketScheduler::setFunctions(DCCPacket::address_t address, DCCPacket::address_kind_t address_kind, uint16_t functions)
 {
@@ -349,7 +585,7 @@ bool DCCPacketScheduler::setFunctions0to4(DCCPacket::address_t address, DCCPacke
     p.addData(data, 1);
     p.setKind(FUNCTION_PACKET_1_KIND);
     p.setRepeat(FUNCTION_REPEAT);
-    return low_priority_queue.insertPacket(p);
+    return queueCommand(p);
 }
 
 
@@ -363,7 +599,7 @@ bool DCCPacketScheduler::setFunctions5to8(DCCPacket::address_t address, DCCPacke
     p.addData(data, 1);
     p.setKind(FUNCTION_PACKET_2_KIND);
     p.setRepeat(FUNCTION_REPEAT);
-    return low_priority_queue.insertPacket(p);
+    return queueCommand(p);
 }
 
 bool DCCPacketScheduler::setFunctions9to12(DCCPacket::address_t address, DCCPacket::address_kind_t address_kind, uint8_t functions)
@@ -377,15 +613,84 @@ bool DCCPacketScheduler::setFunctions9to12(DCCPacket::address_t address, DCCPack
     p.addData(data, 1);
     p.setKind(FUNCTION_PACKET_3_KIND);
     p.setRepeat(FUNCTION_REPEAT);
-    return low_priority_queue.insertPacket(p);
+    return queueCommand(p);
+}
+
+#if DCC_SUPPORT_FEATURE_EXPANSION
+//feature expansion instructions: 110CCCCC followed by one or two bytes, S 9.2.1
+bool DCCPacketScheduler::setFunctions13to20(DCCPacket::address_t address, DCCPacket::address_kind_t address_kind, uint8_t functions)
+{
+    DCCPacket p(address, address_kind);
+    uint8_t data[] = {0xDE, functions};
+
+    p.addData(data, 2);
+    p.setKind(FUNCTION_PACKET_4_KIND);
+    p.setRepeat(FUNCTION_REPEAT);
+    return queueCommand(p);
+}
+
+bool DCCPacketScheduler::setFunctions21to28(DCCPacket::address_t address, DCCPacket::address_kind_t address_kind, uint8_t functions)
+{
+    DCCPacket p(address, address_kind);
+    uint8_t data[] = {0xDF, functions};
+
+    p.addData(data, 2);
+    p.setKind(FUNCTION_PACKET_5_KIND);
+    p.setRepeat(FUNCTION_REPEAT);
+    return queueCommand(p);
+}
+
+bool DCCPacketScheduler::setFunctions29to68(DCCPacket::address_t address, DCCPacket::address_kind_t address_kind, uint8_t first_function, uint8_t functions)
+{
+    //F29-F36 is 0xD8, up to F61-F68 at 0xDC
+    if ((first_function < 29) || (first_function > 61) || ((first_function - 29) & 0x07))
+    {
+        return false;
+    }
+
+    DCCPacket p(address, address_kind);
+    uint8_t data[] = {(uint8_t)(0xD8 + ((first_function - 29) >> 3)), functions};
+
+    p.addData(data, 2);
+    p.setKind(FEATURE_EXPANSION_KIND);
+    p.setRepeat(FUNCTION_REPEAT);
+    return queueCommand(p);
 }
 
+bool DCCPacketScheduler::setBinaryState(DCCPacket::address_t address, DCCPacket::address_kind_t address_kind, uint16_t state, bool on)
+{
+    if (state > 0x7FFF)
+    {
+        return false;
+    }
+
+    DCCPacket p(address, address_kind);
+    uint8_t data[] = {0xDD, (uint8_t)((on ? 0x80 : 0x00) | (state & 0x7F)), (uint8_t)(state >> 7)};
+
+    //states below 128 use the short form, so each state has just one encoding for the queues to match
+    if (state < 128)
+    {
+        p.addData(data, 2);
+    }
+    else
+    {
+        data[0] = 0xC0;
+        p.addData(data, 3);
+    }
+
+    p.setKind(FEATURE_EXPANSION_KIND);
+    p.setRepeat(FUNCTION_REPEAT);
+    return queueCommand(p);
+}
+#endif // DCC_SUPPORT_FEATURE_EXPANSION
+
 
 //other cool functions to follow. Just get these working first, I think.
 
 //bool DCCPacketScheduler::setTurnout(DCCPacket::address_t address)
 //bool DCCPacketScheduler::unsetTurnout(DCCPacket::address_t address)
 
+#if DCC_SUPPORT_OPS_MODE
 bool DCCPacketScheduler::opsProgramCV(DCCPacket::address_t address, DCCPacket::address_kind_t address_kind, uint16_t CV, uint8_t CV_data)
 {
     //format of packet:
@@ -408,6 +713,55 @@ bool DCCPacketScheduler::opsProgramCV(DCCPacket::address_t address, DCCPacket::a
 
     return low_priority_queue.insertPacket(p);
 }
+#endif // DCC_SUPPORT_OPS_MODE
+
+#if DCC_SUPPORT_CONSIST
+bool DCCPacketScheduler::addToConsist(DCCPacket::address_t consist_address, DCCPacket::address_t address, DCCPacket::address_kind_t address_kind, bool reversed)
+{
+    uint16_t key = DCCPacket::packAddress(address, address_kind);
+    consist_member_t* member = findConsistMember(key);
+
+    if ((consist_address < 1) || (consist_address > 127))
+    {
+        return false;
+    }
+
+    if (!member) //not in a consist yet; find a free entry
+    {
+        member = findConsistMember(DCC_CONSIST_FREE);
+
+        if (!member)
+        {
+            return false;
+        }
+    }
+
+    uint8_t cv19 = consist_address | (reversed ? 0x80 : 0x00);
+
+    //CV19: bits 0-6 consist address, bit 7 relative direction. S 9.2.2
+    if (!opsProgramCV(address, address_kind, 19, cv19))
+    {
+        return false;
+    }
+
+    member->key = key;
+    member->cv19 = cv19;
+    return true;
+}
+
+bool DCCPacketScheduler::removeFromConsist(DCCPacket::address_t address, DCCPacket::address_kind_t address_kind)
+{
+    consist_member_t* member = findConsistMember(DCCPacket::packAddress(address, address_kind));
+
+    if (!member || !opsProgramCV(address, address_kind, 19, 0))
+    {
+        return false;
+    }
+
+    member->cv19 = 0;
+    return true;
+}
+#endif // DCC_SUPPORT_CONSIST
 
 //more specific functions
 
@@ -420,8 +774,48 @@ bool DCCPacketScheduler::eStop(void)
     e_stop_packet.addData(data, 1);
     e_stop_packet.setKind(ESTOP_PACKET_KIND);
     e_stop_packet.setRepeat(10);
+#if DCC_SUPPORT_ADAPTIVE_REPEAT
+    if (adaptive)
+    {
+        e_stop_packet.setRepeat(adaptiveRepeat(e_stop_packet));
+    }
+#endif
     e_stop_queue.insertPacket(e_stop_packet);
+#if DCC_SUPPORT_MOMENTUM
+    for (uint8_t i = 0; i < DCC_MOMENTUM_SLOTS; ++i)
+    {
+        momentum[i].key = DCC_MOMENTUM_FREE;
+    }
+#endif
+#if DCC_SUPPORT_ROUTES
+    cancelRoute();
+#endif
+#if DCC_SUPPORT_GOVERNOR
+    for (uint8_t i = 0; i < DCC_GOVERNOR_SLOTS; ++i)
+    {
+        governors[i].key = DCC_GOVERNOR_FREE; //held commands mustn't follow it out
+    }
+#endif
+#if DCC_SUPPORT_QOS
+    for (uint8_t i = 0; i < DCC_QOS_ADDRESSES; ++i)
+    {
+        service_addresses[i].speed_info = 0; //don't refresh anyone back into motion
+    }
+#endif
+#if DCC_SUPPORT_SNAPSHOT
+    for (uint8_t i = 0; i < DCC_SNAPSHOT_LOCOS; ++i)
+    {
+        if (snapshot_locos[i].record[2] & 0x01) //nor restore them into it
+        {
+            snapshot_locos[i].record[2] &= 0x3E;
+            changedLoco(snapshot_locos[i]);
+        }
+    }
+#endif
     //now, clear all other queues
+#if defined(DCC_HW_PACKET_RING)
+    dcc_hardware_flush(); //and whatever's already encoded and waiting for the ISR
+#endif
     high_priority_queue.clear();
     low_priority_queue.clear();
     repeat_queue.clear();
@@ -433,113 +827,1587 @@ bool DCCPacketScheduler::eStop(DCCPacket::address_t address, DCCPacket::address_
     // 111111111111 0 0AAAAAAA 0 01001001 0 EEEEEEEE 1
     // or
     // 111111111111 0 0AAAAAAA 0 01000001 0 EEEEEEEE 1
-    DCCPacket e_stop_packet(address, address_kind);
+    uint16_t key = DCCPacket::packAddress(address, address_kind);
+    DCCPacket::address_t stop_address = address;
+    DCCPacket::address_kind_t stop_address_kind = address_kind;
+#if DCC_SUPPORT_CONSIST
+    //members of a consist take their speed, and so their e-stop, through the consist address
+    consist_member_t* member = findConsistMember(key);
+
+    if (member)
+    {
+        stop_address = member->cv19 & 0x7F;
+        stop_address_kind = DCCPacket::DCC_SHORT_ADDRESS;
+    }
+#endif
+    DCCPacket e_stop_packet(stop_address, stop_address_kind);
     uint8_t data[] = {0x41}; //01000001
     e_stop_packet.addData(data, 1);
     e_stop_packet.setKind(ESTOP_PACKET_KIND);
     e_stop_packet.setRepeat(10);
+#if DCC_SUPPORT_ADAPTIVE_REPEAT
+    if (adaptive)
+    {
+        e_stop_packet.setRepeat(adaptiveRepeat(e_stop_packet));
+    }
+#endif
     e_stop_queue.insertPacket(e_stop_packet);
+    forgetSpeed(key);
     //now, clear this packet's address from all other queues
+#if defined(DCC_HW_PACKET_RING)
+    dcc_hardware_flush(); //the ring can't forget one address, so drop it all; refresh puts the rest back
+#endif
     high_priority_queue.forget(address, address_kind);
     low_priority_queue.forget(address, address_kind);
     repeat_queue.forget(address, address_kind);
+
+    if ((stop_address != address) || (stop_address_kind != address_kind))
+    {
+        //and the consist's, whose queued speeds would set it going again
+        forgetSpeed(DCCPacket::packAddress(stop_address, stop_address_kind));
+        high_priority_queue.forget(stop_address, stop_address_kind);
+        low_priority_queue.forget(stop_address, stop_address_kind);
+        repeat_queue.forget(stop_address, stop_address_kind);
+    }
+
+    return true;
 }
 
-bool DCCPacketScheduler::setBasicAccessory(DCCPacket::address_t address, uint8_t function)
+#if DCC_SUPPORT_QOS
+bool DCCPacketScheduler::setServiceClass(uint8_t service_class, uint16_t refresh_ms, uint8_t repeat, uint8_t priority)
 {
-    DCCPacket p(address);
-
-    uint8_t data[] = { 0x01 | ((function & 0x03) << 1) };
-    p.addData(data, 1);
-    p.setKind(BASIC_ACCESSORY_PACKET_KIND);
-    p.setRepeat(OTHER_REPEAT);
+    if ((service_class >= DCC_QOS_CLASSES) || (priority > DCC_QOS_HIGH) ||
+            ((repeat > DCC_PACKED_MAX_REPEAT) && (repeat != DCC_QOS_DEFAULT_REPEAT)))
+    {
+        return false;
+    }
 
-    return low_priority_queue.insertPacket(p);
+    service_classes[service_class].refresh_ms = refresh_ms;
+    service_classes[service_class].repeat = repeat;
+    service_classes[service_class].priority = priority;
+    return true;
 }
 
-bool DCCPacketScheduler::unsetBasicAccessory(DCCPacket::address_t address, uint8_t function)
+bool DCCPacketScheduler::setAddressClass(DCCPacket::address_t address, DCCPacket::address_kind_t address_kind, uint8_t service_class)
 {
-    DCCPacket p(address);
+    if (service_class >= DCC_QOS_CLASSES)
+    {
+        return false;
+    }
 
-    uint8_t data[] = { ((function & 0x03) << 1) };
-    p.addData(data, 1);
-    p.setKind(BASIC_ACCESSORY_PACKET_KIND);
-    p.setRepeat(OTHER_REPEAT);
+    uint16_t key = DCCPacket::packAddress(address, address_kind);
+    service_address_t* s = findServiceAddress(key);
 
-    return low_priority_queue.insertPacket(p);
+    if (!s)
+    {
+        if (!service_class)
+        {
+            return true; //already in class 0
+        }
+
+        s = findServiceAddress(DCC_QOS_FREE);
+
+        if (!s)
+        {
+            return false;
+        }
+
+        s->key = key;
+        s->speed_info = 0;
+    }
+
+    s->service_class = service_class; //0 frees the entry
+    return true;
 }
+#endif // DCC_SUPPORT_QOS
 
+#if DCC_SUPPORT_ADAPTIVE_REPEAT
+void DCCPacketScheduler::setAdaptiveRepeat(bool on)
+{
+    adaptive = on;
+}
 
-//to be called periodically within loop()
-void DCCPacketScheduler::update(void) //checks queues, puts whatever's pending on the rails via global current_packet. easy-peasy
+void DCCPacketScheduler::setTrackLoss(uint16_t permille)
 {
-    //TODO ADD POM QUEUE?
-    if (dcc_hardware_need_packet()) //if the ISR needs a packet:
-    {
-        DCCPacket p;
+    track_loss = ((permille > 1000) ? 1000 : permille) << 4;
+}
 
-        //Take from e_stop queue first, then high priority queue.
-        //every fifth packet will come from low priority queue.
-        //every 20th packet will come from periodic refresh queue. (Why 20? because. TODO reasoning)
-        //if there's a packet ready, and the counter is not divisible by 5
-        //first, we need to know which queues have packets ready, and the state of the this->packet_counter.
-        if (!e_stop_queue.isEmpty())   //if there's an e_stop packet, send it now!
+//a running average, for the track and for the loco if it has an entry or there's one free
+void DCCPacketScheduler::reportDelivery(DCCPacket::address_t address, DCCPacket::address_kind_t address_kind, bool arrived)
+{
+    uint16_t key = DCCPacket::packAddress(address, address_kind);
+    int32_t sample = arrived ? 0 : (1000L << 4);
+    delivery_t* d = 0;
+
+    track_loss += (sample - (int32_t)track_loss) / (1 << DCC_ADAPTIVE_SHIFT);
+
+    for (uint8_t i = 0; i < DCC_ADAPTIVE_ADDRESSES; ++i)
+    {
+        if (deliveries[i].key == key)
         {
-            //e_stop
-            e_stop_queue.readPacket(p); //nothing more to do. e_stop_queue is a repeat_queue, so automatically repeats where necessary.
+            d = &deliveries[i];
+            break;
         }
-        else
-        {
-            bool doHigh = high_priority_queue.notEmpty() && high_priority_queue.notRepeat(last_packet_address);
-            bool doLow = low_priority_queue.notEmpty() && low_priority_queue.notRepeat(last_packet_address) &&
-                         !((packet_counter % LOW_PRIORITY_INTERVAL) && doHigh);
-            bool doRepeat = repeat_queue.notEmpty() && repeat_queue.notRepeat(last_packet_address) &&
-                            !((packet_counter % REPEAT_INTERVAL) && (doHigh || doLow));
-
-            //bool doRefresh = periodic_refresh_queue.notEmpty() && periodic_refresh_queue.notRepeat(last_packet_address) &&
-            //            !((packet_counter % PERIODIC_REFRESH_INTERVAL) && (doHigh || doLow || doRepeat));
-            //examine queues in order from lowest priority to highest.
-            //if(doRefresh)
-            //{
-            //  periodic_refresh_queue.readPacket(p);
-            //  ++packet_counter;
-            //}
-            //else if(doRepeat)
-            if (doHigh)
-            {
-                high_priority_queue.readPacket(p);
-                ++packet_counter;
-            }
-            else if (doLow)
-            {
-                low_priority_queue.readPacket(p);
-                ++packet_counter;
-            }
-            else if (doRepeat)
-            {
-                repeat_queue.readPacket(p);
-                ++packet_counter;
-            }
 
-            //if none of these conditions hold, DCCPackets initialize to the idle packet, so that's what'll get sent.
-            //++packet_counter; //it's a byte; let it overflow, that's OK.
-            //enqueue the packet for repitition, if necessary:
-            repeatPacket(p);
+        if (!d && (deliveries[i].key == DCC_ADAPTIVE_FREE))
+        {
+            d = &deliveries[i];
         }
+    }
 
-        last_packet_address = p.getAddress(); //remember the address to compare with the next packet
-        uint8_t buffer[DCC_PACKET_MAX_LEN];
-        size_t count = p.getBitstream(buffer);
+    if (!d)
+    {
+        return;
+    }
 
-        dcc_hardware_supply_packet(buffer, count); //feed to the starving ISR.
+    if (d->key != key) //a new one starts from the track's loss
+    {
+        d->key = key;
+        d->loss = track_loss;
     }
+
+    d->loss += (sample - (int32_t)d->loss) / (1 << DCC_ADAPTIVE_SHIFT);
 }
 
-/****************************************************************************
- * Private Functions
- ****************************************************************************/
+uint16_t DCCPacketScheduler::getLoss(DCCPacket::address_t address, DCCPacket::address_kind_t address_kind)
+{
+    uint16_t key = DCCPacket::packAddress(address, address_kind);
 
-/* None */
+    for (uint8_t i = 0; i < DCC_ADAPTIVE_ADDRESSES; ++i)
+    {
+        if (deliveries[i].key == key)
+        {
+            return deliveries[i].loss >> 4;
+        }
+    }
+
+    return track_loss >> 4;
+}
+#endif // DCC_SUPPORT_ADAPTIVE_REPEAT
+
+#if DCC_SUPPORT_GOVERNOR
+void DCCPacketScheduler::setGovernor(uint16_t window_ms)
+{
+    governor_ms = window_ms; //anything held goes at the next update()
+}
+#endif
+
+#if DCC_SUPPORT_FAIR_QUEUES
+void DCCPacketScheduler::setFairQueues(bool on)
+{
+    low_priority_queue.setFair(on);
+    repeat_queue.setFair(on);
+}
+#endif
+
+#if DCC_SUPPORT_REPEAT_SPACING
+void DCCPacketScheduler::setRepeatSpacing(uint8_t gap, uint8_t backoff)
+{
+    e_stop_queue.setSpacing(gap, backoff);
+    repeat_queue.setSpacing(gap, backoff);
+}
+#endif
+
+#if DCC_SUPPORT_ACCESSORY
+bool DCCPacketScheduler::setBasicAccessory(DCCPacket::address_t address, uint8_t function, bool force)
+{
+    return sendBasicAccessory(address, function, true, force);
+}
+
+bool DCCPacketScheduler::unsetBasicAccessory(DCCPacket::address_t address, uint8_t function, bool force)
+{
+    return sendBasicAccessory(address, function, false, force);
+}
+
+bool DCCPacketScheduler::setExtendedAccessory(DCCPacket::address_t address, uint8_t aspect)
+{
+    DCCPacket p(address);
+
+    uint8_t data[] = { aspect };
+    p.addData(data, 1);
+    p.setKind(EXTENDED_ACCESSORY_PACKET_KIND);
+    p.setRepeat(OTHER_REPEAT);
+
+    return low_priority_queue.insertPacket(p);
+}
+#endif // DCC_SUPPORT_ACCESSORY
+
+#if DCC_SUPPORT_ACCESSORY_CACHE
+void DCCPacketScheduler::setAccessoryCache(bool suppress)
+{
+    accessory_suppress = suppress;
+}
+
+void DCCPacketScheduler::clearAccessoryCache(void)
+{
+    for (uint16_t i = 0; i < DCC_ACCESSORY_CACHE_BYTES; ++i)
+    {
+        accessory_known[i] = 0;
+    }
+}
+#endif // DCC_SUPPORT_ACCESSORY_CACHE
+
+#if DCC_SUPPORT_ROUTES
+bool DCCPacketScheduler::setRoute(const uint16_t* entries, uint8_t count)
+{
+    if (getRouteRemaining())
+    {
+        return false;
+    }
+
+    route = entries;
+    route_count = count;
+    route_next = 0;
+    route_last_ms = millis() - DCC_ROUTE_INTERVAL_MS; //first turnout can go straight away
+    return true;
+}
+
+void DCCPacketScheduler::cancelRoute(void)
+{
+    route_count = 0;
+    route_next = 0;
+}
+#endif // DCC_SUPPORT_ROUTES
+
+#if DCC_SUPPORT_TIMERS
+dcc_timer_t DCCPacketScheduler::schedulePacket(const DCCPacket& packet, uint16_t delay, uint16_t period)
+{
+    return timers.add(packet, timer_clock, delay, period);
+}
+
+bool DCCPacketScheduler::cancelTimer(dcc_timer_t timer)
+{
+    return timers.cancel(timer);
+}
+
+#if DCC_SUPPORT_ACCESSORY
+dcc_timer_t DCCPacketScheduler::pulseBasicAccessory(DCCPacket::address_t address, uint8_t function, uint16_t duration)
+{
+    DCCPacket p(address);
+
+    uint8_t data[] = { (uint8_t)((function & 0x03) << 1) };
+    p.addData(data, 1);
+    p.setKind(BASIC_ACCESSORY_PACKET_KIND);
+    p.setRepeat(OTHER_REPEAT);
+
+    //take the timer first, so a coil is never left switched on with nothing to switch it off
+    dcc_timer_t timer = timers.add(p, timer_clock, duration, 0);
+
+    if ((timer != DCC_TIMER_NONE) && !setBasicAccessory(address, function, true))
+    {
+        timers.cancel(timer);
+        timer = DCC_TIMER_NONE;
+    }
+#if DCC_SUPPORT_ACCESSORY_CACHE
+    else if (timer != DCC_TIMER_NONE)
+    {
+        //the cache holds where the output ends up, which is unset
+        uint16_t output = ((address & 0x1FF) << 2) | (function & 0x03);
+        accessory_state[output >> 3] &= ~(1 << (output & 0x07));
+    }
+#endif
+
+    return timer;
+}
+#endif // DCC_SUPPORT_ACCESSORY
+#endif // DCC_SUPPORT_TIMERS
+
+
+#if DCC_SUPPORT_SNAPSHOT
+bool DCCPacketScheduler::restoreSnapshot(void)
+{
+    if (snapshot_wipe)
+    {
+        return false;
+    }
+
+    //each loco is the newest of its records that checks out
+    for (uint8_t i = 0; i < DCC_SNAPSHOT_LOCOS; ++i)
+    {
+        snapshot_loco_t& l = snapshot_locos[i];
+        uint16_t length;
+        uint16_t start = snapshotUnit(1 + i, length);
+        bool found = false;
+
+        for (uint8_t c = 0; c < DCC_SNAPSHOT_COPIES; ++c)
+        {
+            uint16_t offset = start + (c * DCC_SNAPSHOT_RECORD_LEN);
+            uint8_t record[DCC_SNAPSHOT_DATA_LEN];
+            uint8_t check = 0x5A;
+
+            for (uint8_t b = 0; b < DCC_SNAPSHOT_DATA_LEN; ++b)
+            {
+                record[b] = dcc_storage_read(offset + b);
+                check ^= record[b];
+            }
+
+            uint8_t seq = dcc_storage_read(offset + DCC_SNAPSHOT_DATA_LEN + 1);
+
+            if (((check ^ seq) != dcc_storage_read(offset + DCC_SNAPSHOT_DATA_LEN)) ||
+                    ((record[0] & record[1]) == 0xFF) || (found && ((int8_t)(seq - l.seq) <= 0)))
+            {
+                continue;
+            }
+
+            for (uint8_t b = 0; b < DCC_SNAPSHOT_DATA_LEN; ++b)
+            {
+                l.record[b] = record[b];
+            }
+
+            l.copy = c;
+            l.seq = seq;
+            found = true;
+        }
+    }
+
+#if DCC_SUPPORT_CONSIST
+    //CV19 lives in the decoders, so only the table needs to come back
+    uint16_t length;
+    uint16_t start = snapshotUnit(DCC_SNAPSHOT_LOCOS + 1, length);
+    uint8_t check = 0x5A;
+
+    for (uint16_t i = 0; i < (length - 1); ++i)
+    {
+        check ^= dcc_storage_read(start + i);
+    }
+
+    if (check == dcc_storage_read(start + length - 1))
+    {
+        for (uint8_t i = 0; i < DCC_CONSIST_MEMBERS; ++i)
+        {
+            consist_members[i].key = dcc_storage_read(start + (i * 3)) | (dcc_storage_read(start + (i * 3) + 1) << 8);
+            consist_members[i].cv19 = dcc_storage_read(start + (i * 3) + 2);
+        }
+    }
+#endif
+
+#if DCC_SUPPORT_ACCESSORY_CACHE
+    //turnouts stay where they were through a power cut, so they aren't resent. a cache that was
+    //part way through being written would have outputs known in states they were never sent in.
+    uint16_t cache_length;
+    uint16_t cache_start = snapshotUnit(DCC_SNAPSHOT_LOCOS + 2, cache_length);
+    uint8_t cache_check = 0x5A;
+
+    for (uint16_t i = 0; i < (cache_length - 1); ++i)
+    {
+        cache_check ^= dcc_storage_read(cache_start + i);
+    }
+
+    if (cache_check == dcc_storage_read(cache_start + cache_length - 1))
+    {
+        for (uint16_t i = 0; i < DCC_ACCESSORY_CACHE_BYTES; ++i)
+        {
+            accessory_known[i] = dcc_storage_read(cache_start + i);
+            accessory_state[i] = dcc_storage_read(cache_start + DCC_ACCESSORY_CACHE_BYTES + i);
+        }
+    }
+#endif
+
+    snapshot_restore = 0;
+    return true;
+}
+#endif // DCC_SUPPORT_SNAPSHOT
+
+#if DCC_SUPPORT_BANDWIDTH
+uint32_t DCCPacketScheduler::predictRefreshInterval(uint8_t extra_locos, uint8_t route_length)
+{
+    //the queues go out back to back, so the last packet waits for all of them
+    uint32_t total = e_stop_queue.getWireTime() + high_priority_queue.getWireTime() +
+                     low_priority_queue.getWireTime() + repeat_queue.getWireTime();
+
+    //new packets are taken to be all zeros: a 128 step speed to a long address, and a basic accessory
+    uint8_t zeros[DCC_PACKET_MAX_LEN] = {0};
+    uint8_t speed_repeat = SPEED_REPEAT;
+    uint8_t other_repeat = OTHER_REPEAT;
+#if DCC_SUPPORT_ADAPTIVE_REPEAT
+    if (adaptive)
+    {
+        speed_repeat = lossRepeat(track_loss >> 4, SPEED_PACKET_KIND);
+        other_repeat = lossRepeat(track_loss >> 4, BASIC_ACCESSORY_PACKET_KIND);
+    }
+#endif
+    total += DCCPacket::getWireTime(zeros, 5) * (1 + speed_repeat) * extra_locos;
+    total += DCCPacket::getWireTime(zeros, 3) * (1 + other_repeat) * route_length;
+
+    //one address is never sent twice running, so if it has more than half of what's to go, the
+    //rest can't fill in between its packets and idles do. e-stops don't wait for that.
+    DCCPacketQueue* queues[] = { &high_priority_queue, &low_priority_queue, &repeat_queue };
+    uint16_t all = ((1 + speed_repeat) * extra_locos) + ((1 + other_repeat) * route_length);
+    uint16_t most = extra_locos ? (1 + speed_repeat) : 0;
+
+    for (uint8_t q = 0; q < 3; ++q)
+    {
+        for (uint8_t i = queues[q]->head; i != DCC_POOL_NONE; i = dcc_packet_pool.next[i])
+        {
+            uint16_t copies = queuedCopies(dcc_packet_pool.packed_address[i]);
+
+            all += 1 + (dcc_packet_pool.packed_info[i] & DCC_PACKED_REPEAT_MASK);
+            most = (copies > most) ? copies : most;
+        }
+    }
+
+    if ((2 * most) > (all + 1))
+    {
+        uint8_t idle[] = { 0xFF, 0x00, 0xFF };
+        total += DCCPacket::getWireTime(idle, 3) * ((2 * most) - all - 1);
+    }
+
+    //and anything to go waits for what the rails already have: the last packet given them, or
+    //with DCC_HW_PACKET_RING up to a ring of them
+    if (total)
+    {
+#if defined(DCC_HW_PACKET_RING)
+        total += wire_last * DCC_HW_PACKET_RING_SIZE;
+#else
+        total += wire_last;
+#endif
+    }
+
+    total = (total + 999) / 1000;
+
+#if DCC_SUPPORT_ROUTES
+    //and setRoute() won't throw them any faster than this
+    if (route_length && (total < ((uint32_t)(route_length - 1) * DCC_ROUTE_INTERVAL_MS)))
+    {
+        total = (uint32_t)(route_length - 1) * DCC_ROUTE_INTERVAL_MS;
+    }
+#endif
+
+    return total;
+}
+
+//packets still to go to the address at key from the high priority, low priority and repeat queues, with their repeats
+uint16_t DCCPacketScheduler::queuedCopies(uint16_t key)
+{
+    DCCPacketQueue* queues[] = { &high_priority_queue, &low_priority_queue, &repeat_queue };
+    uint16_t copies = 0;
+
+    for (uint8_t q = 0; q < 3; ++q)
+    {
+        for (uint8_t i = queues[q]->head; i != DCC_POOL_NONE; i = dcc_packet_pool.next[i])
+        {
+            if (((dcc_packet_pool.packed_address[i] ^ key) & DCC_PACKED_ADDRESS_MASK) == 0)
+            {
+                copies += 1 + (dcc_packet_pool.packed_info[i] & DCC_PACKED_REPEAT_MASK);
+            }
+        }
+    }
+
+    return copies;
+}
+#endif // DCC_SUPPORT_BANDWIDTH
+
+bool DCCPacketScheduler::visitQueues(dcc_queue_visitor_t visitor, void* context)
+{
+    DCCPacketQueue* queues[] = { &e_stop_queue, &high_priority_queue, &low_priority_queue, &repeat_queue };
+    uint8_t before[4];
+    bool steady = true;
+
+    for (uint8_t i = 0; i < 4; ++i)
+    {
+        before[i] = queues[i]->changes;
+    }
+
+    DCC_QUEUE_BARRIER();
+
+    //DCC_QUEUE_E_STOP to DCC_QUEUE_REPEAT are the queues in this order
+    for (uint8_t i = 0; (i < 4) && steady; ++i)
+    {
+        steady = queues[i]->visit(visitor, context, i);
+    }
+
+    DCC_QUEUE_BARRIER();
+
+    for (uint8_t i = 0; i < 4; ++i)
+    {
+        if (queues[i]->changes != before[i])
+        {
+            steady = false;
+        }
+    }
+
+    return steady;
+}
+
+//to be called periodically within loop()
+void DCCPacketScheduler::update(void) //checks queues, puts whatever's pending on the rails via global current_packet. easy-peasy
+{
+    //TODO ADD POM QUEUE?
+#if DCC_SUPPORT_MOMENTUM
+    updateMomentum();
+#endif
+#if DCC_SUPPORT_ROUTES
+    updateRoute();
+#endif
+#if DCC_SUPPORT_QOS
+    updateRefresh();
+#endif
+#if DCC_SUPPORT_GOVERNOR
+    updateGovernor();
+#endif
+#if DCC_SUPPORT_SNAPSHOT
+    //after a restore, resend one loco each time round until they've all been queued
+    if ((snapshot_restore < DCC_SNAPSHOT_LOCOS) && resendLoco(snapshot_locos[snapshot_restore]))
+    {
+        ++snapshot_restore;
+    }
+
+    updateSnapshot();
+#endif
+#if DCC_SUPPORT_TIMERS
+    updateTimers();
+#endif
+
+    //with DCC_HW_PACKET_RING the ISR can take several packets, so keep
+    //supplying until it's full. Otherwise this runs at most once.
+    while (dcc_hardware_need_packet()) //if the ISR needs a packet:
+    {
+        DCCPacket p;
+
+        //Take from e_stop queue first, then high priority queue.
+        //every fifth packet will come from low priority queue.
+        //every 20th packet will come from periodic refresh queue. (Why 20? because. TODO reasoning)
+        //if there's a packet ready, and the counter is not divisible by 5
+        //first, we need to know which queues have packets ready, and the state of the this->packet_counter.
+        if (e_stop_queue.isDue(DCC_QUEUE_ANY_ADDRESS))   //if there's an e_stop packet, send it now!
+        {
+            //e_stop
+            e_stop_queue.readPacket(p); //nothing more to do. e_stop_queue is a repeat_queue, so automatically repeats where necessary.
+        }
+        else
+        {
+            bool doHigh = high_priority_queue.notEmpty() && high_priority_queue.notRepeat(last_packet_address);
+            bool doLow = low_priority_queue.notEmpty() && low_priority_queue.notRepeat(last_packet_address) &&
+                         !((packet_counter % LOW_PRIORITY_INTERVAL) && doHigh);
+            bool doRepeat = repeat_queue.isDue(last_packet_address) &&
+                            !((packet_counter % REPEAT_INTERVAL) && (doHigh || doLow));
+
+            //bool doRefresh = periodic_refresh_queue.notEmpty() && periodic_refresh_queue.notRepeat(last_packet_address) &&
+            //            !((packet_counter % PERIODIC_REFRESH_INTERVAL) && (doHigh || doLow || doRepeat));
+            //examine queues in order from lowest priority to highest.
+            //if(doRefresh)
+            //{
+            //  periodic_refresh_queue.readPacket(p);
+            //  ++packet_counter;
+            //}
+            //else if(doRepeat)
+            if (doHigh)
+            {
+                high_priority_queue.readPacket(p);
+                ++packet_counter;
+            }
+            else if (doLow)
+            {
+                low_priority_queue.readPacket(p);
+                ++packet_counter;
+            }
+            else if (doRepeat)
+            {
+                repeat_queue.readPacket(p);
+                ++packet_counter;
+            }
+
+            //if none of these conditions hold, DCCPackets initialize to the idle packet, so that's what'll get sent.
+            //++packet_counter; //it's a byte; let it overflow, that's OK.
+            //enqueue the packet for repitition, if necessary. one from the repeat_queue has
+            //already been put back there, and mustn't lose its place or its spacing.
+            if (doHigh || doLow)
+            {
+#if DCC_SUPPORT_ADAPTIVE_REPEAT
+                //its first time on the rails, so it's told now how many more times to go
+                if (adaptive)
+                {
+                    p.setRepeat(adaptiveRepeat(p));
+                }
+#endif
+
+                repeatPacket(p);
+            }
+        }
+
+        last_packet_address = p.getAddress(); //remember the address to compare with the next packet
+        uint8_t buffer[DCC_PACKET_MAX_LEN];
+        size_t count = p.getBitstream(buffer);
+
+        if (!count) //couldn't encode it, so it's lost; try again next time round
+        {
+            break;
+        }
+
+        dcc_hardware_supply_packet(buffer, count); //feed to the starving ISR.
+#if DCC_SUPPORT_REPEAT_SPACING
+        ++dcc_packet_pool.clock; //spaced repeats wait on this
+#endif
+#if DCC_SUPPORT_BANDWIDTH
+        uint32_t wire_time = DCCPacket::getWireTime(buffer, count);
+
+        wire_last = wire_time;
+        wire_total += wire_time;
+
+        if (p.getKind() != IDLE_PACKET_KIND)
+        {
+            wire_busy += wire_time;
+        }
+
+        if (wire_total >= DCC_BANDWIDTH_WINDOW_US)
+        {
+            utilization = (wire_busy * 1000) / wire_total;
+            wire_total = 0;
+            wire_busy = 0;
+        }
+#endif
+#if DCC_SUPPORT_TIMERS
+        ++timer_clock;
+#endif
+    }
+}
+
+/****************************************************************************
+ * Private Functions
+ ****************************************************************************/
+
+//speeds go in the high priority queue and functions in the low, unless the address's service class says otherwise
+bool DCCPacketScheduler::queueCommand(DCCPacket& p)
+{
+    uint16_t key = DCCPacket::packAddress(p.getAddress(), (DCCPacket::address_kind_t)p.getAddressKind());
+    bool high = commandIsHigh(key, p.getKind());
+#if DCC_SUPPORT_QOS
+    service_address_t* s = findServiceAddress(key);
+    const service_class_t& c = service_classes[s ? s->service_class : 0];
+
+    if (c.repeat != DCC_QOS_DEFAULT_REPEAT)
+    {
+        p.setRepeat(c.repeat);
+    }
+
+    if (s && (p.getKind() == SPEED_PACKET_KIND)) //remember it for updateRefresh()
+    {
+        p.pack(s->speed_address, s->speed_data, s->speed_info);
+        s->last_ms = millis();
+    }
+#endif
+#if DCC_SUPPORT_SNAPSHOT
+    recordLoco(p);
+#endif
+#if DCC_SUPPORT_GOVERNOR
+    if (!governCommand(p, high))
+    {
+        return true; //held, to go out when its window ends
+    }
+#endif
+    return high ? high_priority_queue.insertPacket(p) : low_priority_queue.insertPacket(p);
+}
+
+//speeds go in the high priority queue and everything else in the low, unless the service class
+//of the loco at key says otherwise
+bool DCCPacketScheduler::commandIsHigh(uint16_t key, uint8_t kind)
+{
+#if DCC_SUPPORT_QOS
+    service_address_t* s = findServiceAddress(key);
+    uint8_t priority = service_classes[s ? s->service_class : 0].priority;
+
+    if (priority != DCC_QOS_NORMAL)
+    {
+        return priority == DCC_QOS_HIGH;
+    }
+#else
+    (void)key;
+#endif
+
+    return kind == SPEED_PACKET_KIND;
+}
+
+//after an e-stop, so nothing ramps, releases, refreshes or restores the loco at key back into motion
+void DCCPacketScheduler::forgetSpeed(uint16_t key)
+{
+#if DCC_SUPPORT_MOMENTUM
+    momentum_t* m = findMomentum(key);
+
+    if (m)
+    {
+        m->key = DCC_MOMENTUM_FREE;
+    }
+#endif
+#if DCC_SUPPORT_GOVERNOR
+    forgetGoverned(key);
+#endif
+#if DCC_SUPPORT_QOS
+    service_address_t* s = findServiceAddress(key);
+
+    if (s)
+    {
+        s->speed_info = 0;
+    }
+#endif
+#if DCC_SUPPORT_SNAPSHOT
+    snapshot_loco_t* l = findSnapshotLoco(key);
+
+    if (l && (l->record[2] & 0x01))
+    {
+        l->record[2] &= 0x3E;
+        changedLoco(*l);
+    }
+#endif
+}
+
+#if DCC_SUPPORT_GOVERNOR
+//true if p should be queued now; false if it's been held for updateGovernor() to send later
+bool DCCPacketScheduler::governCommand(const DCCPacket& p, bool high)
+{
+    uint8_t kind = p.getKind();
+
+    if (!governor_ms || ((kind != SPEED_PACKET_KIND) && (kind != FUNCTION_PACKET_1_KIND) && (kind != FUNCTION_PACKET_2_KIND) &&
+                         (kind != FUNCTION_PACKET_3_KIND) && (kind != FUNCTION_PACKET_4_KIND) && (kind != FUNCTION_PACKET_5_KIND)))
+    {
+        return true;
+    }
+
+    uint16_t key = DCCPacket::packAddress(p.getAddress(), (DCCPacket::address_kind_t)p.getAddressKind());
+    uint16_t now = millis();
+    uint16_t address;
+    uint8_t data[DCC_PACKED_DATA_LEN];
+    uint8_t info;
+    uint8_t direction = 0;
+    bool urgent = false;
+    governor_t* g = 0;
+
+    p.pack(address, data, info);
+
+    if (kind == SPEED_PACKET_KIND)
+    {
+        if (data[0] == 0x3F) //128 steps: 00111111 DSSSSSSS
+        {
+            direction = data[1] & 0x80;
+            urgent = (data[1] & 0x7F) <= 1; //stop or e-stop
+        }
+        else //14 or 28 steps: 01DCSSSS
+        {
+            direction = data[0] & 0x20;
+            urgent = (data[0] & 0x0F) <= 1;
+        }
+    }
+
+    for (uint8_t i = 0; (i < DCC_GOVERNOR_SLOTS) && !g; ++i)
+    {
+        if ((governors[i].key == key) && (governors[i].kind == kind))
+        {
+            g = &governors[i];
+        }
+    }
+
+    if (!g)
+    {
+        //nothing sent for it lately, so it goes now and starts a window, if there's room to keep track
+        for (uint8_t i = 0; (i < DCC_GOVERNOR_SLOTS) && !g; ++i)
+        {
+            if (governors[i].key == DCC_GOVERNOR_FREE)
+            {
+                g = &governors[i];
+                g->key = key;
+                g->kind = kind;
+                g->direction = direction;
+                g->sent_ms = now;
+                g->held_info = 0;
+            }
+        }
+
+        return true;
+    }
+
+    if (urgent || (direction != g->direction) || ((uint16_t)(now - g->sent_ms) >= governor_ms))
+    {
+        if (g->held_info) //this one supersedes it
+        {
+            g->held_info = 0;
+            ++governor_coalesced;
+        }
+
+        g->direction = direction;
+        g->sent_ms = now;
+        return true;
+    }
+
+    if (g->held_info)
+    {
+        ++governor_coalesced;
+    }
+
+    g->held_address = address;
+    g->held_data[0] = data[0];
+    g->held_data[1] = data[1];
+    g->held_data[2] = data[2];
+    g->held_info = info;
+    g->held_high = high;
+    return false;
+}
+
+void DCCPacketScheduler::forgetGoverned(uint16_t key)
+{
+    for (uint8_t i = 0; i < DCC_GOVERNOR_SLOTS; ++i)
+    {
+        if (governors[i].key == key)
+        {
+            governors[i].key = DCC_GOVERNOR_FREE;
+        }
+    }
+}
+
+//sends whatever has been held to the end of its window, and lets go of locos whose window has passed quietly
+void DCCPacketScheduler::updateGovernor(void)
+{
+    uint16_t now = millis();
+
+    for (uint8_t i = 0; i < DCC_GOVERNOR_SLOTS; ++i)
+    {
+        governor_t& g = governors[i];
+
+        if ((g.key == DCC_GOVERNOR_FREE) || ((uint16_t)(now - g.sent_ms) < governor_ms))
+        {
+            continue;
+        }
+
+        if (!g.held_info)
+        {
+            g.key = DCC_GOVERNOR_FREE;
+            continue;
+        }
+
+        DCCPacket p;
+        p.unpack(g.held_address, g.held_data, g.held_info);
+
+        if (g.held_high ? high_priority_queue.insertPacket(p) : low_priority_queue.insertPacket(p))
+        {
+            g.held_info = 0;
+            g.sent_ms = now; //and a new window begins
+            ++governor_deferred;
+        }
+    }
+}
+#endif // DCC_SUPPORT_GOVERNOR
+
+#if DCC_SUPPORT_MOMENTUM
+DCCPacketScheduler::momentum_t* DCCPacketScheduler::findMomentum(uint16_t key)
+{
+    for (uint8_t i = 0; i < DCC_MOMENTUM_SLOTS; ++i)
+    {
+        if (momentum[i].key == key)
+        {
+            return &momentum[i];
+        }
+    }
+
+    return 0;
+}
+
+//the loco's slot, or failing that a free one or one that has finished its ramp, which
+//starts out stopped in new_speed's direction as we don't know how fast the loco is going.
+//0 if every slot is ramping.
+DCCPacketScheduler::momentum_t* DCCPacketScheduler::takeMomentum(uint16_t key, int8_t new_speed)
+{
+    momentum_t* m = findMomentum(key);
+
+    if (m)
+    {
+        return m;
+    }
+
+    for (uint8_t i = 0; (i < DCC_MOMENTUM_SLOTS) && !m; ++i)
+    {
+        if (momentum[i].key == DCC_MOMENTUM_FREE)
+        {
+            m = &momentum[i];
+        }
+    }
+
+    for (uint8_t i = 0; (i < DCC_MOMENTUM_SLOTS) && !m; ++i)
+    {
+        if (momentum[i].current == momentum[i].target)
+        {
+            m = &momentum[i];
+        }
+    }
+
+    if (m)
+    {
+        m->key = key;
+        m->current = (new_speed < 0) ? -1 : 1;
+        m->target = m->current;
+    }
+
+    return m;
+}
+
+//moves at most one ramping loco on by however many steps are due, and sends its new speed.
+//speeds are handled as [-126,126] with 0 = stop, so a ramp can pass through stop into reverse.
+void DCCPacketScheduler::updateMomentum(void)
+{
+    uint16_t now = millis();
+
+    for (uint8_t n = 0; n < DCC_MOMENTUM_SLOTS; ++n)
+    {
+        momentum_t& m = momentum[momentum_next];
+        momentum_next = (momentum_next + 1) % DCC_MOMENTUM_SLOTS;
+
+        if ((m.key == DCC_MOMENTUM_FREE) || (m.current == m.target))
+        {
+            continue;
+        }
+
+        uint16_t elapsed = now - m.last_ms;
+
+        if (elapsed < m.interval)
+        {
+            continue;
+        }
+
+        //only feed the loco's speed queue while it's within its reservation, so ramps never
+        //crowd out commands from the throttles. Queued speed packets for the same loco replace
+        //each other, so a slow track just means bigger steps.
+        if (commandIsHigh(m.key, SPEED_PACKET_KIND) ? (high_priority_queue.written >= HIGH_PRIORITY_QUEUE_RESERVE) :
+                (low_priority_queue.written >= LOW_PRIORITY_QUEUE_RESERVE))
+        {
+            continue;
+        }
+
+        uint16_t delta = elapsed / m.interval;
+        int16_t current = (m.current > 0) ? (m.current - 1) : (m.current + 1);
+        int16_t target = (m.target > 0) ? (m.target - 1) : (m.target + 1);
+
+        m.last_ms += delta * m.interval;
+
+        if (target > current)
+        {
+            current = ((target - current) > delta) ? (current + delta) : target;
+        }
+        else
+        {
+            current = ((current - target) > delta) ? (current - delta) : target;
+        }
+
+        if (current == 0) //stopped; keep the direction we're heading in
+        {
+            m.current = (m.target > 0) ? 1 : -1;
+        }
+        else
+        {
+            m.current = (current > 0) ? (current + 1) : (current - 1);
+        }
+
+        sendSpeed(DCCPacket::unpackAddress(m.key), DCCPacket::unpackAddressKind(m.key), m.current, m.steps);
+        return;
+    }
+}
+#endif // DCC_SUPPORT_MOMENTUM
+
+#if DCC_SUPPORT_ROUTES
+//sends the next turnout of the route once DCC_ROUTE_INTERVAL_MS has passed since the last
+//one, and only while the low priority queue is within its reservation.
+void DCCPacketScheduler::updateRoute(void)
+{
+#if DCC_SUPPORT_ACCESSORY_CACHE
+    //turnouts the cache would drop never reach the rails, so don't wait between them
+    while (getRouteRemaining())
+    {
+        uint16_t entry = pgm_read_word(&route[route_next]);
+
+        if (!accessoryUnchanged(entry >> 3, entry >> 1, entry & 0x01))
+        {
+            break;
+        }
+
+        ++route_next;
+    }
+#endif
+
+    if (!getRouteRemaining() || (low_priority_queue.written >= LOW_PRIORITY_QUEUE_RESERVE))
+    {
+        return;
+    }
+
+    uint16_t now = millis();
+
+    if ((uint16_t)(now - route_last_ms) < DCC_ROUTE_INTERVAL_MS)
+    {
+        return;
+    }
+
+    uint16_t entry = pgm_read_word(&route[route_next]);
+    bool ok;
+
+    if (entry & 0x01)
+    {
+        ok = setBasicAccessory(entry >> 3, entry >> 1);
+    }
+    else
+    {
+        ok = unsetBasicAccessory(entry >> 3, entry >> 1);
+    }
+
+    if (ok)
+    {
+        ++route_next;
+        route_last_ms = now;
+    }
+}
+#endif // DCC_SUPPORT_ROUTES
+
+#if DCC_SUPPORT_ACCESSORY
+bool DCCPacketScheduler::sendBasicAccessory(DCCPacket::address_t address, uint8_t function, bool on, bool force)
+{
+#if DCC_SUPPORT_ACCESSORY_CACHE
+    if (!force && accessoryUnchanged(address, function, on))
+    {
+        return true; //already there
+    }
+
+    uint16_t output = ((address & 0x1FF) << 2) | (function & 0x03);
+    uint8_t mask = 1 << (output & 0x07);
+#else
+    (void)force;
+#endif
+
+    DCCPacket p(address);
+
+    uint8_t data[] = { (uint8_t)((on ? 0x01 : 0x00) | ((function & 0x03) << 1)) };
+    p.addData(data, 1);
+    p.setKind(BASIC_ACCESSORY_PACKET_KIND);
+    p.setRepeat(OTHER_REPEAT);
+
+    if (!low_priority_queue.insertPacket(p))
+    {
+        return false;
+    }
+
+#if DCC_SUPPORT_ACCESSORY_CACHE
+    accessory_known[output >> 3] |= mask;
+
+    if (on)
+    {
+        accessory_state[output >> 3] |= mask;
+    }
+    else
+    {
+        accessory_state[output >> 3] &= ~mask;
+    }
+#endif
+    return true;
+}
+#endif // DCC_SUPPORT_ACCESSORY
+
+#if DCC_SUPPORT_ACCESSORY_CACHE
+//true if setAccessoryCache(true) is on and the output was last sent in this state
+bool DCCPacketScheduler::accessoryUnchanged(DCCPacket::address_t address, uint8_t function, bool on) const
+{
+    uint16_t output = ((address & 0x1FF) << 2) | (function & 0x03);
+    uint8_t mask = 1 << (output & 0x07);
+    bool known = accessory_known[output >> 3] & mask;
+    bool was_on = accessory_state[output >> 3] & mask;
+
+    return accessory_suppress && known && (was_on == on);
+}
+#endif // DCC_SUPPORT_ACCESSORY_CACHE
+
+#if DCC_SUPPORT_CONSIST
+//DCC_CONSIST_FREE finds an unused entry
+DCCPacketScheduler::consist_member_t* DCCPacketScheduler::findConsistMember(uint16_t key)
+{
+    for (uint8_t i = 0; i < DCC_CONSIST_MEMBERS; ++i)
+    {
+        bool used = (consist_members[i].cv19 != 0);
+
+        if ((key == DCC_CONSIST_FREE) ? !used : (used && (consist_members[i].key == key)))
+        {
+            return &consist_members[i];
+        }
+    }
+
+    return 0;
+}
+#endif // DCC_SUPPORT_CONSIST
+
+#if DCC_SUPPORT_ADAPTIVE_REPEAT
+//locos with feedback go by their own loss, everything else by the track's
+uint8_t DCCPacketScheduler::adaptiveRepeat(const DCCPacket& p)
+{
+    uint8_t kind = p.getKind();
+    uint16_t loss = track_loss >> 4;
+
+    if (kind & MULTIFUNCTION_PACKET_KIND_MASK)
+    {
+        uint16_t key = DCCPacket::packAddress(p.getAddress(), (DCCPacket::address_kind_t)p.getAddressKind());
+
+#if DCC_SUPPORT_QOS
+        service_address_t* s = findServiceAddress(key);
+
+        if ((kind != ESTOP_PACKET_KIND) && (kind != OPS_MODE_PROGRAMMING_KIND) &&
+                (service_classes[s ? s->service_class : 0].repeat != DCC_QOS_DEFAULT_REPEAT))
+        {
+            return p.getRepeat();
+        }
+#endif
+
+        for (uint8_t i = 0; i < DCC_ADAPTIVE_ADDRESSES; ++i)
+        {
+            if (deliveries[i].key == key)
+            {
+                loss = deliveries[i].loss >> 4;
+                break;
+            }
+        }
+    }
+
+    uint8_t repeat = lossRepeat(loss, kind);
+
+    if (kind == ESTOP_PACKET_KIND) //DCCEmergencyQueue counts the first time too
+    {
+        repeat = (repeat < DCC_PACKED_MAX_REPEAT) ? (repeat + 1) : DCC_PACKED_MAX_REPEAT;
+    }
+
+    return repeat;
+}
+
+//fewest repeats for every copy to be lost no more than the miss rate allows
+uint8_t DCCPacketScheduler::lossRepeat(uint16_t loss, uint8_t kind)
+{
+    uint32_t miss = (kind == ESTOP_PACKET_KIND) ? DCC_ADAPTIVE_ESTOP_MISS_PPM : DCC_ADAPTIVE_MISS_PPM;
+    uint32_t all_lost = (uint32_t)loss * 1000; //ppm
+    uint8_t repeat = 0;
+
+    while ((all_lost > miss) && (repeat < DCC_PACKED_MAX_REPEAT))
+    {
+        all_lost = (all_lost * loss) / 1000;
+        ++repeat;
+    }
+
+    //S 9.2.1: a decoder only acts on the second of two identical CV writes
+    if ((kind == OPS_MODE_PROGRAMMING_KIND) && !repeat)
+    {
+        repeat = 1;
+    }
+
+    return repeat;
+}
+#endif // DCC_SUPPORT_ADAPTIVE_REPEAT
+
+#if DCC_SUPPORT_QOS
+//DCC_QOS_FREE finds an unused entry
+DCCPacketScheduler::service_address_t* DCCPacketScheduler::findServiceAddress(uint16_t key)
+{
+    for (uint8_t i = 0; i < DCC_QOS_ADDRESSES; ++i)
+    {
+        bool used = (service_addresses[i].service_class != 0);
+
+        if ((key == DCC_QOS_FREE) ? !used : (used && (service_addresses[i].key == key)))
+        {
+            return &service_addresses[i];
+        }
+    }
+
+    return 0;
+}
+
+//resends at most one address's last speed, once its class's refresh_ms has passed. refreshes go in
+//the same queue as the class's speeds, so a newer speed replaces a waiting refresh rather than
+//following it; they only use that queue's reservation, and aren't repeated.
+void DCCPacketScheduler::updateRefresh(void)
+{
+    uint16_t now = millis();
+
+    for (uint8_t n = 0; n < DCC_QOS_ADDRESSES; ++n)
+    {
+        service_address_t& s = service_addresses[service_next];
+        service_next = (service_next + 1) % DCC_QOS_ADDRESSES;
+
+        if (!s.service_class || !s.speed_info)
+        {
+            continue;
+        }
+
+        const service_class_t& c = service_classes[s.service_class];
+
+        if (!c.refresh_ms || ((uint16_t)(now - s.last_ms) < c.refresh_ms))
+        {
+            continue;
+        }
+
+        DCCPacketQueue& queue = (c.priority == DCC_QOS_LOW) ? low_priority_queue : high_priority_queue;
+
+        if (queue.written >= ((c.priority == DCC_QOS_LOW) ? LOW_PRIORITY_QUEUE_RESERVE : HIGH_PRIORITY_QUEUE_RESERVE))
+        {
+            continue;
+        }
+
+        DCCPacket p;
+        p.unpack(s.speed_address, s.speed_data, s.speed_info);
+        p.setRepeat(0);
+
+        if (queue.insertPacket(p))
+        {
+            s.last_ms = now;
+        }
+
+        return;
+    }
+}
+#endif // DCC_SUPPORT_QOS
+
+#if DCC_SUPPORT_SNAPSHOT
+//DCC_SNAPSHOT_FREE finds an unused entry
+DCCPacketScheduler::snapshot_loco_t* DCCPacketScheduler::findSnapshotLoco(uint16_t key)
+{
+    for (uint8_t i = 0; i < DCC_SNAPSHOT_LOCOS; ++i)
+    {
+        if ((snapshot_locos[i].record[0] | (snapshot_locos[i].record[1] << 8)) == key)
+        {
+            return &snapshot_locos[i];
+        }
+    }
+
+    return 0;
+}
+
+//keeps a loco's last speed and function groups 1-5. locos beyond DCC_SNAPSHOT_LOCOS aren't kept.
+void DCCPacketScheduler::recordLoco(const DCCPacket& p)
+{
+    uint16_t packed_address;
+    uint8_t data[DCC_PACKED_DATA_LEN];
+    uint8_t info;
+    uint8_t group = 0;
+
+    for (uint8_t i = 0; i < sizeof(snapshot_function_kinds); ++i)
+    {
+        if (p.getKind() == snapshot_function_kinds[i])
+        {
+            group = i + 1;
+        }
+    }
+
+    if (!group && (p.getKind() != SPEED_PACKET_KIND))
+    {
+        return;
+    }
+
+    p.pack(packed_address, data, info);
+
+    uint16_t key = packed_address & DCC_PACKED_ADDRESS_MASK;
+    snapshot_loco_t* l = findSnapshotLoco(key);
+
+    if (!l)
+    {
+        l = findSnapshotLoco(DCC_SNAPSHOT_FREE);
+
+        if (!l)
+        {
+            return;
+        }
+    }
+
+    uint8_t record[DCC_SNAPSHOT_DATA_LEN];
+
+    for (uint8_t b = 0; b < DCC_SNAPSHOT_DATA_LEN; ++b)
+    {
+        record[b] = l->record[b];
+    }
+
+    record[0] = key & 0xFF;
+    record[1] = key >> 8;
+
+    if (!group)
+    {
+        record[2] = (record[2] & 0x3E) | 0x01 | ((packed_address >> DCC_PACKED_SIZE_SHIFT) << 6);
+        record[3] = data[0];
+        record[4] = data[1];
+    }
+    else
+    {
+        //groups 4 and 5 are an instruction byte then the functions
+        record[2] |= 1 << group;
+        record[4 + group] = (group > 3) ? data[1] : data[0];
+    }
+
+    bool changed = false;
+
+    for (uint8_t b = 0; b < DCC_SNAPSHOT_DATA_LEN; ++b)
+    {
+        changed = changed || (record[b] != l->record[b]);
+        l->record[b] = record[b];
+    }
+
+    if (changed)
+    {
+        changedLoco(*l);
+    }
+}
+
+//a change goes in the loco's next record, so the last one holds until this one's written
+void DCCPacketScheduler::changedLoco(snapshot_loco_t& l)
+{
+    if (!(l.flags & DCC_SNAPSHOT_PENDING))
+    {
+        l.copy = (l.copy + 1) % DCC_SNAPSHOT_COPIES;
+        ++l.seq;
+        l.flags |= DCC_SNAPSHOT_PENDING;
+    }
+
+    l.flags |= DCC_SNAPSHOT_CHANGED;
+}
+
+//returns false if a queue was full; resending is safe, as queued packets replace each other
+bool DCCPacketScheduler::resendLoco(const snapshot_loco_t& l)
+{
+    uint16_t key = l.record[0] | (l.record[1] << 8);
+
+    if (key == DCC_SNAPSHOT_FREE)
+    {
+        return true;
+    }
+
+    DCCPacket::address_t address = DCCPacket::unpackAddress(key);
+    DCCPacket::address_kind_t address_kind = DCCPacket::unpackAddressKind(key);
+
+    if ((l.record[2] & 0x01) && (l.record[2] >> 6))
+    {
+        DCCPacket p(address, address_kind);
+        uint8_t data[] = {l.record[3], l.record[4]};
+
+        p.addData(data, l.record[2] >> 6);
+        p.setKind(SPEED_PACKET_KIND);
+        p.setRepeat(SPEED_REPEAT);
+
+        if (!queueCommand(p))
+        {
+            return false;
+        }
+    }
+
+    for (uint8_t group = 1; group <= sizeof(snapshot_function_kinds); ++group)
+    {
+        if (!(l.record[2] & (1 << group)))
+        {
+            continue;
+        }
+
+        DCCPacket p(address, address_kind);
+        uint8_t data[] = {(uint8_t)((group == 4) ? 0xDE : 0xDF), l.record[4 + group]};
+
+        if (group > 3)
+        {
+            p.addData(data, 2);
+        }
+        else
+        {
+            p.addData(data + 1, 1);
+        }
+
+        p.setKind(snapshot_function_kinds[group - 1]);
+        p.setRepeat(FUNCTION_REPEAT);
+
+        if (!queueCommand(p))
+        {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+//where each part of the snapshot starts: 0 the header, then each loco's records, the consist table and the accessory cache
+uint16_t DCCPacketScheduler::snapshotUnit(uint8_t unit, uint16_t& length)
+{
+    if (unit == 0)
+    {
+        length = DCC_SNAPSHOT_HEADER_LEN;
+        return 0;
+    }
+
+    if (unit <= DCC_SNAPSHOT_LOCOS)
+    {
+        length = DCC_SNAPSHOT_COPIES * DCC_SNAPSHOT_RECORD_LEN;
+        return DCC_SNAPSHOT_HEADER_LEN + ((unit - 1) * length);
+    }
+
+    if (unit == (DCC_SNAPSHOT_LOCOS + 1))
+    {
+        length = DCC_SNAPSHOT_CONSIST_LEN;
+        return DCC_SNAPSHOT_HEADER_LEN + DCC_SNAPSHOT_LOCOS_LEN;
+    }
+
+    length = DCC_SNAPSHOT_CACHE_LEN;
+    return DCC_SNAPSHOT_HEADER_LEN + DCC_SNAPSHOT_LOCOS_LEN + DCC_SNAPSHOT_CONSIST_LEN;
+}
+
+//what a byte of the snapshot should be, or -1 if it can be left as it is
+int16_t DCCPacketScheduler::snapshotByte(uint8_t unit, uint16_t pos)
+{
+    if (unit == 0)
+    {
+        const uint8_t header[DCC_SNAPSHOT_HEADER_LEN] = {'D', 'C', DCC_SNAPSHOT_VERSION, DCC_SNAPSHOT_LOCOS, DCC_SNAPSHOT_COPIES,
+                                                        (uint8_t)DCC_SNAPSHOT_CONSIST_LEN, (uint8_t)DCC_SNAPSHOT_CACHE_LEN, (uint8_t)(DCC_SNAPSHOT_CACHE_LEN >> 8)
+                                                       };
+        return header[pos];
+    }
+
+    if (unit <= DCC_SNAPSHOT_LOCOS)
+    {
+        const snapshot_loco_t& l = snapshot_locos[unit - 1];
+        uint8_t b = pos % DCC_SNAPSHOT_RECORD_LEN;
+
+        //older records are left alone, unless they belong to another configuration
+        if ((pos / DCC_SNAPSHOT_RECORD_LEN) != l.copy)
+        {
+            return snapshot_wipe ? 0xFF : -1;
+        }
+
+        if (b < DCC_SNAPSHOT_DATA_LEN)
+        {
+            return l.record[b];
+        }
+
+        if (b > DCC_SNAPSHOT_DATA_LEN)
+        {
+            return l.seq;
+        }
+
+        uint8_t check = 0x5A ^ l.seq;
+
+        for (b = 0; b < DCC_SNAPSHOT_DATA_LEN; ++b)
+        {
+            check ^= l.record[b];
+        }
+
+        return check;
+    }
+
+#if DCC_SUPPORT_CONSIST
+    if (unit == (DCC_SNAPSHOT_LOCOS + 1))
+    {
+        if (pos < (DCC_SNAPSHOT_CONSIST_LEN - 1))
+        {
+            const consist_member_t& m = consist_members[pos / 3];
+            uint16_t key = m.cv19 ? m.key : DCC_CONSIST_FREE;
+            uint8_t field = pos % 3;
+
+            return (field == 0) ? (key & 0xFF) : ((field == 1) ? (key >> 8) : m.cv19);
+        }
+
+        uint8_t check = 0x5A;
+
+        for (pos = 0; pos < (DCC_SNAPSHOT_CONSIST_LEN - 1); ++pos)
+        {
+            check ^= snapshotByte(unit, pos);
+        }
+
+        return check;
+    }
+#endif
+
+#if DCC_SUPPORT_ACCESSORY_CACHE
+    if (pos < DCC_ACCESSORY_CACHE_BYTES)
+    {
+        return accessory_known[pos];
+    }
+
+    if (pos < (2 * DCC_ACCESSORY_CACHE_BYTES))
+    {
+        return accessory_state[pos - DCC_ACCESSORY_CACHE_BYTES];
+    }
+
+    uint8_t check = 0x5A;
+
+    for (pos = 0; pos < DCC_ACCESSORY_CACHE_BYTES; ++pos)
+    {
+        check ^= accessory_known[pos] ^ accessory_state[pos];
+    }
+
+    return check;
+#else
+    return -1;
+#endif
+}
+
+//brings the snapshot up to date a part at a time, writing at most one byte per call and never waiting for storage.
+//a loco's record is only finished with once it has been written through without the loco changing.
+void DCCPacketScheduler::updateSnapshot(void)
+{
+    if (!dcc_storage_ready())
+    {
+        return;
+    }
+
+    for (uint8_t n = 0; n < DCC_SNAPSHOT_SCAN; ++n)
+    {
+        bool loco = (snapshot_unit >= 1) && (snapshot_unit <= DCC_SNAPSHOT_LOCOS);
+        uint16_t length;
+        uint16_t start = snapshotUnit(snapshot_unit, length);
+
+        if (loco && (snapshot_pos == 0))
+        {
+            snapshot_locos[snapshot_unit - 1].flags &= ~DCC_SNAPSHOT_CHANGED;
+        }
+
+        if (snapshot_pos < length)
+        {
+            int16_t value = snapshotByte(snapshot_unit, snapshot_pos);
+            uint16_t offset = start + snapshot_pos++;
+
+            if ((value >= 0) && (dcc_storage_read(offset) != value))
+            {
+                dcc_storage_write(offset, value);
+                return;
+            }
+
+            continue;
+        }
+
+        snapshot_pos = 0;
+
+        if (loco)
+        {
+            snapshot_loco_t& l = snapshot_locos[snapshot_unit - 1];
+
+            if (l.flags & DCC_SNAPSHOT_CHANGED)
+            {
+                continue; //go round this loco again
+            }
+
+            l.flags &= ~DCC_SNAPSHOT_PENDING;
+        }
+
+        if (++snapshot_unit == DCC_SNAPSHOT_UNITS)
+        {
+            snapshot_unit = 0;
+            snapshot_wipe = false;
+        }
+    }
+}
+#endif // DCC_SUPPORT_SNAPSHOT
+
+#if DCC_SUPPORT_TIMERS
+//queues at most DCC_TIMER_FIRE_LIMIT timers that are due. accessories go in the low priority queue,
+//as setBasicAccessory() puts them, and everything else through queueCommand() as the throttles'
+//commands do. timers wait in the wheel while the queues are full.
+void DCCPacketScheduler::updateTimers(void)
+{
+    for (uint8_t fired = 0; fired < DCC_TIMER_FIRE_LIMIT; ++fired)
+    {
+        DCCPacket p;
+
+        if (high_priority_queue.isFull() || low_priority_queue.isFull() || !timers.poll(timer_clock, p))
+        {
+            return;
+        }
+
+        if (p.getKind() & ACCESSORY_PACKET_KIND_MASK)
+        {
+            low_priority_queue.insertPacket(p);
+        }
+        else
+        {
+            queueCommand(p);
+        }
+    }
+}
+#endif
 
 /****************************************************************************
  * End of file
@@ -29,12 +29,57 @@
 #ifndef INC_DCCPACKETSCHEDULER_H
 #define INC_DCCPACKETSCHEDULER_H
 
+#include "DCCConfig.h"
 #include "DCCPacket.h"
 #include "DCCPacketQueue.h"
 #include "DCCEmergencyQueue.h"
 #include "DCCRepeatQueue.h"
+#include "DCCTimerWheel.h"
 #include "DCCHardware.h"
 
+#if DCC_SUPPORT_QOS
+//service class priorities. NORMAL sends speeds as high priority and everything else as low.
+#define DCC_QOS_LOW            0
+#define DCC_QOS_NORMAL         1
+#define DCC_QOS_HIGH           2
+
+//service class repeat that leaves each kind of packet with its usual repeat count
+#define DCC_QOS_DEFAULT_REPEAT 0xFF
+#endif
+
+#if DCC_SUPPORT_ACCESSORY_CACHE
+//one bit for each of the four output pairs of 512 basic accessory decoders
+#define DCC_ACCESSORY_CACHE_BYTES (2048 / 8)
+#endif
+
+#if DCC_SUPPORT_SNAPSHOT
+//snapshot layout: a header, then DCC_SNAPSHOT_COPIES records for each loco, the consist table and the accessory cache.
+//a loco record is its DCCPacket::packAddress(), a byte saying which of the rest are there (bit 0 the speed, bits 1-5
+//function groups 1-5, bits 6-7 the speed's size), 2 of speed, 5 of function groups, a check byte and a sequence number.
+//the consist table and the accessory cache each end with a check byte too.
+#define DCC_SNAPSHOT_VERSION     1
+#define DCC_SNAPSHOT_HEADER_LEN  8
+#define DCC_SNAPSHOT_DATA_LEN    10
+#define DCC_SNAPSHOT_RECORD_LEN  (DCC_SNAPSHOT_DATA_LEN + 2)
+#define DCC_SNAPSHOT_LOCOS_LEN   (DCC_SNAPSHOT_LOCOS * DCC_SNAPSHOT_COPIES * DCC_SNAPSHOT_RECORD_LEN)
+#if DCC_SUPPORT_CONSIST
+#define DCC_SNAPSHOT_CONSIST_LEN ((DCC_CONSIST_MEMBERS * 3) + 1)
+#else
+#define DCC_SNAPSHOT_CONSIST_LEN 0
+#endif
+#if DCC_SUPPORT_ACCESSORY_CACHE
+#define DCC_SNAPSHOT_CACHE_LEN   ((2 * DCC_ACCESSORY_CACHE_BYTES) + 1)
+#else
+#define DCC_SNAPSHOT_CACHE_LEN   0
+#endif
+#define DCC_SNAPSHOT_SIZE        (DCC_SNAPSHOT_HEADER_LEN + DCC_SNAPSHOT_LOCOS_LEN + DCC_SNAPSHOT_CONSIST_LEN + DCC_SNAPSHOT_CACHE_LEN)
+#endif
+
+#if DCC_SUPPORT_ROUTES
+//one turnout of a route, as it would be given to setBasicAccessory()/unsetBasicAccessory()
+#define DCC_ROUTE_ENTRY(address, function, set) ((uint16_t)(((address) << 3) | (((function) & 0x03) << 1) | ((set) ? 1 : 0)))
+#endif
+
 class DCCPacketScheduler
 {
   public:
@@ -47,9 +92,23 @@ class DCCPacketScheduler
 
     //for enqueueing packets
     bool setSpeed(DCCPacket::address_t address, DCCPacket::address_kind_t address_kind, int8_t new_speed, uint8_t steps = 0); //new_speed: [-127,127]
+#if DCC_SUPPORT_SPEED14
     bool setSpeed14(DCCPacket::address_t address, DCCPacket::address_kind_t address_kind, int8_t new_speed, bool F0=true); //new_speed: [-13,13], and optionally F0 settings.
+#endif
+#if DCC_SUPPORT_SPEED28
     bool setSpeed28(DCCPacket::address_t address, DCCPacket::address_kind_t address_kind, int8_t new_speed); //new_speed: [-28,28]
+#endif
+#if DCC_SUPPORT_SPEED128
     bool setSpeed128(DCCPacket::address_t address, DCCPacket::address_kind_t address_kind, int8_t new_speed); //new_speed: [-127,127]
+#endif
+
+#if DCC_SUPPORT_MOMENTUM
+    //ramp towards new_speed at rate speed steps (out of 127) per second, from the loco's last
+    //setSpeed() or ramp, or from stop if a slot hasn't kept it. update() sends the intermediate
+    //speeds; setSpeed() or eStop() on the same loco cancel the ramp.
+    //returns false if DCC_MOMENTUM_SLOTS locos are already ramping.
+    bool setSpeedTarget(DCCPacket::address_t address, DCCPacket::address_kind_t address_kind, int8_t new_speed, uint8_t rate, uint8_t steps = 0);
+#endif
 
     //the function methods are NOT stateful; you must specify all functions each time you call one
     //keeping track of function state is the responsibility of the calling program.
@@ -58,23 +117,311 @@ class DCCPacketScheduler
     bool setFunctions0to4(DCCPacket::address_t address, DCCPacket::address_kind_t address_kind, uint8_t functions);
     bool setFunctions5to8(DCCPacket::address_t address, DCCPacket::address_kind_t address_kind, uint8_t functions);
     bool setFunctions9to12(DCCPacket::address_t address, DCCPacket::address_kind_t address_kind, uint8_t functions);
+#if DCC_SUPPORT_QOS
+    //service classes are [0,DCC_QOS_CLASSES), and every address is in class 0 until given another.
+    //refresh_ms: resend the last speed this often, 0 for never. Class 0 is never refreshed.
+    //repeat: repeats of speed and function packets, [0,15] or DCC_QOS_DEFAULT_REPEAT.
+    //priority: DCC_QOS_LOW, DCC_QOS_NORMAL or DCC_QOS_HIGH.
+    bool setServiceClass(uint8_t service_class, uint16_t refresh_ms, uint8_t repeat, uint8_t priority);
+    //returns false if DCC_QOS_ADDRESSES addresses are already in classes other than 0
+    bool setAddressClass(DCCPacket::address_t address, DCCPacket::address_kind_t address_kind, uint8_t service_class);
+#endif
+
+#if DCC_SUPPORT_ADAPTIVE_REPEAT
+    //on: repeat each packet as often as the loss says it needs, rather than SPEED_REPEAT and the rest. speed and
+    //function packets for an address in a service class with its own repeat keep that. off by default.
+    void setAdaptiveRepeat(bool on);
+    //the track's loss, in thousandths of packets, to go on until reportDelivery() says otherwise
+    void setTrackLoss(uint16_t permille);
+    //feedback, e.g. from RailCom: whether a packet sent to this loco reached it
+    void reportDelivery(DCCPacket::address_t address, DCCPacket::address_kind_t address_kind, bool arrived);
+    //thousandths; the track's loss for a loco without feedback of its own
+    uint16_t getLoss(DCCPacket::address_t address, DCCPacket::address_kind_t address_kind);
+#endif
+
+#if DCC_SUPPORT_GOVERNOR
+    //send each loco at most one speed packet, and one of each function group, every window_ms. commands in
+    //between are held, each replacing the one before, and the latest goes when the window ends. stops and
+    //changes of direction go straight away. 0 turns it off.
+    void setGovernor(uint16_t window_ms);
+    inline uint32_t getCoalesced(void) const //commands replaced by a newer one before they were sent
+    {
+        return governor_coalesced;
+    }
+    inline uint32_t getDeferred(void) const //commands held back until the end of a window, then sent
+    {
+        return governor_deferred;
+    }
+#endif
+
+#if DCC_SUPPORT_FAIR_QUEUES
+    //on: the low priority and repeat queues send one packet for each address with something waiting,
+    //in turn, rather than everything in the order it came. starts at DCC_FAIR_QUEUES.
+    void setFairQueues(bool on);
+#endif
+
+#if DCC_SUPPORT_REPEAT_SPACING
+    //spread each packet's repeats and e-stops out, rather than sending them back to back: the first
+    //repeat waits at least gap packets, and each one after backoff times the last, up to DCC_REPEAT_MAX_GAP.
+    //0 sends them as soon as the queues allow. starts at DCC_REPEAT_SPACING and DCC_REPEAT_BACKOFF.
+    void setRepeatSpacing(uint8_t gap, uint8_t backoff);
+#endif
+
+#if DCC_SUPPORT_FEATURE_EXPANSION
+    bool setFunctions13to20(DCCPacket::address_t address, DCCPacket::address_kind_t address_kind, uint8_t functions); //bit 0 = F13
+    bool setFunctions21to28(DCCPacket::address_t address, DCCPacket::address_kind_t address_kind, uint8_t functions); //bit 0 = F21
+    //eight functions from first_function, which must be 29, 37, 45, 53 or 61. bit 0 = first_function
+    bool setFunctions29to68(DCCPacket::address_t address, DCCPacket::address_kind_t address_kind, uint8_t first_function, uint8_t functions);
+    //state: [0,32767], where 0 means all binary states
+    bool setBinaryState(DCCPacket::address_t address, DCCPacket::address_kind_t address_kind, uint16_t state, bool on);
+#endif
     //other cool functions to follow. Just get these working first, I think.
 
-    bool setBasicAccessory(DCCPacket::address_t address, uint8_t function);
-    bool unsetBasicAccessory(DCCPacket::address_t address, uint8_t function);
+#if DCC_SUPPORT_ACCESSORY
+    //force: send even if the accessory cache says the output is already in this state
+    bool setBasicAccessory(DCCPacket::address_t address, uint8_t function, bool force = false);
+    bool unsetBasicAccessory(DCCPacket::address_t address, uint8_t function, bool force = false);
+    bool setExtendedAccessory(DCCPacket::address_t address, uint8_t aspect); //address: 11 bit output address
+#endif
+
+#if DCC_SUPPORT_ACCESSORY_CACHE
+    //suppress: set/unsetBasicAccessory() quietly drop commands for outputs already in that state.
+    //the cache is always kept up to date; clear it if the decoders may have been changed behind our back.
+    void setAccessoryCache(bool suppress);
+    void clearAccessoryCache(void);
+#endif
 
+#if DCC_SUPPORT_ROUTES
+    //throw a whole route: count DCC_ROUTE_ENTRY()s, which must be in PROGMEM. update() sends
+    //them one at a time, DCC_ROUTE_INTERVAL_MS apart, passing straight over any the accessory
+    //cache would drop. returns false if a route is still being set.
+    bool setRoute(const uint16_t* entries, uint8_t count);
+    void cancelRoute(void);
+    inline uint8_t getRouteRemaining(void) const //turnouts not yet sent; 0 when the route is set
+    {
+        return route_count - route_next;
+    }
+#endif
+
+#if DCC_SUPPORT_TIMERS
+    //timers count packets put on the rails, so delays are in packets (roughly 5-10ms each).
+    //send packet after delay packets, then every period packets if period is not 0.
+    //returns a handle for cancelTimer(), or DCC_TIMER_NONE if DCC_TIMER_COUNT timers are waiting.
+    dcc_timer_t schedulePacket(const DCCPacket& packet, uint16_t delay, uint16_t period = 0);
+    bool cancelTimer(dcc_timer_t timer);
+#if DCC_SUPPORT_ACCESSORY
+    //setBasicAccessory() now, and unsetBasicAccessory() duration packets later
+    dcc_timer_t pulseBasicAccessory(DCCPacket::address_t address, uint8_t function, uint16_t duration);
+#endif
+#endif
+
+#if DCC_SUPPORT_OPS_MODE
     bool opsProgramCV(DCCPacket::address_t address, DCCPacket::address_kind_t address_kind, uint16_t CV, uint8_t CV_data);
+#endif
+
+#if DCC_SUPPORT_CONSIST
+    //advanced consisting. Writes CV19 on the main, and from then on setSpeed() for any member
+    //sends one speed packet to consist_address [1,127] instead. Functions still go to each member.
+    //reversed: the member faces the other way, so its decoder inverts the consist's direction.
+    bool addToConsist(DCCPacket::address_t consist_address, DCCPacket::address_t address, DCCPacket::address_kind_t address_kind, bool reversed = false);
+    bool removeFromConsist(DCCPacket::address_t address, DCCPacket::address_kind_t address_kind);
+#endif
 
     //more specific functions
     bool eStop(void); //all locos
     bool eStop(DCCPacket::address_t address, DCCPacket::address_kind_t address_kind); //just one specific loco
 
+#if DCC_SUPPORT_SNAPSHOT
+    //call straight after setup(). loads the snapshot, and has update() resend each loco's speed and
+    //functions. returns false if there's no snapshot, or it was saved with a different configuration.
+    //from then on update() keeps the snapshot up to date, one byte at a time.
+    bool restoreSnapshot(void);
+#endif
+
+#if DCC_SUPPORT_BANDWIDTH
+    //permille of the rails' time spent on packets other than idles, over the last DCC_BANDWIDTH_WINDOW_US
+    inline uint16_t getUtilization(void) const
+    {
+        return utilization;
+    }
+
+    //worst case ms until everything now queued, plus a speed for each of extra_locos more locos
+    //and a route of route_length turnouts, has been put on the rails with all its repeats
+    uint32_t predictRefreshInterval(uint8_t extra_locos, uint8_t route_length = 0);
+#endif
+
+    //show visitor everything queued, queue by queue from the e-stop queue down, each in the order it'll go
+    //out, in place and without disturbing it. false if any queue changed while it looked (see
+    //DCCPacketQueue::visit()); then what it saw isn't one consistent picture, and it should look again.
+    bool visitQueues(dcc_queue_visitor_t visitor, void* context);
+
     //to be called periodically within loop()
     void update(void); //checks queues, puts whatever's pending on the rails via global current_packet. easy-peasy
 
   private:
 
     void repeatPacket(const DCCPacket& p); //insert into the appropriate repeat queue
+    bool sendSpeed(DCCPacket::address_t address, DCCPacket::address_kind_t address_kind, int8_t new_speed, uint8_t steps);
+    bool queueCommand(DCCPacket& p); //queue a speed or function packet
+    bool commandIsHigh(uint16_t key, uint8_t kind); //whether queueCommand() would put it in the high priority queue
+    void forgetSpeed(uint16_t key); //drop anything that would set a stopped loco going again
+
+#if DCC_SUPPORT_MOMENTUM
+    typedef struct
+    {
+        uint16_t key; //DCCPacket::packAddress(), or DCC_MOMENTUM_FREE
+        int8_t current; //last speed sent, as for setSpeed()
+        int8_t target;
+        uint8_t steps;
+        uint16_t interval; //ms per speed step
+        uint16_t last_ms; //when current last moved
+    } momentum_t;
+
+    momentum_t momentum[DCC_MOMENTUM_SLOTS];
+    uint8_t momentum_next; //where updateMomentum() looks first
+
+    momentum_t* findMomentum(uint16_t key);
+    momentum_t* takeMomentum(uint16_t key, int8_t new_speed);
+    void updateMomentum(void);
+#endif
+
+#if DCC_SUPPORT_QOS
+    typedef struct
+    {
+        uint16_t refresh_ms;
+        uint8_t repeat;
+        uint8_t priority;
+    } service_class_t;
+
+    typedef struct
+    {
+        uint16_t key; //DCCPacket::packAddress()
+        uint8_t service_class; //0 if the entry is free
+        uint8_t speed_info; //last speed sent, packed. 0 if there isn't one
+        uint16_t speed_address;
+        uint8_t speed_data[DCC_PACKED_DATA_LEN];
+        uint16_t last_ms; //when the speed was last sent
+    } service_address_t;
+
+    service_class_t service_classes[DCC_QOS_CLASSES];
+    service_address_t service_addresses[DCC_QOS_ADDRESSES];
+    uint8_t service_next; //where updateRefresh() looks first
+
+    service_address_t* findServiceAddress(uint16_t key);
+    void updateRefresh(void);
+#endif
+
+#if DCC_SUPPORT_ADAPTIVE_REPEAT
+    typedef struct
+    {
+        uint16_t key; //DCCPacket::packAddress(), or DCC_ADAPTIVE_FREE
+        uint16_t loss; //thousandths << 4
+    } delivery_t;
+
+    delivery_t deliveries[DCC_ADAPTIVE_ADDRESSES];
+    uint16_t track_loss; //thousandths << 4
+    bool adaptive;
+
+    uint8_t adaptiveRepeat(const DCCPacket& p);
+    uint8_t lossRepeat(uint16_t loss, uint8_t kind);
+#endif
+
+#if DCC_SUPPORT_GOVERNOR
+    typedef struct
+    {
+        uint16_t key; //DCCPacket::packAddress(), or DCC_GOVERNOR_FREE
+        uint8_t kind; //speed packets and each function group are governed apart
+        uint8_t direction; //of the last speed sent
+        uint16_t sent_ms; //when the window began
+        uint8_t held_info; //the command waiting for the window to end, packed. 0 if there isn't one
+        bool held_high; //and which queue it goes to
+        uint16_t held_address;
+        uint8_t held_data[DCC_PACKED_DATA_LEN];
+    } governor_t;
+
+    governor_t governors[DCC_GOVERNOR_SLOTS];
+    uint16_t governor_ms;
+    uint32_t governor_coalesced;
+    uint32_t governor_deferred;
+
+    bool governCommand(const DCCPacket& p, bool high);
+    void forgetGoverned(uint16_t key);
+    void updateGovernor(void);
+#endif
+
+#if DCC_SUPPORT_SNAPSHOT
+    typedef struct
+    {
+        uint8_t record[DCC_SNAPSHOT_DATA_LEN]; //as stored; key 0xFFFF if the entry is free
+        uint8_t copy; //which of the loco's records holds this
+        uint8_t seq; //sequence number of that record
+        uint8_t flags; //DCC_SNAPSHOT_PENDING, DCC_SNAPSHOT_CHANGED
+    } snapshot_loco_t;
+
+    snapshot_loco_t snapshot_locos[DCC_SNAPSHOT_LOCOS];
+    uint8_t snapshot_unit; //what updateSnapshot() is bringing up to date: the header, a loco, consists or accessories
+    uint16_t snapshot_pos; //and how far it's got
+    uint8_t snapshot_restore; //next loco for update() to resend
+    bool snapshot_wipe; //clear out records from another configuration
+
+    snapshot_loco_t* findSnapshotLoco(uint16_t key);
+    void recordLoco(const DCCPacket& p);
+    void changedLoco(snapshot_loco_t& l);
+    bool resendLoco(const snapshot_loco_t& l);
+    uint16_t snapshotUnit(uint8_t unit, uint16_t& length);
+    int16_t snapshotByte(uint8_t unit, uint16_t pos);
+    void updateSnapshot(void);
+#endif
+
+#if DCC_SUPPORT_ACCESSORY
+    bool sendBasicAccessory(DCCPacket::address_t address, uint8_t function, bool on, bool force);
+#endif
+
+#if DCC_SUPPORT_ACCESSORY_CACHE
+    uint8_t accessory_known[DCC_ACCESSORY_CACHE_BYTES]; //set once an output has been sent
+    uint8_t accessory_state[DCC_ACCESSORY_CACHE_BYTES]; //set if it was last set, clear if unset
+    bool accessory_suppress;
+
+    bool accessoryUnchanged(DCCPacket::address_t address, uint8_t function, bool on) const;
+#endif
+
+#if DCC_SUPPORT_ROUTES
+    const uint16_t* route;
+    uint8_t route_count;
+    uint8_t route_next;
+    uint16_t route_last_ms;
+
+    void updateRoute(void);
+#endif
+
+#if DCC_SUPPORT_CONSIST
+    typedef struct
+    {
+        uint16_t key; //DCCPacket::packAddress() of the member
+        uint8_t cv19; //consist address, bit 7 set if reversed. 0 if the entry is free.
+    } consist_member_t;
+
+    consist_member_t consist_members[DCC_CONSIST_MEMBERS];
+
+    consist_member_t* findConsistMember(uint16_t key);
+#endif
+
+#if DCC_SUPPORT_TIMERS
+    DCCTimerWheel timers;
+    uint16_t timer_clock; //packets put on the rails
+
+    void updateTimers(void);
+#endif
+
+#if DCC_SUPPORT_BANDWIDTH
+    uint32_t wire_total; //us of packets sent in this window
+    uint32_t wire_busy; //and how much of that wasn't idles
+    uint32_t wire_last; //us of the packet last given to the rails
+    uint16_t utilization;
+
+    uint16_t queuedCopies(uint16_t key);
+#endif
+
     uint8_t default_speed_steps;
     uint16_t last_packet_address;
 
@@ -76,7 +76,19 @@ bool DCCRepeatQueue::insertPacket(const DCCPacket& packet)
 {
     if (packet.getRepeat())
     {
+#if DCC_SUPPORT_REPEAT_SPACING
+        uint8_t slot = insertSlot(packet);
+
+        if (slot == DCC_POOL_NONE)
+        {
+            return false;
+        }
+
+        respace(slot); //it's just been sent once, by whichever queue it came from
+        return true;
+#else
         return (DCCPacketQueue::insertPacket(packet));
+#endif
     }
 
     return false;
@@ -86,14 +98,26 @@ bool DCCRepeatQueue::readPacket(DCCPacket& packet)
 {
     if (!isEmpty())
     {
-        packet = queue[read_pos];
-        read_pos = (read_pos + 1) % size;
-        --written;
+        loadPacket(head, packet);
+#if DCC_SUPPORT_REPEAT_SPACING
+        uint8_t gap = dcc_packet_pool.gap[head];
+#endif
+        dropHead();
 
         if (packet.getRepeat()) //the packet needs to be sent out at least one more time
         {
             packet.setRepeat(packet.getRepeat() - 1);
+#if DCC_SUPPORT_REPEAT_SPACING
+            uint8_t slot = packet.getRepeat() ? insertSlot(packet) : DCC_POOL_NONE; //as insertPacket() would
+
+            if (slot != DCC_POOL_NONE)
+            {
+                dcc_packet_pool.gap[slot] = gap; //so the next wait backs off from this one
+                respace(slot);
+            }
+#else
             insertPacket(packet);
+#endif
         }
 
         return true;
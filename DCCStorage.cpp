@@ -0,0 +1,168 @@
+/*
+ * CmdrArduino
+ *
+ * DCC Snapshot Storage
+ *
+ * Author: Don Goodman-Wilson dgoodman@artificial-science.org
+ * Changes by: Jonathan Pallant dcc@thejpster.org.uk
+ *
+ * based on software by Wolfgang Kufer, http://opendcc.de
+ *
+ * Copyright 2010 Don Goodman-Wilson
+ * Copyright 2015 Jonathan Pallant
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/****************************************************************************
+* Includes
+****************************************************************************/
+#include <Arduino.h>
+#include <stdint.h>
+
+#include "DCCStorage.h"
+
+#if DCC_SUPPORT_SNAPSHOT
+
+#if defined(__AVR__)
+#include <avr/eeprom.h>
+#else
+#include <stdio.h>
+#endif
+
+/****************************************************************************
+ * Defines
+ ****************************************************************************/
+
+/* None */
+
+/****************************************************************************
+ * Data Types
+ ****************************************************************************/
+
+/* None */
+
+/****************************************************************************
+ * Function Prototypes
+ ****************************************************************************/
+
+/* None */
+
+/****************************************************************************
+ * Public Data
+ ****************************************************************************/
+
+/* None */
+
+/****************************************************************************
+ * Private Data
+ ****************************************************************************/
+
+#if !defined(__AVR__)
+static FILE* storage_file = 0;
+#endif
+
+/****************************************************************************
+ * Public Functions
+ ****************************************************************************/
+
+#if defined(__AVR__)
+
+void dcc_storage_setup(uint16_t size)
+{
+    (void)size; //blank EEPROM is already 0xFF
+}
+
+bool dcc_storage_ready(void)
+{
+    //EEPROM writes take 3.3ms, and the next one would spin until it's done
+    return eeprom_is_ready();
+}
+
+uint8_t dcc_storage_read(uint16_t offset)
+{
+    return eeprom_read_byte((const uint8_t*)(DCC_SNAPSHOT_ADDRESS + offset));
+}
+
+void dcc_storage_write(uint16_t offset, uint8_t value)
+{
+    eeprom_write_byte((uint8_t*)(DCC_SNAPSHOT_ADDRESS + offset), value);
+}
+
+#else
+
+void dcc_storage_setup(uint16_t size)
+{
+    //another scheduler's setup() may have opened it already
+    if (storage_file)
+    {
+        fclose(storage_file);
+    }
+
+    storage_file = fopen(DCC_SNAPSHOT_FILE, "r+b");
+
+    if (!storage_file)
+    {
+        storage_file = fopen(DCC_SNAPSHOT_FILE, "w+b");
+    }
+
+    if (!storage_file)
+    {
+        return;
+    }
+
+    //pad a new or short file out with 0xFF, as if it were blank EEPROM
+    fseek(storage_file, 0, SEEK_END);
+
+    for (long length = ftell(storage_file); length < size; ++length)
+    {
+        fputc(0xFF, storage_file);
+    }
+
+    fflush(storage_file);
+}
+
+bool dcc_storage_ready(void)
+{
+    return storage_file != 0;
+}
+
+uint8_t dcc_storage_read(uint16_t offset)
+{
+    if (!storage_file || fseek(storage_file, offset, SEEK_SET))
+    {
+        return 0xFF;
+    }
+
+    int value = fgetc(storage_file);
+    return (value == EOF) ? 0xFF : (uint8_t)value;
+}
+
+void dcc_storage_write(uint16_t offset, uint8_t value)
+{
+    if (storage_file && !fseek(storage_file, offset, SEEK_SET))
+    {
+        fputc(value, storage_file);
+        fflush(storage_file);
+    }
+}
+
+#endif // defined(__AVR__)
+
+#endif // DCC_SUPPORT_SNAPSHOT
+
+/****************************************************************************
+ * End of file
+ ****************************************************************************/
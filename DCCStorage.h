@@ -0,0 +1,47 @@
+/*
+ * CmdrArduino
+ *
+ * DCC Snapshot Storage
+ *
+ * Author: Don Goodman-Wilson dgoodman@artificial-science.org
+ * Changes by: Jonathan Pallant dcc@thejpster.org.uk
+ *
+ * based on software by Wolfgang Kufer, http://opendcc.de
+ *
+ * Copyright 2010 Don Goodman-Wilson
+ * Copyright 2015 Jonathan Pallant
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef INC_DCCSTORAGE_H
+#define INC_DCCSTORAGE_H
+
+#include "DCCConfig.h"
+
+// Byte-wide, non-volatile storage for the scheduler's snapshot: EEPROM
+// from DCC_SNAPSHOT_ADDRESS on AVR, and the file DCC_SNAPSHOT_FILE
+// anywhere else. Offsets start at 0. Bytes never written read as 0xFF.
+
+void dcc_storage_setup(uint16_t size);
+bool dcc_storage_ready(void); //true if a write can start without waiting
+uint8_t dcc_storage_read(uint16_t offset);
+void dcc_storage_write(uint16_t offset, uint8_t value);
+
+#endif // INC_DCCSTORAGE_H
+
+/****************************************************************************
+ * End of file
+ ****************************************************************************/
@@ -0,0 +1,262 @@
+/*
+ * CmdrArduino
+ *
+ * DCC Packet Timer Wheel
+ *
+ * Author: Don Goodman-Wilson dgoodman@artificial-science.org
+ * Changes by: Jonathan Pallant dcc@thejpster.org.uk
+ *
+ * based on software by Wolfgang Kufer, http://opendcc.de
+ *
+ * Copyright 2010 Don Goodman-Wilson
+ * Copyright 2015 Jonathan Pallant
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/****************************************************************************
+* Includes
+****************************************************************************/
+#include <Arduino.h>
+#include <stdint.h>
+
+#include "DCCTimerWheel.h"
+
+#if DCC_SUPPORT_TIMERS
+
+/****************************************************************************
+ * Defines
+ ****************************************************************************/
+
+/* None */
+
+/****************************************************************************
+ * Data Types
+ ****************************************************************************/
+
+/* None */
+
+/****************************************************************************
+ * Function Prototypes
+ ****************************************************************************/
+
+/* None */
+
+/****************************************************************************
+ * Public Data
+ ****************************************************************************/
+
+/* None */
+
+/****************************************************************************
+ * Private Data
+ ****************************************************************************/
+
+/* None */
+
+/****************************************************************************
+ * Public Functions
+ ****************************************************************************/
+
+DCCTimerWheel::DCCTimerWheel(void) : free_list(0), time(0)
+{
+    for (dcc_timer_t i = 0; i < DCC_TIMER_COUNT; ++i)
+    {
+        next[i] = i + 1;
+        bucket_of[i] = DCC_TIMER_NO_BUCKET;
+    }
+
+    next[DCC_TIMER_COUNT - 1] = DCC_TIMER_NONE;
+
+    for (uint8_t i = 0; i < (DCC_TIMER_WHEEL_LEVELS * DCC_TIMER_WHEEL_SLOTS); ++i)
+    {
+        buckets[i] = DCC_TIMER_NONE;
+    }
+}
+
+dcc_timer_t DCCTimerWheel::add(const DCCPacket& packet, uint16_t now, uint16_t delay, uint16_t new_period)
+{
+    dcc_timer_t timer = free_list;
+
+    if (timer == DCC_TIMER_NONE)
+    {
+        return DCC_TIMER_NONE;
+    }
+
+    free_list = next[timer];
+
+    //delays count from now, but the wheel may still be catching up to now
+    uint16_t lag = now - time;
+
+    if (new_period > DCC_TIMER_MAX_DELAY)
+    {
+        new_period = DCC_TIMER_MAX_DELAY;
+    }
+
+    packet.pack(packed_address[timer], packed_data[timer], packed_info[timer]);
+
+    if (lag >= DCC_TIMER_MAX_DELAY)
+    {
+        //now is further off than the wheel can reach, so it's already overdue
+        expires[timer] = time + 1;
+    }
+    else
+    {
+        if (delay > (DCC_TIMER_MAX_DELAY - lag))
+        {
+            delay = DCC_TIMER_MAX_DELAY - lag;
+        }
+
+        expires[timer] = now + delay;
+    }
+
+    period[timer] = new_period;
+    link(timer);
+    return timer;
+}
+
+bool DCCTimerWheel::cancel(dcc_timer_t timer)
+{
+    if (!isPending(timer))
+    {
+        return false;
+    }
+
+    unlink(timer);
+    next[timer] = free_list;
+    free_list = timer;
+    return true;
+}
+
+bool DCCTimerWheel::poll(uint16_t now, DCCPacket& packet)
+{
+    for (;;)
+    {
+        dcc_timer_t timer = buckets[time & DCC_TIMER_WHEEL_MASK];
+
+        if (timer != DCC_TIMER_NONE)
+        {
+            packet.unpack(packed_address[timer], packed_data[timer], packed_info[timer]);
+            unlink(timer);
+
+            if (period[timer])
+            {
+                expires[timer] += period[timer];
+                link(timer);
+            }
+            else
+            {
+                next[timer] = free_list;
+                free_list = timer;
+            }
+
+            return true;
+        }
+
+        if (time == now)
+        {
+            return false;
+        }
+
+        //on to the next tick, pulling timers down from the coarser levels when we cross into their bucket
+        ++time;
+
+        if (!(time & DCC_TIMER_WHEEL_MASK))
+        {
+            if (!(time & ((DCC_TIMER_WHEEL_SLOTS * DCC_TIMER_WHEEL_SLOTS) - 1)))
+            {
+                cascade(2);
+            }
+
+            cascade(1);
+        }
+    }
+}
+
+/****************************************************************************
+ * Private Functions
+ ****************************************************************************/
+
+//put a timer in the bucket for its expiry time, relative to the wheel's time
+void DCCTimerWheel::link(dcc_timer_t timer)
+{
+    uint16_t when = expires[timer];
+    uint8_t bucket;
+
+    if ((when >> DCC_TIMER_WHEEL_BITS) == (time >> DCC_TIMER_WHEEL_BITS))
+    {
+        bucket = when & DCC_TIMER_WHEEL_MASK;
+    }
+    else if ((when >> (2 * DCC_TIMER_WHEEL_BITS)) == (time >> (2 * DCC_TIMER_WHEEL_BITS)))
+    {
+        bucket = DCC_TIMER_WHEEL_SLOTS + ((when >> DCC_TIMER_WHEEL_BITS) & DCC_TIMER_WHEEL_MASK);
+    }
+    else
+    {
+        bucket = (2 * DCC_TIMER_WHEEL_SLOTS) + ((when >> (2 * DCC_TIMER_WHEEL_BITS)) & DCC_TIMER_WHEEL_MASK);
+    }
+
+    bucket_of[timer] = bucket;
+    prev[timer] = DCC_TIMER_NONE;
+    next[timer] = buckets[bucket];
+
+    if (next[timer] != DCC_TIMER_NONE)
+    {
+        prev[next[timer]] = timer;
+    }
+
+    buckets[bucket] = timer;
+}
+
+void DCCTimerWheel::unlink(dcc_timer_t timer)
+{
+    if (prev[timer] == DCC_TIMER_NONE)
+    {
+        buckets[bucket_of[timer]] = next[timer];
+    }
+    else
+    {
+        next[prev[timer]] = next[timer];
+    }
+
+    if (next[timer] != DCC_TIMER_NONE)
+    {
+        prev[next[timer]] = prev[timer];
+    }
+
+    bucket_of[timer] = DCC_TIMER_NO_BUCKET;
+}
+
+//move every timer in the current bucket of a coarse level down to where it now belongs
+void DCCTimerWheel::cascade(uint8_t level)
+{
+    uint8_t bucket = (level * DCC_TIMER_WHEEL_SLOTS) + ((time >> (level * DCC_TIMER_WHEEL_BITS)) & DCC_TIMER_WHEEL_MASK);
+    dcc_timer_t timer = buckets[bucket];
+
+    buckets[bucket] = DCC_TIMER_NONE;
+
+    while (timer != DCC_TIMER_NONE)
+    {
+        dcc_timer_t following = next[timer];
+        link(timer);
+        timer = following;
+    }
+}
+
+#endif // DCC_SUPPORT_TIMERS
+
+/****************************************************************************
+ * End of file
+ ****************************************************************************/
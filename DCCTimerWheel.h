@@ -0,0 +1,111 @@
+/*
+ * CmdrArduino
+ *
+ * DCC Packet Timer Wheel
+ *
+ * Author: Don Goodman-Wilson dgoodman@artificial-science.org
+ * Changes by: Jonathan Pallant dcc@thejpster.org.uk
+ *
+ * based on software by Wolfgang Kufer, http://opendcc.de
+ *
+ * Copyright 2010 Don Goodman-Wilson
+ * Copyright 2015 Jonathan Pallant
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef INC_DCCTIMERWHEEL_H
+#define INC_DCCTIMERWHEEL_H
+
+#include "DCCConfig.h"
+#include "DCCPacket.h"
+
+/****************************************************************************
+ * Defines
+ ****************************************************************************/
+
+// Three levels of 32 buckets: 1, 32 and 1024 ticks per bucket
+#define DCC_TIMER_WHEEL_BITS   5
+#define DCC_TIMER_WHEEL_SLOTS  (1 << DCC_TIMER_WHEEL_BITS)
+#define DCC_TIMER_WHEEL_MASK   (DCC_TIMER_WHEEL_SLOTS - 1)
+#define DCC_TIMER_WHEEL_LEVELS 3
+
+// Longest delay or period, in ticks
+#define DCC_TIMER_MAX_DELAY    0x7FFF
+
+#define DCC_TIMER_NO_BUCKET    0xFF
+
+/****************************************************************************
+ * Data Types
+ ****************************************************************************/
+
+#if DCC_TIMER_COUNT < 255
+typedef uint8_t dcc_timer_t;
+#else
+typedef uint16_t dcc_timer_t;
+#endif
+
+#define DCC_TIMER_NONE ((dcc_timer_t)~0)
+
+/**
+ * A hierarchical timing wheel of packets waiting to be sent. Time is
+ * counted in ticks, which the scheduler advances once per packet put on
+ * the rails. Timers are kept in doubly linked lists so adding and
+ * cancelling are O(1). Each timer costs 13 bytes of RAM, 15 if
+ * DCC_TIMER_COUNT is 255 or more: its six byte packed packet, expiry and
+ * period, list links and bucket. The wheel adds one handle for each of
+ * its 96 buckets.
+**/
+class DCCTimerWheel
+{
+public:
+    DCCTimerWheel(void);
+
+    //returns a handle for cancel(), or DCC_TIMER_NONE if all timers are in use
+    dcc_timer_t add(const DCCPacket& packet, uint16_t now, uint16_t delay, uint16_t period);
+    bool cancel(dcc_timer_t timer);
+
+    //hands out one packet that's due by now. Call until it returns false.
+    bool poll(uint16_t now, DCCPacket& packet);
+
+    inline bool isPending(dcc_timer_t timer) const
+    {
+        return (timer < DCC_TIMER_COUNT) && (bucket_of[timer] != DCC_TIMER_NO_BUCKET);
+    }
+
+private:
+    uint16_t packed_address[DCC_TIMER_COUNT];
+    uint8_t packed_data[DCC_TIMER_COUNT][DCC_PACKED_DATA_LEN];
+    uint8_t packed_info[DCC_TIMER_COUNT];
+    uint16_t expires[DCC_TIMER_COUNT];
+    uint16_t period[DCC_TIMER_COUNT];
+    dcc_timer_t next[DCC_TIMER_COUNT];
+    dcc_timer_t prev[DCC_TIMER_COUNT];
+    uint8_t bucket_of[DCC_TIMER_COUNT]; //bucket a timer is in, or DCC_TIMER_NO_BUCKET if free
+
+    dcc_timer_t buckets[DCC_TIMER_WHEEL_LEVELS * DCC_TIMER_WHEEL_SLOTS];
+    dcc_timer_t free_list;
+    uint16_t time; //the tick whose bucket is being emptied
+
+    void link(dcc_timer_t timer);
+    void unlink(dcc_timer_t timer);
+    void cascade(uint8_t level);
+};
+
+#endif // INC_DCCTIMERWHEEL_H
+
+/****************************************************************************
+ * End of file
+ ****************************************************************************/
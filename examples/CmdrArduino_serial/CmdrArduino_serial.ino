@@ -0,0 +1,41 @@
+/********************
+* Creates a DCC command station controlled over the serial port with DCC++ style commands,
+* e.g. <t 1 3 20 1> to run loco 3 forwards at speed 20, <f 3 144> to turn on its headlight,
+* <a 5 2 1> to throw a turnout, and <!> to stop everything.
+* Replies with <O> for each command accepted and <X> for each one that wasn't.
+* The DCC waveform is output on Pin 9, and is suitable for connection to an LMD18200-based booster directly,
+* or to a single-ended-to-differential driver, to connect with most other kinds of boosters.
+* Needs DCC_SUPPORT_PARSER set to 1 in DCCConfig.h.
+********************/
+
+#include <DCCPacket.h>
+#include <DCCPacketQueue.h>
+#include <DCCPacketScheduler.h>
+#include <DCCCommandParser.h>
+
+
+DCCPacketScheduler dps;
+DCCCommandParser parser(dps);
+
+void setup() {
+  Serial.begin(115200);
+  dps.setup();
+}
+
+void loop() {
+  //only read what's already arrived, so update() is never held up
+  while(Serial.available())
+  {
+    byte result = parser.parse(Serial.read());
+    if(result == DCC_PARSE_OK)
+    {
+      Serial.print("<O>");
+    }
+    else if(result != DCC_PARSE_NONE)
+    {
+      Serial.print("<X>");
+    }
+  }
+
+  dps.update();
+}
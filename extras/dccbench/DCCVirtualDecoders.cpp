@@ -0,0 +1,277 @@
+/*
+ * CmdrArduino
+ *
+ * Virtual Decoders
+ *
+ * A host-side stand-in for the decoders on a layout: a number of mobile
+ * decoders and basic accessory decoders, each of which carries out the
+ * packets addressed to it, or loses some of them at random.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/****************************************************************************
+* Includes
+****************************************************************************/
+#include <Arduino.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "DCCVirtualDecoders.h"
+
+/****************************************************************************
+ * Public Functions
+ ****************************************************************************/
+
+DCCVirtualDecoders::DCCVirtualDecoders(uint16_t locos, uint16_t accessories, dcc_virtual_handler_t handler) :
+    num_locos((locos > DCC_VIRTUAL_MAX_LOCO) ? DCC_VIRTUAL_MAX_LOCO : locos),
+    num_accessories((accessories > DCC_VIRTUAL_MAX_ACCESSORY) ? DCC_VIRTUAL_MAX_ACCESSORY : accessories),
+    handler(handler), applied(0), dropped(0), random_state(1)
+{
+    this->locos = new loco_t[num_locos];
+    accessory_state = new uint8_t[(DCC_VIRTUAL_MAX_ACCESSORY + 1) * 4 / 8];
+    accessory_loss = new uint16_t[num_accessories];
+
+    //as decoders come from the factory: stopped, lights off, CVs blank
+    memset(this->locos, 0, num_locos * sizeof(loco_t));
+    memset(accessory_state, 0, (DCC_VIRTUAL_MAX_ACCESSORY + 1) * 4 / 8);
+    memset(accessory_loss, 0, num_accessories * sizeof(uint16_t));
+}
+
+DCCVirtualDecoders::~DCCVirtualDecoders(void)
+{
+    delete[] locos;
+    delete[] accessory_state;
+    delete[] accessory_loss;
+}
+
+void DCCVirtualDecoders::setLoss(uint16_t permille)
+{
+    for (uint16_t i = 0; i < num_locos; ++i)
+    {
+        locos[i].loss = permille;
+    }
+
+    for (uint16_t i = 0; i < num_accessories; ++i)
+    {
+        accessory_loss[i] = permille;
+    }
+}
+
+void DCCVirtualDecoders::setLocoLoss(uint16_t cab, uint16_t permille)
+{
+    if ((cab >= 1) && (cab <= num_locos))
+    {
+        locos[cab - 1].loss = permille;
+    }
+}
+
+void DCCVirtualDecoders::setAccessoryLoss(uint16_t address, uint16_t permille)
+{
+    if ((address >= 1) && (address <= num_accessories))
+    {
+        accessory_loss[address - 1] = permille;
+    }
+}
+
+void DCCVirtualDecoders::receive(const uint8_t* rawbytes, size_t count)
+{
+    DCCPacket p;
+
+    if (!p.setBitstream(rawbytes, count))
+    {
+        return;
+    }
+
+    DCCPacket::address_t address = p.getAddress();
+
+    if (p.getKind() == BASIC_ACCESSORY_PACKET_KIND)
+    {
+        if ((address < 1) || (address > num_accessories))
+        {
+            return;
+        }
+
+        if (lost(accessory_loss[address - 1]))
+        {
+            ++dropped;
+            return;
+        }
+
+        //1AAACDDD: DD is the pair, and this library sends the set/unset in the last D
+        uint16_t output = (address << 2) | ((rawbytes[1] >> 1) & 0x03);
+        bool on = rawbytes[1] & 0x01;
+
+        if (on)
+        {
+            accessory_state[output >> 3] |= (1 << (output & 0x07));
+        }
+        else
+        {
+            accessory_state[output >> 3] &= ~(1 << (output & 0x07));
+        }
+
+        ++applied;
+        notify(DCC_VIRTUAL_ACCESSORY, output, 0, on);
+        return;
+    }
+
+    if ((p.getKind() & MULTIFUNCTION_PACKET_KIND_MASK) == 0 || (p.getKind() == IDLE_PACKET_KIND))
+    {
+        return;
+    }
+
+    bool long_address = (p.getAddressKind() == DCCPacket::DCC_LONG_ADDRESS);
+    size_t first = long_address ? 2 : 1;
+
+    if (!long_address && (address == 0)) //broadcast
+    {
+        for (uint16_t cab = 1; cab <= num_locos; ++cab)
+        {
+            locoPacket(cab, &rawbytes[first], count - first - 1);
+        }
+    }
+    else if ((address >= 1) && (address <= num_locos) && (long_address == (address > 127)))
+    {
+        locoPacket(address, &rawbytes[first], count - first - 1);
+    }
+}
+
+uint8_t DCCVirtualDecoders::getSpeed(uint16_t cab) const
+{
+    return ((cab >= 1) && (cab <= num_locos)) ? locos[cab - 1].speed : 0;
+}
+
+uint32_t DCCVirtualDecoders::getFunctions(uint16_t cab) const
+{
+    return ((cab >= 1) && (cab <= num_locos)) ? locos[cab - 1].functions : 0;
+}
+
+uint8_t DCCVirtualDecoders::getCV(uint16_t cab, uint16_t CV) const
+{
+    return ((cab >= 1) && (cab <= num_locos) && (CV >= 1) && (CV <= DCC_VIRTUAL_CVS)) ? locos[cab - 1].cv[CV - 1] : 0;
+}
+
+bool DCCVirtualDecoders::getAccessory(uint16_t output) const
+{
+    return (output < ((DCC_VIRTUAL_MAX_ACCESSORY + 1) * 4)) && (accessory_state[output >> 3] & (1 << (output & 0x07)));
+}
+
+/****************************************************************************
+ * Private Functions
+ ****************************************************************************/
+
+//xorshift32: the same losses every run
+bool DCCVirtualDecoders::lost(uint16_t permille)
+{
+    if (!permille)
+    {
+        return false;
+    }
+
+    random_state ^= random_state << 13;
+    random_state ^= random_state >> 17;
+    random_state ^= random_state << 5;
+    return (random_state % 1000) < permille;
+}
+
+//count: bytes of instruction and data, without the XOR
+void DCCVirtualDecoders::locoPacket(uint16_t cab, const uint8_t* instruction, size_t count)
+{
+    loco_t& l = locos[cab - 1];
+    uint8_t i = instruction[0];
+    uint8_t first_function;
+    uint8_t bits;
+
+    if (lost(l.loss))
+    {
+        ++dropped;
+        return;
+    }
+
+    if ((i == 0x3F) && (count == 2)) //128 speed steps
+    {
+        l.speed = instruction[1];
+        ++applied;
+        notify(DCC_VIRTUAL_SPEED, cab, 0, l.speed);
+        return;
+    }
+
+    if ((i & 0xC0) == 0x40) //14 or 28 speed steps
+    {
+        l.speed = i;
+        ++applied;
+        notify(DCC_VIRTUAL_SPEED, cab, 0, l.speed);
+        return;
+    }
+
+    if (((i & 0xFC) == 0xEC) && (count == 3)) //write a CV byte
+    {
+        uint16_t CV = (((i & 0x03) << 8) | instruction[1]) + 1;
+        l.cv[CV - 1] = instruction[2];
+        ++applied;
+        notify(DCC_VIRTUAL_CV, cab, CV, instruction[2]);
+        return;
+    }
+
+    //function groups
+    if ((i & 0xE0) == 0x80)
+    {
+        first_function = 0;
+        bits = ((i >> 4) & 0x01) | ((i & 0x0F) << 1); //F0 is bit 4
+        l.functions = (l.functions & ~0x1FUL) | bits;
+    }
+    else if ((i & 0xF0) == 0xB0)
+    {
+        first_function = 5;
+        bits = i & 0x0F;
+    }
+    else if ((i & 0xF0) == 0xA0)
+    {
+        first_function = 9;
+        bits = i & 0x0F;
+    }
+    else if (((i == 0xDE) || (i == 0xDF)) && (count == 2))
+    {
+        first_function = (i == 0xDE) ? 13 : 21;
+        bits = instruction[1];
+    }
+    else
+    {
+        return; //not something these decoders do
+    }
+
+    if (first_function)
+    {
+        uint32_t mask = ((first_function < 13) ? 0x0FUL : 0xFFUL) << first_function;
+        l.functions = (l.functions & ~mask) | (((uint32_t)bits << first_function) & mask);
+    }
+
+    ++applied;
+    notify(DCC_VIRTUAL_FUNCTIONS, cab, first_function, bits);
+}
+
+void DCCVirtualDecoders::notify(uint8_t what, uint16_t address, uint16_t item, uint16_t value)
+{
+    if (handler)
+    {
+        dcc_virtual_event_t event = {what, address, item, value};
+        handler(event);
+    }
+}
+
+/****************************************************************************
+ * End of file
+ ****************************************************************************/
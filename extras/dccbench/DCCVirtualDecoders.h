@@ -0,0 +1,122 @@
+/*
+ * CmdrArduino
+ *
+ * Virtual Decoders
+ *
+ * A host-side stand-in for the decoders on a layout: a number of mobile
+ * decoders and basic accessory decoders, each of which carries out the
+ * packets addressed to it, or loses some of them at random.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef INC_DCCVIRTUALDECODERS_H
+#define INC_DCCVIRTUALDECODERS_H
+
+#include "DCCPacket.h"
+
+/****************************************************************************
+ * Defines
+ ****************************************************************************/
+
+#define DCC_VIRTUAL_CVS        1024
+#define DCC_VIRTUAL_MAX_LOCO   10239
+#define DCC_VIRTUAL_MAX_ACCESSORY 511
+
+// What a dcc_virtual_event_t is about
+#define DCC_VIRTUAL_SPEED      0 //value: the speed byte of a 128 step packet, or the instruction of a 14/28 step one
+#define DCC_VIRTUAL_FUNCTIONS  1 //item: first function of the group; value: the group's bits, lowest function in bit 0
+#define DCC_VIRTUAL_CV         2 //item: CV number; value: what was written
+#define DCC_VIRTUAL_ACCESSORY  3 //address: (decoder << 2) | pair; value: 1 if set, 0 if unset
+
+/****************************************************************************
+ * Data Types
+ ****************************************************************************/
+
+typedef struct
+{
+    uint8_t what;
+    uint16_t address; //loco cab (1-127 short, 128 and up long), or accessory output
+    uint16_t item;
+    uint16_t value;
+} dcc_virtual_event_t;
+
+//called every time a decoder carries out a packet, whether or not it changed anything
+typedef void (*dcc_virtual_handler_t)(const dcc_virtual_event_t& event);
+
+/**
+ * Locos are cabs 1 to the number asked for, short addresses up to 127 and
+ * long after that. Accessory decoders are 1 to the number asked for.
+ * Every decoder sees every packet, as on real rails, and each drops any
+ * packet with its own chance, in thousandths.
+**/
+class DCCVirtualDecoders
+{
+public:
+    DCCVirtualDecoders(uint16_t locos, uint16_t accessories, dcc_virtual_handler_t handler = 0);
+    ~DCCVirtualDecoders(void);
+
+    void setLoss(uint16_t permille); //every decoder
+    void setLocoLoss(uint16_t cab, uint16_t permille);
+    void setAccessoryLoss(uint16_t address, uint16_t permille);
+
+    //a packet as getBitstream() or DCCDecoder writes it
+    void receive(const uint8_t* rawbytes, size_t count);
+
+    uint8_t getSpeed(uint16_t cab) const;
+    uint32_t getFunctions(uint16_t cab) const; //F0 in bit 0, up to F28
+    uint8_t getCV(uint16_t cab, uint16_t CV) const;
+    bool getAccessory(uint16_t output) const;
+
+    inline uint32_t getApplied(void) const //packets carried out, counting once per decoder
+    {
+        return applied;
+    }
+
+    inline uint32_t getDropped(void) const
+    {
+        return dropped;
+    }
+
+private:
+    typedef struct
+    {
+        uint8_t speed;
+        uint32_t functions;
+        uint8_t cv[DCC_VIRTUAL_CVS];
+        uint16_t loss;
+    } loco_t;
+
+    uint16_t num_locos;
+    uint16_t num_accessories;
+    loco_t* locos; //[0] is cab 1
+    uint8_t* accessory_state; //bit for each output
+    uint16_t* accessory_loss;
+    dcc_virtual_handler_t handler;
+
+    uint32_t applied;
+    uint32_t dropped;
+    uint32_t random_state;
+
+    bool lost(uint16_t permille);
+    void locoPacket(uint16_t cab, const uint8_t* instruction, size_t count);
+    void notify(uint8_t what, uint16_t address, uint16_t item, uint16_t value);
+};
+
+#endif // INC_DCCVIRTUALDECODERS_H
+
+/****************************************************************************
+ * End of file
+ ****************************************************************************/
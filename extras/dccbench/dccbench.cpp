@@ -0,0 +1,759 @@
+/*
+ * CmdrArduino
+ *
+ * dccbench: how long commands take to reach the decoders
+ *
+ * Runs a DCCPacketScheduler on the simulated hardware against a layout of
+ * virtual decoders (DCCVirtualDecoders), all in simulated time, so an hour
+ * of running takes a second or two. Throttles make setSpeed128(),
+ * setFunctions0to4(), set/unsetBasicAccessory() and opsProgramCV() calls
+ * at random; every packet that goes out is turned into half bits, read
+ * back by a DCCDecoder, and handed to the decoders, which drop some of
+ * them if asked to.
+ *
+ * A command is timed from the call to the end of the first packet, put on
+ * the rails after the call, that leaves its decoder in the state asked
+ * for. A command replaced by another for the same thing before that
+ * happens is counted as superseded; one still waiting at the end never
+ * took effect.
+ *
+ * Scheduler settings are the DCCConfig.h ones, so to compare them build
+ * with -D, e.g. -DSPEED_REPEAT=1 or -DDCC_QUEUE_LOW_SIZE=32. Adaptive
+ * repeats are switched on with -q, which gives the scheduler the track's
+ * loss, and -f, which reports each packet to a loco as delivered or lost
+ * as RailCom would; repeats are spread out with -g, and the queues take
+ * addresses in turn with -i. Faults are
+ * injected with -p, packets each decoder drops; -b, bits in a million
+ * flipped on the rails, which every decoder then rejects; and -n, bursts
+ * of noise a second, -w milliseconds long, that spoil every packet on the
+ * rails while they last, as a dirty wheel or a loose joint would.
+ *
+ * With -k, the first locos are each on an encoder throttle that is being
+ * spun, a new speed every KNOB_INTERVAL_US, and are timed apart from the
+ * rest; -t sets the scheduler's governor window to rein them in.
+ *
+ * Build, from the top of the library:
+ *     g++ -std=gnu++11 -O2 -DDCC_HW_SIMULATED -DDCC_HOST_VIRTUAL_CLOCK \
+ *         -Iextras/host -Iextras/dccbench -I. extras/dccbench/dccbench.cpp \
+ *         extras/dccbench/DCCVirtualDecoders.cpp DCC*.cpp -o dccbench
+ *
+ * Usage: dccbench [-l locos] [-a accessory decoders] [-r commands per
+ *                 second] [-p packets lost per thousand] [-d seconds]
+ *                 [-s seed] [-b bit errors per million] [-q track loss
+ *                 per thousand for adaptive repeats] [-f] [-g repeat
+ *                 gap in packets[,backoff]] [-n noise bursts per second]
+ *                 [-w burst milliseconds] [-k locos on spun knobs]
+ *                 [-t governor milliseconds] [-i] [-v VCD file]
+ *                 [-e edge log]
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/****************************************************************************
+* Includes
+****************************************************************************/
+#include <Arduino.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "DCCPacketScheduler.h"
+#include "DCCDecoder.h"
+#include "DCCHardware.h"
+#include "DCCVirtualDecoders.h"
+
+#if !defined(DCC_HW_SIMULATED) || !defined(DCC_HOST_VIRTUAL_CLOCK)
+#error "dccbench needs DCC_HW_SIMULATED and DCC_HOST_VIRTUAL_CLOCK"
+#endif
+
+#if !DCC_SUPPORT_DECODER
+#error "dccbench needs DCC_SUPPORT_DECODER"
+#endif
+
+/****************************************************************************
+* Defines
+****************************************************************************/
+
+// The kinds of command timed
+#define BENCH_SPEED     0
+#define BENCH_FUNCTIONS 1
+#define BENCH_ACCESSORY 2
+#define BENCH_CV        3
+#define BENCH_KNOB      4 //speeds from the spun knobs
+#define BENCH_KINDS     5
+
+// How often a spun knob makes a call: 50 a second, as a quick twist of an encoder does
+#define KNOB_INTERVAL_US 20000
+
+// Latencies are counted in buckets of LATENCY_STEP_US, up to LATENCY_BUCKETS
+#define LATENCY_STEP_US 100
+#define LATENCY_BUCKETS 100000
+
+// Longest packet the monitor expands: preamble, then a zero and 8 bits a byte, and the end bit
+#define MAX_HALVES      (2 * (DCC_PREAMBLE_BITS + (9 * 6) + 1))
+
+/****************************************************************************
+* Data Types
+****************************************************************************/
+
+//the last command for one thing that hasn't taken effect yet
+typedef struct
+{
+    uint64_t called_us;
+    uint16_t item; //CV number, for BENCH_CV
+    uint16_t value; //as the virtual decoder reports it
+    bool pending;
+} expect_t;
+
+typedef struct
+{
+    uint32_t called;
+    uint32_t rejected; //the scheduler turned it down
+    uint32_t superseded;
+    uint32_t timed;
+    uint32_t latency[LATENCY_BUCKETS + 1]; //the last bucket is everything longer
+    uint64_t latency_max_us;
+} figures_t;
+
+/****************************************************************************
+* Function Prototypes
+****************************************************************************/
+
+static uint64_t next_after(uint64_t t, double rate);
+static void call_one(void);
+static void spin_knobs(uint32_t tick);
+static void expect(uint8_t kind, expect_t& e, uint16_t item, uint16_t value, bool accepted);
+static void packet_monitor(const uint8_t* p_packet, size_t num_bytes, uint32_t start_us);
+static bool flip(void);
+static bool jammed(uint64_t from_us, uint64_t to_us);
+static uint32_t fault_next(void);
+static void decoded(const uint8_t* rawbytes, size_t count);
+static void applied(const dcc_virtual_event_t& event);
+static void took_effect(uint8_t kind, expect_t& e);
+static void print_figures(uint8_t kind, const char* name, const expect_t* e, uint32_t count);
+
+/****************************************************************************
+* Public Data
+****************************************************************************/
+
+uint64_t dcc_host_clock_us = 0;
+
+/****************************************************************************
+* Private Data
+****************************************************************************/
+
+static DCCPacketScheduler scheduler;
+static DCCDecoder decoder;
+static DCCVirtualDecoders* layout;
+
+static uint16_t num_locos = 100;
+static uint16_t num_accessories = 32;
+static uint16_t num_knobs = 0; //locos 1 to num_knobs are on spun knobs
+
+//what the throttles last asked for
+static uint8_t* speeds; //as the second byte of a 128 step packet
+static uint8_t* functions; //F0-F4, F0 in bit 0
+static uint8_t* outputs; //bit for each accessory output
+
+static expect_t* speed_expect;
+static expect_t* function_expect;
+static expect_t* cv_expect;
+static expect_t* accessory_expect;
+static figures_t figures[BENCH_KINDS];
+
+static uint64_t supplied_us; //when the packet being decoded was handed to the rails
+static uint64_t effect_us; //when it finished on the rails
+static uint32_t packets = 0;
+static uint64_t busy_us = 0; //on packets other than idles
+
+static uint32_t bit_errors = 0; //per million bits
+static uint32_t fault_random = 1; //apart from rand(), so the commands are the same whatever the faults
+static uint32_t bits_flipped = 0;
+
+static double burst_rate = 0; //bursts a second
+static uint32_t burst_us = 10000;
+static uint64_t burst_start_us = 0; //the next burst, or the one going on
+static uint32_t packets_jammed = 0;
+
+static bool feedback = false;
+static uint16_t feedback_cab; //the loco the packet being decoded is for, or 0
+static bool feedback_arrived;
+
+/****************************************************************************
+* Public Functions
+****************************************************************************/
+
+int main(int argc, char** argv)
+{
+    double rate = 20;
+    uint16_t loss = 0;
+    int seconds = 600;
+    unsigned int seed = 1;
+    int track_loss = -1;
+    unsigned int gap = 0;
+    unsigned int backoff = DCC_REPEAT_BACKOFF;
+    unsigned int governor = 0;
+    bool fair = false;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "l:a:r:p:d:s:b:q:fg:n:w:k:t:iv:e:")) != -1)
+    {
+        switch (opt)
+        {
+        case 'l':
+            num_locos = atoi(optarg);
+            break;
+        case 'a':
+            num_accessories = atoi(optarg);
+            break;
+        case 'r':
+            rate = atof(optarg);
+            break;
+        case 'p':
+            loss = atoi(optarg);
+            break;
+        case 'd':
+            seconds = atoi(optarg);
+            break;
+        case 's':
+            seed = atoi(optarg);
+            break;
+        case 'b':
+            bit_errors = atoi(optarg);
+            break;
+        case 'q':
+            track_loss = atoi(optarg);
+            break;
+        case 'f':
+            feedback = true;
+            break;
+        case 'g':
+            sscanf(optarg, "%u,%u", &gap, &backoff);
+            break;
+        case 'n':
+            burst_rate = atof(optarg);
+            break;
+        case 'w':
+            burst_us = atof(optarg) * 1000;
+            break;
+        case 'k':
+            num_knobs = atoi(optarg);
+            break;
+        case 't':
+            governor = atoi(optarg);
+            break;
+        case 'i':
+            fair = true;
+            break;
+        case 'v':
+        case 'e':
+            if (!dcc_hardware_capture(optarg, (opt == 'v') ? DCC_CAPTURE_VCD : DCC_CAPTURE_EDGES))
+            {
+                perror(optarg);
+                return 1;
+            }
+            break;
+        default:
+            fprintf(stderr, "usage: %s [-l locos] [-a accessories] [-r rate] [-p loss] [-d seconds] [-s seed] [-b bit errors] [-q track loss] [-f] [-g gap[,backoff]] [-n bursts] [-w burst ms] [-k knobs] [-t governor ms] [-i] [-v vcd] [-e edges]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    if ((num_locos < 1) || (num_locos > DCC_VIRTUAL_MAX_LOCO) || (num_accessories > DCC_VIRTUAL_MAX_ACCESSORY) ||
+        (rate <= 0) || (loss > 1000) || (gap > DCC_REPEAT_MAX_GAP) || (burst_rate < 0) || (num_knobs >= num_locos) || (governor > 65535))
+    {
+        fprintf(stderr, "%s: need 1-%u locos, fewer of them on knobs, up to %u accessory decoders, a rate above 0, a loss up to 1000 and a gap up to %u\n",
+                argv[0], DCC_VIRTUAL_MAX_LOCO, DCC_VIRTUAL_MAX_ACCESSORY, DCC_REPEAT_MAX_GAP);
+        return 1;
+    }
+
+    srand(seed);
+    layout = new DCCVirtualDecoders(num_locos, num_accessories, applied);
+    layout->setLoss(loss);
+
+    speeds = new uint8_t[num_locos];
+    functions = new uint8_t[num_locos];
+    outputs = new uint8_t[num_accessories + 1];
+    speed_expect = new expect_t[num_locos];
+    function_expect = new expect_t[num_locos];
+    cv_expect = new expect_t[num_locos];
+    accessory_expect = new expect_t[(num_accessories + 1) * 4];
+
+    memset(speeds, 0, num_locos);
+    memset(functions, 0, num_locos);
+    memset(outputs, 0, num_accessories + 1);
+    memset(speed_expect, 0, num_locos * sizeof(expect_t));
+    memset(function_expect, 0, num_locos * sizeof(expect_t));
+    memset(cv_expect, 0, num_locos * sizeof(expect_t));
+    memset(accessory_expect, 0, (num_accessories + 1) * 4 * sizeof(expect_t));
+
+    scheduler.setup();
+    dcc_hardware_set_monitor(packet_monitor);
+
+    if ((track_loss >= 0) || feedback)
+    {
+        scheduler.setAdaptiveRepeat(true);
+        scheduler.setTrackLoss((track_loss > 0) ? track_loss : 0);
+    }
+
+    scheduler.setRepeatSpacing(gap, backoff);
+    scheduler.setGovernor(governor);
+    scheduler.setFairQueues(fair);
+
+    if (burst_rate > 0)
+    {
+        burst_start_us = (uint64_t)((-log((fault_next() + 1.0) / 4294967297.0) / burst_rate) * 1e6);
+    }
+
+    uint64_t end = seconds * 1000000ULL;
+    uint64_t next_call = next_after(0, rate);
+    uint64_t next_knob = num_knobs ? 0 : end;
+
+    while (dcc_host_clock_us < end)
+    {
+        //the throttles go first, so a packet put out at the same moment counts as after the call
+        while (next_call <= dcc_host_clock_us)
+        {
+            call_one();
+            next_call = next_after(next_call, rate);
+        }
+
+        while (next_knob <= dcc_host_clock_us)
+        {
+            spin_knobs(next_knob / KNOB_INTERVAL_US);
+            next_knob += KNOB_INTERVAL_US;
+        }
+
+        scheduler.update();
+
+        //on to whichever comes first: the rails wanting a packet, or the next call
+        uint32_t wait = dcc_hardware_wait_us();
+        uint64_t wake = dcc_host_clock_us + (wait ? wait : 1);
+        wake = (wake < next_call) ? wake : next_call;
+        dcc_host_clock_us = (wake < next_knob) ? wake : next_knob;
+    }
+
+    dcc_hardware_capture_stop();
+
+    printf("dccbench: %u locos, %u accessory decoders, %.1f commands/s, %u/1000 lost, %u/1000000 bits flipped, %ds simulated\n",
+           num_locos, num_accessories, rate, loss, bit_errors, seconds);
+
+    if ((track_loss >= 0) || feedback)
+    {
+        printf("dccbench: adaptive repeats, track loss %d/1000%s, ended at %u/1000\n", (track_loss > 0) ? track_loss : 0,
+               feedback ? " and feedback" : "", scheduler.getLoss(0, DCCPacket::DCC_SHORT_ADDRESS));
+    }
+    else
+    {
+        printf("dccbench: fixed repeats, speed %u, functions %u, ops mode %u, others %u\n",
+               SPEED_REPEAT, FUNCTION_REPEAT, OPS_MODE_PROGRAMMING_REPEAT, OTHER_REPEAT);
+    }
+
+    if (fair)
+    {
+        printf("dccbench: low priority and repeat queues take addresses in turn\n");
+    }
+
+    if (gap)
+    {
+        printf("dccbench: repeats spaced %u packets apart, backing off %ux\n", gap, backoff);
+    }
+
+    if (num_knobs)
+    {
+        printf("dccbench: %u locos on knobs spun %u times a second\n", num_knobs, 1000000 / KNOB_INTERVAL_US);
+    }
+
+    if (governor)
+    {
+        printf("dccbench: governed to one command per %ums, %u coalesced, %u held to the end of a window\n",
+               governor, scheduler.getCoalesced(), scheduler.getDeferred());
+    }
+
+    if (burst_rate > 0)
+    {
+        printf("dccbench: %.2f noise bursts a second, %.1fms long, spoiled %u packets\n", burst_rate, burst_us / 1000.0, packets_jammed);
+    }
+
+    printf("dccbench: %u packets, rails %.1f%% busy, %u bits flipped, %u decoded (%u bad), %u carried out, %u dropped\n",
+           packets, (100.0 * busy_us) / dcc_host_clock_us, bits_flipped, decoder.getPackets(),
+           decoder.getChecksumErrors() + decoder.getFramingErrors(), layout->getApplied(), layout->getDropped());
+
+    uint32_t took_effect = 0;
+
+    for (uint8_t kind = 0; kind < BENCH_KINDS; ++kind)
+    {
+        took_effect += figures[kind].timed;
+    }
+
+    printf("dccbench: %u commands took effect, %.2f per second of the rails' busy time\n", took_effect, took_effect / (busy_us / 1e6));
+
+    print_figures(BENCH_SPEED, "setSpeed128", speed_expect + num_knobs, num_locos - num_knobs);
+    print_figures(BENCH_FUNCTIONS, "setFunctions0to4", function_expect, num_locos);
+    print_figures(BENCH_ACCESSORY, "setBasicAccessory", accessory_expect, (num_accessories + 1) * 4);
+    print_figures(BENCH_CV, "opsProgramCV", cv_expect, num_locos);
+
+    if (num_knobs)
+    {
+        print_figures(BENCH_KNOB, "knob setSpeed128", speed_expect, num_knobs);
+    }
+
+    delete layout;
+    delete[] speeds;
+    delete[] functions;
+    delete[] outputs;
+    delete[] speed_expect;
+    delete[] function_expect;
+    delete[] cv_expect;
+    delete[] accessory_expect;
+    return 0;
+}
+
+/****************************************************************************
+* Private Functions
+****************************************************************************/
+
+//commands come at random, rate times a second on average
+static uint64_t next_after(uint64_t t, double rate)
+{
+    double u = (rand() + 1.0) / (RAND_MAX + 2.0);
+    return t + (uint64_t)((-log(u) / rate) * 1e6) + 1;
+}
+
+//one command, from a throttle: mostly speeds, some functions and turnouts, now and then a CV
+static void call_one(void)
+{
+    uint16_t cab = num_knobs + (rand() % (num_locos - num_knobs)) + 1;
+    DCCPacket::address_kind_t kind = (cab > 127) ? DCCPacket::DCC_LONG_ADDRESS : DCCPacket::DCC_SHORT_ADDRESS;
+    int what = rand() % 20;
+
+    if (num_accessories && (what < 2))
+    {
+        uint16_t address = (rand() % num_accessories) + 1;
+        uint8_t pair = rand() % 4;
+        uint16_t output = (address << 2) | pair;
+        bool on = !(outputs[address] & (1 << pair));
+
+        outputs[address] ^= 1 << pair;
+        bool accepted = on ? scheduler.setBasicAccessory(address, pair) : scheduler.unsetBasicAccessory(address, pair);
+        expect(BENCH_ACCESSORY, accessory_expect[output], 0, on, accepted);
+    }
+    else if (what < 3)
+    {
+        uint16_t CV = 49 + (rand() % 16); //manufacturer's own CVs, well away from the address ones
+        uint8_t value = rand() % 256;
+
+        expect(BENCH_CV, cv_expect[cab - 1], CV, value, scheduler.opsProgramCV(cab, kind, CV, value));
+    }
+    else if (what < 7)
+    {
+        functions[cab - 1] ^= 1 << (rand() % 5);
+        expect(BENCH_FUNCTIONS, function_expect[cab - 1], 0, functions[cab - 1],
+               scheduler.setFunctions0to4(cab, kind, functions[cab - 1]));
+    }
+    else
+    {
+        //always a different speed from the last one, or there'd be nothing to see
+        uint8_t speed;
+
+        do
+        {
+            speed = ((rand() % 2) << 7) | (2 + (rand() % 126));
+        }
+        while (speed == speeds[cab - 1]);
+
+        speeds[cab - 1] = speed;
+        int8_t new_speed = (speed & 0x80) ? (speed & 0x7F) : -(speed & 0x7F);
+        expect(BENCH_SPEED, speed_expect[cab - 1], 0, speed, scheduler.setSpeed128(cab, kind, new_speed));
+    }
+}
+
+//each spun knob sweeps its loco's speed up and back down, forwards, a step each call
+static void spin_knobs(uint32_t tick)
+{
+    for (uint16_t cab = 1; cab <= num_knobs; ++cab)
+    {
+        uint8_t sweep = (tick + (cab * 37)) % 250;
+        uint8_t speed = 0x80 | (2 + ((sweep < 125) ? sweep : (249 - sweep)));
+
+        if (speed == speeds[cab - 1])
+        {
+            continue;
+        }
+
+        speeds[cab - 1] = speed;
+        DCCPacket::address_kind_t kind = (cab > 127) ? DCCPacket::DCC_LONG_ADDRESS : DCCPacket::DCC_SHORT_ADDRESS;
+        expect(BENCH_KNOB, speed_expect[cab - 1], 0, speed, scheduler.setSpeed128(cab, kind, speed & 0x7F));
+    }
+}
+
+static void expect(uint8_t kind, expect_t& e, uint16_t item, uint16_t value, bool accepted)
+{
+    ++figures[kind].called;
+
+    if (!accepted)
+    {
+        ++figures[kind].rejected;
+        return;
+    }
+
+    if (e.pending)
+    {
+        ++figures[kind].superseded;
+    }
+
+    e.called_us = dcc_host_clock_us;
+    e.item = item;
+    e.value = value;
+    e.pending = true;
+}
+
+//out to the rails as half bits, and back in through a DCCDecoder
+static void packet_monitor(const uint8_t* p_packet, size_t num_bytes, uint32_t start_us)
+{
+    uint16_t halves[MAX_HALVES];
+    size_t n = 0;
+    uint32_t length_us = 0;
+
+    if (num_bytes > 6)
+    {
+        return;
+    }
+
+    DCCPacket p;
+    feedback_cab = 0;
+
+    if (feedback && p.setBitstream(p_packet, num_bytes) && (p.getKind() & MULTIFUNCTION_PACKET_KIND_MASK) &&
+        (p.getKind() != IDLE_PACKET_KIND) && p.getAddress() && (p.getAddress() <= num_locos) &&
+        ((p.getAddressKind() == DCCPacket::DCC_LONG_ADDRESS) == (p.getAddress() > 127)))
+    {
+        feedback_cab = p.getAddress();
+        feedback_arrived = false;
+    }
+
+    for (uint8_t i = 0; i < DCC_PREAMBLE_BITS; ++i)
+    {
+        halves[n++] = DCC_ONE_US;
+        halves[n++] = DCC_ONE_US;
+    }
+
+    for (size_t i = 0; i < num_bytes; ++i)
+    {
+        halves[n++] = DCC_ZERO_HIGH_US;
+        halves[n++] = DCC_ZERO_LOW_US;
+
+        for (uint8_t mask = 0x80; mask; mask >>= 1)
+        {
+            bool one = p_packet[i] & mask;
+
+            if (flip())
+            {
+                one = !one;
+                ++bits_flipped;
+            }
+
+            halves[n++] = one ? DCC_ONE_US : DCC_ZERO_HIGH_US;
+            halves[n++] = one ? DCC_ONE_US : DCC_ZERO_LOW_US;
+        }
+    }
+
+    halves[n++] = DCC_ONE_US;
+    halves[n++] = DCC_ONE_US;
+
+    for (size_t i = 0; i < n; ++i)
+    {
+        length_us += halves[i];
+    }
+
+    //start_us may be a little ahead of the clock, behind the packet before
+    supplied_us = dcc_host_clock_us;
+    effect_us = dcc_host_clock_us + (int32_t)(start_us - (uint32_t)dcc_host_clock_us) + length_us;
+
+    if (jammed(effect_us - length_us, effect_us))
+    {
+        //turn the first bit of the address byte over, so it fails the checksum
+        size_t first = (2 * DCC_PREAMBLE_BITS) + 2;
+        bool one = (halves[first] == DCC_ONE_US);
+
+        halves[first] = one ? DCC_ZERO_HIGH_US : DCC_ONE_US;
+        halves[first + 1] = one ? DCC_ZERO_LOW_US : DCC_ONE_US;
+        ++packets_jammed;
+    }
+    if (p_packet[0] != 0xFF)
+    {
+        busy_us += length_us;
+    }
+
+    ++packets;
+
+    decoder.decode(halves, n, decoded);
+
+    if (feedback_cab)
+    {
+        scheduler.reportDelivery(feedback_cab, (feedback_cab > 127) ? DCCPacket::DCC_LONG_ADDRESS : DCCPacket::DCC_SHORT_ADDRESS,
+                                 feedback_arrived);
+    }
+}
+
+//a bit error is a one in a million chance
+static bool flip(void)
+{
+    if (!bit_errors)
+    {
+        return false;
+    }
+
+    return (fault_next() % 1000000) < bit_errors;
+}
+
+//does a burst of noise overlap this stretch of time? bursts come at random, burst_rate a second
+static bool jammed(uint64_t from_us, uint64_t to_us)
+{
+    if (burst_rate <= 0)
+    {
+        return false;
+    }
+
+    //bursts that ended before this packet began are gone for good
+    while (burst_start_us + burst_us <= from_us)
+    {
+        double u = (fault_next() + 1.0) / 4294967297.0;
+        burst_start_us += burst_us + (uint64_t)((-log(u) / burst_rate) * 1e6);
+    }
+
+    return burst_start_us < to_us;
+}
+
+//xorshift32
+static uint32_t fault_next(void)
+{
+    fault_random ^= fault_random << 13;
+    fault_random ^= fault_random >> 17;
+    fault_random ^= fault_random << 5;
+    return fault_random;
+}
+
+static void decoded(const uint8_t* rawbytes, size_t count)
+{
+    layout->receive(rawbytes, count);
+}
+
+static void applied(const dcc_virtual_event_t& event)
+{
+    if (feedback_cab && (event.what != DCC_VIRTUAL_ACCESSORY) && (event.address == feedback_cab))
+    {
+        feedback_arrived = true;
+    }
+
+    switch (event.what)
+    {
+    case DCC_VIRTUAL_SPEED:
+        if (speed_expect[event.address - 1].value == event.value)
+        {
+            took_effect((event.address <= num_knobs) ? BENCH_KNOB : BENCH_SPEED, speed_expect[event.address - 1]);
+        }
+        break;
+    case DCC_VIRTUAL_FUNCTIONS:
+        if ((event.item == 0) && (function_expect[event.address - 1].value == event.value))
+        {
+            took_effect(BENCH_FUNCTIONS, function_expect[event.address - 1]);
+        }
+        break;
+    case DCC_VIRTUAL_CV:
+        if ((cv_expect[event.address - 1].item == event.item) && (cv_expect[event.address - 1].value == event.value))
+        {
+            took_effect(BENCH_CV, cv_expect[event.address - 1]);
+        }
+        break;
+    case DCC_VIRTUAL_ACCESSORY:
+        if (accessory_expect[event.address].value == event.value)
+        {
+            took_effect(BENCH_ACCESSORY, accessory_expect[event.address]);
+        }
+        break;
+    }
+}
+
+static void took_effect(uint8_t kind, expect_t& e)
+{
+    //a packet already on its way when the call was made doesn't count
+    if (!e.pending || (supplied_us < e.called_us))
+    {
+        return;
+    }
+
+    figures_t& f = figures[kind];
+    uint64_t us = effect_us - e.called_us;
+    uint64_t bucket = us / LATENCY_STEP_US;
+
+    ++f.latency[(bucket < LATENCY_BUCKETS) ? bucket : LATENCY_BUCKETS];
+    ++f.timed;
+
+    if (us > f.latency_max_us)
+    {
+        f.latency_max_us = us;
+    }
+
+    e.pending = false;
+}
+
+static void print_figures(uint8_t kind, const char* name, const expect_t* e, uint32_t count)
+{
+    const figures_t& f = figures[kind];
+    uint32_t never = 0;
+
+    for (uint32_t i = 0; i < count; ++i)
+    {
+        if (e[i].pending)
+        {
+            ++never;
+        }
+    }
+
+    printf("%-18s %7u called, %u rejected, %u superseded, %u never took effect",
+           name, f.called, f.rejected, f.superseded, never);
+
+    if (!f.timed)
+    {
+        printf("\n");
+        return;
+    }
+
+    //p50, p90 and p99, to the top of their bucket
+    static const uint16_t permille[] = {500, 900, 990};
+    uint32_t seen = 0;
+    uint8_t next = 0;
+
+    printf("; latency");
+
+    for (uint32_t i = 0; (i <= LATENCY_BUCKETS) && (next < 3); ++i)
+    {
+        seen += f.latency[i];
+
+        while ((next < 3) && ((uint64_t)seen * 1000 >= (uint64_t)f.timed * permille[next]))
+        {
+            printf(" p%u %.1fms", permille[next] / 10, ((i + 1) * LATENCY_STEP_US) / 1000.0);
+            ++next;
+        }
+    }
+
+    printf(" max %.1fms\n", f.latency_max_us / 1000.0);
+}
+
+/****************************************************************************
+* End of file
+****************************************************************************/
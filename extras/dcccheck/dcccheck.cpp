@@ -0,0 +1,2351 @@
+/*
+ * CmdrArduino
+ *
+ * dcccheck: checks of the library's behaviour that can be run on a host
+ *
+ * Runs a DCCPacketScheduler on the simulated hardware, in simulated time,
+ * and checks that what reaches the rails is what each feature says it
+ * should be. Every check starts from a new scheduler. Each prints a line
+ * saying whether it passed, and every failed expectation is printed with
+ * its line number; the exit status is the number of checks that failed.
+ *
+ * roundtrip: a packet of every kind the scheduler builds is put on the
+ *     rails, turned into half bits, read back by a DCCDecoder, and must
+ *     come back byte for byte as it went out, and as DCCPacket's
+ *     getBitstream() writes it after setBitstream().
+ *
+ * speeds: every speed, in each speed step mode, reaches the rails as
+ *     S 9.2 says it should, which checks the PROGMEM tables setSpeed14()
+ *     and setSpeed28() look steps up in.
+ *
+ * consist: addToConsist() writes CV19, after which a member's speeds and
+ *     e-stops go to the consist address, turned round if the member is, while
+ *     its functions still go to it; removeFromConsist() undoes all that.
+ *
+ * route: setRoute() sends its turnouts in order, DCC_ROUTE_INTERVAL_MS
+ *     apart, going straight past those the accessory cache says are already
+ *     set that way, and cancelRoute() stops it part way.
+ *
+ * timers: a DCCTimerWheel is run through several wraps of its 16 bit clock
+ *     with timers added and cancelled at random, and must fire each one on
+ *     the same tick a plain list of expiry times does. Adding with the wheel
+ *     behind the clock counts from the clock, and pulseBasicAccessory()
+ *     switches the output off the packets asked for later.
+ *
+ * parser: each DCC++ command DCCCommandParser knows puts the packet it
+ *     should on the rails, and garbled or out of range ones are errors that
+ *     send nothing and don't upset the command after.
+ *
+ * frames: a frame from DCCFrameEncoder carries out each of its commands
+ *     through DCCFrameDecoder, by parse() or through the receive() ring. A
+ *     frame with a bad CRC carries out none, and the decoder finds the
+ *     next good frame after it, and after noise and stray sync bytes.
+ *
+ * inbox: threads post ramps of speeds to a DCCInbox all at once while the
+ *     main thread drains it into the scheduler. Every post that's taken
+ *     reaches the rails, each loco's speeds in the order they were posted,
+ *     and every post turned away is counted as the inbox being full.
+ *
+ * adaptive: with adaptive repeat on, a packet goes out as many times as its
+ *     loss needs for DCC_ADAPTIVE_MISS_PPM, or DCC_ADAPTIVE_ESTOP_MISS_PPM
+ *     for an e-stop: the track's loss, or the loco's own once it has
+ *     reported deliveries. A service class with its own repeat keeps it.
+ *
+ * governor: with a window set, a loco's first speed goes straight away, and
+ *     those after it in the window are held, each replacing the one before,
+ *     until the latest goes when the window ends. Stops, changes of
+ *     direction and other function groups aren't held.
+ *
+ * fair: with fair queues on, locos queued behind another's burst of
+ *     commands get their turn after one of its packets rather than all of
+ *     them; with them off, they wait. Either way every packet goes out as
+ *     often as it should.
+ *
+ * visit: visit() shows a queue's packets in the order they'll go out, and
+ *     says to look again if it was caught part way through a change, or the
+ *     queue changed while it looked; visitQueues() goes through the
+ *     scheduler's queues from the e-stop queue down.
+ *
+ * momentum: setSpeedTarget() steps a loco towards its target at the rate
+ *     asked for, never backing off or going past it, and ends there. A ramp
+ *     after setSpeed() starts from the speed it set.
+ *
+ * accessory: with the accessory cache on, outputs of one decoder set in the
+ *     same update all reach the rails, and none is sent again while it's
+ *     still that way; setting one output both ways sends only the last.
+ *
+ * snapshot: a loco's functions and the accessory cache come back through
+ *     restoreSnapshot() after a power cut, but a cache that was cut off part
+ *     way through its first write to blank storage doesn't come back at all.
+ *
+ * spacing: with repeat spacing, each repeat of a packet waits its gap, the
+ *     gaps backing off up to DCC_REPEAT_MAX_GAP, and other locos' packets
+ *     and e-stops take turns in them; with it off, repeats go out as soon as
+ *     they can and one loco's e-stops all go before the next loco's.
+ *
+ * bandwidth: each packet takes as long on the rails as getWireTime() says,
+ *     which is what its half bits add up to, and what's queued goes out
+ *     within predictRefreshInterval() of asking, as do the speeds of locos
+ *     it was told are on their way.
+ *
+ * qos: a service class's priority puts all its locos' commands in the high
+ *     or the low priority queue whatever their kind, its repeat replaces
+ *     each kind's own, and its refresh_ms resends a loco's last speed that
+ *     often, once each time, until the loco is e-stopped.
+ *
+ * Build and run, from the top of the library:
+ *     g++ -std=gnu++11 -O2 -pthread -DDCC_HW_SIMULATED -DDCC_HOST_VIRTUAL_CLOCK \
+ *         -Iextras/host -I. extras/dcccheck/dcccheck.cpp DCC*.cpp -o dcccheck
+ *     ./dcccheck
+ *
+ * Adding -fsanitize=thread has the inbox check look for data races too, and
+ * -DDCC_SUPPORT_SNAPSHOT=1 adds the snapshot check, which starts afresh with
+ * DCC_SNAPSHOT_FILE in the current directory and removes it after.
+ *
+ * Usage: dcccheck [check ...]
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/****************************************************************************
+* Includes
+****************************************************************************/
+#include <Arduino.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "DCCPacketScheduler.h"
+#include "DCCDecoder.h"
+#include "DCCHardware.h"
+#if DCC_SUPPORT_TIMERS
+#include "DCCTimerWheel.h"
+#endif
+#if DCC_SUPPORT_PARSER
+#include "DCCCommandParser.h"
+#endif
+#if DCC_SUPPORT_FRAMES
+#include "DCCFrame.h"
+#include "DCCFrameDecoder.h"
+#endif
+#if DCC_SUPPORT_INBOX
+#include <thread>
+#include "DCCInbox.h"
+#endif
+#if DCC_SUPPORT_SNAPSHOT
+#include "DCCStorage.h"
+#endif
+
+#if !defined(DCC_HW_SIMULATED) || !defined(DCC_HOST_VIRTUAL_CLOCK)
+#error "dcccheck needs DCC_HW_SIMULATED and DCC_HOST_VIRTUAL_CLOCK"
+#endif
+
+#if !DCC_SUPPORT_DECODER
+#error "dcccheck needs DCC_SUPPORT_DECODER"
+#endif
+
+/****************************************************************************
+* Defines
+****************************************************************************/
+
+// Packets the rails log keeps for a check to look back over
+#define MAX_SENT        1024
+
+// Longest packet put into half bits: preamble, then a zero and 8 bits a byte, and the end bit
+#define MAX_HALVES      (2 * (DCC_PREAMBLE_BITS + (9 * DCC_PACKET_MAX_LEN) + 1))
+
+// Packets setup() puts out before anything else: 15 resets and 15 idles
+#define SETUP_PACKETS   30
+
+// Note a failed expectation, and carry on with the check
+#define CHECK(condition) \
+    do { if (!(condition)) { failed(__LINE__, #condition); } } while (0)
+
+/****************************************************************************
+* Data Types
+****************************************************************************/
+
+//one packet that went to the rails
+typedef struct
+{
+    uint8_t bytes[DCC_PACKET_MAX_LEN];
+    uint8_t count;
+    uint64_t start_us;
+} sent_t;
+
+typedef struct
+{
+    const char* name;
+    void (*run)(void);
+} check_t;
+
+//one command for the round trip, and what setBitstream() should make of the packet it sends
+typedef struct
+{
+    const char* name;
+    bool (*call)(DCCPacketScheduler& s);
+    uint8_t kind;
+    uint16_t address;
+    uint8_t address_kind;
+} roundtrip_t;
+
+//one command for the parser, and the packet it should send, less its error byte
+typedef struct
+{
+    const char* text;
+    uint8_t bytes[DCC_PACKET_MAX_LEN];
+    uint8_t count;
+} parse_t;
+
+/****************************************************************************
+* Function Prototypes
+****************************************************************************/
+
+static void failed(int line, const char* condition);
+static DCCPacketScheduler* start(void);
+static void finish(DCCPacketScheduler* s);
+static void run_packets(DCCPacketScheduler& s, size_t count);
+static void run_ms(DCCPacketScheduler& s, uint32_t ms);
+static void monitor(const uint8_t* p_packet, size_t num_bytes, uint32_t start_us);
+static size_t to_halves(const uint8_t* bytes, size_t count, uint16_t* halves);
+static const sent_t* find_sent(size_t from, uint8_t kind, uint16_t address, uint8_t address_kind);
+static uint8_t rails_speed(DCCPacketScheduler& s, uint16_t address);
+static const sent_t* find_bytes(size_t from, const uint8_t* bytes, uint8_t count);
+static size_t times_sent(DCCPacketScheduler& s, const uint8_t* bytes, uint8_t count);
+
+static void check_roundtrip(void);
+static void check_speeds(void);
+#if DCC_SUPPORT_CONSIST && DCC_SUPPORT_SPEED128
+static void check_consist(void);
+#endif
+#if DCC_SUPPORT_ROUTES
+static void check_route(void);
+#endif
+#if DCC_SUPPORT_TIMERS
+static void check_timers(void);
+#endif
+#if DCC_SUPPORT_PARSER
+static void check_parser(void);
+#endif
+#if DCC_SUPPORT_FRAMES && DCC_SUPPORT_SPEED128
+static void check_frames(void);
+#endif
+#if DCC_SUPPORT_INBOX && DCC_SUPPORT_SPEED128
+static void check_inbox(void);
+#endif
+#if DCC_SUPPORT_ADAPTIVE_REPEAT && DCC_SUPPORT_SPEED128
+static void check_adaptive(void);
+#endif
+#if DCC_SUPPORT_GOVERNOR && DCC_SUPPORT_SPEED128
+static void check_governor(void);
+#endif
+#if DCC_SUPPORT_FAIR_QUEUES && DCC_SUPPORT_FEATURE_EXPANSION && DCC_SUPPORT_OPS_MODE
+static void check_fair(void);
+#endif
+static void check_visit(void);
+#if DCC_SUPPORT_MOMENTUM && DCC_SUPPORT_SPEED128
+static void check_momentum(void);
+#endif
+#if DCC_SUPPORT_ACCESSORY_CACHE
+static void check_accessory(void);
+#endif
+#if DCC_SUPPORT_SNAPSHOT && DCC_SUPPORT_ACCESSORY_CACHE
+static void check_snapshot(void);
+#endif
+#if DCC_SUPPORT_REPEAT_SPACING
+static void check_spacing(void);
+#endif
+#if DCC_SUPPORT_BANDWIDTH && DCC_SUPPORT_SPEED128
+static void check_bandwidth(void);
+#endif
+#if DCC_SUPPORT_QOS && DCC_SUPPORT_SPEED128
+static void check_qos(void);
+#endif
+
+/****************************************************************************
+* Public Data
+****************************************************************************/
+
+uint64_t dcc_host_clock_us = 0;
+
+/****************************************************************************
+* Private Data
+****************************************************************************/
+
+static const check_t checks[] =
+{
+    { "roundtrip", check_roundtrip },
+    { "speeds", check_speeds },
+#if DCC_SUPPORT_CONSIST && DCC_SUPPORT_SPEED128
+    { "consist", check_consist },
+#endif
+#if DCC_SUPPORT_ROUTES
+    { "route", check_route },
+#endif
+#if DCC_SUPPORT_TIMERS
+    { "timers", check_timers },
+#endif
+#if DCC_SUPPORT_PARSER
+    { "parser", check_parser },
+#endif
+#if DCC_SUPPORT_FRAMES && DCC_SUPPORT_SPEED128
+    { "frames", check_frames },
+#endif
+#if DCC_SUPPORT_INBOX && DCC_SUPPORT_SPEED128
+    { "inbox", check_inbox },
+#endif
+#if DCC_SUPPORT_ADAPTIVE_REPEAT && DCC_SUPPORT_SPEED128
+    { "adaptive", check_adaptive },
+#endif
+#if DCC_SUPPORT_GOVERNOR && DCC_SUPPORT_SPEED128
+    { "governor", check_governor },
+#endif
+#if DCC_SUPPORT_FAIR_QUEUES && DCC_SUPPORT_FEATURE_EXPANSION && DCC_SUPPORT_OPS_MODE
+    { "fair", check_fair },
+#endif
+    { "visit", check_visit },
+#if DCC_SUPPORT_MOMENTUM && DCC_SUPPORT_SPEED128
+    { "momentum", check_momentum },
+#endif
+#if DCC_SUPPORT_ACCESSORY_CACHE
+    { "accessory", check_accessory },
+#endif
+#if DCC_SUPPORT_SNAPSHOT && DCC_SUPPORT_ACCESSORY_CACHE
+    { "snapshot", check_snapshot },
+#endif
+#if DCC_SUPPORT_REPEAT_SPACING
+    { "spacing", check_spacing },
+#endif
+#if DCC_SUPPORT_BANDWIDTH && DCC_SUPPORT_SPEED128
+    { "bandwidth", check_bandwidth },
+#endif
+#if DCC_SUPPORT_QOS && DCC_SUPPORT_SPEED128
+    { "qos", check_qos },
+#endif
+};
+
+static sent_t sent[MAX_SENT];
+static size_t sent_count; //since the check started; only the first MAX_SENT are kept
+
+static uint32_t failures; //in the check being run
+
+/****************************************************************************
+* Public Functions
+****************************************************************************/
+
+int main(int argc, char** argv)
+{
+    int bad = 0;
+
+    dcc_hardware_set_monitor(monitor);
+
+    for (size_t i = 0; i < (sizeof(checks) / sizeof(checks[0])); ++i)
+    {
+        bool wanted = (argc < 2);
+
+        for (int arg = 1; arg < argc; ++arg)
+        {
+            wanted = wanted || !strcmp(argv[arg], checks[i].name);
+        }
+
+        if (!wanted)
+        {
+            continue;
+        }
+
+        failures = 0;
+        sent_count = 0;
+        checks[i].run();
+        printf("dcccheck: %-10s %s\n", checks[i].name, failures ? "FAILED" : "ok");
+
+        if (failures)
+        {
+            ++bad;
+        }
+    }
+
+    return bad;
+}
+
+/****************************************************************************
+* Private Functions
+****************************************************************************/
+
+static void failed(int line, const char* condition)
+{
+    printf("dcccheck: line %d: %s\n", line, condition);
+    ++failures;
+}
+
+//a new scheduler, with the packets setup() sends already on the rails
+static DCCPacketScheduler* start(void)
+{
+    DCCPacketScheduler* s = new DCCPacketScheduler;
+
+    s->setup();
+    run_packets(*s, SETUP_PACKETS);
+    return s;
+}
+
+static void finish(DCCPacketScheduler* s)
+{
+    delete s; //its queues give their slots back to the pool
+}
+
+//runs update() until count more packets have gone out, moving the clock on as the rails would
+static void run_packets(DCCPacketScheduler& s, size_t count)
+{
+    size_t until = sent_count + count;
+
+    while (sent_count < until)
+    {
+        s.update();
+
+        uint32_t wait = dcc_hardware_wait_us();
+        dcc_host_clock_us += wait ? wait : 1;
+    }
+}
+
+//runs update() for ms of simulated time
+static void run_ms(DCCPacketScheduler& s, uint32_t ms)
+{
+    uint64_t until = dcc_host_clock_us + (ms * 1000ULL);
+
+    while (dcc_host_clock_us < until)
+    {
+        s.update();
+
+        uint32_t wait = dcc_hardware_wait_us();
+        dcc_host_clock_us += wait ? wait : 1;
+    }
+}
+
+static void monitor(const uint8_t* p_packet, size_t num_bytes, uint32_t start_us)
+{
+    if ((sent_count < MAX_SENT) && (num_bytes <= DCC_PACKET_MAX_LEN))
+    {
+        sent_t& p = sent[sent_count];
+
+        memcpy(p.bytes, p_packet, num_bytes);
+        p.count = num_bytes;
+        //start_us may be a little ahead of the clock, behind the packet before
+        p.start_us = dcc_host_clock_us + (int32_t)(start_us - (uint32_t)dcc_host_clock_us);
+    }
+
+    ++sent_count;
+}
+
+//the lengths of the half bits a packet is sent as
+static size_t to_halves(const uint8_t* bytes, size_t count, uint16_t* halves)
+{
+    size_t n = 0;
+
+    for (uint8_t i = 0; i < DCC_PREAMBLE_BITS; ++i)
+    {
+        halves[n++] = DCC_ONE_US;
+        halves[n++] = DCC_ONE_US;
+    }
+
+    for (size_t i = 0; i < count; ++i)
+    {
+        halves[n++] = DCC_ZERO_HIGH_US;
+        halves[n++] = DCC_ZERO_LOW_US;
+
+        for (uint8_t mask = 0x80; mask; mask >>= 1)
+        {
+            bool one = bytes[i] & mask;
+
+            halves[n++] = one ? DCC_ONE_US : DCC_ZERO_HIGH_US;
+            halves[n++] = one ? DCC_ONE_US : DCC_ZERO_LOW_US;
+        }
+    }
+
+    halves[n++] = DCC_ONE_US;
+    halves[n++] = DCC_ONE_US;
+    return n;
+}
+
+//the first packet logged from sent[from] on that reads back as this kind, for this address
+static const sent_t* find_sent(size_t from, uint8_t kind, uint16_t address, uint8_t address_kind)
+{
+    for (size_t i = from; (i < sent_count) && (i < MAX_SENT); ++i)
+    {
+        DCCPacket p;
+
+        if (p.setBitstream(sent[i].bytes, sent[i].count) && (p.getKind() == kind) &&
+                (p.getAddress() == address) && (p.getAddressKind() == address_kind))
+        {
+            return &sent[i];
+        }
+    }
+
+    return 0;
+}
+
+//the speed byte of the next speed packet a short address is sent, which must be the
+//one just queued for it; 0 if there's none among the next 10 packets
+static uint8_t rails_speed(DCCPacketScheduler& s, uint16_t address)
+{
+    size_t from = sent_count;
+    run_packets(s, 10);
+
+    const sent_t* p = find_sent(from, SPEED_PACKET_KIND, address, DCCPacket::DCC_SHORT_ADDRESS);
+    return p ? p->bytes[(p->bytes[1] == 0x3F) ? 2 : 1] : 0;
+}
+
+//the first packet logged from sent[from] on that is these bytes, and its error byte
+static const sent_t* find_bytes(size_t from, const uint8_t* bytes, uint8_t count)
+{
+    for (size_t i = from; (i < sent_count) && (i < MAX_SENT); ++i)
+    {
+        if ((sent[i].count == count + 1) && !memcmp(sent[i].bytes, bytes, count))
+        {
+            return &sent[i];
+        }
+    }
+
+    return 0;
+}
+
+//times these bytes, and their error byte, go out in the next 60 packets
+static size_t times_sent(DCCPacketScheduler& s, const uint8_t* bytes, uint8_t count)
+{
+    size_t times = 0;
+
+    sent_count = 0;
+    run_packets(s, 60);
+
+    for (size_t i = 0; (i < sent_count) && (i < MAX_SENT); ++i)
+    {
+        if ((sent[i].count == count + 1) && !memcmp(sent[i].bytes, bytes, count))
+        {
+            ++times;
+        }
+    }
+
+    return times;
+}
+
+/****************************************************************************
+* roundtrip
+****************************************************************************/
+
+static bool rt_nothing(DCCPacketScheduler& s)
+{
+    (void)s;
+    return true;
+}
+
+#if DCC_SUPPORT_SPEED14
+static bool rt_speed14(DCCPacketScheduler& s)
+{
+    return s.setSpeed14(3, DCCPacket::DCC_SHORT_ADDRESS, -7);
+}
+#endif
+
+#if DCC_SUPPORT_SPEED28
+static bool rt_speed28(DCCPacketScheduler& s)
+{
+    return s.setSpeed28(1234, DCCPacket::DCC_LONG_ADDRESS, 19);
+}
+#endif
+
+#if DCC_SUPPORT_SPEED128
+static bool rt_speed128(DCCPacketScheduler& s)
+{
+    return s.setSpeed128(127, DCCPacket::DCC_SHORT_ADDRESS, -100);
+}
+#endif
+
+static bool rt_functions0to4(DCCPacketScheduler& s)
+{
+    return s.setFunctions0to4(3, DCCPacket::DCC_SHORT_ADDRESS, 0x15);
+}
+
+static bool rt_functions5to8(DCCPacketScheduler& s)
+{
+    return s.setFunctions5to8(1234, DCCPacket::DCC_LONG_ADDRESS, 0x0A);
+}
+
+static bool rt_functions9to12(DCCPacketScheduler& s)
+{
+    return s.setFunctions9to12(3, DCCPacket::DCC_SHORT_ADDRESS, 0x05);
+}
+
+#if DCC_SUPPORT_FEATURE_EXPANSION
+static bool rt_functions13to20(DCCPacketScheduler& s)
+{
+    return s.setFunctions13to20(3, DCCPacket::DCC_SHORT_ADDRESS, 0xA5);
+}
+
+static bool rt_functions21to28(DCCPacketScheduler& s)
+{
+    return s.setFunctions21to28(10239, DCCPacket::DCC_LONG_ADDRESS, 0x5A);
+}
+
+static bool rt_functions29to68(DCCPacketScheduler& s)
+{
+    return s.setFunctions29to68(3, DCCPacket::DCC_SHORT_ADDRESS, 37, 0xC3);
+}
+
+static bool rt_binary_state(DCCPacketScheduler& s)
+{
+    return s.setBinaryState(1234, DCCPacket::DCC_LONG_ADDRESS, 300, true);
+}
+#endif
+
+#if DCC_SUPPORT_ACCESSORY
+static bool rt_set_accessory(DCCPacketScheduler& s)
+{
+    return s.setBasicAccessory(5, 1);
+}
+
+static bool rt_unset_accessory(DCCPacketScheduler& s)
+{
+    return s.unsetBasicAccessory(511, 3);
+}
+
+static bool rt_extended_accessory(DCCPacketScheduler& s)
+{
+    return s.setExtendedAccessory(2045, 0x1F);
+}
+#endif
+
+#if DCC_SUPPORT_OPS_MODE
+static bool rt_ops_cv(DCCPacketScheduler& s)
+{
+    return s.opsProgramCV(1234, DCCPacket::DCC_LONG_ADDRESS, 1000, 0xA5);
+}
+#endif
+
+static bool rt_estop_all(DCCPacketScheduler& s)
+{
+    return s.eStop();
+}
+
+static bool rt_estop_one(DCCPacketScheduler& s)
+{
+    return s.eStop(3, DCCPacket::DCC_SHORT_ADDRESS);
+}
+
+static const roundtrip_t roundtrips[] =
+{
+    { "idle", rt_nothing, IDLE_PACKET_KIND, 0xFF, DCCPacket::DCC_SHORT_ADDRESS },
+#if DCC_SUPPORT_SPEED14
+    { "setSpeed14", rt_speed14, SPEED_PACKET_KIND, 3, DCCPacket::DCC_SHORT_ADDRESS },
+#endif
+#if DCC_SUPPORT_SPEED28
+    { "setSpeed28", rt_speed28, SPEED_PACKET_KIND, 1234, DCCPacket::DCC_LONG_ADDRESS },
+#endif
+#if DCC_SUPPORT_SPEED128
+    { "setSpeed128", rt_speed128, SPEED_PACKET_KIND, 127, DCCPacket::DCC_SHORT_ADDRESS },
+#endif
+    { "setFunctions0to4", rt_functions0to4, FUNCTION_PACKET_1_KIND, 3, DCCPacket::DCC_SHORT_ADDRESS },
+    { "setFunctions5to8", rt_functions5to8, FUNCTION_PACKET_2_KIND, 1234, DCCPacket::DCC_LONG_ADDRESS },
+    { "setFunctions9to12", rt_functions9to12, FUNCTION_PACKET_3_KIND, 3, DCCPacket::DCC_SHORT_ADDRESS },
+#if DCC_SUPPORT_FEATURE_EXPANSION
+    { "setFunctions13to20", rt_functions13to20, FUNCTION_PACKET_4_KIND, 3, DCCPacket::DCC_SHORT_ADDRESS },
+    { "setFunctions21to28", rt_functions21to28, FUNCTION_PACKET_5_KIND, 10239, DCCPacket::DCC_LONG_ADDRESS },
+    { "setFunctions29to68", rt_functions29to68, FEATURE_EXPANSION_KIND, 3, DCCPacket::DCC_SHORT_ADDRESS },
+    { "setBinaryState", rt_binary_state, FEATURE_EXPANSION_KIND, 1234, DCCPacket::DCC_LONG_ADDRESS },
+#endif
+#if DCC_SUPPORT_ACCESSORY
+    { "setBasicAccessory", rt_set_accessory, BASIC_ACCESSORY_PACKET_KIND, 5, DCCPacket::DCC_SHORT_ADDRESS },
+    { "unsetBasicAccessory", rt_unset_accessory, BASIC_ACCESSORY_PACKET_KIND, 511, DCCPacket::DCC_SHORT_ADDRESS },
+    { "setExtendedAccessory", rt_extended_accessory, EXTENDED_ACCESSORY_PACKET_KIND, 2045, DCCPacket::DCC_SHORT_ADDRESS },
+#endif
+#if DCC_SUPPORT_OPS_MODE
+    { "opsProgramCV", rt_ops_cv, OPS_MODE_PROGRAMMING_KIND, 1234, DCCPacket::DCC_LONG_ADDRESS },
+#endif
+    { "eStop", rt_estop_all, ESTOP_PACKET_KIND, 0, DCCPacket::DCC_SHORT_ADDRESS },
+    { "eStop(address)", rt_estop_one, ESTOP_PACKET_KIND, 3, DCCPacket::DCC_SHORT_ADDRESS },
+};
+
+//every packet, from setup() on, must read back as it was sent, and each command must send its packet
+static void check_roundtrip(void)
+{
+    DCCDecoder decoder;
+    uint16_t halves[MAX_HALVES];
+    bool reset_seen = false;
+
+    for (size_t i = 0; i < (sizeof(roundtrips) / sizeof(roundtrips[0])); ++i)
+    {
+        const roundtrip_t& r = roundtrips[i];
+        sent_count = 0;
+        DCCPacketScheduler* s = start();
+        reset_seen = reset_seen || find_sent(0, RESET_PACKET_KIND, 0, DCCPacket::DCC_SHORT_ADDRESS);
+
+        size_t from = sent_count;
+        CHECK(r.call(*s));
+        run_packets(*s, 20);
+
+        if (!find_sent(from, r.kind, r.address, r.address_kind))
+        {
+            printf("dcccheck: %s sent nothing that reads back as kind %02X for %u\n", r.name, r.kind, r.address);
+            ++failures;
+        }
+
+        for (size_t j = 0; (j < sent_count) && (j < MAX_SENT); ++j)
+        {
+            const sent_t& p = sent[j];
+            uint8_t bytes[DCC_PACKET_MAX_LEN];
+            uint32_t before = decoder.getPackets();
+
+            decoder.reset();
+            size_t n = to_halves(p.bytes, p.count, halves);
+            CHECK(decoder.decode(halves, n) == 1);
+            CHECK(decoder.getPackets() == before + 1);
+            CHECK((decoder.getBitstream(bytes) == p.count) && !memcmp(bytes, p.bytes, p.count));
+
+            DCCPacket q;
+            CHECK(q.setBitstream(p.bytes, p.count));
+            CHECK((q.getBitstream(bytes) == p.count) && !memcmp(bytes, p.bytes, p.count));
+        }
+
+        finish(s);
+    }
+
+    CHECK(reset_seen);
+    CHECK(!decoder.getChecksumErrors() && !decoder.getFramingErrors());
+}
+
+/****************************************************************************
+* speeds
+****************************************************************************/
+
+//speeds are given as [-127,127] in every mode, where 1 is stop and 0 an e-stop that roundtrip covers
+static void check_speeds(void)
+{
+    DCCPacketScheduler* s = start();
+
+    for (int speed = -127; speed <= 127; ++speed)
+    {
+        uint8_t abs_speed = (speed < 0) ? -speed : speed;
+        uint8_t forward = (speed > 0);
+
+        if (!speed)
+        {
+            continue;
+        }
+
+        sent_count = 0; //the log needn't go back past this speed
+
+#if DCC_SUPPORT_SPEED14
+        //01DCSSSS, C being F0 here: 0 is stop, 1 e-stop, and 2-15 steps 1-14
+        uint8_t step14 = (abs_speed == 1) ? 0 : (2 + (((abs_speed - 2) * 13) / 125));
+        CHECK(s->setSpeed14(3, DCCPacket::DCC_SHORT_ADDRESS, speed, false));
+        CHECK(rails_speed(*s, 3) == (0x40 | (forward << 5) | step14));
+#endif
+
+#if DCC_SUPPORT_SPEED28
+        //01DCSSSS, C being the step's lowest bit: 0-1 are stop, 2-3 e-stop, and 4-31 steps 1-28
+        uint8_t step28 = (abs_speed == 1) ? 0 : (4 + (((abs_speed - 2) * 27) / 125));
+        CHECK(s->setSpeed28(4, DCCPacket::DCC_SHORT_ADDRESS, speed));
+        CHECK(rails_speed(*s, 4) == (0x40 | (forward << 5) | ((step28 & 0x01) << 4) | (step28 >> 1)));
+#endif
+
+#if DCC_SUPPORT_SPEED128
+        //00111111 DSSSSSSS: 0 is stop, 1 e-stop, and 2-127 steps 1-126
+        uint8_t step128 = (abs_speed == 1) ? 0 : abs_speed;
+        CHECK(s->setSpeed128(5, DCCPacket::DCC_SHORT_ADDRESS, speed));
+        CHECK(rails_speed(*s, 5) == ((forward << 7) | step128));
+#endif
+    }
+
+    finish(s);
+}
+
+#if DCC_SUPPORT_CONSIST && DCC_SUPPORT_SPEED128
+/****************************************************************************
+* consist
+****************************************************************************/
+
+//loco 1234, facing backwards, in consist 20
+static void check_consist(void)
+{
+    static const uint8_t cv19_set[] = { 0xC4, 0xD2, 0xEC, 0x12, 0x94 }; //write CV19 = 20, reversed
+    static const uint8_t cv19_clear[] = { 0xC4, 0xD2, 0xEC, 0x12, 0x00 };
+    static const uint8_t consist_speed[] = { 0x14, 0x3F, 0x1E }; //forwards 30 turned round
+    static const uint8_t consist_estop[] = { 0x14, 0x41 };
+    static const uint8_t own_speed[] = { 0xC4, 0xD2, 0x3F, 0x9E };
+    static const uint8_t own_functions[] = { 0xC4, 0xD2, 0x91 }; //F0 and F1
+    DCCPacketScheduler* s = start();
+
+    size_t from = sent_count;
+    CHECK(s->addToConsist(20, 1234, DCCPacket::DCC_LONG_ADDRESS, true));
+    run_packets(*s, 20);
+    CHECK(find_bytes(from, cv19_set, sizeof(cv19_set)));
+
+    from = sent_count;
+    CHECK(s->setSpeed(1234, DCCPacket::DCC_LONG_ADDRESS, 30, 128));
+    CHECK(s->setFunctions0to4(1234, DCCPacket::DCC_LONG_ADDRESS, 0x03));
+    run_packets(*s, 20);
+    CHECK(find_bytes(from, consist_speed, sizeof(consist_speed)));
+    CHECK(find_bytes(from, own_functions, sizeof(own_functions)));
+    CHECK(!find_sent(from, SPEED_PACKET_KIND, 1234, DCCPacket::DCC_LONG_ADDRESS));
+
+    //an e-stop stops the consist, and with it whatever speed it had queued
+    from = sent_count;
+    CHECK(s->eStop(1234, DCCPacket::DCC_LONG_ADDRESS));
+    run_packets(*s, 20);
+    CHECK(find_bytes(from, consist_estop, sizeof(consist_estop)));
+    CHECK(!find_sent(from, ESTOP_PACKET_KIND, 1234, DCCPacket::DCC_LONG_ADDRESS));
+    CHECK(!find_sent(from, SPEED_PACKET_KIND, 20, DCCPacket::DCC_SHORT_ADDRESS));
+
+    from = sent_count;
+    CHECK(s->removeFromConsist(1234, DCCPacket::DCC_LONG_ADDRESS));
+    CHECK(!s->removeFromConsist(1234, DCCPacket::DCC_LONG_ADDRESS));
+    run_packets(*s, 20);
+    CHECK(find_bytes(from, cv19_clear, sizeof(cv19_clear)));
+
+    from = sent_count;
+    CHECK(s->setSpeed(1234, DCCPacket::DCC_LONG_ADDRESS, 30, 128));
+    run_packets(*s, 20);
+    CHECK(find_bytes(from, own_speed, sizeof(own_speed)));
+    CHECK(!find_sent(from, SPEED_PACKET_KIND, 20, DCCPacket::DCC_SHORT_ADDRESS));
+
+    //consist addresses are short, and not 0
+    CHECK(!s->addToConsist(0, 1234, DCCPacket::DCC_LONG_ADDRESS));
+    CHECK(!s->addToConsist(128, 1234, DCCPacket::DCC_LONG_ADDRESS));
+    finish(s);
+}
+#endif
+
+#if DCC_SUPPORT_ROUTES
+/****************************************************************************
+* route
+****************************************************************************/
+
+// Leeway for a turnout to wait on the packet on the rails when its time came
+#define ROUTE_SLACK_US  20000ULL
+
+static const uint16_t route[] PROGMEM =
+{
+    DCC_ROUTE_ENTRY(1, 0, true),
+    DCC_ROUTE_ENTRY(2, 1, false),
+    DCC_ROUTE_ENTRY(3, 2, true),
+    DCC_ROUTE_ENTRY(300, 3, true),
+};
+
+static const uint16_t route_addresses[] = { 1, 2, 3, 300 };
+
+//when each of the route's turnouts first went out, from sent[from] on; 0 for those that didn't
+static void route_times(size_t from, uint64_t* times)
+{
+    for (size_t i = 0; i < (sizeof(route_addresses) / sizeof(route_addresses[0])); ++i)
+    {
+        const sent_t* p = find_sent(from, BASIC_ACCESSORY_PACKET_KIND, route_addresses[i], DCCPacket::DCC_SHORT_ADDRESS);
+        times[i] = p ? p->start_us : 0;
+    }
+}
+
+static void check_route(void)
+{
+    uint64_t times[sizeof(route_addresses) / sizeof(route_addresses[0])];
+    DCCPacketScheduler* s = start();
+
+    //all of it, a turnout each DCC_ROUTE_INTERVAL_MS
+    sent_count = 0;
+    CHECK(s->setRoute(route, 4));
+    CHECK(!s->setRoute(route, 4));
+    CHECK(s->getRouteRemaining() == 4);
+    run_ms(*s, 1000);
+    CHECK(s->getRouteRemaining() == 0);
+    route_times(0, times);
+
+    for (size_t i = 0; i < 4; ++i)
+    {
+        CHECK(times[i]);
+
+        if (i && times[i] && times[i - 1])
+        {
+            CHECK(times[i] - times[i - 1] >= (DCC_ROUTE_INTERVAL_MS * 1000ULL));
+            CHECK(times[i] - times[i - 1] <= (DCC_ROUTE_INTERVAL_MS * 1000ULL) + ROUTE_SLACK_US);
+        }
+    }
+
+    //cancelled after the first
+    sent_count = 0;
+    CHECK(s->setRoute(route, 4));
+    run_ms(*s, DCC_ROUTE_INTERVAL_MS / 2);
+    s->cancelRoute();
+    CHECK(s->getRouteRemaining() == 0);
+    size_t from = sent_count;
+    run_ms(*s, 1000);
+    route_times(from, times);
+    CHECK(!times[1] && !times[2] && !times[3]);
+
+#if DCC_SUPPORT_ACCESSORY_CACHE
+    //with only 2 and 3 already set that way, 300 follows 1 without waiting on them
+    s->clearAccessoryCache();
+    s->setAccessoryCache(true);
+    CHECK(s->unsetBasicAccessory(2, 1));
+    CHECK(s->setBasicAccessory(3, 2));
+    run_ms(*s, 1000);
+    sent_count = 0;
+    CHECK(s->setRoute(route, 4));
+    run_ms(*s, 1000);
+    CHECK(s->getRouteRemaining() == 0);
+    route_times(0, times);
+    CHECK(times[0] && !times[1] && !times[2] && times[3]);
+    CHECK(times[3] - times[0] >= (DCC_ROUTE_INTERVAL_MS * 1000ULL));
+    CHECK(times[3] - times[0] <= (DCC_ROUTE_INTERVAL_MS * 1000ULL) + ROUTE_SLACK_US);
+#endif
+
+    finish(s);
+}
+#endif
+
+#if DCC_SUPPORT_TIMERS
+/****************************************************************************
+* timers
+****************************************************************************/
+
+// Ticks the random run lasts: three wraps of the wheel's clock, starting just short of one
+#define TIMER_TICKS     (3 * 65536UL)
+#define TIMER_START     65000U
+
+//the reference: when each timer is due, on a clock that doesn't wrap
+typedef struct
+{
+    bool pending;
+    uint32_t expires;
+    uint16_t period;
+    uint16_t address; //of the timer's packet, which is new for each timer added
+} timer_ref_t;
+
+static uint32_t timer_random_state = 1;
+
+//the same numbers every run, so a failure can be run again
+static uint32_t timer_random(uint32_t range)
+{
+    timer_random_state = (timer_random_state * 1103515245UL) + 12345UL;
+    return (timer_random_state >> 8) % range;
+}
+
+//polls the wheel up to now, and checks it hands out just the timers the reference has due by then
+static void timer_poll(DCCTimerWheel& wheel, timer_ref_t* ref, uint32_t now)
+{
+    bool fired[DCC_TIMER_COUNT] = { false };
+    DCCPacket p;
+
+    while (wheel.poll((uint16_t)now, p))
+    {
+        dcc_timer_t timer = 0;
+
+        while ((timer < DCC_TIMER_COUNT) && (!ref[timer].pending || (ref[timer].address != p.getAddress())))
+        {
+            ++timer;
+        }
+
+        CHECK((timer < DCC_TIMER_COUNT) && !fired[timer]);
+
+        if (timer < DCC_TIMER_COUNT)
+        {
+            fired[timer] = true;
+        }
+    }
+
+    for (dcc_timer_t timer = 0; timer < DCC_TIMER_COUNT; ++timer)
+    {
+        timer_ref_t& r = ref[timer];
+        bool due = r.pending && (r.expires <= now);
+
+        if (due != fired[timer])
+        {
+            printf("dcccheck: timer %u at tick %lu: %s\n", (unsigned)timer, (unsigned long)now, due ? "didn't fire" : "fired early");
+            ++failures;
+        }
+
+        if (due)
+        {
+            r.expires += r.period;
+            r.pending = (r.period != 0);
+        }
+    }
+}
+
+#if DCC_SUPPORT_QOS
+//a timer's speed for a loco in a service class goes out as often as the class says, as the
+//loco's other speeds do
+static void timer_classed(void)
+{
+    static const uint8_t speed[] = { 0x09, 0x3F, 0x94 };
+    uint8_t data[] = { 0x3F, 0x94 };
+    DCCPacketScheduler* s = start();
+    DCCPacket p(9, DCCPacket::DCC_SHORT_ADDRESS);
+
+    p.addData(data, 2);
+    p.setKind(SPEED_PACKET_KIND);
+    p.setRepeat(SPEED_REPEAT);
+    CHECK(s->setServiceClass(1, 0, 7, DCC_QOS_NORMAL));
+    CHECK(s->setAddressClass(9, DCCPacket::DCC_SHORT_ADDRESS, 1));
+    CHECK(s->schedulePacket(p, 5) != DCC_TIMER_NONE);
+    CHECK(times_sent(*s, speed, sizeof(speed)) == 8);
+    finish(s);
+}
+#endif
+
+static void check_timers(void)
+{
+    timer_ref_t ref[DCC_TIMER_COUNT];
+    DCCTimerWheel* wheel = new DCCTimerWheel;
+    uint32_t now = TIMER_START;
+    uint32_t adds = 0;
+
+    memset(ref, 0, sizeof(ref));
+    timer_poll(*wheel, ref, now);
+
+    for (uint32_t tick = 0; (tick < TIMER_TICKS) && !failures; ++tick)
+    {
+        //delays and periods up to past the longest the wheel takes, mostly short ones
+        uint16_t range = timer_random(4) ? 64 : 40000;
+        uint16_t delay = timer_random(range);
+        uint16_t period = timer_random(3) ? 0 : (1 + timer_random(range));
+        dcc_timer_t timer = DCC_TIMER_NONE;
+
+        switch (timer_random(4))
+        {
+        case 0:
+            timer = wheel->add(DCCPacket(1 + (adds % 10000), DCCPacket::DCC_LONG_ADDRESS), (uint16_t)now, delay, period);
+
+            if (timer != DCC_TIMER_NONE)
+            {
+                CHECK((timer < DCC_TIMER_COUNT) && !ref[timer].pending);
+                ref[timer].pending = true;
+                ref[timer].address = 1 + (adds % 10000);
+                //a delay of 0 is due straight away, which is the next poll
+                ref[timer].expires = now + ((delay > DCC_TIMER_MAX_DELAY) ? DCC_TIMER_MAX_DELAY : delay);
+                ref[timer].period = (period > DCC_TIMER_MAX_DELAY) ? DCC_TIMER_MAX_DELAY : period;
+                ++adds;
+            }
+            break;
+
+        case 1:
+            timer = timer_random(DCC_TIMER_COUNT);
+            CHECK(wheel->cancel(timer) == ref[timer].pending);
+            ref[timer].pending = false;
+            break;
+
+        default:
+            break;
+        }
+
+        ++now;
+        timer_poll(*wheel, ref, now);
+    }
+
+    CHECK(adds > 1000);
+    delete wheel;
+
+    //with the wheel behind, a delay counts from the clock passed in
+    wheel = new DCCTimerWheel;
+    CHECK(wheel->add(DCCPacket(1), 100, 50, 0) == 0);
+    memset(ref, 0, sizeof(ref));
+    ref[0].pending = true;
+    ref[0].expires = 150;
+    ref[0].address = 1;
+    timer_poll(*wheel, ref, 149);
+    timer_poll(*wheel, ref, 150);
+
+    //and if the clock is further ahead than the wheel can reach, it's overdue
+    timer_poll(*wheel, ref, 1000);
+    CHECK(wheel->add(DCCPacket(1), 1000 + 40000, 10, 0) == 0);
+    ref[0].pending = true;
+    ref[0].expires = 1001;
+    timer_poll(*wheel, ref, 1001);
+    delete wheel;
+
+#if DCC_SUPPORT_ACCESSORY
+    //pulseBasicAccessory() sets the output now, and unsets it 20 packets on
+    DCCPacketScheduler* s = start();
+    size_t set_at = MAX_SENT;
+    size_t unset_at = MAX_SENT;
+
+    sent_count = 0;
+    CHECK(s->pulseBasicAccessory(5, 1, 20) != DCC_TIMER_NONE);
+    run_packets(*s, 60);
+
+    for (size_t i = 0; i < sent_count; ++i)
+    {
+        DCCPacket p;
+
+        if (p.setBitstream(sent[i].bytes, sent[i].count) && (p.getKind() == BASIC_ACCESSORY_PACKET_KIND) && (p.getAddress() == 5))
+        {
+            bool on = sent[i].bytes[1] & 0x01; //1AAACDDD, the lowest D saying which way
+
+            if (on && (set_at == MAX_SENT))
+            {
+                set_at = i;
+            }
+            else if (!on && (unset_at == MAX_SENT))
+            {
+                unset_at = i;
+            }
+        }
+    }
+
+    //give the unset a few packets to get through the low priority queue
+    CHECK(set_at < 5);
+    CHECK((unset_at >= 20) && (unset_at < 30));
+    finish(s);
+#endif
+#if DCC_SUPPORT_QOS
+    timer_classed();
+#endif
+}
+#endif
+
+#if DCC_SUPPORT_PARSER
+/****************************************************************************
+* parser
+****************************************************************************/
+
+static const parse_t parses[] =
+{
+#if DCC_SUPPORT_SPEED128
+    { "<t 1 3 20 1>", { 0x03, 0x3F, 0x95 }, 3 },
+    { "<t 3 20 0>", { 0x03, 0x3F, 0x15 }, 3 },
+    { "<t 3 0 1>", { 0x03, 0x3F, 0x80 }, 3 },
+    { "<t 3 126 1>", { 0x03, 0x3F, 0xFF }, 3 },
+    { "<t 1234 -1 1>", { 0xC4, 0xD2, 0x41 }, 3 },
+#endif
+    { "<f 3 144>", { 0x03, 0x90 }, 2 },
+    { "<f 127 133>", { 0x7F, 0x85 }, 2 },
+    { "<f 128 165>", { 0xC0, 0x80, 0xA5 }, 3 },
+    { "<f 10239 187>", { 0xE7, 0xFF, 0xBB }, 3 },
+#if DCC_SUPPORT_FEATURE_EXPANSION
+    { "<f 3 222 165>", { 0x03, 0xDE, 0xA5 }, 3 },
+    { "<f 3 223 90>", { 0x03, 0xDF, 0x5A }, 3 },
+#endif
+#if DCC_SUPPORT_ACCESSORY
+    { "<a 5 1 1>", { 0x85, 0xFB }, 2 },
+    { "<a 5 1 0>", { 0x85, 0xFA }, 2 },
+#endif
+#if DCC_SUPPORT_OPS_MODE
+    { "<w 3 29 6>", { 0x03, 0xEC, 0x1C, 0x06 }, 4 },
+    { "<w 3 1024 255>", { 0x03, 0xEF, 0xFF, 0xFF }, 4 },
+#endif
+    { "\r\n< ! >", { 0x00, 0x71 }, 2 },
+};
+
+//each of these must come back DCC_PARSE_ERROR, and send nothing
+static const char* const parse_errors[] =
+{
+    "<t 3 127 1>",
+    "<t 3 -2 1>",
+    "<t 3 5 2>",
+    "<t 3 5>",
+    "<t 0 5 1>",
+    "<t 10240 5 1>",
+    "<t 3 x 1>",
+    "<t 3 - 1>",
+    "<t 3 999999 1>",
+    "<f 3 200>",
+    "<f 3 144 1>",
+    "<f 3 222 256>",
+    "<a 512 0 1>",
+    "<a 5 4 1>",
+    "<a 5 1>",
+    "<w 3 0 5>",
+    "<w 3 1025 5>",
+    "<w 3 1 256>",
+    "<f 3 1 2 3 4 5 6 7 8 9 10 11 12 13 14 15 16>",
+    "<x 1>",
+    "<! 1>",
+    "<>",
+};
+
+//the one result the text's last byte should bring back, having sent nothing before it
+static uint8_t parse_text(DCCCommandParser& parser, const char* text)
+{
+    uint8_t retval = DCC_PARSE_NONE;
+
+    for (const char* c = text; *c; ++c)
+    {
+        CHECK(retval == DCC_PARSE_NONE);
+        retval = parser.parse(*c);
+    }
+
+    return retval;
+}
+
+static void check_parser(void)
+{
+    uint16_t errors = 0;
+
+    for (size_t i = 0; i < (sizeof(parses) / sizeof(parses[0])); ++i)
+    {
+        const parse_t& c = parses[i];
+        DCCPacketScheduler* s = start();
+        DCCCommandParser parser(*s);
+        size_t from = sent_count;
+
+        CHECK(parse_text(parser, c.text) == DCC_PARSE_OK);
+        run_packets(*s, 20);
+
+        if (!find_bytes(from, c.bytes, c.count))
+        {
+            printf("dcccheck: %s didn't send its packet\n", c.text);
+            ++failures;
+        }
+
+        CHECK(!parser.getErrors());
+        finish(s);
+    }
+
+    DCCPacketScheduler* s = start();
+    DCCCommandParser parser(*s);
+    size_t from = sent_count;
+
+    for (size_t i = 0; i < (sizeof(parse_errors) / sizeof(parse_errors[0])); ++i)
+    {
+        if (parse_text(parser, parse_errors[i]) != DCC_PARSE_ERROR)
+        {
+            printf("dcccheck: %s wasn't an error\n", parse_errors[i]);
+            ++failures;
+        }
+
+        ++errors;
+    }
+
+    CHECK(parser.getErrors() == errors);
+    run_packets(*s, 20);
+
+    for (size_t i = from; (i < sent_count) && (i < MAX_SENT); ++i)
+    {
+        CHECK(sent[i].bytes[0] == 0xFF); //idles
+    }
+
+    //a command cut short by the next one's '<' is an error, and the next one still works
+    static const uint8_t stream[] = "junk <t 3 20 1 <f 3 144>\n<f 3 187>";
+    static const uint8_t f0[] = { 0x03, 0x90 };
+    static const uint8_t f5to8[] = { 0x03, 0xBB };
+
+    from = sent_count;
+    CHECK(parser.parse(stream, sizeof(stream) - 1) == 2);
+    CHECK(parser.getErrors() == errors + 1);
+    CHECK((parser.getCommand() == 'f') && (parser.getArgCount() == 2) && (parser.getArg(1) == 187));
+    run_packets(*s, 20);
+    CHECK(find_bytes(from, f0, sizeof(f0)));
+    CHECK(find_bytes(from, f5to8, sizeof(f5to8)));
+    finish(s);
+}
+#endif
+
+#if DCC_SUPPORT_FRAMES && DCC_SUPPORT_SPEED128
+/****************************************************************************
+* frames
+****************************************************************************/
+
+// Commands in the frame frame_build() makes
+#define FRAME_COMMANDS  (2 + DCC_SUPPORT_ACCESSORY + DCC_SUPPORT_OPS_MODE)
+
+//a frame of one of each command that leaves the others alone, with speed on the rails for loco 3
+static size_t frame_build(uint8_t* buffer, uint8_t speed)
+{
+    DCCFrameEncoder encoder(buffer, DCC_FRAME_MAX_PAYLOAD + DCC_FRAME_OVERHEAD);
+
+    encoder.begin();
+    CHECK(encoder.speed(3, false, 0x80 | speed));
+    CHECK(encoder.functions(3, false, 0, 0x03));
+#if DCC_SUPPORT_ACCESSORY
+    CHECK(encoder.accessory(5, 1, true));
+#endif
+#if DCC_SUPPORT_OPS_MODE
+    CHECK(encoder.opsProgramCV(1234, true, 29, 6));
+#endif
+    return encoder.finish();
+}
+
+//hands the decoder bytes one at a time, and adds up the commands it carries out
+static uint8_t frame_parse(DCCFrameDecoder& decoder, const uint8_t* bytes, size_t count)
+{
+    uint8_t commands = 0;
+
+    for (size_t i = 0; i < count; ++i)
+    {
+        commands += decoder.parse(bytes[i]);
+    }
+
+    return commands;
+}
+
+//whether the frame frame_build() made for speed has reached the rails since sent[from]
+static bool frame_sent(size_t from, uint8_t speed)
+{
+    const uint8_t speed128[] = { 0x03, 0x3F, (uint8_t)(0x80 | speed) };
+    static const uint8_t functions[] = { 0x03, 0x91 };
+    static const uint8_t accessory[] = { 0x85, 0xFB };
+    static const uint8_t ops_cv[] = { 0xC4, 0xD2, 0xEC, 0x1C, 0x06 };
+
+    return find_bytes(from, speed128, sizeof(speed128)) && find_bytes(from, functions, sizeof(functions)) &&
+           (!DCC_SUPPORT_ACCESSORY || find_bytes(from, accessory, sizeof(accessory))) &&
+           (!DCC_SUPPORT_OPS_MODE || find_bytes(from, ops_cv, sizeof(ops_cv)));
+}
+
+static void check_frames(void)
+{
+    uint8_t good[DCC_FRAME_MAX_PAYLOAD + DCC_FRAME_OVERHEAD];
+    uint8_t bad[DCC_FRAME_MAX_PAYLOAD + DCC_FRAME_OVERHEAD];
+    static const uint8_t noise[] = { 0x00, DCC_FRAME_SYNC, 0x00, 0x55, DCC_FRAME_SYNC, DCC_FRAME_SYNC, 0xFF };
+    DCCPacketScheduler* s = start();
+    DCCFrameDecoder decoder(*s);
+
+    //a good frame
+    size_t length = frame_build(good, 20);
+    size_t from = sent_count;
+    CHECK(length == DCC_FRAME_OVERHEAD + DCC_FRAME_SPEED_LEN + DCC_FRAME_FUNCTIONS_LEN +
+          (DCC_SUPPORT_ACCESSORY * DCC_FRAME_ACCESSORY_LEN) + (DCC_SUPPORT_OPS_MODE * DCC_FRAME_OPS_CV_LEN));
+    CHECK(frame_parse(decoder, good, length) == FRAME_COMMANDS);
+    CHECK(!decoder.getErrors());
+    run_packets(*s, 40);
+    CHECK(frame_sent(from, 20));
+
+    //each bit of the commands and CRC flipped in turn: none of the frame carried out, and the
+    //good frame straight after still is. A bad length byte can swallow what follows, so isn't tried.
+    static const uint8_t bad_speed[] = { 0x03, 0x3F, 0x80 | 40 };
+    CHECK(frame_build(bad, 40) == length);
+    from = sent_count;
+
+    for (size_t bit = 16; bit < (length * 8); ++bit)
+    {
+        uint16_t errors = decoder.getErrors();
+
+        bad[bit / 8] ^= (1 << (bit % 8));
+        CHECK(!frame_parse(decoder, bad, length));
+        CHECK(frame_parse(decoder, good, length) == FRAME_COMMANDS);
+        CHECK(decoder.getErrors() > errors);
+        bad[bit / 8] ^= (1 << (bit % 8));
+    }
+
+    run_packets(*s, 40);
+    CHECK(!find_bytes(from, bad_speed, sizeof(bad_speed)));
+
+    //noise and stray sync bytes, then the frame
+    uint16_t errors = decoder.getErrors();
+    CHECK(!frame_parse(decoder, noise, sizeof(noise)));
+    CHECK(frame_parse(decoder, good, length) == FRAME_COMMANDS);
+    CHECK(decoder.getErrors() > errors);
+
+    //through the ring
+    length = frame_build(good, 60);
+    from = sent_count;
+
+    for (size_t i = 0; i < length; ++i)
+    {
+        decoder.receive(good[i]);
+    }
+
+    CHECK(decoder.update() == FRAME_COMMANDS);
+    CHECK(!decoder.update() && !decoder.getOverruns());
+    run_packets(*s, 40);
+    CHECK(frame_sent(from, 60));
+    finish(s);
+}
+#endif
+
+#if DCC_SUPPORT_INBOX && DCC_SUPPORT_SPEED128
+/****************************************************************************
+* inbox
+****************************************************************************/
+
+// Posting threads, and the locos each ramps one after the other; more posts than the inbox holds
+#define INBOX_THREADS   4
+#define INBOX_LOCOS     16
+
+static std::atomic<uint32_t> inbox_posted;
+static std::atomic<uint32_t> inbox_turned_away;
+
+//short addresses 1-64, a thread's INBOX_LOCOS together, each ramped from 2 to 127
+static void inbox_post(DCCInbox* inbox, uint8_t thread)
+{
+    for (uint8_t loco = 0; loco < INBOX_LOCOS; ++loco)
+    {
+        uint16_t cab = 1 + (thread * INBOX_LOCOS) + loco;
+
+        for (uint8_t speed = 2; speed <= 127; ++speed)
+        {
+            while (!inbox->speed(cab, false, 0x80 | speed))
+            {
+                inbox_turned_away.fetch_add(1, std::memory_order_relaxed);
+                std::this_thread::yield();
+            }
+
+            inbox_posted.fetch_add(1, std::memory_order_relaxed);
+        }
+    }
+}
+
+//checks the speeds logged are no slower than the last seen for each loco, and notes them
+static void inbox_scan(uint8_t* last, size_t locos)
+{
+    for (size_t i = 0; (i < sent_count) && (i < MAX_SENT); ++i)
+    {
+        const sent_t& p = sent[i];
+
+        if ((p.count == 4) && (p.bytes[0] >= 1) && (p.bytes[0] <= locos) && (p.bytes[1] == 0x3F))
+        {
+            uint8_t speed = p.bytes[2] & 0x7F;
+
+            CHECK((p.bytes[2] & 0x80) && (speed >= last[p.bytes[0]]));
+            last[p.bytes[0]] = speed;
+        }
+    }
+}
+
+static void check_inbox(void)
+{
+    static uint8_t last[1 + (INBOX_THREADS * INBOX_LOCOS)]; //fastest seen on the rails, by address
+    std::thread* threads[INBOX_THREADS];
+    DCCPacketScheduler* s = start();
+    DCCInbox inbox(*s);
+    uint32_t drained = 0;
+    uint32_t expected = INBOX_THREADS * INBOX_LOCOS * 126;
+
+    memset(last, 0, sizeof(last));
+    inbox_posted = 0;
+    inbox_turned_away = 0;
+
+    for (uint8_t i = 0; i < INBOX_THREADS; ++i)
+    {
+        threads[i] = new std::thread(inbox_post, &inbox, i);
+    }
+
+    //a command a packet, so the scheduler is never what turns one down
+    while (drained < expected)
+    {
+        size_t taken = inbox.drain(1);
+
+        if (!taken)
+        {
+            std::this_thread::yield();
+            continue;
+        }
+
+        drained += taken;
+        sent_count = 0;
+        run_packets(*s, 1);
+        inbox_scan(last, sizeof(last) - 1);
+    }
+
+    for (uint8_t i = 0; i < INBOX_THREADS; ++i)
+    {
+        threads[i]->join();
+        delete threads[i];
+    }
+
+    CHECK(!inbox.drain());
+    CHECK(inbox_posted == expected);
+    CHECK(inbox.getFull() == inbox_turned_away);
+    CHECK(inbox_turned_away > 0);
+    CHECK(!inbox.getErrors());
+
+    //every loco gets to the top of its ramp
+    sent_count = 0;
+    run_packets(*s, 40);
+    inbox_scan(last, sizeof(last) - 1);
+
+    for (size_t i = 1; i < sizeof(last); ++i)
+    {
+        CHECK(last[i] == 127);
+    }
+
+    finish(s);
+}
+#endif
+
+#if DCC_SUPPORT_ADAPTIVE_REPEAT && DCC_SUPPORT_SPEED128
+/****************************************************************************
+* adaptive
+****************************************************************************/
+
+//speed 20 for a short address, each time a new loco so nothing else of its is queued
+static size_t speed_times(DCCPacketScheduler& s, uint8_t address)
+{
+    const uint8_t bytes[] = { address, 0x3F, 0x94 };
+
+    CHECK(s.setSpeed128(address, DCCPacket::DCC_SHORT_ADDRESS, 20));
+    return times_sent(s, bytes, sizeof(bytes));
+}
+
+static size_t estop_times(DCCPacketScheduler& s, uint8_t address)
+{
+    const uint8_t bytes[] = { address, 0x41 };
+
+    CHECK(s.eStop(address, DCCPacket::DCC_SHORT_ADDRESS));
+    return times_sent(s, bytes, sizeof(bytes));
+}
+
+//the counts below are the fewest sends for every one to be lost no more than a thousand
+//times in a million, or once for an e-stop: at 10% 3 and 6, at 50% 10 and 16, but capped
+static void check_adaptive(void)
+{
+    DCCPacketScheduler* s = start();
+
+    //off, it's the fixed SPEED_REPEAT
+    CHECK(speed_times(*s, 10) == 1 + SPEED_REPEAT);
+
+    s->setAdaptiveRepeat(true);
+    s->setTrackLoss(0);
+    CHECK(speed_times(*s, 11) == 1);
+    CHECK(estop_times(*s, 12) == 1);
+
+    s->setTrackLoss(100);
+    CHECK(speed_times(*s, 13) == 3);
+    CHECK(estop_times(*s, 14) == 6);
+
+    s->setTrackLoss(500);
+    CHECK(speed_times(*s, 15) == 10);
+    CHECK(estop_times(*s, 16) == DCC_PACKED_MAX_REPEAT);
+
+    //a loco that reports its own loss goes by that, and the others by the track's
+    s->setTrackLoss(0);
+
+    for (uint8_t i = 0; i < 200; ++i)
+    {
+        s->reportDelivery(17, DCCPacket::DCC_SHORT_ADDRESS, (i % 2) != 0);
+        s->reportDelivery(18, DCCPacket::DCC_SHORT_ADDRESS, true);
+    }
+
+    CHECK(s->getLoss(17, DCCPacket::DCC_SHORT_ADDRESS) >= 400);
+    CHECK(s->getLoss(17, DCCPacket::DCC_SHORT_ADDRESS) <= 600);
+    CHECK(s->getLoss(18, DCCPacket::DCC_SHORT_ADDRESS) <= 2); //it started from the track's, and the average never quite gets to 0
+    CHECK(s->getLoss(19, DCCPacket::DCC_SHORT_ADDRESS) == s->getLoss(0, DCCPacket::DCC_SHORT_ADDRESS));
+    CHECK(speed_times(*s, 17) >= 9);
+    CHECK(speed_times(*s, 18) == 1);
+
+#if DCC_SUPPORT_QOS
+    //a class's own repeat stands
+    s->setTrackLoss(500);
+    CHECK(s->setServiceClass(1, 0, 1, DCC_QOS_NORMAL));
+    CHECK(s->setAddressClass(20, DCCPacket::DCC_SHORT_ADDRESS, 1));
+    CHECK(speed_times(*s, 20) == 2);
+#endif
+
+    finish(s);
+}
+#endif
+
+#if DCC_SUPPORT_GOVERNOR && DCC_SUPPORT_SPEED128
+/****************************************************************************
+* governor
+****************************************************************************/
+
+// The window, and leeway for a packet to wait on the one on the rails when its time came
+#define GOVERNOR_MS         200
+#define GOVERNOR_SLACK_US   20000ULL
+
+//when loco 3's 128 step speed first went out after sent[from], or 0 if it hasn't
+static uint64_t governed_at(size_t from, uint8_t speed)
+{
+    const uint8_t bytes[] = { 0x03, 0x3F, speed };
+    const sent_t* p = find_bytes(from, bytes, sizeof(bytes));
+
+    return p ? p->start_us : 0;
+}
+
+static void check_governor(void)
+{
+    static const uint8_t functions[] = { 0x03, 0x91 };
+    DCCPacketScheduler* s = start();
+
+    s->setGovernor(GOVERNOR_MS);
+    sent_count = 0;
+
+    //forwards 20 goes now and starts the window; 30 and 40 are replaced by 50, which waits for the window to end
+    uint64_t window_us = dcc_host_clock_us;
+    CHECK(s->setSpeed128(3, DCCPacket::DCC_SHORT_ADDRESS, 20));
+    run_ms(*s, 20);
+    CHECK(s->setSpeed128(3, DCCPacket::DCC_SHORT_ADDRESS, 30));
+    CHECK(s->setSpeed128(3, DCCPacket::DCC_SHORT_ADDRESS, 40));
+    CHECK(s->setSpeed128(3, DCCPacket::DCC_SHORT_ADDRESS, 50));
+    CHECK(s->setFunctions0to4(3, DCCPacket::DCC_SHORT_ADDRESS, 0x03));
+    run_ms(*s, GOVERNOR_MS + 50);
+
+    uint64_t at = governed_at(0, 0x80 | 20);
+    CHECK(at && (at - window_us <= GOVERNOR_SLACK_US));
+    CHECK(!governed_at(0, 0x80 | 30) && !governed_at(0, 0x80 | 40));
+    const sent_t* p = find_bytes(0, functions, sizeof(functions));
+    CHECK(p && (p->start_us - window_us <= 20000 + GOVERNOR_SLACK_US));
+    at = governed_at(0, 0x80 | 50);
+    CHECK(at && (at - window_us >= GOVERNOR_MS * 1000ULL) && (at - window_us <= (GOVERNOR_MS * 1000ULL) + GOVERNOR_SLACK_US));
+    CHECK(s->getCoalesced() == 2);
+    CHECK(s->getDeferred() == 1);
+
+    //in the window 50 began, backwards 20 goes now, as does the stop after it
+    size_t from = sent_count;
+    uint64_t set_us = dcc_host_clock_us;
+    CHECK(s->setSpeed128(3, DCCPacket::DCC_SHORT_ADDRESS, -20));
+    run_ms(*s, 10);
+    uint64_t stop_us = dcc_host_clock_us;
+    CHECK(s->setSpeed128(3, DCCPacket::DCC_SHORT_ADDRESS, -1));
+    run_ms(*s, 40);
+    at = governed_at(from, 20);
+    CHECK(at && (at - set_us <= GOVERNOR_SLACK_US));
+    at = governed_at(from, 0);
+    CHECK(at && (at - stop_us <= GOVERNOR_SLACK_US));
+
+    //but backwards 30 straight after waits for the window the stop began
+    from = sent_count;
+    CHECK(s->setSpeed128(3, DCCPacket::DCC_SHORT_ADDRESS, -30));
+    run_ms(*s, GOVERNOR_MS);
+    at = governed_at(from, 30);
+    CHECK(at && (at - stop_us >= GOVERNOR_MS * 1000ULL));
+
+    //0 turns it off
+    s->setGovernor(0);
+    from = sent_count;
+    CHECK(s->setSpeed128(3, DCCPacket::DCC_SHORT_ADDRESS, -40));
+    CHECK(s->setSpeed128(3, DCCPacket::DCC_SHORT_ADDRESS, -50));
+    run_ms(*s, 50);
+    CHECK(governed_at(from, 50));
+    finish(s);
+}
+#endif
+
+#if DCC_SUPPORT_FAIR_QUEUES && DCC_SUPPORT_FEATURE_EXPANSION && DCC_SUPPORT_OPS_MODE
+/****************************************************************************
+* fair
+****************************************************************************/
+
+// Loco 3's burst, then a command each for locos 4 and 5, less their error bytes
+#define FAIR_BURST      6
+#define FAIR_COMMANDS   (FAIR_BURST + 2)
+
+static const uint8_t fair_bytes[FAIR_COMMANDS][4] =
+{
+    { 0x03, 0x90 },
+    { 0x03, 0xB1 },
+    { 0x03, 0xA1 },
+    { 0x03, 0xDE, 0x01 },
+    { 0x03, 0xDF, 0x01 },
+    { 0x03, 0xEC, 0x31, 0x01 },
+    { 0x04, 0x90 },
+    { 0x05, 0x90 },
+};
+
+static const uint8_t fair_lengths[FAIR_COMMANDS] = { 2, 2, 2, 3, 3, 4, 2, 2 };
+
+//queues the commands, and notes where each first went out and how many times it did
+static void fair_run(bool on, size_t* first, size_t* times)
+{
+    DCCPacketScheduler* s = start();
+
+    s->setFairQueues(on);
+    sent_count = 0;
+    CHECK(s->setFunctions0to4(3, DCCPacket::DCC_SHORT_ADDRESS, 0x01));
+    CHECK(s->setFunctions5to8(3, DCCPacket::DCC_SHORT_ADDRESS, 0x01));
+    CHECK(s->setFunctions9to12(3, DCCPacket::DCC_SHORT_ADDRESS, 0x01));
+    CHECK(s->setFunctions13to20(3, DCCPacket::DCC_SHORT_ADDRESS, 0x01));
+    CHECK(s->setFunctions21to28(3, DCCPacket::DCC_SHORT_ADDRESS, 0x01));
+    CHECK(s->opsProgramCV(3, DCCPacket::DCC_SHORT_ADDRESS, 50, 0x01));
+    CHECK(s->setFunctions0to4(4, DCCPacket::DCC_SHORT_ADDRESS, 0x01));
+    CHECK(s->setFunctions0to4(5, DCCPacket::DCC_SHORT_ADDRESS, 0x01));
+    run_packets(*s, 120);
+
+    for (uint8_t c = 0; c < FAIR_COMMANDS; ++c)
+    {
+        first[c] = MAX_SENT;
+        times[c] = 0;
+
+        for (size_t i = 0; (i < sent_count) && (i < MAX_SENT); ++i)
+        {
+            if ((sent[i].count == fair_lengths[c] + 1) && !memcmp(sent[i].bytes, fair_bytes[c], fair_lengths[c]))
+            {
+                first[c] = (first[c] < i) ? first[c] : i;
+                ++times[c];
+            }
+        }
+    }
+
+    finish(s);
+}
+
+static void check_fair(void)
+{
+    size_t first_fifo[FAIR_COMMANDS];
+    size_t times_fifo[FAIR_COMMANDS];
+    size_t first_fair[FAIR_COMMANDS];
+    size_t times_fair[FAIR_COMMANDS];
+
+    fair_run(false, first_fifo, times_fifo);
+    fair_run(true, first_fair, times_fair);
+
+    for (uint8_t c = 0; c < FAIR_COMMANDS; ++c)
+    {
+        CHECK(times_fifo[c] && (times_fair[c] == times_fifo[c]));
+    }
+
+    //first come first served: 4 and 5 wait for all of 3's; fair: only for its first
+    for (uint8_t c = FAIR_BURST; c < FAIR_COMMANDS; ++c)
+    {
+        CHECK(first_fifo[c] > first_fifo[FAIR_BURST - 1]);
+        CHECK((first_fair[c] > first_fair[0]) && (first_fair[c] < first_fair[1]));
+    }
+
+    //and 3's burst still goes in the order it was queued
+    for (uint8_t c = 1; c < FAIR_BURST; ++c)
+    {
+        CHECK(first_fifo[c] > first_fifo[c - 1]);
+        CHECK(first_fair[c] > first_fair[c - 1]);
+    }
+}
+#endif
+
+/****************************************************************************
+* visit
+****************************************************************************/
+
+// Packets a visitor notes, and after how many it stops
+#define VISIT_MAX       16
+
+typedef struct
+{
+    uint8_t count;
+    uint8_t stop_after;
+    uint8_t queue[VISIT_MAX];
+    uint8_t position[VISIT_MAX];
+    uint16_t address[VISIT_MAX];
+    DCCPacketQueue* meddle; //if set, gets a packet queued on it from inside the visit
+} visited_t;
+
+static bool visitor(const DCCQueuedPacket& packet, void* context)
+{
+    visited_t* v = (visited_t*)context;
+
+    if (v->count < VISIT_MAX)
+    {
+        v->queue[v->count] = packet.queue;
+        v->position[v->count] = packet.position;
+        v->address[v->count] = packet.getAddress();
+    }
+
+    ++v->count;
+
+    if (v->meddle)
+    {
+        v->meddle->insertPacket(DCCPacket(99));
+    }
+
+    return v->count != v->stop_after;
+}
+
+//one queue on its own, as DCCPacketQueue sees it
+static void visit_queue(void)
+{
+    DCCPacketQueue q;
+    visited_t v;
+
+    q.setup(2, 8);
+    CHECK(q.insertPacket(DCCPacket(10)));
+    CHECK(q.insertPacket(DCCPacket(11)));
+    CHECK(q.insertPacket(DCCPacket(12)));
+
+    //all three, in order
+    memset(&v, 0, sizeof(v));
+    CHECK(q.visit(visitor, &v, 7));
+    CHECK(v.count == 3);
+
+    for (uint8_t i = 0; i < 3; ++i)
+    {
+        CHECK((v.queue[i] == 7) && (v.position[i] == i) && (v.address[i] == 10 + i));
+    }
+
+    //a visitor can stop early, and what it saw still stands
+    memset(&v, 0, sizeof(v));
+    v.stop_after = 1;
+    CHECK(q.visit(visitor, &v));
+    CHECK(v.count == 1);
+
+    //caught part way through a change, as an interrupt breaking into update() would be: look again later
+    memset(&v, 0, sizeof(v));
+    ++q.changes;
+    CHECK(!q.visit(visitor, &v));
+    CHECK(v.count == 0);
+    ++q.changes;
+    CHECK(q.visit(visitor, &v) && (v.count == 3));
+
+    //changed while it looked: it stops at once, and says so
+    memset(&v, 0, sizeof(v));
+    v.meddle = &q;
+    CHECK(!q.visit(visitor, &v));
+    CHECK(v.count == 1);
+
+    //and what's queued is what was, plus what the visitor added, in order
+    DCCPacket p;
+    static const uint16_t queued[] = { 10, 11, 12, 99 };
+
+    for (uint8_t i = 0; i < 4; ++i)
+    {
+        CHECK(q.readPacket(p) && (p.getAddress() == queued[i]));
+    }
+
+    CHECK(q.isEmpty());
+}
+
+static void check_visit(void)
+{
+    visited_t v;
+
+    visit_queue();
+
+    //the scheduler's queues, e-stops first
+    DCCPacketScheduler* s = start();
+    sent_count = 0;
+    CHECK(s->setFunctions0to4(4, DCCPacket::DCC_SHORT_ADDRESS, 0x01));
+    CHECK(s->eStop(5, DCCPacket::DCC_SHORT_ADDRESS));
+    memset(&v, 0, sizeof(v));
+    CHECK(s->visitQueues(visitor, &v));
+    CHECK(v.count >= 2);
+    CHECK((v.queue[0] == DCC_QUEUE_E_STOP) && (v.address[0] == 5));
+
+    for (uint8_t i = 1; (i < v.count) && (i < VISIT_MAX); ++i)
+    {
+        CHECK(v.queue[i] >= v.queue[i - 1]);
+    }
+
+    finish(s);
+}
+
+#if DCC_SUPPORT_MOMENTUM && DCC_SUPPORT_SPEED128
+/****************************************************************************
+* momentum
+****************************************************************************/
+
+//a ramp at 50 steps a second, from standing to 100 of 126
+static void check_momentum(void)
+{
+    DCCPacketScheduler* s = start();
+    uint64_t started_us = dcc_host_clock_us;
+    uint64_t reached_us = 0;
+    int last = 1;
+
+    sent_count = 0;
+    CHECK(s->setSpeedTarget(3, DCCPacket::DCC_SHORT_ADDRESS, 100, 50, 128));
+    run_ms(*s, 2500);
+    CHECK(sent_count <= MAX_SENT);
+
+    for (size_t i = 0; (i < sent_count) && (i < MAX_SENT); ++i)
+    {
+        const sent_t& p = sent[i];
+
+        if ((p.count != 4) || (p.bytes[0] != 3) || (p.bytes[1] != 0x3F))
+        {
+            continue;
+        }
+
+        int speed = p.bytes[2] & 0x7F;
+        uint64_t since_us = p.start_us - started_us;
+
+        CHECK(p.bytes[2] & 0x80);
+        CHECK((speed >= last) && (speed <= 100));
+        //no faster than a step each 20ms, allowing a step for the packet on the rails when it was set
+        CHECK((speed - 2) * 20000ULL <= since_us);
+
+        if ((speed == 100) && (last != 100))
+        {
+            reached_us = since_us;
+        }
+
+        last = speed;
+    }
+
+    //and no slower either: 99 steps take 1.98s, allowing 100ms for the rails to catch up
+    CHECK(last == 100);
+    CHECK(reached_us && (reached_us <= 2080000ULL));
+
+    //a ramp after setSpeed() starts from that speed, not from standing
+    CHECK(s->setSpeed(5, DCCPacket::DCC_SHORT_ADDRESS, 100, 128));
+    CHECK(rails_speed(*s, 5) == (0x80 | 100));
+    sent_count = 0;
+    CHECK(s->setSpeedTarget(5, DCCPacket::DCC_SHORT_ADDRESS, 90, 50, 128));
+    run_ms(*s, 500);
+    last = 100;
+
+    for (size_t i = 0; (i < sent_count) && (i < MAX_SENT); ++i)
+    {
+        const sent_t& p = sent[i];
+
+        if ((p.count == 4) && (p.bytes[0] == 5) && (p.bytes[1] == 0x3F))
+        {
+            CHECK(((p.bytes[2] & 0x7F) <= last) && ((p.bytes[2] & 0x7F) >= 90));
+            last = p.bytes[2] & 0x7F;
+        }
+    }
+
+    CHECK(last == 90);
+    finish(s);
+}
+#endif
+
+#if DCC_SUPPORT_ACCESSORY_CACHE
+/****************************************************************************
+* accessory
+****************************************************************************/
+
+//decoder 5's first two output pairs, as they go to the rails less their error byte
+static const uint8_t output0_on[] = { 0x85, 0xF9 };
+static const uint8_t output0_off[] = { 0x85, 0xF8 };
+static const uint8_t output1_on[] = { 0x85, 0xFB };
+
+static void check_accessory(void)
+{
+    DCCPacketScheduler* s = start();
+
+    s->setAccessoryCache(true);
+
+    //two outputs in the same update, neither replacing the other in the queue
+    sent_count = 0;
+    CHECK(s->setBasicAccessory(5, 0));
+    CHECK(s->setBasicAccessory(5, 1));
+    run_packets(*s, 20);
+    CHECK(find_bytes(0, output0_on, 2));
+    CHECK(find_bytes(0, output1_on, 2));
+
+    //both are known to be on now
+    sent_count = 0;
+    CHECK(s->setBasicAccessory(5, 0));
+    CHECK(s->setBasicAccessory(5, 1));
+    run_packets(*s, 20);
+    CHECK(!find_bytes(0, output0_on, 2));
+    CHECK(!find_bytes(0, output1_on, 2));
+
+    //one output off and back on before it went: the on replaces the off
+    sent_count = 0;
+    CHECK(s->unsetBasicAccessory(5, 0));
+    CHECK(s->setBasicAccessory(5, 0));
+    run_packets(*s, 20);
+    CHECK(!find_bytes(0, output0_off, 2));
+    CHECK(find_bytes(0, output0_on, 2));
+
+    finish(s);
+}
+#endif
+
+#if DCC_SUPPORT_SNAPSHOT && DCC_SUPPORT_ACCESSORY_CACHE
+/****************************************************************************
+* snapshot
+****************************************************************************/
+
+// Where the accessory cache starts in storage
+#define SNAPSHOT_CACHE_AT   (DCC_SNAPSHOT_HEADER_LEN + DCC_SNAPSHOT_LOCOS_LEN + DCC_SNAPSHOT_CONSIST_LEN)
+
+//loco 3 with F0, F1 and F3 on, less its error byte
+static const uint8_t snapshot_functions[] = { 0x03, 0x95 };
+
+//a new scheduler that restores the snapshot straight after setup(), before update() can write over it
+static DCCPacketScheduler* snapshot_start(bool& restored)
+{
+    DCCPacketScheduler* s = new DCCPacketScheduler;
+
+    s->setup();
+    restored = s->restoreSnapshot();
+    run_packets(*s, SETUP_PACKETS);
+    return s;
+}
+
+static void check_snapshot(void)
+{
+    bool restored;
+
+    remove(DCC_SNAPSHOT_FILE);
+
+    //the first pass over blank storage, cut off half way through the accessory cache
+    DCCPacketScheduler* s = start();
+
+    for (size_t n = 0; (n < 5000) && (dcc_storage_read(SNAPSHOT_CACHE_AT + (DCC_ACCESSORY_CACHE_BYTES / 2)) == 0xFF); ++n)
+    {
+        run_packets(*s, 1);
+    }
+
+    CHECK(dcc_storage_read(SNAPSHOT_CACHE_AT + DCC_SNAPSHOT_CACHE_LEN - 1) == 0xFF);
+    finish(s);
+
+    //decoder 500's bits were still blank, which would say its outputs are all on
+    s = snapshot_start(restored);
+    CHECK(restored);
+    s->setAccessoryCache(true);
+    sent_count = 0;
+    CHECK(s->setBasicAccessory(500, 0));
+    run_packets(*s, 20);
+    CHECK(find_sent(0, BASIC_ACCESSORY_PACKET_KIND, 500, DCCPacket::DCC_SHORT_ADDRESS));
+
+    //a whole pass, then the power cut
+    CHECK(s->setFunctions0to4(3, DCCPacket::DCC_SHORT_ADDRESS, 0x0B));
+    CHECK(s->setBasicAccessory(5, 1));
+    run_ms(*s, 20000);
+    finish(s);
+
+    s = snapshot_start(restored);
+    CHECK(restored);
+    s->setAccessoryCache(true);
+    sent_count = 0;
+    run_packets(*s, 40);
+    CHECK(find_bytes(0, snapshot_functions, 2));
+    sent_count = 0;
+    CHECK(s->setBasicAccessory(5, 1));
+    CHECK(s->setBasicAccessory(500, 0));
+    CHECK(s->unsetBasicAccessory(6, 0));
+    run_packets(*s, 20);
+    CHECK(!find_sent(0, BASIC_ACCESSORY_PACKET_KIND, 5, DCCPacket::DCC_SHORT_ADDRESS));
+    CHECK(!find_sent(0, BASIC_ACCESSORY_PACKET_KIND, 500, DCCPacket::DCC_SHORT_ADDRESS));
+    CHECK(find_sent(0, BASIC_ACCESSORY_PACKET_KIND, 6, DCCPacket::DCC_SHORT_ADDRESS));
+    finish(s);
+
+    remove(DCC_SNAPSHOT_FILE);
+}
+#endif
+
+#if DCC_SUPPORT_REPEAT_SPACING
+/****************************************************************************
+* spacing
+****************************************************************************/
+
+// Most copies of one packet a case looks at
+#define SPACING_COPIES  12
+
+// Times eStop() sends an e-stop
+#define SPACING_ESTOPS  10
+
+//F0 on for locos 3 and 4, and e-stops for them, less their error bytes
+static const uint8_t spacing_f0[2][2] = { { 0x03, 0x90 }, { 0x04, 0x90 } };
+static const uint8_t spacing_estop[2][2] = { { 0x03, 0x41 }, { 0x04, 0x41 } };
+
+//a new scheduler with this spacing, and the log cleared for the case
+static DCCPacketScheduler* spacing_start(uint8_t gap, uint8_t backoff)
+{
+    DCCPacketScheduler* s = start();
+
+    s->setRepeatSpacing(gap, backoff);
+    sent_count = 0;
+    return s;
+}
+
+//how many times these two bytes went out since the case started, with the packets between each
+//copy and the one before in gaps; first is where the first copy went
+static size_t spacing_gaps(const uint8_t* bytes, size_t* gaps, size_t& first)
+{
+    size_t copies = 0;
+    size_t last = 0;
+
+    for (size_t i = 0; (i < sent_count) && (i < MAX_SENT); ++i)
+    {
+        if ((sent[i].count == 3) && !memcmp(sent[i].bytes, bytes, 2))
+        {
+            if (!copies)
+            {
+                first = i;
+            }
+            else if (copies <= SPACING_COPIES)
+            {
+                gaps[copies - 1] = i - last - 1;
+            }
+
+            last = i;
+            ++copies;
+        }
+    }
+
+    return copies;
+}
+
+//each gap starts at gap, then grows by backoff times up to DCC_REPEAT_MAX_GAP
+static void spacing_expect(const size_t* gaps, size_t count, size_t gap, size_t backoff)
+{
+    for (size_t i = 0; i < count; ++i)
+    {
+        if (gap > DCC_REPEAT_MAX_GAP)
+        {
+            gap = DCC_REPEAT_MAX_GAP;
+        }
+
+        CHECK(gaps[i] == gap);
+        gap *= backoff;
+    }
+}
+
+static void check_spacing(void)
+{
+    size_t gaps[SPACING_COPIES];
+    size_t first[2];
+
+    //off: each repeat goes out as soon as a packet for another address has come between
+    DCCPacketScheduler* s = spacing_start(0, 1);
+    CHECK(s->setFunctions0to4(3, DCCPacket::DCC_SHORT_ADDRESS, 0x01));
+    run_packets(*s, 60);
+    CHECK(spacing_gaps(spacing_f0[0], gaps, first[0]) == FUNCTION_REPEAT + 1);
+    spacing_expect(gaps, FUNCTION_REPEAT, 1, 1);
+    finish(s);
+
+    //2 packets between the first two, then backing off to 4 and 8, with another loco's in between
+    s = spacing_start(2, 2);
+    CHECK(s->setFunctions0to4(3, DCCPacket::DCC_SHORT_ADDRESS, 0x01));
+    CHECK(s->setFunctions0to4(4, DCCPacket::DCC_SHORT_ADDRESS, 0x01));
+    run_packets(*s, 60);
+
+    for (size_t l = 0; l < 2; ++l)
+    {
+        CHECK(spacing_gaps(spacing_f0[l], gaps, first[l]) == FUNCTION_REPEAT + 1);
+        spacing_expect(gaps, FUNCTION_REPEAT, 2, 2);
+    }
+
+    CHECK(first[1] < (first[0] + 3));
+    finish(s);
+
+    //the gaps stop growing at DCC_REPEAT_MAX_GAP
+    s = spacing_start(40, 2);
+    CHECK(s->setFunctions0to4(3, DCCPacket::DCC_SHORT_ADDRESS, 0x01));
+    run_packets(*s, (3 * DCC_REPEAT_MAX_GAP) + 60);
+    CHECK(spacing_gaps(spacing_f0[0], gaps, first[0]) == FUNCTION_REPEAT + 1);
+    spacing_expect(gaps, FUNCTION_REPEAT, 40, 2);
+    finish(s);
+
+    //off: one loco's e-stops go back to back, and all before the next loco's
+    s = spacing_start(0, 1);
+    s->eStop(3, DCCPacket::DCC_SHORT_ADDRESS);
+    s->eStop(4, DCCPacket::DCC_SHORT_ADDRESS);
+    run_packets(*s, 40);
+
+    for (size_t l = 0; l < 2; ++l)
+    {
+        CHECK(spacing_gaps(spacing_estop[l], gaps, first[l]) == SPACING_ESTOPS);
+        spacing_expect(gaps, SPACING_ESTOPS - 1, 0, 1);
+    }
+
+    CHECK(first[1] == (first[0] + SPACING_ESTOPS));
+    finish(s);
+
+    //on: each e-stop waits its gap, and the other loco's go in between
+    s = spacing_start(3, 1);
+    s->eStop(3, DCCPacket::DCC_SHORT_ADDRESS);
+    s->eStop(4, DCCPacket::DCC_SHORT_ADDRESS);
+    run_packets(*s, 60);
+
+    for (size_t l = 0; l < 2; ++l)
+    {
+        CHECK(spacing_gaps(spacing_estop[l], gaps, first[l]) == SPACING_ESTOPS);
+        spacing_expect(gaps, SPACING_ESTOPS - 1, 3, 1);
+    }
+
+    CHECK(first[1] == (first[0] + 1));
+    finish(s);
+
+    //and backs off as repeats do
+    s = spacing_start(2, 2);
+    s->eStop(3, DCCPacket::DCC_SHORT_ADDRESS);
+    run_packets(*s, (5 * DCC_REPEAT_MAX_GAP) + 100);
+    CHECK(spacing_gaps(spacing_estop[0], gaps, first[0]) == SPACING_ESTOPS);
+    spacing_expect(gaps, SPACING_ESTOPS - 1, 2, 2);
+    finish(s);
+}
+#endif
+
+#if DCC_SUPPORT_BANDWIDTH && DCC_SUPPORT_SPEED128
+/****************************************************************************
+* bandwidth
+****************************************************************************/
+
+// How much sooner than predicted the queues may empty: the packet on the rails when it was
+// asked was already part way out, and the prediction is rounded up to a ms. With
+// DCC_HW_PACKET_RING it allows for a full ring ahead too, which the simulation doesn't keep.
+#if defined(DCC_HW_PACKET_RING)
+#define BANDWIDTH_SLACK_US  (8000ULL * (DCC_HW_PACKET_RING_SIZE + 1))
+#else
+#define BANDWIDTH_SLACK_US  8000ULL
+#endif
+
+//a speed, and F0 if functions, for each of count locos with long addresses from 1000 on
+static void bandwidth_locos(DCCPacketScheduler& s, uint8_t count, bool functions)
+{
+    for (uint16_t i = 0; i < count; ++i)
+    {
+        CHECK(s.setSpeed128(1000 + i, DCCPacket::DCC_LONG_ADDRESS, 50));
+        CHECK(!functions || s.setFunctions0to4(1000 + i, DCCPacket::DCC_LONG_ADDRESS, 0x01));
+    }
+}
+
+//when the last packet logged other than an idle came off the rails
+static uint64_t bandwidth_done(void)
+{
+    uint64_t done_us = 0;
+
+    for (size_t i = 0; (i < sent_count) && (i < MAX_SENT); ++i)
+    {
+        if (sent[i].bytes[0] != 0xFF)
+        {
+            done_us = sent[i].start_us + DCCPacket::getWireTime(sent[i].bytes, sent[i].count);
+        }
+    }
+
+    return done_us;
+}
+
+static void check_bandwidth(void)
+{
+    static const uint8_t locos[] = { 1, 2, 4, 8 };
+    uint16_t halves[MAX_HALVES];
+    DCCPacketScheduler* s = start();
+
+    //packets go out back to back, each taking its wire time
+    sent_count = 0;
+    bandwidth_locos(*s, 4, true);
+    run_packets(*s, 40);
+
+    for (size_t i = 0; (i + 1 < sent_count) && (i + 1 < MAX_SENT); ++i)
+    {
+        uint32_t wire_us = DCCPacket::getWireTime(sent[i].bytes, sent[i].count);
+        size_t count = to_halves(sent[i].bytes, sent[i].count, halves);
+        uint32_t halves_us = 0;
+
+        for (size_t h = 0; h < count; ++h)
+        {
+            halves_us += halves[h];
+        }
+
+        CHECK(halves_us == wire_us);
+        CHECK(sent[i + 1].start_us - sent[i].start_us == wire_us);
+    }
+
+    finish(s);
+
+    //a loco alone has idles between its own packets, which the prediction has to allow for
+    for (size_t i = 0; i < (sizeof(locos) / sizeof(locos[0])); ++i)
+    {
+        s = start();
+        bandwidth_locos(*s, locos[i], true);
+
+        uint64_t asked_us = dcc_host_clock_us;
+        uint64_t predicted_us = s->predictRefreshInterval(0) * 1000ULL;
+
+        sent_count = 0;
+        run_packets(*s, 100);
+        CHECK(bandwidth_done() - asked_us <= predicted_us);
+        CHECK(bandwidth_done() - asked_us + BANDWIDTH_SLACK_US >= predicted_us);
+        finish(s);
+    }
+
+    //locos to come are taken to be the longest speed packets there can be, so their real ones are quicker
+    s = start();
+
+    uint64_t asked_us = dcc_host_clock_us;
+    uint64_t predicted_us = s->predictRefreshInterval(8) * 1000ULL;
+
+    sent_count = 0;
+    bandwidth_locos(*s, 8, false);
+    run_packets(*s, 100);
+    CHECK(bandwidth_done() - asked_us <= predicted_us);
+    CHECK((bandwidth_done() - asked_us) * 13 >= predicted_us * 10);
+    finish(s);
+}
+#endif
+
+#if DCC_SUPPORT_QOS && DCC_SUPPORT_SPEED128
+/****************************************************************************
+* qos
+****************************************************************************/
+
+// How often the refreshing class resends a speed, how long that's watched, and how far
+// either way of refresh_ms a resend may be: a ms of millis(), and the packet on the rails
+#define QOS_REFRESH_MS  50
+#define QOS_WATCH_MS    500
+#define QOS_LATE_US     8000
+
+static const uint8_t qos_speed[] = { 0x07, 0x3F, 0xB2 };
+
+//the queue visitQueues() shows a short address's only packet in, or DCC_QUEUE_REPEAT + 1 if it
+//shows none or several
+static uint8_t qos_queue(DCCPacketScheduler& s, uint16_t address)
+{
+    visited_t v;
+    uint8_t queue = DCC_QUEUE_REPEAT + 1;
+    uint8_t found = 0;
+
+    memset(&v, 0, sizeof(v));
+    CHECK(s.visitQueues(visitor, &v));
+
+    for (uint8_t i = 0; (i < v.count) && (i < VISIT_MAX); ++i)
+    {
+        if (v.address[i] == address)
+        {
+            queue = v.queue[i];
+            ++found;
+        }
+    }
+
+    return (found == 1) ? queue : (DCC_QUEUE_REPEAT + 1);
+}
+
+static void check_qos(void)
+{
+    DCCPacketScheduler* s = start();
+
+    //a class's priority picks the queue for speeds and functions alike; class 0 leaves them to their kind
+    CHECK(s->setServiceClass(1, 0, DCC_QOS_DEFAULT_REPEAT, DCC_QOS_LOW));
+    CHECK(s->setServiceClass(2, 0, DCC_QOS_DEFAULT_REPEAT, DCC_QOS_HIGH));
+    CHECK(s->setAddressClass(3, DCCPacket::DCC_SHORT_ADDRESS, 1));
+    CHECK(s->setAddressClass(5, DCCPacket::DCC_SHORT_ADDRESS, 2));
+    CHECK(s->setSpeed128(3, DCCPacket::DCC_SHORT_ADDRESS, 50));
+    CHECK(s->setSpeed128(4, DCCPacket::DCC_SHORT_ADDRESS, 50));
+    CHECK(s->setFunctions0to4(5, DCCPacket::DCC_SHORT_ADDRESS, 0x01));
+    CHECK(s->setFunctions0to4(6, DCCPacket::DCC_SHORT_ADDRESS, 0x01));
+    CHECK(qos_queue(*s, 3) == DCC_QUEUE_LOW);
+    CHECK(qos_queue(*s, 4) == DCC_QUEUE_HIGH);
+    CHECK(qos_queue(*s, 5) == DCC_QUEUE_HIGH);
+    CHECK(qos_queue(*s, 6) == DCC_QUEUE_LOW);
+    finish(s);
+
+    //a class's repeat of 0 sends a speed just once
+    s = start();
+    CHECK(s->setServiceClass(3, 0, 0, DCC_QOS_NORMAL));
+    CHECK(s->setAddressClass(7, DCCPacket::DCC_SHORT_ADDRESS, 3));
+    CHECK(s->setSpeed128(7, DCCPacket::DCC_SHORT_ADDRESS, 50));
+    CHECK(times_sent(*s, qos_speed, sizeof(qos_speed)) == 1);
+
+    //with refresh_ms, the speed goes again that often, once each time
+    CHECK(s->setServiceClass(3, QOS_REFRESH_MS, 0, DCC_QOS_NORMAL));
+    sent_count = 0;
+    run_ms(*s, QOS_WATCH_MS);
+
+    size_t resends = 0;
+    uint64_t last_us = 0;
+
+    for (const sent_t* p = find_bytes(0, qos_speed, sizeof(qos_speed)); p;
+            p = find_bytes((p - sent) + 1, qos_speed, sizeof(qos_speed)))
+    {
+        if (resends)
+        {
+            CHECK(p->start_us - last_us + QOS_LATE_US >= QOS_REFRESH_MS * 1000ULL);
+            CHECK(p->start_us - last_us <= QOS_REFRESH_MS * 1000ULL + QOS_LATE_US);
+        }
+
+        last_us = p->start_us;
+        ++resends;
+    }
+
+    CHECK(resends + 1 >= QOS_WATCH_MS / QOS_REFRESH_MS);
+    CHECK(resends <= QOS_WATCH_MS / QOS_REFRESH_MS + 1);
+
+    //until an e-stop, after which it's never sent again
+    CHECK(s->eStop(7, DCCPacket::DCC_SHORT_ADDRESS));
+    sent_count = 0;
+    run_ms(*s, QOS_WATCH_MS);
+    CHECK(!find_bytes(0, qos_speed, sizeof(qos_speed)));
+    finish(s);
+}
+#endif
+
+/****************************************************************************
+* End of file
+****************************************************************************/
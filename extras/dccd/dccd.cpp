@@ -0,0 +1,517 @@
+/*
+ * CmdrArduino
+ *
+ * dccd: a command station daemon for Linux
+ *
+ * Runs a DCCPacketScheduler on the simulated hardware (DCC_HW_SIMULATED)
+ * and takes DCC++ style text commands, as DCCCommandParser reads them,
+ * from any number of clients on a Unix-domain socket. Everything happens
+ * in one epoll loop: each client has its own parser and reply buffer, and
+ * nothing blocks. Each command is answered with <O>, or <X> if it was
+ * garbled or the scheduler turned it down.
+ *
+ * Every <t> speed command is timed from when it was read to when its
+ * packet starts on the rails. The figures are printed every few seconds,
+ * with what's waiting in each of the scheduler's queues, and again when
+ * the daemon is stopped with ^C.
+ *
+ * Build, from the top of the library:
+ *     g++ -std=gnu++11 -O2 -DDCC_HW_SIMULATED -Iextras/host -I. \
+ *         extras/dccd/dccd.cpp DCC*.cpp -o dccd
+ *
+ * Usage: dccd [-s socket] [-i seconds between figures, 0 for none]
+ *             [-v VCD file] [-e edge log]
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/****************************************************************************
+* Includes
+****************************************************************************/
+#include <Arduino.h>
+#include <errno.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "DCCPacketScheduler.h"
+#include "DCCCommandParser.h"
+#include "DCCHardware.h"
+
+#if !defined(DCC_HW_SIMULATED)
+#error "dccd needs DCC_HW_SIMULATED"
+#endif
+
+/****************************************************************************
+* Defines
+****************************************************************************/
+
+#define DEFAULT_SOCKET  "/tmp/dccd.sock"
+#define MAX_EVENTS      64
+#define READ_LEN        4096
+#define REPLY_LEN       1024 //replies waiting for a slow client; more are dropped
+#define MAX_CAB         10239
+
+// Latencies are counted in buckets of LATENCY_STEP_US, up to LATENCY_BUCKETS
+#define LATENCY_STEP_US 100
+#define LATENCY_BUCKETS 50000
+
+/****************************************************************************
+* Data Types
+****************************************************************************/
+
+typedef struct client_t
+{
+    client_t(DCCPacketScheduler& scheduler) : parser(scheduler), reply_len(0), writing(false) {}
+
+    int fd;
+    DCCCommandParser parser;
+    char reply[REPLY_LEN];
+    size_t reply_len;
+    bool writing; //waiting for EPOLLOUT
+} client_t;
+
+//the last speed command for a loco that hasn't reached the rails yet
+typedef struct
+{
+    uint32_t read_us;
+    uint8_t speed; //as the second byte of a 128 step packet
+    bool pending;
+} loco_t;
+
+/****************************************************************************
+* Function Prototypes
+****************************************************************************/
+
+static int listen_on(const char* path);
+static void accept_clients(int listener);
+static void read_client(client_t* c);
+static void write_client(client_t* c);
+static void close_client(client_t* c);
+static void command_done(client_t* c, uint8_t result, uint32_t read_us);
+static void packet_monitor(const uint8_t* p_packet, size_t num_bytes, uint32_t start_us);
+static void print_figures(void);
+static bool count_queued(const DCCQueuedPacket& packet, void* context);
+static void on_signal(int sig);
+
+/****************************************************************************
+* Private Data
+****************************************************************************/
+
+static DCCPacketScheduler scheduler;
+static int epoll_fd = -1;
+static volatile sig_atomic_t stopping = 0;
+
+static loco_t locos[MAX_CAB + 1];
+static uint32_t latency[LATENCY_BUCKETS + 1]; //the last bucket is everything longer
+static uint32_t latency_max_us = 0;
+
+static uint32_t clients = 0;
+static uint32_t commands = 0;
+static uint32_t rejected = 0;
+static uint32_t superseded = 0; //speed commands replaced before they reached the rails
+static uint32_t replies_dropped = 0;
+static uint32_t packets = 0;
+
+/****************************************************************************
+* Public Functions
+****************************************************************************/
+
+int main(int argc, char** argv)
+{
+    const char* path = DEFAULT_SOCKET;
+    uint32_t interval_ms = 5000;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "s:i:v:e:")) != -1)
+    {
+        switch (opt)
+        {
+        case 's':
+            path = optarg;
+            break;
+        case 'i':
+            interval_ms = atoi(optarg) * 1000;
+            break;
+        case 'v':
+        case 'e':
+            if (!dcc_hardware_capture(optarg, (opt == 'v') ? DCC_CAPTURE_VCD : DCC_CAPTURE_EDGES))
+            {
+                perror(optarg);
+                return 1;
+            }
+            break;
+        default:
+            fprintf(stderr, "usage: %s [-s socket] [-i seconds] [-v vcd] [-e edges]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = on_signal;
+    sigaction(SIGINT, &sa, 0);
+    sigaction(SIGTERM, &sa, 0);
+    signal(SIGPIPE, SIG_IGN);
+
+    int listener = listen_on(path);
+    epoll_fd = epoll_create1(0);
+
+    if ((listener < 0) || (epoll_fd < 0))
+    {
+        perror(path);
+        return 1;
+    }
+
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.ptr = 0; //the listener; clients have their client_t
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, listener, &ev);
+
+    scheduler.setup();
+    dcc_hardware_set_monitor(packet_monitor);
+    fprintf(stderr, "dccd: listening on %s\n", path);
+
+    uint32_t last_figures = millis();
+
+    while (!stopping)
+    {
+        //sleep until the rails want a packet, rounded up to the next millisecond
+        int timeout = (dcc_hardware_wait_us() + 999) / 1000;
+        struct epoll_event events[MAX_EVENTS];
+        int n = epoll_wait(epoll_fd, events, MAX_EVENTS, timeout);
+
+        for (int i = 0; i < n; ++i)
+        {
+            client_t* c = (client_t*)events[i].data.ptr;
+
+            if (!c)
+            {
+                accept_clients(listener);
+            }
+            else if (events[i].events & (EPOLLERR | EPOLLHUP))
+            {
+                close_client(c);
+            }
+            else
+            {
+                if (events[i].events & EPOLLOUT)
+                {
+                    write_client(c);
+                }
+
+                if (events[i].events & EPOLLIN)
+                {
+                    read_client(c);
+                }
+            }
+        }
+
+        scheduler.update();
+
+        if (interval_ms && ((uint32_t)(millis() - last_figures) >= interval_ms))
+        {
+            print_figures();
+            last_figures = millis();
+        }
+    }
+
+    print_figures();
+    dcc_hardware_capture_stop();
+    close(listener);
+    unlink(path);
+    return 0;
+}
+
+/****************************************************************************
+* Private Functions
+****************************************************************************/
+
+static int listen_on(const char* path)
+{
+    struct sockaddr_un addr;
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0);
+
+    if ((fd < 0) || (strlen(path) >= sizeof(addr.sun_path)))
+    {
+        return -1;
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+    unlink(path);
+
+    if ((bind(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0) || (listen(fd, SOMAXCONN) < 0))
+    {
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+static void accept_clients(int listener)
+{
+    int fd;
+
+    while ((fd = accept4(listener, 0, 0, SOCK_NONBLOCK)) >= 0)
+    {
+        client_t* c = new client_t(scheduler);
+        struct epoll_event ev;
+
+        c->fd = fd;
+        ev.events = EPOLLIN;
+        ev.data.ptr = c;
+        epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev);
+        ++clients;
+    }
+}
+
+static void read_client(client_t* c)
+{
+    uint8_t buffer[READ_LEN];
+
+    for (;;)
+    {
+        ssize_t n = read(c->fd, buffer, sizeof(buffer));
+
+        if (n < 0)
+        {
+            if ((errno != EAGAIN) && (errno != EWOULDBLOCK))
+            {
+                close_client(c);
+                return;
+            }
+
+            break;
+        }
+
+        if (n == 0)
+        {
+            close_client(c);
+            return;
+        }
+
+        uint32_t read_us = micros();
+
+        for (ssize_t i = 0; i < n; ++i)
+        {
+            uint8_t result = c->parser.parse(buffer[i]);
+
+            if (result != DCC_PARSE_NONE)
+            {
+                command_done(c, result, read_us);
+            }
+        }
+    }
+
+    write_client(c);
+}
+
+static void write_client(client_t* c)
+{
+    size_t sent = 0;
+
+    while (sent < c->reply_len)
+    {
+        ssize_t n = send(c->fd, c->reply + sent, c->reply_len - sent, MSG_NOSIGNAL);
+
+        if (n <= 0)
+        {
+            break;
+        }
+
+        sent += n;
+    }
+
+    memmove(c->reply, c->reply + sent, c->reply_len - sent);
+    c->reply_len -= sent;
+
+    //only ask for EPOLLOUT while there's something left to send
+    bool writing = (c->reply_len > 0);
+
+    if (writing != c->writing)
+    {
+        struct epoll_event ev;
+        ev.events = EPOLLIN | (writing ? (uint32_t)EPOLLOUT : 0u);
+        ev.data.ptr = c;
+        epoll_ctl(epoll_fd, EPOLL_CTL_MOD, c->fd, &ev);
+        c->writing = writing;
+    }
+}
+
+static void close_client(client_t* c)
+{
+    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, c->fd, 0);
+    close(c->fd);
+    delete c;
+    --clients;
+}
+
+static void command_done(client_t* c, uint8_t result, uint32_t read_us)
+{
+    ++commands;
+
+    if (result != DCC_PARSE_OK)
+    {
+        ++rejected;
+    }
+
+    if (c->reply_len + 3 <= REPLY_LEN)
+    {
+        memcpy(c->reply + c->reply_len, (result == DCC_PARSE_OK) ? "<O>" : "<X>", 3);
+        c->reply_len += 3;
+    }
+    else
+    {
+        ++replies_dropped;
+    }
+
+    //time speed commands, but not emergency stops: <t [REGISTER] CAB SPEED DIRECTION>
+    uint8_t count = c->parser.getArgCount();
+
+    if ((result == DCC_PARSE_OK) && (c->parser.getCommand() == 't') && (c->parser.getArg(count - 2) >= 0))
+    {
+        loco_t& l = locos[c->parser.getArg(count - 3)];
+        int32_t speed = c->parser.getArg(count - 2);
+
+        if (l.pending)
+        {
+            ++superseded;
+        }
+
+        l.read_us = read_us;
+        l.speed = (speed ? (speed + 1) : 0) | (c->parser.getArg(count - 1) ? 0x80 : 0x00);
+        l.pending = true;
+    }
+}
+
+//looks for 128 step speed packets that carry out a timed command
+static void packet_monitor(const uint8_t* p_packet, size_t num_bytes, uint32_t start_us)
+{
+    uint16_t address;
+    const uint8_t* instruction;
+
+    ++packets;
+
+    if ((p_packet[0] >= 1) && (p_packet[0] <= 127))
+    {
+        address = p_packet[0];
+        instruction = &p_packet[1];
+    }
+    else if ((p_packet[0] >= 0xC0) && (p_packet[0] <= 0xE7) && (num_bytes > 2))
+    {
+        address = ((p_packet[0] & 0x3F) << 8) | p_packet[1];
+        instruction = &p_packet[2];
+    }
+    else
+    {
+        return;
+    }
+
+    if ((address > MAX_CAB) || (instruction + 2 >= p_packet + num_bytes) || (instruction[0] != 0x3F))
+    {
+        return;
+    }
+
+    loco_t& l = locos[address];
+
+    if (l.pending && (instruction[1] == l.speed))
+    {
+        uint32_t us = start_us - l.read_us;
+        uint32_t bucket = us / LATENCY_STEP_US;
+
+        ++latency[(bucket < LATENCY_BUCKETS) ? bucket : LATENCY_BUCKETS];
+
+        if (us > latency_max_us)
+        {
+            latency_max_us = us;
+        }
+
+        l.pending = false;
+    }
+}
+
+static void print_figures(void)
+{
+    uint32_t timed = 0;
+
+    for (uint32_t i = 0; i <= LATENCY_BUCKETS; ++i)
+    {
+        timed += latency[i];
+    }
+
+    fprintf(stderr, "dccd: %u clients, %u commands (%u rejected), %u packets, %u replies dropped",
+            clients, commands, rejected, packets, replies_dropped);
+#if DCC_SUPPORT_BANDWIDTH
+    fprintf(stderr, ", rails %u.%u%% busy", scheduler.getUtilization() / 10, scheduler.getUtilization() % 10);
+#endif
+    fprintf(stderr, "\n");
+
+    //the daemon is the only thing calling update(), so this is always a steady picture
+    uint32_t queued[4] = {0, 0, 0, 0};
+
+    scheduler.visitQueues(count_queued, queued);
+    fprintf(stderr, "dccd: queued: %u e-stop, %u high, %u low, %u repeat; %u pool slots free\n",
+            queued[DCC_QUEUE_E_STOP], queued[DCC_QUEUE_HIGH], queued[DCC_QUEUE_LOW], queued[DCC_QUEUE_REPEAT],
+            dcc_packet_pool.freeSlots());
+
+    if (!timed)
+    {
+        return;
+    }
+
+    //p50, p90 and p99, to the top of their bucket
+    static const uint16_t permille[] = {500, 900, 990};
+    uint32_t seen = 0;
+    uint8_t next = 0;
+
+    fprintf(stderr, "dccd: %u speeds timed, %u superseded; latency", timed, superseded);
+
+    for (uint32_t i = 0; (i <= LATENCY_BUCKETS) && (next < 3); ++i)
+    {
+        seen += latency[i];
+
+        while ((next < 3) && ((uint64_t)seen * 1000 >= (uint64_t)timed * permille[next]))
+        {
+            fprintf(stderr, " p%u %.1fms", permille[next] / 10, ((i + 1) * LATENCY_STEP_US) / 1000.0);
+            ++next;
+        }
+    }
+
+    fprintf(stderr, " max %.1fms\n", latency_max_us / 1000.0);
+}
+
+static bool count_queued(const DCCQueuedPacket& packet, void* context)
+{
+    ++((uint32_t*)context)[packet.queue];
+    return true;
+}
+
+static void on_signal(int sig)
+{
+    (void)sig;
+    stopping = 1;
+}
+
+/****************************************************************************
+* End of file
+****************************************************************************/
@@ -0,0 +1,317 @@
+/*
+ * CmdrArduino
+ *
+ * dccsoak: throttle load for dccd
+ *
+ * Opens a number of throttle connections to dccd from one epoll loop and
+ * drives a number of locos from them as people would: each loco gets a
+ * new speed or function every so often, at random, from the throttle
+ * it's shared out to. dccd prints the latency figures; this prints what
+ * it sent and what came back.
+ *
+ * Build, from the top of the library:
+ *     g++ -std=gnu++11 -O2 extras/dccd/dccsoak.cpp -o dccsoak
+ *
+ * Usage: dccsoak [-s socket] [-c throttles] [-l locos] [-r commands per
+ *                loco per second] [-d seconds]
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/****************************************************************************
+* Includes
+****************************************************************************/
+#include <errno.h>
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+/****************************************************************************
+* Defines
+****************************************************************************/
+
+#define DEFAULT_SOCKET "/tmp/dccd.sock"
+#define MAX_EVENTS     64
+
+/****************************************************************************
+* Data Types
+****************************************************************************/
+
+typedef struct
+{
+    uint16_t cab;
+    int throttle; //socket it's driven from
+    int16_t speed; //0-126
+    uint8_t direction;
+    uint8_t functions; //F0-F4, as <f> takes them
+    uint64_t next_us; //when it next gets a command
+} loco_t;
+
+/****************************************************************************
+* Function Prototypes
+****************************************************************************/
+
+static uint64_t now_us(void);
+static uint64_t next_after(uint64_t t, double rate);
+static int connect_to(const char* path);
+static void drive(loco_t& l);
+
+/****************************************************************************
+* Private Data
+****************************************************************************/
+
+static uint32_t sent = 0;
+static uint32_t send_failed = 0; //the socket was full
+static uint32_t replied_ok = 0;
+static uint32_t replied_bad = 0;
+
+/****************************************************************************
+* Public Functions
+****************************************************************************/
+
+int main(int argc, char** argv)
+{
+    const char* path = DEFAULT_SOCKET;
+    int num_throttles = 50;
+    int num_locos = 100;
+    double rate = 0.5;
+    int seconds = 60;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "s:c:l:r:d:")) != -1)
+    {
+        switch (opt)
+        {
+        case 's':
+            path = optarg;
+            break;
+        case 'c':
+            num_throttles = atoi(optarg);
+            break;
+        case 'l':
+            num_locos = atoi(optarg);
+            break;
+        case 'r':
+            rate = atof(optarg);
+            break;
+        case 'd':
+            seconds = atoi(optarg);
+            break;
+        default:
+            fprintf(stderr, "usage: %s [-s socket] [-c throttles] [-l locos] [-r rate] [-d seconds]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    if ((num_throttles < 1) || (num_locos < 1) || (num_locos > 10239) || (rate <= 0))
+    {
+        fprintf(stderr, "%s: need at least one throttle and one loco, and a rate above 0\n", argv[0]);
+        return 1;
+    }
+
+    int epoll_fd = epoll_create1(0);
+    int* throttles = new int[num_throttles];
+
+    for (int i = 0; i < num_throttles; ++i)
+    {
+        throttles[i] = connect_to(path);
+
+        if (throttles[i] < 0)
+        {
+            perror(path);
+            return 1;
+        }
+
+        struct epoll_event ev;
+        ev.events = EPOLLIN;
+        ev.data.fd = throttles[i];
+        epoll_ctl(epoll_fd, EPOLL_CTL_ADD, throttles[i], &ev);
+    }
+
+    srand(time(0));
+    uint64_t start = now_us();
+    uint64_t end = start + (seconds * 1000000ULL);
+    loco_t* locos = new loco_t[num_locos];
+
+    for (int i = 0; i < num_locos; ++i)
+    {
+        locos[i].cab = i + 1;
+        locos[i].throttle = throttles[i % num_throttles];
+        locos[i].speed = 0;
+        locos[i].direction = 1;
+        locos[i].functions = 0;
+        locos[i].next_us = next_after(start, rate);
+    }
+
+    uint64_t now;
+
+    while ((now = now_us()) < end)
+    {
+        uint64_t soonest = end;
+
+        for (int i = 0; i < num_locos; ++i)
+        {
+            if (locos[i].next_us <= now)
+            {
+                drive(locos[i]);
+                locos[i].next_us = next_after(now, rate);
+            }
+
+            if (locos[i].next_us < soonest)
+            {
+                soonest = locos[i].next_us;
+            }
+        }
+
+        struct epoll_event events[MAX_EVENTS];
+        int n = epoll_wait(epoll_fd, events, MAX_EVENTS, (soonest - now + 999) / 1000);
+
+        for (int i = 0; i < n; ++i)
+        {
+            char buffer[4096];
+            ssize_t len;
+
+            while ((len = read(events[i].data.fd, buffer, sizeof(buffer))) > 0)
+            {
+                for (ssize_t j = 0; j + 1 < len; ++j)
+                {
+                    if (buffer[j] == '<')
+                    {
+                        if (buffer[j + 1] == 'O')
+                        {
+                            ++replied_ok;
+                        }
+                        else
+                        {
+                            ++replied_bad;
+                        }
+                    }
+                }
+            }
+
+            if (len == 0)
+            {
+                fprintf(stderr, "dccsoak: dccd hung up\n");
+                return 1;
+            }
+        }
+    }
+
+    printf("dccsoak: %d throttles, %d locos, %.0fs: %u commands sent (%.1f/s), %u couldn't be sent, %u <O>, %u <X>\n",
+           num_throttles, num_locos, (now - start) / 1e6, sent, sent / ((now - start) / 1e6), send_failed, replied_ok, replied_bad);
+
+    for (int i = 0; i < num_throttles; ++i)
+    {
+        close(throttles[i]);
+    }
+
+    delete[] locos;
+    delete[] throttles;
+    return 0;
+}
+
+/****************************************************************************
+* Private Functions
+****************************************************************************/
+
+static uint64_t now_us(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (ts.tv_sec * 1000000ULL) + (ts.tv_nsec / 1000);
+}
+
+//commands come at random, rate times a second on average
+static uint64_t next_after(uint64_t t, double rate)
+{
+    double u = (rand() + 1.0) / (RAND_MAX + 2.0);
+    return t + (uint64_t)((-log(u) / rate) * 1e6);
+}
+
+static int connect_to(const char* path)
+{
+    struct sockaddr_un addr;
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0);
+
+    if ((fd < 0) || (strlen(path) >= sizeof(addr.sun_path)))
+    {
+        return -1;
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+
+    if (connect(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0)
+    {
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+//mostly notch the throttle up or down; now and then stop, turn round or flick a function
+static void drive(loco_t& l)
+{
+    char command[32];
+    int len;
+    int what = rand() % 20;
+
+    if (what == 0)
+    {
+        l.functions ^= 1 << (rand() % 5);
+        //<f> wants F0 in bit 4 and F1-F4 in bits 0-3
+        len = snprintf(command, sizeof(command), "<f %u %u>\n", l.cab, 128 | ((l.functions & 0x01) << 4) | (l.functions >> 1));
+    }
+    else
+    {
+        if (what == 1)
+        {
+            l.speed = 0;
+        }
+        else if ((what == 2) && (l.speed == 0))
+        {
+            l.direction ^= 1;
+        }
+        else
+        {
+            l.speed += (rand() % 21) - 10;
+            l.speed = (l.speed < 0) ? 0 : ((l.speed > 126) ? 126 : l.speed);
+        }
+
+        len = snprintf(command, sizeof(command), "<t 1 %u %d %u>\n", l.cab, l.speed, l.direction);
+    }
+
+    if (send(l.throttle, command, len, MSG_NOSIGNAL) == len)
+    {
+        ++sent;
+    }
+    else
+    {
+        ++send_failed;
+    }
+}
+
+/****************************************************************************
+* End of file
+****************************************************************************/
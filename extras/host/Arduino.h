@@ -0,0 +1,68 @@
+/*
+ * CmdrArduino
+ *
+ * Just enough of Arduino.h to build the library into a host program,
+ * with DCC_HW_SIMULATED. Put this directory on the include path.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+#ifndef INC_HOST_ARDUINO_H
+#define INC_HOST_ARDUINO_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <time.h>
+
+typedef uint8_t byte;
+typedef bool boolean;
+
+// Flash and RAM are the same thing here
+#define PROGMEM
+#define pgm_read_byte(p) (*(const uint8_t*)(p))
+#define pgm_read_word(p) (*(const uint16_t*)(p))
+
+// Wrap at 32 bits, as they do on the boards. With DCC_HOST_VIRTUAL_CLOCK
+// defined, time only moves when the program moves dcc_host_clock_us, so
+// it can simulate hours in seconds.
+#if defined(DCC_HOST_VIRTUAL_CLOCK)
+extern uint64_t dcc_host_clock_us;
+
+static inline unsigned long micros(void)
+{
+    return (uint32_t)dcc_host_clock_us;
+}
+
+static inline unsigned long millis(void)
+{
+    return (uint32_t)(dcc_host_clock_us / 1000);
+}
+#else
+static inline unsigned long micros(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint32_t)((ts.tv_sec * 1000000ULL) + (ts.tv_nsec / 1000));
+}
+
+static inline unsigned long millis(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint32_t)((ts.tv_sec * 1000ULL) + (ts.tv_nsec / 1000000));
+}
+#endif
+
+#endif // INC_HOST_ARDUINO_H
@@ -0,0 +1,7 @@
+/*
+ * CmdrArduino
+ *
+ * Stands in for HardwareSerial.h in host builds; the library doesn't use
+ * the serial port itself.
+ *
+ */